@@ -8,6 +8,9 @@
 #include <sys/types.h>
 
 #include "util.h"
+#include "io_limiter.h"
+#include "memory_budget.h"
+#include "rofile_pool.h"
 #include "sys_journal.h"
 #include "dtable_factory.h"
 #include "ctable_factory.h"
@@ -328,6 +331,43 @@ void anvil_params_kill(anvil_params * c)
 	delete safer.cpp;
 }
 
+/* The "rofile_pool" parameter is passed to rofile_pool::configure(), the
+ * "io_limit" parameter to io_limiter::configure(), and the "memory_budget"
+ * parameter to memory_budget::configure(). */
+int anvil_configure(const anvil_params * config)
+{
+	anvil_params_union_const safer(config);
+	const params & cpp = *safer;
+	if(cpp.contains("rofile_pool"))
+	{
+		params pool;
+		if(!cpp.get("rofile_pool", &pool, params()))
+			return -EINVAL;
+		int r = rofile_pool::configure(pool);
+		if(r < 0)
+			return r;
+	}
+	if(cpp.contains("io_limit"))
+	{
+		params limit;
+		if(!cpp.get("io_limit", &limit, params()))
+			return -EINVAL;
+		int r = io_limiter::configure(limit);
+		if(r < 0)
+			return r;
+	}
+	if(cpp.contains("memory_budget"))
+	{
+		params budget;
+		if(!cpp.get("memory_budget", &budget, params()))
+			return -EINVAL;
+		int r = memory_budget::configure(budget);
+		if(r < 0)
+			return r;
+	}
+	return 0;
+}
+
 static inline int init_anvil_dtype(anvil_dtype * c, const dtype & value)
 {
 	anvil_dtype_union safer(c);
@@ -94,6 +94,9 @@ typedef int (*blob_test)(const void *, size_t, void *);
 
 /* use Anvil runtime environment (journals, etc.) at this path */
 int anvil_init(const char * path);
+/* configure the resources shared by the whole process (see anvil.cpp); this
+ * should be done once, before opening any tables */
+int anvil_configure(const anvil_params * config);
 
 /* istr */
 int anvil_istr_new(anvil_istr * c, const char * str);
@@ -17,7 +17,6 @@ class bg_thread
 public:
 	void start()
 	{
-		pthread_t thread;
 		scopelock scope(lock);
 		if(running)
 			return;
@@ -59,6 +58,11 @@ public:
 		token.loan();
 	}
 	
+	inline pthread_t id() const
+	{
+		return thread;
+	}
+	
 	/* this syntax means "pointer to member function of class T" */
 	typedef void (T::*method_t)(bg_token *);
 	
@@ -74,6 +78,7 @@ public:
 	
 private:
 	bool stop_request, running;
+	pthread_t thread;
 	
 	T * const object;
 	const method_t method;
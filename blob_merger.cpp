@@ -0,0 +1,36 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#include <map>
+#include <assert.h>
+
+#include "blob_merger.h"
+
+typedef std::map<istr, const blob_merger *, strcmp_less> merger_map;
+
+/* a function, rather than a static member, so that it will be constructed
+ * before any statically allocated blob mergers try to register themselves */
+static merger_map & mergers()
+{
+	static merger_map map;
+	return map;
+}
+
+blob_merger::blob_merger(const istr & name)
+	: name(name)
+{
+	bool unique = mergers().insert(merger_map::value_type(name, this)).second;
+	assert(unique);
+}
+
+blob_merger::~blob_merger()
+{
+	mergers().erase(name);
+}
+
+const blob_merger * blob_merger::lookup(const istr & name)
+{
+	merger_map::const_iterator it = mergers().find(name);
+	return (it != mergers().end()) ? it->second : NULL;
+}
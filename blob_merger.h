@@ -0,0 +1,50 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#ifndef __BLOB_MERGER_H
+#define __BLOB_MERGER_H
+
+#ifndef __cplusplus
+#error blob_merger.h is a C++ header file
+#endif
+
+#include "blob.h"
+#include "istr.h"
+
+/* A blob merger allows some values stored in dtables to be "partial" values,
+ * or deltas, which only describe how to change the next older value for the
+ * same key. Deltas can then be written blindly, without reading the value they
+ * will change first: journal_dtable merges them with the values it already has
+ * in memory, overlay_dtable merges them with older values on lookups, and so
+ * combining dtables (see managed_dtable) folds them into complete values. */
+/* NOTE: blob mergers are registered by name when they are constructed, so that
+ * journal_dtable can find them again when replaying the journal on startup.
+ * They should therefore be statically allocated, and live forever. */
+class blob_merger
+{
+public:
+	/* Returns true if this (existing) value is a delta. The encoding must be
+	 * such that complete values are never mistaken for deltas. */
+	virtual bool partial(const blob & value) const = 0;
+	
+	/* Merges a delta with the next older value for the same key. If the older
+	 * value is also a delta, the result must be a delta which has the effect
+	 * of both; otherwise it must be a complete value. A nonexistent older
+	 * value means there is no older value, or that it has been removed. */
+	virtual blob merge(const blob & delta, const blob & older) const = 0;
+	
+	static const blob_merger * lookup(const istr & name);
+	
+	const istr name;
+	
+protected:
+	blob_merger(const istr & name);
+	virtual ~blob_merger();
+	
+private:
+	void operator=(const blob_merger &);
+	blob_merger(const blob_merger &);
+};
+
+#endif /* __BLOB_MERGER_H */
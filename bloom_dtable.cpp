@@ -4,18 +4,23 @@
 
 #define _ATFILE_SOURCE
 
+#include <math.h>
+
 #include "md5.h"
 #include "openat.h"
 
 #include "util.h"
 #include "rofile.h"
+#include "dtable_stats.h"
 #include "bloom_dtable.h"
 
 /* The bloom filter dtable keeps a bloom filter of the keys in an underlying
  * dtable, and checks it before serving a key lookup. On a bloom filter miss,
  * the key is not looked up at all in the underlying dtable. Otherwise the
  * lookup is passed through. Since there can be no false negatives, this will
- * always work correctly. */
+ * always work correctly. The filter is sized for the number of keys in the
+ * underlying dtable when it is created, to meet a target false positive rate,
+ * and the rate actually observed is tracked while it is in use. */
 
 #if BFDT_PERF_TEST
 #include <stdio.h>
@@ -39,17 +44,19 @@ public:
 		uint32_t value = 0;
 		while(need)
 		{
-			uint8_t take = (need > left) ? left : need;
-			value <<= take;
-			value |= byte & ((1 << take) - 1);
-			byte >>= take;
-			left -= take;
-			need -= take;
+			uint8_t take;
+			/* don't read past the end of the array after the last index */
 			if(!left)
 			{
 				byte = *++array;
 				left = 8;
 			}
+			take = (need > left) ? left : need;
+			value <<= take;
+			value |= byte & ((1 << take) - 1);
+			byte >>= take;
+			left -= take;
+			need -= take;
 		}
 		return value;
 	}
@@ -59,7 +66,37 @@ private:
 	uint8_t byte, left;
 };
 
-int bloom_dtable::bloom::init(int dfd, const char * file, size_t * m, size_t * k)
+/* Version 0 filters split the hash into fields of the given number of bits to
+ * get the indices, so their size must be a power of 2. Later versions instead
+ * combine the two halves of the hash (double hashing), for any filter size. */
+class indexer
+{
+public:
+	indexer(const uint8_t * hash, size_t m, uint8_t bits)
+		: fields(hash, bits), m(m), bits(bits)
+	{
+		util::memcpy(&a, hash, sizeof(a));
+		util::memcpy(&b, &hash[sizeof(a)], sizeof(b));
+		/* make sure we don't just get the same index k times */
+		b |= 1;
+	}
+	uint32_t next()
+	{
+		uint32_t index;
+		if(bits)
+			return fields.next();
+		index = a % m;
+		a += b;
+		return index;
+	}
+private:
+	bitreader fields;
+	const size_t m;
+	const uint8_t bits;
+	uint64_t a, b;
+};
+
+int bloom_dtable::bloom::init(int dfd, const char * file, size_t * m, size_t * k, uint32_t * version)
 {
 	ssize_t bytes;
 	rofile * data;
@@ -71,7 +108,10 @@ int bloom_dtable::bloom::init(int dfd, const char * file, size_t * m, size_t * k
 		return -1;
 	if(data->read_type(0, &header) < 0)
 		goto fail_close;
-	if(header.magic != BLOOM_DTABLE_MAGIC || header.version != BLOOM_DTABLE_VERSION)
+	/* we can still read version 0 filters */
+	if(header.magic != BLOOM_DTABLE_MAGIC || header.version > BLOOM_DTABLE_VERSION)
+		goto fail_close;
+	if(!header.m || !header.k)
 		goto fail_close;
 	bytes = (header.m + 7) / 8;
 	filter = new uint8_t[bytes];
@@ -81,15 +121,15 @@ int bloom_dtable::bloom::init(int dfd, const char * file, size_t * m, size_t * k
 		goto fail_free;
 	*m = header.m;
 	*k = header.k;
+	*version = header.version;
 	delete data;
+	reset();
 #if BFDT_PERF_TEST
 	{
 		char * dir_string = getcwdat(dfd, NULL, 0);
 		dir_name = util::tilde_home(dir_string);
 		free(dir_string);
 		file_name = file;
-		total_lookups = 0;
-		blocked_lookups = 0;
 	}
 #endif
 	return 0;
@@ -110,13 +150,17 @@ int bloom_dtable::bloom::init(size_t bytes)
 	if(!filter)
 		return -ENOMEM;
 	util::memset(filter, 0, bytes);
-#if BFDT_PERF_TEST
-	total_lookups = 0;
-	blocked_lookups = 0;
-#endif
+	reset();
 	return 0;
 }
 
+void bloom_dtable::bloom::reset()
+{
+	total_lookups.zero();
+	blocked_lookups.zero();
+	false_positives.zero();
+}
+
 void bloom_dtable::bloom::deinit()
 {
 	if(filter)
@@ -124,11 +168,14 @@ void bloom_dtable::bloom::deinit()
 		delete[] filter;
 		filter = NULL;
 #if BFDT_PERF_TEST
-		if(perf_enable && total_lookups)
+		size_t total = total_lookups.get();
+		if(perf_enable && total)
 		{
-			double percent = 100 * blocked_lookups / (double) total_lookups;
+			size_t blocked = blocked_lookups.get();
+			double percent = 100 * blocked / (double) total;
 			printf("Bloom filter %s/%s: ", dir_name.str(), file_name.str());
-			printf("%zu/%zu lookups blocked (%lg%%)\n", blocked_lookups, total_lookups, percent);
+			printf("%zu/%zu lookups blocked (%lg%%), ", blocked, total, percent);
+			printf("observed false positive rate %lg\n", observed_fpr());
 		}
 		dir_name = NULL;
 		file_name = NULL;
@@ -136,14 +183,14 @@ void bloom_dtable::bloom::deinit()
 	}
 }
 
-int bloom_dtable::bloom::write(int dfd, const char * file, size_t m, size_t k) const
+int bloom_dtable::bloom::write(int dfd, const char * file, size_t m, size_t k, uint32_t version) const
 {
 	int fd;
 	ssize_t r, bytes = (m + 7) / 8;
 	bloom_dtable_header header;
 
 	header.magic = BLOOM_DTABLE_MAGIC;
-	header.version = BLOOM_DTABLE_VERSION;
+	header.version = version;
 	header.m = m;
 	header.k = k;
 	
@@ -167,33 +214,39 @@ fail:
 	return (r < 0) ? r : -1;
 }
 
-bool bloom_dtable::bloom::check(const uint8_t * hash, size_t k, size_t bits) const
+double bloom_dtable::bloom::observed_fpr() const
 {
-#if BFDT_PERF_TEST
-	if(perf_enable)
-		total_lookups++;
-#endif
-	bitreader indices(hash, bits);
+	/* every lookup of a key not in the dtable is either blocked by the
+	 * filter or is a false positive */
+	size_t positives = false_positives.get();
+	size_t negatives = blocked_lookups.get() + positives;
+	return negatives ? positives / (double) negatives : 0;
+}
+
+bool bloom_dtable::bloom::check(const uint8_t * hash, size_t m, size_t k, size_t bits) const
+{
+	indexer indices(hash, m, bits);
+	bool track = tracking();
+	if(track)
+		total_lookups.inc();
 	for(size_t i = 0; i < k; i++)
 		if(!check(indices.next()))
 		{
-#if BFDT_PERF_TEST
-			if(perf_enable)
-				blocked_lookups++;
-#endif
+			if(track)
+				blocked_lookups.inc();
 			return false;
 		}
 	return true;
 }
 
-void bloom_dtable::bloom::add(const uint8_t * hash, size_t k, size_t bits)
+void bloom_dtable::bloom::add(const uint8_t * hash, size_t m, size_t k, size_t bits)
 {
-	bitreader indices(hash, bits);
+	indexer indices(hash, m, bits);
 	for(size_t i = 0; i < k; i++)
 		set(indices.next());
 }
 
-bool bloom_dtable::bloom::check(const dtype & key, size_t k, size_t bits) const
+bool bloom_dtable::bloom::check(const dtype & key, size_t m, size_t k, size_t bits) const
 {
 	MD5_CTX ctx;
 	uint8_t hash[HASH_SIZE];
@@ -203,26 +256,30 @@ bool bloom_dtable::bloom::check(const dtype & key, size_t k, size_t bits) const
 		case dtype::UINT32:
 			MD5Update(&ctx, (const uint8_t *) &key.u32, sizeof(key.u32));
 			MD5Final(hash, &ctx);
-			return check(hash, k, bits);
+			return check(hash, m, k, bits);
+		case dtype::UINT64:
+			MD5Update(&ctx, (const uint8_t *) &key.u64, sizeof(key.u64));
+			MD5Final(hash, &ctx);
+			return check(hash, m, k, bits);
 		case dtype::DOUBLE:
 			MD5Update(&ctx, (const uint8_t *) &key.dbl, sizeof(key.dbl));
 			MD5Final(hash, &ctx);
-			return check(hash, k, bits);
+			return check(hash, m, k, bits);
 		case dtype::STRING:
 			if(key.str)
 				MD5Update(&ctx, (const uint8_t *) key.str.str(), key.str.length());
 			MD5Final(hash, &ctx);
-			return check(hash, k, bits);
+			return check(hash, m, k, bits);
 		case dtype::BLOB:
 			if(key.blb.exists())
 				MD5Update(&ctx, &key.blb[0], key.blb.size());
 			MD5Final(hash, &ctx);
-			return check(hash, k, bits);
+			return check(hash, m, k, bits);
 	}
 	abort();
 }
 
-void bloom_dtable::bloom::add(const dtype & key, size_t k, size_t bits)
+void bloom_dtable::bloom::add(const dtype & key, size_t m, size_t k, size_t bits)
 {
 	MD5_CTX ctx;
 	uint8_t hash[HASH_SIZE];
@@ -232,43 +289,55 @@ void bloom_dtable::bloom::add(const dtype & key, size_t k, size_t bits)
 		case dtype::UINT32:
 			MD5Update(&ctx, (const uint8_t *) &key.u32, sizeof(key.u32));
 			MD5Final(hash, &ctx);
-			return add(hash, k, bits);
+			return add(hash, m, k, bits);
+		case dtype::UINT64:
+			MD5Update(&ctx, (const uint8_t *) &key.u64, sizeof(key.u64));
+			MD5Final(hash, &ctx);
+			return add(hash, m, k, bits);
 		case dtype::DOUBLE:
 			MD5Update(&ctx, (const uint8_t *) &key.dbl, sizeof(key.dbl));
 			MD5Final(hash, &ctx);
-			return add(hash, k, bits);
+			return add(hash, m, k, bits);
 		case dtype::STRING:
 			if(key.str)
 				MD5Update(&ctx, (const uint8_t *) key.str.str(), key.str.length());
 			MD5Final(hash, &ctx);
-			return add(hash, k, bits);
+			return add(hash, m, k, bits);
 		case dtype::BLOB:
 			if(key.blb.exists())
 				MD5Update(&ctx, &key.blb[0], key.blb.size());
 			MD5Final(hash, &ctx);
-			return add(hash, k, bits);
+			return add(hash, m, k, bits);
 	}
 	abort();
 }
 
 bool bloom_dtable::present(const dtype & key, bool * found, ATX_DEF) const
 {
-	if(!filter.check(key, k, bits))
+	bool value;
+	if(!filter.check(key, m, k, bits))
 	{
 		*found = false;
 		return false;
 	}
-	return base->present(key, found);
+	value = base->present(key, found);
+	if(!*found)
+		filter.false_positive();
+	return value;
 }
 
 blob bloom_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
 {
-	if(!filter.check(key, k, bits))
+	blob value;
+	if(!filter.check(key, m, k, bits))
 	{
 		*found = false;
 		return blob();
 	}
-	return base->lookup(key, found);
+	value = base->lookup(key, found);
+	if(!*found)
+		filter.false_positive();
+	return value;
 }
 
 bool bloom_dtable::static_indexed_access(const params & config)
@@ -287,7 +356,9 @@ int bloom_dtable::init(int dfd, const char * file, const params & config, sys_jo
 {
 	const dtable_factory * factory;
 	params base_config;
+	uint32_t version;
 	int r, bf_dfd;
+	bool track;
 	if(base)
 		deinit();
 	factory = dtable_factory::lookup(config, "base");
@@ -295,6 +366,8 @@ int bloom_dtable::init(int dfd, const char * file, const params & config, sys_jo
 		return -ENOENT;
 	if(!config.get("base_config", &base_config, params()))
 		return -EINVAL;
+	if(!config.get("bloom_track", &track, false))
+		return -EINVAL;
 	bf_dfd = openat(dfd, file, O_RDONLY);
 	if(bf_dfd < 0)
 		return bf_dfd;
@@ -305,10 +378,11 @@ int bloom_dtable::init(int dfd, const char * file, const params & config, sys_jo
 	assert(ktype == dtype::UINT32);
 	cmp_name = base->get_cmp_name();
 	
-	r = filter.init(bf_dfd, "bloom", &m, &k);
+	r = filter.init(bf_dfd, "bloom", &m, &k, &version);
 	if(r < 0)
 		goto fail_filter;
-	bits = HASH_BITS / k;
+	bits = version ? 0 : HASH_BITS / k;
+	filter.track = track;
 	
 	close(bf_dfd);
 	return 0;
@@ -332,21 +406,52 @@ void bloom_dtable::deinit()
 	}
 }
 
-/* The "bloom_k" parameter should be a divisor of 128 (the size in bits of an
- * MD5 hash). An MD5 hash of the key will be taken, and divided into bloom_k
- * indices, each of which will be used to set a bit of an appropriately sized
- * bloom filter. Picking a value that divides 160 as well, for SHA1, will avoid
- * having to change anything if we switch to that hash instead. The default
- * value is 8, resulting in 16-bit indices and and an 8KiB bloom filter. (For
- * SHA1 it would be a 128KiB bloom filter with 20-bit indices.) */
-/* FIXME: Should this be given as index_bits instead, and divide to get k? It
- * might be more stable in case of hash changes. */
+/* Picks the filter size m (in bits) and number of hash indices k for the
+ * given number of keys and target false positive rate p. If k is given, m is
+ * the smallest size that achieves p with k indices: m = -kn / ln(1 - p^(1/k)).
+ * Otherwise we use the optimal m = -n ln(p) / ln(2)^2, with k = (m/n) ln(2). */
+void bloom_dtable::size_filter(size_t keys, double fpr, size_t * m, size_t * k)
+{
+	double bits;
+	if(!keys)
+		keys = 1;
+	if(*k)
+		bits = -(double) *k * keys / log(1 - pow(fpr, 1.0 / *k));
+	else
+		bits = -(double) keys * log(fpr) / (M_LN2 * M_LN2);
+	/* the header stores m as 32 bits */
+	if(bits > UINT32_MAX - 7)
+		bits = UINT32_MAX - 7;
+	*m = (size_t) ceil(bits);
+	if(*m < 64)
+		*m = 64;
+	if(!*k)
+	{
+		*k = (size_t) (*m * M_LN2 / keys + 0.5);
+		if(*k < 1)
+			*k = 1;
+		else if(*k > 32)
+			*k = 32;
+	}
+}
+
+/* The "bloom_fpr" parameter gives the target false positive rate, and defaults
+ * to 1%. The filter is sized for the actual number of keys in the base dtable
+ * to meet it. An MD5 hash of each key will be taken, and its two halves used to
+ * derive the filter indices by double hashing. The "bloom_indices" parameter
+ * can be used to fix the number of indices; the default (0) picks the optimal
+ * one. For compatibility, if the "bloom_k" parameter is given, a fixed-size
+ * version 0 filter is built instead: bloom_k should be a divisor of 128 (the
+ * size in bits of an MD5 hash), which is divided into bloom_k indices, each
+ * setting a bit of a filter with 2^(128 / bloom_k) bits. */
 int bloom_dtable::create(int dfd, const char * file, const params & config, dtable::iter * source, const ktable * shadow)
 {
 	bool valid;
+	float fpr;
 	bloom filter;
 	int bf_dfd, r;
-	size_t m, k, bits;
+	size_t m, k, bits, keys;
+	uint32_t version;
 	params base_config;
 	dtable::iter * iter;
 	dtable * base_dtable;
@@ -355,11 +460,27 @@ int bloom_dtable::create(int dfd, const char * file, const params & config, dtab
 		return -ENOENT;
 	if(!config.get("base_config", &base_config, params()))
 		return -EINVAL;
-	if(!config.get("bloom_k", &r, 8) || r < 5 || r > 32)
+	if(!config.get("bloom_indices", &r, 0) || r < 0 || r > 32)
 		return -EINVAL;
 	k = r;
-	bits = HASH_BITS / k;
-	m = 1 << bits;
+	if(!config.get("bloom_fpr", &fpr, 0.01) || fpr <= 0 || fpr >= 1)
+		return -EINVAL;
+	if(config.has("bloom_k"))
+	{
+		/* the fixed-size filter can't be combined with the new parameters */
+		if(k || config.has("bloom_fpr"))
+			return -EINVAL;
+		if(!config.get("bloom_k", &r, 8) || r < 5 || r > 32)
+			return -EINVAL;
+		k = r;
+		bits = HASH_BITS / k;
+		version = 0;
+	}
+	else
+	{
+		bits = 0;
+		version = BLOOM_DTABLE_VERSION;
+	}
 	
 	if(!source_shadow_ok(source, shadow))
 		return -EINVAL;
@@ -379,21 +500,45 @@ int bloom_dtable::create(int dfd, const char * file, const params & config, dtab
 	if(!base_dtable)
 		goto fail_reopen;
 	
-	r = filter.init((m + 7) / 8);
-	if(r < 0)
-		goto fail_write;
 	iter = base_dtable->iterator();
 	if(!iter)
 		goto fail_write;
+	if(bits)
+		m = 1 << bits;
+	else
+	{
+		keys = base_dtable->size();
+		if(keys == (size_t) -1)
+		{
+			dtable_stats stats;
+			if(base_dtable->get_stats(&stats) >= 0 && !stats.partial)
+				keys = stats.count;
+			else
+			{
+				/* no indexed access or stats, so count the keys ourselves */
+				keys = 0;
+				for(valid = iter->valid(); valid; valid = iter->next())
+					keys++;
+				iter->first();
+			}
+		}
+		size_filter(keys, fpr, &m, &k);
+	}
+	r = filter.init((m + 7) / 8);
+	if(r < 0)
+	{
+		delete iter;
+		goto fail_write;
+	}
 	valid = iter->valid();
 	while(valid)
 	{
 		/* add all keys, even ones with nonexistent values */
-		filter.add(iter->key(), k, bits);
+		filter.add(iter->key(), m, k, bits);
 		valid = iter->next();
 	}
 	delete iter;
-	r = filter.write(bf_dfd, "bloom", m, k);
+	r = filter.write(bf_dfd, "bloom", m, k, version);
 	if(r < 0)
 		goto fail_write;
 	
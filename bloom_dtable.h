@@ -13,15 +13,20 @@
 #error bloom_dtable.h is a C++ header file
 #endif
 
+#include "atomic.h"
 #include "dtable_factory.h"
 
 /* The bloom filter dtable must be created with another read-only dtable, and
- * builds a bloom filter for the keys. Negative lookups are then very fast. */
+ * builds a bloom filter for the keys. Negative lookups are then very fast. The
+ * filter is sized for the number of keys to meet a target false positive rate,
+ * given by the "bloom_fpr" parameter, unless the older fixed-size "bloom_k"
+ * parameter is given. The filter's hit rate is only tracked if the "bloom_track"
+ * parameter is set, since the counters are shared by all lookups. */
 
 #define BFDT_PERF_TEST 0
 
 #define BLOOM_DTABLE_MAGIC 0x1138B893
-#define BLOOM_DTABLE_VERSION 0
+#define BLOOM_DTABLE_VERSION 1
 
 class bloom_dtable : public dtable
 {
@@ -36,6 +41,7 @@ public:
 	virtual blob index(size_t index) const { return base->index(index); }
 	virtual bool contains_index(size_t index) const { return base->contains_index(index); }
 	virtual size_t size() const { return base->size(); }
+	inline virtual int get_stats(dtable_stats * stats) const { return base->get_stats(stats); }
 	
 	inline virtual int set_blob_cmp(const blob_comparator * cmp)
 	{
@@ -48,6 +54,10 @@ public:
 		return value;
 	}
 	
+	/* the fraction of lookups for absent keys that the filter did not block,
+	 * if "bloom_track" is set (or 0 otherwise) */
+	inline double observed_fpr() const { return filter.observed_fpr(); }
+	
 	/* bloom_dtable supports indexed access if its base does */
 	static bool static_indexed_access(const params & config);
 	
@@ -73,12 +83,12 @@ private:
 	class bloom
 	{
 	public:
-		bloom() : filter(NULL) {}
+		bloom() : filter(NULL), track(false) {}
 		/* for reading */
-		int init(int dfd, const char * file, size_t * m, size_t * k);
+		int init(int dfd, const char * file, size_t * m, size_t * k, uint32_t * version);
 		/* for writing */
 		int init(size_t bytes);
-		int write(int dfd, const char * file, size_t m, size_t k) const;
+		int write(int dfd, const char * file, size_t m, size_t k, uint32_t version) const;
 		void deinit();
 		~bloom()
 		{
@@ -93,16 +103,35 @@ private:
 		{
 			filter[number / 8] |= 1 << (number % 8);
 		}
-		bool check(const uint8_t * hash, size_t k, size_t bits) const;
-		void add(const uint8_t * hash, size_t k, size_t bits);
-		bool check(const dtype & key, size_t k, size_t bits) const;
-		void add(const dtype & key, size_t k, size_t bits);
+		bool check(const uint8_t * hash, size_t m, size_t k, size_t bits) const;
+		void add(const uint8_t * hash, size_t m, size_t k, size_t bits);
+		bool check(const dtype & key, size_t m, size_t k, size_t bits) const;
+		void add(const dtype & key, size_t m, size_t k, size_t bits);
+		/* called when a key passed the filter but was not found */
+		inline void false_positive() const
+		{
+			if(tracking())
+				false_positives.inc();
+		}
+		double observed_fpr() const;
+		/* whether to count lookups; lookups may come from several threads */
+		bool track;
 	private:
+		inline bool tracking() const
+		{
+#if BFDT_PERF_TEST
+			if(perf_enable)
+				return true;
+#endif
+			return track;
+		}
+		void reset();
+		
 		uint8_t * filter;
 #if BFDT_PERF_TEST
 		istr dir_name, file_name;
-		mutable size_t total_lookups, blocked_lookups;
 #endif
+		mutable atomic<size_t> total_lookups, blocked_lookups, false_positives;
 	};
 
 	struct bloom_dtable_header
@@ -112,12 +141,14 @@ private:
 		uint32_t m, k;
 	} __attribute__((packed));
 	
+	static void size_filter(size_t keys, double fpr, size_t * m, size_t * k);
+	
 	dtable * base;
 	mutable chain_callback chain;
 	bloom filter;
 	/* m: number of bits in filter
 	 * k: number of hash indices
-	 * bits: size of each index */
+	 * bits: size of each index (version 0), or 0 for double hashing */
 	size_t m, k, bits;
 };
 
@@ -35,6 +35,7 @@ public:
 	inline virtual int check_tx(ATX_REQ) const { return base->check_tx(atx); }
 	inline virtual int commit_tx(ATX_REQ) { return base->commit_tx(atx); }
 	inline virtual void abort_tx(ATX_REQ) { return base->abort_tx(atx); }
+	inline virtual int get_stats(dtable_stats * stats) const { return base->get_stats(stats); }
 	
 	inline virtual int set_blob_cmp(const blob_comparator * cmp)
 	{
@@ -48,6 +49,7 @@ public:
 	}
 	
 	inline virtual int maintain(bool force = false) { return base->maintain(force); }
+	inline virtual void defer_maintenance(bool defer) { base->defer_maintenance(defer); }
 	
 	DECLARE_WRAP_FACTORY(cache_dtable);
 	
@@ -288,6 +288,214 @@ blob column_ctable::p_iter::value(size_t column) const
 	return source[column]->value();
 }
 
+column_ctable::filter_p_iter::filter_p_iter(const column_ctable * base, const size_t * columns, size_t count, const size_t * test_columns, size_t test_count, const row_test * test)
+	: test(test), zones(NULL), base(base)
+{
+	assert(count && test);
+	source = new dtable::iter *[base->column_count];
+	driving = new bool[base->column_count];
+	current = new bool[base->column_count];
+	for(size_t i = 0; i < base->column_count; i++)
+	{
+		source[i] = NULL;
+		driving[i] = false;
+		current[i] = false;
+	}
+	for(size_t i = 0; i < test_count; i++)
+	{
+		assert(test_columns[i] < base->column_count);
+		driving[test_columns[i]] = true;
+	}
+	/* with no test columns, just walk the first projected column */
+	if(!test_count)
+		driving[columns[0]] = true;
+	/* with more than one, skipping would leave the others behind */
+	else if(test_count == 1)
+		zones = test->zones(test_columns[0]);
+	for(size_t i = 0; i < base->column_count; i++)
+		if(driving[i])
+			source[i] = base->column_table[i]->iterator();
+	for(size_t i = 0; i < count; i++)
+	{
+		assert(columns[i] < base->column_count);
+		if(!source[columns[i]])
+			source[columns[i]] = base->column_table[columns[i]]->iterator();
+	}
+	start = (size_t) -1;
+	for(size_t i = 0; i < base->column_count; i++)
+		if(driving[i])
+		{
+			start = i;
+			break;
+		}
+	assert(start != (size_t) -1);
+	reset();
+	advance();
+}
+
+bool column_ctable::filter_p_iter::step(bool forward)
+{
+	bool valid;
+	do {
+		valid = forward ? source[start]->next() : source[start]->prev();
+		for(size_t i = start + 1; i < base->column_count; i++)
+			if(driving[i])
+			{
+				if(forward)
+					source[i]->next();
+				else
+					source[i]->prev();
+			}
+	} while(valid && !source[start]->meta().exists());
+	reset();
+	return valid;
+}
+
+bool column_ctable::filter_p_iter::advance()
+{
+	if(!source[start]->valid() || !skip())
+		return false;
+	if(source[start]->meta().exists() && (*test)(this))
+		return true;
+	return next();
+}
+
+bool column_ctable::filter_p_iter::skip()
+{
+	bool valid;
+	if(!zones)
+		return source[start]->valid();
+	/* there is only one driving column, so the others need not follow */
+	valid = source[start]->skip_zones(*zones);
+	reset();
+	return valid;
+}
+
+void column_ctable::filter_p_iter::reset()
+{
+	for(size_t i = 0; i < base->column_count; i++)
+		current[i] = driving[i];
+}
+
+bool column_ctable::filter_p_iter::valid() const
+{
+	return source[start]->valid();
+}
+
+bool column_ctable::filter_p_iter::next()
+{
+	while(step(true))
+	{
+		if(zones)
+		{
+			if(!skip())
+				return false;
+			/* we may have landed on a nonexistent row */
+			if(!source[start]->meta().exists())
+				continue;
+		}
+		if((*test)(this))
+			return true;
+	}
+	return false;
+}
+
+bool column_ctable::filter_p_iter::prev()
+{
+	while(step(false))
+		if((*test)(this))
+			return true;
+	/* go back to the first passing row */
+	first();
+	return false;
+}
+
+bool column_ctable::filter_p_iter::first()
+{
+	for(size_t i = start; i < base->column_count; i++)
+		if(driving[i])
+			source[i]->first();
+	reset();
+	return advance();
+}
+
+bool column_ctable::filter_p_iter::last()
+{
+	bool valid = source[start]->last();
+	for(size_t i = start + 1; i < base->column_count; i++)
+		if(driving[i])
+			source[i]->last();
+	reset();
+	if(valid && source[start]->meta().exists() && (*test)(this))
+		return true;
+	return valid && prev();
+}
+
+dtype column_ctable::filter_p_iter::key() const
+{
+	return source[start]->key();
+}
+
+bool column_ctable::filter_p_iter::seek(const dtype & key)
+{
+	bool found = source[start]->seek(key);
+	for(size_t i = start + 1; i < base->column_count; i++)
+		if(driving[i])
+			source[i]->seek(key);
+	reset();
+	if(!source[start]->valid())
+		return false;
+	if(source[start]->meta().exists() && (*test)(this))
+		return found;
+	next();
+	return false;
+}
+
+bool column_ctable::filter_p_iter::seek(const dtype_test & test)
+{
+	bool found = source[start]->seek(test);
+	for(size_t i = start + 1; i < base->column_count; i++)
+		if(driving[i])
+			source[i]->seek(test);
+	reset();
+	if(!source[start]->valid())
+		return false;
+	if(source[start]->meta().exists() && (*this->test)(this))
+		return found;
+	next();
+	return false;
+}
+
+dtype::ctype column_ctable::filter_p_iter::key_type() const
+{
+	return base->key_type();
+}
+
+blob column_ctable::filter_p_iter::value(size_t column) const
+{
+	assert(column < base->column_count);
+	assert(source[column]);
+	if(!current[column])
+	{
+		dtype key = source[start]->key();
+		dtable::iter * iter = source[column];
+		/* when reading rows in order, this column is usually just behind
+		 * the current row, and a few next() calls are cheaper than a seek */
+		int c = iter->valid() ? iter->key().compare(key, base->blob_cmp) : 1;
+		for(int i = 0; c < 0 && i < COLUMN_CTABLE_FILTER_STEPS; i++)
+			c = iter->next() ? iter->key().compare(key, base->blob_cmp) : 1;
+		if(c)
+		{
+			/* try the index next, since it can be much cheaper than a seek */
+			size_t index = source[start]->get_index();
+			if(index == (size_t) -1 || !iter->seek_index(index) || iter->key().compare(key, base->blob_cmp))
+				iter->seek(key);
+		}
+		current[column] = true;
+	}
+	return source[column]->value();
+}
+
 dtable::key_iter * column_ctable::keys() const
 {
 	return column_table[0]->iterator();
@@ -303,6 +511,11 @@ ctable::p_iter * column_ctable::iterator(const size_t * columns, size_t count) c
 	return new p_iter(this, columns, count);
 }
 
+ctable::p_iter * column_ctable::iterator(const size_t * columns, size_t count, const size_t * test_columns, size_t test_count, const row_test * test) const
+{
+	return new filter_p_iter(this, columns, count, test_columns, test_count, test);
+}
+
 blob column_ctable::find(const dtype & key, size_t column) const
 {
 	assert(column < column_count);
@@ -17,12 +17,16 @@
 #define COLUMN_CTABLE_MAGIC 0x36BC4B9D
 #define COLUMN_CTABLE_VERSION 0
 
+/* how far filter_p_iter will step a column forward before seeking it */
+#define COLUMN_CTABLE_FILTER_STEPS 4
+
 class column_ctable : public ctable
 {
 public:
 	virtual dtable::key_iter * keys() const;
 	virtual iter * iterator() const;
 	virtual p_iter * iterator(const size_t * columns, size_t count) const;
+	virtual p_iter * iterator(const size_t * columns, size_t count, const size_t * test_columns, size_t test_count, const row_test * test) const;
 	virtual blob find(const dtype & key, size_t column) const;
 	virtual bool contains(const dtype & key) const;
 	
@@ -120,6 +124,53 @@ private:
 		const column_ctable * base;
 	};
 	
+	/* A projection iterator which reads only the test columns for each row,
+	 * and moves the iterators for the other columns to a row only if it passes
+	 * the test and one of their values is actually requested. */
+	class filter_p_iter : public ctable::p_iter
+	{
+	public:
+		virtual bool valid() const;
+		virtual bool next();
+		virtual bool prev();
+		virtual bool first();
+		virtual bool last();
+		virtual dtype key() const;
+		virtual bool seek(const dtype & key);
+		virtual bool seek(const dtype_test & test);
+		virtual dtype::ctype key_type() const;
+		virtual blob value(size_t column) const;
+		filter_p_iter(const column_ctable * base, const size_t * columns, size_t count, const size_t * test_columns, size_t test_count, const row_test * test);
+		virtual ~filter_p_iter()
+		{
+			for(size_t i = 0; i < base->column_count; i++)
+				if(source[i])
+					delete source[i];
+			delete[] source;
+			delete[] driving;
+			delete[] current;
+		}
+		
+	private:
+		/* moves the test columns together, skipping nonexistent rows */
+		bool step(bool forward);
+		/* finds the next passing row, starting with the current row */
+		bool advance();
+		/* skips rows ruled out by the test column's summaries */
+		bool skip();
+		void reset();
+		
+		size_t start;
+		dtable::iter ** source;
+		/* whether each column is moved along with every row */
+		bool * driving;
+		/* whether each other column has been moved to the current row */
+		mutable bool * current;
+		const row_test * test;
+		const zone_test * zones;
+		const column_ctable * base;
+	};
+	
 	dtable ** column_table;
 };
 
@@ -0,0 +1,5 @@
+#ifndef __CONFIG_H
+#define __CONFIG_H
+#define HAVE_FSTITCH 0
+#define HAVE_IO_URING 1
+#endif
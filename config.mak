@@ -0,0 +1,9 @@
+CC=gcc
+CXX=g++
+LD=ld
+CONFIG_CFLAGS=
+CONFIG_CXXFLAGS=
+CONFIG_LDFLAGS=
+FSTITCH_CFLAGS=
+FSTITCH_LDFLAGS=
+FSTITCH_LIB=
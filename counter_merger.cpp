@@ -0,0 +1,51 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#include <string.h>
+
+#include "blob_buffer.h"
+#include "counter_merger.h"
+
+/* the first byte of operands, which are otherwise just like values */
+#define COUNTER_OPERAND 0x2B
+
+bool counter_merger::partial(const blob & value) const
+{
+	return value.size() == sizeof(int64_t) + 1 && value[0] == COUNTER_OPERAND;
+}
+
+blob counter_merger::merge(const blob & delta, const blob & older) const
+{
+	int64_t sum = read(delta);
+	if(partial(older))
+		return operand(sum + read(older));
+	sum += value(older);
+	return blob(sizeof(sum), &sum);
+}
+
+blob counter_merger::operand(int64_t delta)
+{
+	blob_buffer buffer(sizeof(delta) + 1);
+	buffer << (uint8_t) COUNTER_OPERAND << delta;
+	return buffer;
+}
+
+int64_t counter_merger::value(const blob & x)
+{
+	int64_t value;
+	if(x.size() != sizeof(value))
+		return 0;
+	memcpy(&value, &x[0], sizeof(value));
+	return value;
+}
+
+/* reads the increment of an operand */
+int64_t counter_merger::read(const blob & x)
+{
+	int64_t delta;
+	memcpy(&delta, &x[1], sizeof(delta));
+	return delta;
+}
+
+const counter_merger counter_merger::instance;
@@ -0,0 +1,44 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#ifndef __COUNTER_MERGER_H
+#define __COUNTER_MERGER_H
+
+#include <stdint.h>
+
+#ifndef __cplusplus
+#error counter_merger.h is a C++ header file
+#endif
+
+#include "blob.h"
+#include "blob_merger.h"
+
+/* The counter merger, named "counter", allows counters to be incremented
+ * without reading them first. Counter values are stored as native 64-bit
+ * signed integers; increments are stored as operands made by operand(), which
+ * are one byte longer so that they can be told apart. Nonexistent counters
+ * are treated as zero, and removing a counter resets it to zero. */
+
+class counter_merger : public blob_merger
+{
+public:
+	virtual bool partial(const blob & value) const;
+	virtual blob merge(const blob & delta, const blob & older) const;
+	
+	/* use this value with dtable::insert() to add to a counter */
+	static blob operand(int64_t delta);
+	/* get the value of a counter from a (complete) stored value */
+	static int64_t value(const blob & x);
+	
+	static inline const blob_merger * merger() { return &instance; }
+	
+private:
+	inline counter_merger() : blob_merger("counter") {}
+	
+	static int64_t read(const blob & x);
+	
+	static const counter_merger instance;
+};
+
+#endif /* __COUNTER_MERGER_H */
@@ -0,0 +1,84 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#include <string.h>
+
+#include "crc32c.h"
+
+/* the reversed Castagnoli polynomial */
+#define CRC32C_POLY 0x82F63B78
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRC32C_SSE42 1
+#else
+#define CRC32C_SSE42 0
+#endif
+
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t * data, size_t length)
+{
+	while(length--)
+		crc = crc32c_table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+#if CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t * data, size_t length)
+{
+	/* get to an aligned address first */
+	while(length && ((uintptr_t) data & 7))
+	{
+		crc = __builtin_ia32_crc32qi(crc, *data++);
+		length--;
+	}
+#ifdef __x86_64__
+	while(length >= 8)
+	{
+		uint64_t word;
+		memcpy(&word, data, 8);
+		crc = (uint32_t) __builtin_ia32_crc32di(crc, word);
+		data += 8;
+		length -= 8;
+	}
+#endif
+	while(length >= 4)
+	{
+		uint32_t word;
+		memcpy(&word, data, 4);
+		crc = __builtin_ia32_crc32si(crc, word);
+		data += 4;
+		length -= 4;
+	}
+	while(length--)
+		crc = __builtin_ia32_crc32qi(crc, *data++);
+	return crc;
+}
+#endif
+
+static uint32_t (*crc32c_impl)(uint32_t crc, const uint8_t * data, size_t length) = crc32c_sw;
+
+/* runs before main(), so there is no race setting these up */
+static void __attribute__((constructor)) crc32c_init(void)
+{
+	uint32_t i, j;
+	for(i = 0; i < 256; i++)
+	{
+		uint32_t crc = i;
+		for(j = 0; j < 8; j++)
+			crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		crc32c_table[i] = crc;
+	}
+#if CRC32C_SSE42
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse4.2"))
+		crc32c_impl = crc32c_hw;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void * data, size_t length)
+{
+	return ~crc32c_impl(~crc, (const uint8_t *) data, length);
+}
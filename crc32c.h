@@ -0,0 +1,25 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#ifndef __CRC32C_H
+#define __CRC32C_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Computes the CRC32C (Castagnoli) checksum of the data, continuing from a
+ * previous value: pass 0 to start, and the result of one call to continue it
+ * with the next piece. The SSE4.2 crc32 instruction is used when the CPU has
+ * it, and a lookup table otherwise; the results are the same either way. */
+uint32_t crc32c(uint32_t crc, const void * data, size_t length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CRC32C_H */
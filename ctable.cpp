@@ -0,0 +1,128 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#include <vector>
+
+#include "ctable.h"
+
+/* skips the rows of a projection iterator that fail a row test */
+class ctable_filter_p_iter : public ctable::p_iter
+{
+public:
+	virtual bool valid() const
+	{
+		return base->valid();
+	}
+	virtual bool next()
+	{
+		return advance(true);
+	}
+	virtual bool prev()
+	{
+		return retreat(true);
+	}
+	virtual bool first()
+	{
+		if(!base->first())
+			return false;
+		return advance();
+	}
+	virtual bool last()
+	{
+		if(!base->last())
+			return false;
+		return retreat();
+	}
+	virtual dtype key() const
+	{
+		return base->key();
+	}
+	virtual bool seek(const dtype & key)
+	{
+		bool found = base->seek(key);
+		if(found && (*test)(base))
+			return true;
+		advance();
+		return false;
+	}
+	virtual bool seek(const dtype_test & test)
+	{
+		bool found = base->seek(test);
+		if(found && (*this->test)(base))
+			return true;
+		advance();
+		return false;
+	}
+	virtual dtype::ctype key_type() const
+	{
+		return base->key_type();
+	}
+	virtual blob value(size_t column) const
+	{
+		return base->value(column);
+	}
+	inline ctable_filter_p_iter(ctable::p_iter * base, const ctable::row_test * test)
+		: base(base), test(test)
+	{
+		advance();
+	}
+	virtual ~ctable_filter_p_iter()
+	{
+		delete base;
+	}
+	
+private:
+	inline bool advance(bool initial = false)
+	{
+		bool valid;
+		if(initial)
+			while((valid = base->next()) && !(*test)(base));
+		else
+		{
+			valid = base->valid();
+			while(valid && !(*test)(base))
+				valid = base->next();
+		}
+		return valid;
+	}
+	
+	inline bool retreat(bool initial = false)
+	{
+		bool valid;
+		if(initial)
+			while((valid = base->prev()) && !(*test)(base));
+		else
+		{
+			valid = base->valid();
+			while(valid && !(*test)(base))
+				valid = base->prev();
+		}
+		if(!valid)
+			advance();
+		return valid;
+	}
+	
+	ctable::p_iter * base;
+	const ctable::row_test * test;
+};
+
+ctable::p_iter * ctable::iterator(const size_t * columns, size_t count, const size_t * test_columns, size_t test_count, const row_test * test) const
+{
+	p_iter * source;
+	std::vector<size_t> all(columns, columns + count);
+	/* add any test columns that are not also projected */
+	for(size_t i = 0; i < test_count; i++)
+	{
+		size_t j;
+		for(j = 0; j < count; j++)
+			if(columns[j] == test_columns[i])
+				break;
+		if(j == count)
+			all.push_back(test_columns[i]);
+	}
+	source = iterator(&all[0], all.size());
+	if(!source)
+		return NULL;
+	return new ctable_filter_p_iter(source, test);
+}
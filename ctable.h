@@ -63,6 +63,20 @@ public:
 		void operator=(const p_iter &);
 		p_iter(const p_iter &);
 	};
+	/* row predicates, for filtered projection iterators */
+	class row_test
+	{
+	public:
+		/* Returns true if the row should be returned. Only the key and the
+		 * test columns given to iterator() may be read from the row. */
+		virtual bool operator()(const p_iter * row) const = 0;
+		/* If there is a single test column, this may return a test on its
+		 * values which fails for every value that cannot pass the row test,
+		 * so that column stores can skip zones of rows without reading them
+		 * (see dtable::iter::skip_zones()). */
+		inline virtual const zone_test * zones(size_t column) const { return NULL; }
+		inline virtual ~row_test() {}
+	};
 	
 	/* column indices */
 	inline size_t index(const istr & column) const
@@ -91,6 +105,12 @@ public:
 		return i;
 	}
 	virtual p_iter * iterator(const size_t * columns, size_t count) const = 0;
+	/* Returns a projection iterator over just the rows that pass the test,
+	 * which is evaluated on the test columns. (The test columns need not be
+	 * in the projection.) This default implementation reads all the columns
+	 * of every row and skips the ones that fail, but column stores can read
+	 * the rest of the columns only for the rows that pass. */
+	virtual p_iter * iterator(const size_t * columns, size_t count, const size_t * test_columns, size_t test_count, const row_test * test) const;
 	inline p_iter * iterator(const istr * columns, size_t count) const
 	{
 		size_t indices[count];
@@ -62,6 +62,8 @@ private:
 		virtual bool seek(const dtype_test & test);
 		virtual metablob meta() const;
 		virtual blob value() const;
+		/* the base's zone summaries describe our encoded values */
+		virtual bool skip_zones(const zone_test & test) { return valid(); }
 		inline iter(dtable::iter * base, const deltaint_dtable * source);
 		virtual ~iter() {}
 	private:
@@ -17,6 +17,20 @@
 #include "params.h"
 #include "callback.h"
 #include "blob_comparator.h"
+#include "blob_merger.h"
+
+class dtable_stats;
+
+/* value range tests (used by dtable::iter::skip_zones()) */
+class zone_test
+{
+public:
+	/* Returns true if any value in the range [min, max] might satisfy the
+	 * test. The encoding of the values depends on the dtable which stored
+	 * the summaries; see zone_dtable for details. */
+	virtual bool operator()(const blob & min, const blob & max) const = 0;
+	inline virtual ~zone_test() {}
+};
 
 /* key tables (used for shadow checks) */
 class ktable
@@ -118,6 +132,14 @@ public:
 		 * should return an error, as it cannot store the requested value. */
 		virtual bool reject(blob * replacement) { return false; }
 		
+		/* Moves the iterator forward past entries whose values the dtable
+		 * can prove, using stored summaries of value ranges, will not
+		 * satisfy the given test. It may stop at any entry which might, and
+		 * never moves backward. Returns true if the iterator points at a
+		 * valid entry afterward. By default no summaries are available, so
+		 * it just does not move the iterator at all. */
+		virtual bool skip_zones(const zone_test & test) { return valid(); }
+		
 		inline iter() {}
 		virtual ~iter() {}
 	private:
@@ -147,6 +169,8 @@ public:
 	inline virtual blob index(size_t index) const { return blob(); }
 	inline virtual bool contains_index(size_t index) const { return false; }
 	inline virtual size_t size() const { return (size_t) -1; }
+	/* statistics about the keys, for dtables that keep them (see stats_dtable) */
+	inline virtual int get_stats(dtable_stats * stats) const { return -ENOSYS; }
 	
 	inline virtual bool writable() const { return false; }
 	/* writable dtables support these */
@@ -159,7 +183,7 @@ public:
 	inline virtual int commit_tx(ATX_REQ) { return -ENOSYS; }
 	inline virtual void abort_tx(ATX_REQ) {}
 	
-	inline dtable() : usage(0) {}
+	inline dtable() : blob_mrg(NULL), usage(0) {}
 	/* calls the destructor by default, but can be overridden */
 	inline virtual void destroy() const { delete this; }
 	
@@ -176,8 +200,18 @@ public:
 		return 0;
 	}
 	
+	/* Dtables which can merge deltas (see blob_merger.h) support this. It
+	 * should be set before inserting any deltas, and every time the dtable
+	 * is opened; the merger is not stored with the data. */
+	inline virtual int set_blob_merger(const blob_merger * merger) { return -ENOSYS; }
+	inline const blob_merger * get_blob_merger() const { return blob_mrg; }
+	
 	/* maintenance callback; does nothing by default */
 	inline virtual int maintain(bool force = false) { return 0; }
+	/* Called with true when insert() and remove() may be called from several
+	 * threads at once (e.g. for the shards of a keydiv_dtable): then they must
+	 * leave any maintenance, like digesting, to the next maintain() call. */
+	inline virtual void defer_maintenance(bool defer) {}
 	
 	/* subclasses can specify that they support indexed access */
 	static inline bool static_indexed_access(const params & config) { return false; }
@@ -213,6 +247,9 @@ public:
 	};
 	
 protected:
+	/* the blob merger, if deltas are supported and one has been set */
+	const blob_merger * blob_mrg;
+	
 	/* iterator usage counting */
 	inline void retain() const { usage.inc(); }
 	inline void release() const { if(!usage.dec()) unused_callbacks.invoke(); }
@@ -238,6 +275,7 @@ protected:
 			blob_cmp = NULL;
 		}
 		cmp_name = NULL;
+		blob_mrg = NULL;
 	}
 	
 	/* subclass destructors should [indirectly] call dtable::deinit() to avoid these asserts */
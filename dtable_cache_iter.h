@@ -159,6 +159,11 @@ public:
 		kill_cache();
 		return base->seek_index(index);
 	}
+	virtual bool skip_zones(const zone_test & test)
+	{
+		kill_cache();
+		return base->skip_zones(test);
+	}
 	virtual blob value() const
 	{
 		if(!value_cached)
@@ -62,6 +62,14 @@ public:
 		return false;
 	}
 	
+	/* the skip test only looks at keys and existence, so we can pass this through */
+	inline virtual bool skip_zones(const zone_test & test)
+	{
+		if(!base->skip_zones(test))
+			return false;
+		return advance();
+	}
+	
 	inline dtable_skip_iter_noindex(dtable::iter * base, bool claim_base = false)
 		: dtable_wrap_iter_noindex(base, claim_base)
 	{
@@ -0,0 +1,384 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#define _ATFILE_SOURCE
+
+#include <stdlib.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "openat.h"
+
+#include "util.h"
+#include "rofile.h"
+#include "rwfile.h"
+#include "blob_buffer.h"
+#include "dtable_stats.h"
+
+void dtable_stats::sketch(const dtype & key)
+{
+	uint64_t h = hash(key);
+	size_t index = h >> (64 - DTABLE_STATS_HLL_BITS);
+	uint8_t rho = 1;
+	/* count the leading zeros in the rest of the hash */
+	for(h <<= DTABLE_STATS_HLL_BITS; rho <= 64 - DTABLE_STATS_HLL_BITS && !(h & ((uint64_t) 1 << 63)); h <<= 1)
+		rho++;
+	if(registers[index] < rho)
+		registers[index] = rho;
+}
+
+void dtable_stats::add(const dtype & key, bool exists)
+{
+	sketch(key);
+	if(!count++)
+		min = key;
+	max = key;
+	if(!exists)
+		dne_count++;
+	
+	/* the keys come in order, so every stride-th key gives an equi-depth
+	 * histogram; when we have too many, double the stride */
+	if(count % stride)
+		return;
+	histogram.push_back(bucket(key, count));
+	if(histogram.size() == 2 * DTABLE_STATS_BUCKETS)
+	{
+		for(size_t i = 0; i < DTABLE_STATS_BUCKETS; i++)
+			histogram[i] = histogram[2 * i + 1];
+		histogram.resize(DTABLE_STATS_BUCKETS, bucket(0u, 0));
+		stride *= 2;
+	}
+}
+
+void dtable_stats::add_unordered(const dtype & key, bool exists, const blob_comparator * blob_cmp)
+{
+	sketch(key);
+	if(!count++)
+		min = max = key;
+	else if(key.compare(min, blob_cmp) < 0)
+		min = key;
+	else if(key.compare(max, blob_cmp) > 0)
+		max = key;
+	if(!exists)
+		dne_count++;
+}
+
+void dtable_stats::finish()
+{
+	/* the last bucket always ends with the largest key */
+	if(count && (histogram.empty() || histogram.back().rank != count))
+		histogram.push_back(bucket(max, count));
+	rebucket();
+}
+
+void dtable_stats::add(dtable::iter * source)
+{
+	bool valid = source->valid();
+	while(valid)
+	{
+		add(source->key(), source->meta().exists());
+		valid = source->next();
+	}
+	finish();
+}
+
+void dtable_stats::rebucket()
+{
+	size_t next = 0;
+	std::vector<bucket> buckets;
+	if(histogram.size() <= DTABLE_STATS_BUCKETS)
+		return;
+	/* pick the first bucket boundary past each of the target ranks */
+	for(size_t i = 1; i <= DTABLE_STATS_BUCKETS; i++)
+	{
+		size_t target = (count * i + DTABLE_STATS_BUCKETS - 1) / DTABLE_STATS_BUCKETS;
+		while(next < histogram.size() - 1 && histogram[next].rank < target)
+			next++;
+		if(buckets.empty() || buckets.back().rank != histogram[next].rank)
+			buckets.push_back(histogram[next]);
+	}
+	histogram.swap(buckets);
+}
+
+void dtable_stats::merge(const dtable_stats & x, const blob_comparator * blob_cmp)
+{
+	size_t i = 0, j = 0;
+	size_t rank_a = 0, rank_b = 0;
+	std::vector<bucket> merged;
+	if(x.partial)
+		partial = true;
+	if(!x.count)
+		return;
+	if(!count)
+	{
+		bool was_partial = partial;
+		*this = x;
+		partial = was_partial || x.partial;
+		return;
+	}
+	count += x.count;
+	dne_count += x.dne_count;
+	if(x.min.compare(min, blob_cmp) < 0)
+		min = x.min;
+	if(x.max.compare(max, blob_cmp) > 0)
+		max = x.max;
+	for(size_t k = 0; k < DTABLE_STATS_HLL_SIZE; k++)
+		if(registers[k] < x.registers[k])
+			registers[k] = x.registers[k];
+	
+	/* merge the bucket boundaries, adding up the ranks from each side */
+	merged.reserve(histogram.size() + x.histogram.size());
+	while(i < histogram.size() || j < x.histogram.size())
+	{
+		int c;
+		if(i == histogram.size())
+			c = 1;
+		else if(j == x.histogram.size())
+			c = -1;
+		else
+			c = histogram[i].upper.compare(x.histogram[j].upper, blob_cmp);
+		if(c <= 0)
+			rank_a = histogram[i].rank;
+		if(c >= 0)
+			rank_b = x.histogram[j].rank;
+		merged.push_back(bucket((c <= 0) ? histogram[i].upper : x.histogram[j].upper, rank_a + rank_b));
+		if(c <= 0)
+			i++;
+		if(c >= 0)
+			j++;
+	}
+	histogram.swap(merged);
+	rebucket();
+}
+
+size_t dtable_stats::distinct() const
+{
+	size_t zeros = 0;
+	double sum = 0, estimate;
+	const double m = DTABLE_STATS_HLL_SIZE;
+	for(size_t i = 0; i < DTABLE_STATS_HLL_SIZE; i++)
+	{
+		sum += ldexp(1, -registers[i]);
+		if(!registers[i])
+			zeros++;
+	}
+	estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+	/* use linear counting for small cardinalities */
+	if(estimate <= 2.5 * m && zeros)
+		estimate = m * log(m / zeros);
+	/* we can't have more distinct keys than keys */
+	if(estimate > count)
+		return count;
+	return (size_t) (estimate + 0.5);
+}
+
+/* estimates how far key is between low and high, as a fraction */
+static double interpolate(const dtype & low, const dtype & high, const dtype & key)
+{
+	switch(key.type)
+	{
+		case dtype::UINT32:
+			return (key.u32 - (double) low.u32) / (high.u32 - (double) low.u32);
+		case dtype::UINT64:
+			return (key.u64 - (double) low.u64) / (high.u64 - (double) low.u64);
+		case dtype::DOUBLE:
+			return (key.dbl - low.dbl) / (high.dbl - low.dbl);
+		case dtype::STRING:
+		case dtype::BLOB:
+			/* just guess the middle */
+			return 0.5;
+	}
+	abort();
+}
+
+size_t dtable_stats::rank(const dtype & key, bool inclusive, const blob_comparator * blob_cmp) const
+{
+	size_t lower = 0;
+	const dtype * floor = &min;
+	int c = key.compare(min, blob_cmp);
+	if(c < 0 || (!c && !inclusive))
+		return 0;
+	for(size_t i = 0; i < histogram.size(); i++)
+	{
+		c = histogram[i].upper.compare(key, blob_cmp);
+		if(c < 0)
+		{
+			lower = histogram[i].rank;
+			floor = &histogram[i].upper;
+			continue;
+		}
+		if(!c)
+			return inclusive ? histogram[i].rank : histogram[i].rank - 1;
+		/* it's somewhere in this bucket */
+		return lower + (size_t) ((histogram[i].rank - lower) * interpolate(*floor, histogram[i].upper, key));
+	}
+	return count;
+}
+
+size_t dtable_stats::estimate(const dtype & low, const dtype & high, const blob_comparator * blob_cmp) const
+{
+	size_t below, through;
+	if(!count || high.compare(min, blob_cmp) < 0 || low.compare(max, blob_cmp) > 0)
+		return 0;
+	below = rank(low, false, blob_cmp);
+	through = rank(high, true, blob_cmp);
+	return (through > below) ? through - below : 0;
+}
+
+uint64_t dtable_stats::hash(const dtype & key)
+{
+	/* FNV-1a, followed by the MurmurHash3 finalizer for better mixing */
+	uint64_t h = 14695981039346656037ULL;
+	const uint8_t * data = NULL;
+	size_t size = 0;
+	switch(key.type)
+	{
+		case dtype::UINT32:
+			data = (const uint8_t *) &key.u32;
+			size = sizeof(key.u32);
+			break;
+		case dtype::UINT64:
+			data = (const uint8_t *) &key.u64;
+			size = sizeof(key.u64);
+			break;
+		case dtype::DOUBLE:
+			data = (const uint8_t *) &key.dbl;
+			size = sizeof(key.dbl);
+			break;
+		case dtype::STRING:
+			data = (const uint8_t *) key.str.str();
+			size = key.str.length();
+			break;
+		case dtype::BLOB:
+			if(key.blb.exists() && key.blb.size())
+			{
+				data = &key.blb[0];
+				size = key.blb.size();
+			}
+			break;
+	}
+	for(size_t i = 0; i < size; i++)
+	{
+		h ^= data[i];
+		h *= 1099511628211ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/* keys are stored as a 32-bit length followed by the flattened key */
+static int read_key(const uint8_t * data, size_t size, size_t * offset, dtype::ctype type, dtype * key)
+{
+	uint32_t length;
+	if(*offset + sizeof(length) > size)
+		return -EINVAL;
+	util::memcpy(&length, &data[*offset], sizeof(length));
+	*offset += sizeof(length);
+	if(*offset + length > size)
+		return -EINVAL;
+	*key = dtype(blob(length, &data[*offset]), type);
+	*offset += length;
+	return 0;
+}
+
+static void write_key(blob_buffer * buffer, const dtype & key)
+{
+	blob flat = key.flatten();
+	uint32_t length = flat.size();
+	*buffer << length;
+	buffer->append(flat);
+}
+
+int dtable_stats::read(int dfd, const char * file, dtype::ctype key_type)
+{
+	int r = -EINVAL;
+	size_t offset;
+	uint8_t * data;
+	stats_header header;
+	rofile * stats = rofile::open<4, 2>(dfd, file);
+	if(!stats)
+		return -1;
+	data = new uint8_t[stats->size()];
+	if(stats->read(0, data, stats->size()) != stats->size())
+		goto fail_read;
+	if(stats->size() < (off_t) (sizeof(header) + sizeof(registers)))
+		goto fail_read;
+	util::memcpy(&header, data, sizeof(header));
+	if(header.magic != DTABLE_STATS_MAGIC || header.version != DTABLE_STATS_VERSION)
+		goto fail_read;
+	count = header.count;
+	dne_count = header.dne_count;
+	util::memcpy(registers, &data[sizeof(header)], sizeof(registers));
+	offset = sizeof(header) + sizeof(registers);
+	histogram.clear();
+	if(count)
+	{
+		if(read_key(data, stats->size(), &offset, key_type, &min) < 0)
+			goto fail_read;
+		if(read_key(data, stats->size(), &offset, key_type, &max) < 0)
+			goto fail_read;
+	}
+	for(uint32_t i = 0; i < header.buckets; i++)
+	{
+		dtype upper(0u);
+		uint64_t rank;
+		if(read_key(data, stats->size(), &offset, key_type, &upper) < 0)
+			goto fail_read;
+		if(offset + sizeof(rank) > (size_t) stats->size())
+			goto fail_read;
+		util::memcpy(&rank, &data[offset], sizeof(rank));
+		offset += sizeof(rank);
+		histogram.push_back(bucket(upper, rank));
+	}
+	r = 0;
+fail_read:
+	delete[] data;
+	delete stats;
+	return r;
+}
+
+int dtable_stats::write(int dfd, const char * file_name) const
+{
+	int r;
+	rwfile file;
+	blob_buffer buffer;
+	stats_header header;
+	header.magic = DTABLE_STATS_MAGIC;
+	header.version = DTABLE_STATS_VERSION;
+	header.count = count;
+	header.dne_count = dne_count;
+	header.buckets = histogram.size();
+	buffer << header;
+	buffer.append(registers, sizeof(registers));
+	if(count)
+	{
+		write_key(&buffer, min);
+		write_key(&buffer, max);
+	}
+	for(size_t i = 0; i < histogram.size(); i++)
+	{
+		uint64_t rank = histogram[i].rank;
+		write_key(&buffer, histogram[i].upper);
+		buffer << rank;
+	}
+	
+	/* this is written along with the base dtable's own files, possibly by a
+	 * background digest outside the global transaction, so like them it
+	 * uses rwfile rather than tx_write() */
+	r = file.create(dfd, file_name);
+	if(r < 0)
+		return r;
+	if(file.append(buffer.data(), buffer.size()) != (ssize_t) buffer.size())
+		r = -1;
+	if(file.close() < 0)
+		r = -1;
+	if(r < 0)
+		unlinkat(dfd, file_name, 0);
+	return r;
+}
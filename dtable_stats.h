@@ -0,0 +1,107 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#ifndef __DTABLE_STATS_H
+#define __DTABLE_STATS_H
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef __cplusplus
+#error dtable_stats.h is a C++ header file
+#endif
+
+#include <vector>
+
+#include "dtype.h"
+#include "dtable.h"
+#include "blob_comparator.h"
+
+#define DTABLE_STATS_MAGIC 0x5D7A7C01
+#define DTABLE_STATS_VERSION 0
+
+/* HyperLogLog uses 2^10 one-byte registers, for about 3% error */
+#define DTABLE_STATS_HLL_BITS 10
+#define DTABLE_STATS_HLL_SIZE (1 << DTABLE_STATS_HLL_BITS)
+/* the maximum number of buckets in the equi-depth histogram */
+#define DTABLE_STATS_BUCKETS 32
+
+/* Summary statistics about the keys of a dtable, gathered while it is being
+ * created: the number of keys and how many of them have nonexistent values,
+ * the smallest and largest keys, a HyperLogLog sketch of the keys, and an
+ * equi-depth histogram of them. The statistics of several dtables can be
+ * merged (e.g. for the constituents of an overlay_dtable), in which case
+ * keys in more than one of them are counted more than once, except by the
+ * distinct() estimate. See stats_dtable for a dtable that keeps these. */
+
+class dtable_stats
+{
+public:
+	/* the number of keys, and how many have nonexistent values */
+	size_t count, dne_count;
+	/* the smallest and largest keys; only valid if count is nonzero */
+	dtype min, max;
+	/* set if some of the keys were left out, e.g. by an overlay_dtable with
+	 * layers that don't keep statistics; the counts are then only a bound */
+	bool partial;
+	
+	/* keys must be added in order, then finish() must be called */
+	void add(const dtype & key, bool exists);
+	void finish();
+	/* adds all the keys from an iterator, and calls finish() */
+	void add(dtable::iter * source);
+	/* adds a key which was not already counted, in any order; the
+	 * histogram is not kept, so it will span from min to max evenly */
+	void add_unordered(const dtype & key, bool exists, const blob_comparator * blob_cmp = NULL);
+	
+	void merge(const dtable_stats & x, const blob_comparator * blob_cmp = NULL);
+	
+	/* estimates the number of distinct keys */
+	size_t distinct() const;
+	/* estimates the number of keys in the range [low, high] */
+	size_t estimate(const dtype & low, const dtype & high, const blob_comparator * blob_cmp = NULL) const;
+	
+	int read(int dfd, const char * file, dtype::ctype key_type);
+	int write(int dfd, const char * file) const;
+	
+	inline dtable_stats() : count(0), dne_count(0), min(0u), max(0u), partial(false), stride(1)
+	{
+		memset(registers, 0, sizeof(registers));
+	}
+	
+private:
+	struct bucket
+	{
+		/* the largest key in the bucket, and the number of keys <= it */
+		dtype upper;
+		size_t rank;
+		inline bucket(const dtype & upper, size_t rank) : upper(upper), rank(rank) {}
+	};
+	
+	struct stats_header
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint64_t count;
+		uint64_t dne_count;
+		uint32_t buckets;
+	} __attribute__((packed));
+	
+	/* estimates the number of keys < key (or <= key, if inclusive) */
+	size_t rank(const dtype & key, bool inclusive, const blob_comparator * blob_cmp) const;
+	/* reduces the histogram to at most DTABLE_STATS_BUCKETS equal buckets */
+	void rebucket();
+	
+	/* adds the key to the HyperLogLog sketch */
+	void sketch(const dtype & key);
+	
+	static uint64_t hash(const dtype & key);
+	
+	/* while keys are being added, every stride-th key */
+	std::vector<bucket> histogram;
+	size_t stride;
+	uint8_t registers[DTABLE_STATS_HLL_SIZE];
+};
+
+#endif /* __DTABLE_STATS_H */
@@ -34,6 +34,9 @@ public:
 	inline virtual blob value() const { return base->value(); }
 	inline virtual const dtable * source() const { return base->source(); }
 	inline virtual bool reject(blob * replacement) { return base->reject(replacement); }
+	/* wrappers which change the values must override this, since the base's
+	 * summaries would then describe values they never return */
+	inline virtual bool skip_zones(const zone_test & test) { return base->skip_zones(test); }
 	
 	inline dtable_wrap_iter_noindex(dtable::iter * base, bool claim_base = false) : base(base), claim_base(claim_base) {}
 	inline virtual ~dtable_wrap_iter_noindex() { if(base && claim_base) delete base; }
@@ -20,7 +20,8 @@ enum dtype_ctype
 	DT_UINT32 = 0,
 	DT_DOUBLE,
 	DT_STRING,
-	DT_BLOB
+	DT_BLOB,
+	DT_UINT64
 };
 
 /* abortable transaction handle */
@@ -51,13 +52,15 @@ public:
 		UINT32 = DT_UINT32,
 		DOUBLE = DT_DOUBLE,
 		STRING = DT_STRING,
-		BLOB = DT_BLOB
+		BLOB = DT_BLOB,
+		UINT64 = DT_UINT64
 	};
 	ctype type;
 	
 	union
 	{
 		uint32_t u32;
+		uint64_t u64;
 		double dbl;
 	};
 	/* alas, we can't put these in the union */
@@ -65,6 +68,7 @@ public:
 	blob blb;
 	
 	inline dtype(uint32_t x) : type(UINT32), u32(x) {}
+	inline dtype(uint64_t x) : type(UINT64), u64(x) {}
 	inline dtype(double x) : type(DOUBLE), dbl(x) {}
 	inline dtype(const istr & x) : type(STRING), u32(0), str(x) {}
 	/* have to provide this even though usually istr is transparent */
@@ -81,6 +85,10 @@ public:
 				assert(b.size() == sizeof(uint32_t));
 				u32 = b.index<uint32_t>(0);
 				return;
+			case UINT64:
+				assert(b.size() == sizeof(uint64_t));
+				u64 = b.index<uint64_t>(0);
+				return;
 			case DOUBLE:
 				assert(b.size() == sizeof(double));
 				dbl = b.index<double>(0);
@@ -101,6 +109,8 @@ public:
 		{
 			case UINT32:
 				return blob(sizeof(uint32_t), &u32);
+			case UINT64:
+				return blob(sizeof(uint64_t), &u64);
 			case DOUBLE:
 				return blob(sizeof(double), &dbl);
 			case STRING:
@@ -117,6 +127,8 @@ public:
 		{
 			case UINT32:
 				return "uint32";
+			case UINT64:
+				return "uint64";
 			case DOUBLE:
 				return "double";
 			case STRING:
@@ -134,6 +146,8 @@ public:
 		{
 			case UINT32:
 				return (u32 < x.u32) ? -1 : u32 != x.u32;
+			case UINT64:
+				return (u64 < x.u64) ? -1 : u64 != x.u64;
 			case DOUBLE:
 				return (dbl < x.dbl) ? -1 : dbl != x.dbl;
 			case STRING:
@@ -155,6 +169,12 @@ public:
 		return (u32 < x) ? -1 : u32 != x;
 	}
 	
+	inline int compare(uint64_t x) const
+	{
+		assert(type == UINT64);
+		return (u64 < x) ? -1 : u64 != x;
+	}
+	
 	inline int compare(double x) const
 	{
 		assert(type == DOUBLE);
@@ -243,6 +263,18 @@ struct dtype_hash_helper<unsigned long>
 	}
 };
 
+template<>
+struct dtype_hash_helper<unsigned long long>
+{
+	inline size_t operator()(unsigned long long x) const
+	{
+		/* we count on the compiler to optimize this */
+		if(sizeof(size_t) == sizeof(unsigned long long))
+			return x;
+		return (size_t) ((x >> 32) ^ x);
+	}
+};
+
 template<>
 struct dtype_hash_helper<void *>
 {
@@ -285,6 +317,8 @@ public:
 		{
 			case dtype::UINT32:
 				return dt.u32;
+			case dtype::UINT64:
+				return dtype_hash_helper<uint64_t>()(dt.u64);
 			case dtype::DOUBLE:
 				/* 0 and -0 both hash to zero */
 				if(dt.dbl == 0.0)
@@ -22,6 +22,9 @@ public:
 		virtual bool valid() const = 0;
 		/* see the note about dtable::iter in dtable.h */
 		virtual bool next() = 0;
+		/* Seeks to the first entry for the requested key, or for the next
+		 * key if it is not present, like dtable::iter::seek(). */
+		virtual bool seek(const dtype & key) = 0;
 		virtual dtype key() const = 0;
 		virtual dtype pri() const = 0;
 		virtual ~iter() {}
@@ -24,10 +24,11 @@
  * bytes 4-7: format version
  * bytes 8-11: key count
  * bytes 12-15: value size
- * byte 16: key type (0 -> invalid, 1 -> uint32, 2 -> double, 3 -> string, 4 -> blob)
- * byte 17: key size (for uint32/string/blob; 1-4 bytes)
+ * byte 16: key type (0 -> invalid, 1 -> uint32, 2 -> double, 3 -> string, 4 -> blob, 5 -> uint64)
+ * byte 17: key size (for uint32/string/blob; 1-4 bytes, for uint64; 1-8 bytes)
  * bytes 18-21: if key type is blob, blob comparator name length
  * bytes 22-n: if key type is blob and length > 0, blob comparator name
+ * bytes 18-25: if key type is uint64, the smallest key (others are stored relative to it)
  * bytes 18-m, 22-m, or n+1-m: if key type is string/blob, a string table
  * byte 18 or m+1: main data tables
  * 
@@ -160,6 +161,8 @@ dtype fixed_dtable::get_key(size_t index, bool * data_exists, off_t * data_offse
 	{
 		case dtype::UINT32:
 			return dtype(util::read_bytes(bytes, 0, key_size));
+		case dtype::UINT64:
+			return dtype(key_base + util::read_bytes64(bytes, 0, key_size));
 		case dtype::DOUBLE:
 		{
 			double value;
@@ -287,6 +290,14 @@ int fixed_dtable::init(int dfd, const char * file, const params & config, sys_jo
 			if(key_size != sizeof(double))
 				goto fail;
 			break;
+		case 5:
+			ktype = dtype::UINT64;
+			if(key_size > 8)
+				goto fail;
+			if(fp->read_type(key_start_off, &key_base) < 0)
+				goto fail;
+			key_start_off += sizeof(key_base);
+			break;
 		case 4:
 			uint32_t length;
 			if(fp->read_type(key_start_off, &length) < 0)
@@ -343,6 +354,7 @@ int fixed_dtable::create(int dfd, const char * file, const params & config, dtab
 	bool value_size_known = false;
 	size_t key_count = 0;
 	uint32_t max_key = 0;
+	uint64_t min_key64 = (uint64_t) -1, max_key64 = 0;
 	dtable_header header;
 	rwfile out;
 	int r;
@@ -377,6 +389,12 @@ int fixed_dtable::create(int dfd, const char * file, const params & config, dtab
 				if(key.u32 > max_key)
 					max_key = key.u32;
 				break;
+			case dtype::UINT64:
+				if(key.u64 < min_key64)
+					min_key64 = key.u64;
+				if(key.u64 > max_key64)
+					max_key64 = key.u64;
+				break;
 			case dtype::DOUBLE:
 				/* nothing to do */
 				break;
@@ -406,6 +424,12 @@ int fixed_dtable::create(int dfd, const char * file, const params & config, dtab
 			header.key_type = 1;
 			header.key_size = util::byte_size(max_key);
 			break;
+		case dtype::UINT64:
+			if(!key_count)
+				min_key64 = 0;
+			header.key_type = 5;
+			header.key_size = util::byte_size64(max_key64 - min_key64);
+			break;
 		case dtype::DOUBLE:
 			header.key_type = 2;
 			header.key_size = sizeof(double);
@@ -426,7 +450,13 @@ int fixed_dtable::create(int dfd, const char * file, const params & config, dtab
 	r = out.append(&header);
 	if(r < 0)
 		goto fail_unlink;
-	if(key_type == dtype::BLOB)
+	if(key_type == dtype::UINT64)
+	{
+		r = out.append(&min_key64);
+		if(r < 0)
+			goto fail_unlink;
+	}
+	else if(key_type == dtype::BLOB)
 	{
 		uint32_t length = blob_cmp ? strlen(blob_cmp->name) : 0;
 		out.append(&length);
@@ -467,6 +497,9 @@ int fixed_dtable::create(int dfd, const char * file, const params & config, dtab
 			case dtype::UINT32:
 				util::layout_bytes(bytes, &i, key.u32, header.key_size);
 				break;
+			case dtype::UINT64:
+				util::layout_bytes64(bytes, &i, key.u64 - min_key64, header.key_size);
+				break;
 			case dtype::DOUBLE:
 				util::memcpy(bytes, &key.dbl, sizeof(double));
 				i += sizeof(double);
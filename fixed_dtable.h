@@ -100,6 +100,8 @@ private:
 	size_t value_size, record_size;
 	stringtbl st;
 	uint8_t key_size;
+	/* uint64 keys are stored as offsets from the smallest one */
+	uint64_t key_base;
 	off_t key_start_off;
 };
 
@@ -0,0 +1,795 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#define _ATFILE_SOURCE
+
+#include <set>
+#include <vector>
+
+#include "openat.h"
+
+#include "util.h"
+#include "rwfile.h"
+#include "rofile.h"
+#include "transaction.h"
+#include "group_ctable.h"
+
+group_ctable::p_iter::p_iter(const group_ctable * base, const size_t * columns, size_t count)
+	: base(base), current(0u), is_valid(false)
+{
+	std::vector<size_t> local[base->group_count];
+	assert(count);
+	for(size_t i = 0; i < count; i++)
+	{
+		assert(columns[i] < base->column_count);
+		local[base->column_group[columns[i]]].push_back(base->column_index[columns[i]]);
+	}
+	source = new ctable::p_iter *[base->group_count];
+	current_group = new bool[base->group_count];
+	for(size_t i = 0; i < base->group_count; i++)
+	{
+		current_group[i] = false;
+		if(local[i].empty())
+		{
+			/* don't even open groups we don't need */
+			source[i] = NULL;
+			continue;
+		}
+		source[i] = base->group_table[i]->iterator(&local[i][0], local[i].size());
+		assert(source[i]);
+	}
+	update();
+}
+
+bool group_ctable::p_iter::update()
+{
+	is_valid = false;
+	for(size_t i = 0; i < base->group_count; i++)
+	{
+		int c;
+		current_group[i] = false;
+		if(!source[i] || !source[i]->valid())
+			continue;
+		if(!is_valid)
+		{
+			current = source[i]->key();
+			is_valid = true;
+			current_group[i] = true;
+			continue;
+		}
+		c = source[i]->key().compare(current, base->blob_cmp);
+		if(c > 0)
+			continue;
+		if(c < 0)
+		{
+			/* a new smallest key; forget the groups we had */
+			current = source[i]->key();
+			for(size_t j = 0; j < i; j++)
+				current_group[j] = false;
+		}
+		current_group[i] = true;
+	}
+	return is_valid;
+}
+
+bool group_ctable::p_iter::valid() const
+{
+	return is_valid;
+}
+
+bool group_ctable::p_iter::next()
+{
+	if(!is_valid)
+		return false;
+	for(size_t i = 0; i < base->group_count; i++)
+		if(current_group[i])
+			source[i]->next();
+	return update();
+}
+
+bool group_ctable::p_iter::prev()
+{
+	bool found = false;
+	bool moved[base->group_count];
+	dtype previous(0u);
+	/* each sub iterator is at the first key >= the current one, so
+	 * moving it back once gets to its last key < the current one */
+	for(size_t i = 0; i < base->group_count; i++)
+	{
+		moved[i] = source[i] && source[i]->prev();
+		if(!moved[i])
+			continue;
+		if(!found || source[i]->key().compare(previous, base->blob_cmp) > 0)
+		{
+			previous = source[i]->key();
+			found = true;
+		}
+	}
+	if(!found)
+		return false;
+	/* put back any that are now before the new current key */
+	for(size_t i = 0; i < base->group_count; i++)
+		if(moved[i] && source[i]->key().compare(previous, base->blob_cmp) < 0)
+			source[i]->next();
+	return update();
+}
+
+bool group_ctable::p_iter::first()
+{
+	for(size_t i = 0; i < base->group_count; i++)
+		if(source[i])
+			source[i]->first();
+	return update();
+}
+
+bool group_ctable::p_iter::last()
+{
+	bool found = false;
+	dtype largest(0u);
+	for(size_t i = 0; i < base->group_count; i++)
+	{
+		if(!source[i] || !source[i]->last())
+			continue;
+		if(!found || source[i]->key().compare(largest, base->blob_cmp) > 0)
+		{
+			largest = source[i]->key();
+			found = true;
+		}
+	}
+	if(!found)
+		return update();
+	/* groups without the largest key belong past the end */
+	for(size_t i = 0; i < base->group_count; i++)
+		if(source[i] && source[i]->valid() && source[i]->key().compare(largest, base->blob_cmp) < 0)
+			source[i]->next();
+	return update();
+}
+
+dtype group_ctable::p_iter::key() const
+{
+	assert(is_valid);
+	return current;
+}
+
+bool group_ctable::p_iter::seek(const dtype & key)
+{
+	for(size_t i = 0; i < base->group_count; i++)
+		if(source[i])
+			source[i]->seek(key);
+	return update() && !current.compare(key, base->blob_cmp);
+}
+
+bool group_ctable::p_iter::seek(const dtype_test & test)
+{
+	for(size_t i = 0; i < base->group_count; i++)
+		if(source[i])
+			source[i]->seek(test);
+	return update() && !test(current);
+}
+
+dtype::ctype group_ctable::p_iter::key_type() const
+{
+	return base->key_type();
+}
+
+blob group_ctable::p_iter::value(size_t column) const
+{
+	size_t group;
+	assert(column < base->column_count);
+	group = base->column_group[column];
+	assert(source[group]);
+	/* this group may not have the current row at all */
+	if(!current_group[group])
+		return blob();
+	return source[group]->value(base->column_index[column]);
+}
+
+group_ctable::iter::iter(const group_ctable * base)
+	: base(base), number(0)
+{
+	size_t columns[base->column_count];
+	for(size_t i = 0; i < base->column_count; i++)
+		columns[i] = i;
+	source = new p_iter(base, columns, base->column_count);
+	advance();
+}
+
+bool group_ctable::iter::valid() const
+{
+	return number < base->column_count;
+}
+
+bool group_ctable::iter::next_column(bool reset)
+{
+	if(reset)
+		number = (size_t) -1;
+	else if(number >= base->column_count)
+		return false;
+	while(++number < base->column_count)
+		if(source->value(number).exists())
+			return true;
+	return false;
+}
+
+bool group_ctable::iter::prev_column(bool reset)
+{
+	if(reset)
+		number = base->column_count;
+	else if(number >= base->column_count)
+		return false;
+	while(number)
+		if(source->value(--number).exists())
+			return true;
+	return false;
+}
+
+bool group_ctable::iter::advance()
+{
+	while(source->valid())
+	{
+		if(next_column(true))
+			return true;
+		source->next();
+	}
+	number = base->column_count;
+	return false;
+}
+
+bool group_ctable::iter::retreat()
+{
+	while(source->prev())
+		if(prev_column(true))
+			return true;
+	/* need to go back forward to where we were */
+	advance();
+	return false;
+}
+
+bool group_ctable::iter::next(bool row)
+{
+	if(number >= base->column_count)
+		return false;
+	if(!row && next_column())
+		return true;
+	source->next();
+	return advance();
+}
+
+bool group_ctable::iter::prev(bool row)
+{
+	if(!row && number < base->column_count && prev_column())
+		return true;
+	return retreat();
+}
+
+bool group_ctable::iter::first()
+{
+	source->first();
+	return advance();
+}
+
+bool group_ctable::iter::last()
+{
+	if(source->last() && prev_column(true))
+		return true;
+	return retreat();
+}
+
+dtype group_ctable::iter::key() const
+{
+	return source->key();
+}
+
+bool group_ctable::iter::seek(const dtype & key)
+{
+	bool found = source->seek(key);
+	if(!advance())
+		return false;
+	return found && !source->key().compare(key, base->blob_cmp);
+}
+
+bool group_ctable::iter::seek(const dtype_test & test)
+{
+	bool found = source->seek(test);
+	if(!advance())
+		return false;
+	return found && !test(source->key());
+}
+
+dtype::ctype group_ctable::iter::key_type() const
+{
+	return base->key_type();
+}
+
+size_t group_ctable::iter::column() const
+{
+	assert(number < base->column_count);
+	return number;
+}
+
+const istr & group_ctable::iter::name() const
+{
+	assert(number < base->column_count);
+	return base->column_name[number];
+}
+
+blob group_ctable::iter::value() const
+{
+	assert(number < base->column_count);
+	return source->value(number);
+}
+
+blob group_ctable::iter::index(size_t column) const
+{
+	assert(column < base->column_count);
+	return source->value(column);
+}
+
+bool group_ctable::key_iter::valid() const
+{
+	return source->valid();
+}
+
+bool group_ctable::key_iter::next()
+{
+	return source->next();
+}
+
+bool group_ctable::key_iter::prev()
+{
+	return source->prev();
+}
+
+bool group_ctable::key_iter::first()
+{
+	return source->first();
+}
+
+bool group_ctable::key_iter::last()
+{
+	return source->last();
+}
+
+dtype group_ctable::key_iter::key() const
+{
+	return source->key();
+}
+
+bool group_ctable::key_iter::seek(const dtype & key)
+{
+	return source->seek(key);
+}
+
+bool group_ctable::key_iter::seek(const dtype_test & test)
+{
+	return source->seek(test);
+}
+
+dtype::ctype group_ctable::key_iter::key_type() const
+{
+	return base->key_type();
+}
+
+const blob_comparator * group_ctable::key_iter::get_blob_cmp() const
+{
+	return base->get_blob_cmp();
+}
+
+const istr & group_ctable::key_iter::get_cmp_name() const
+{
+	return base->get_cmp_name();
+}
+
+dtable::key_iter * group_ctable::keys() const
+{
+	/* any column from each group will do */
+	size_t columns[group_count];
+	for(size_t i = 0; i < column_count; i++)
+		columns[column_group[i]] = i;
+	return new key_iter(this, new p_iter(this, columns, group_count));
+}
+
+ctable::iter * group_ctable::iterator() const
+{
+	return new iter(this);
+}
+
+ctable::p_iter * group_ctable::iterator(const size_t * columns, size_t count) const
+{
+	return new p_iter(this, columns, count);
+}
+
+blob group_ctable::find(const dtype & key, size_t column) const
+{
+	assert(column < column_count);
+	return group_table[column_group[column]]->find(key, column_index[column]);
+}
+
+int group_ctable::group_colvals(const dtype & key, colval * values, size_t count, bool insert, bool append) const
+{
+	int r = 0;
+	colval local[count];
+	for(size_t group = 0; group < group_count; group++)
+	{
+		size_t local_count = 0;
+		for(size_t i = 0; i < count; i++)
+		{
+			assert(values[i].index < column_count);
+			if(column_group[values[i].index] != group)
+				continue;
+			local[local_count].index = column_index[values[i].index];
+			local[local_count++].value = values[i].value;
+		}
+		if(!local_count)
+			continue;
+		if(insert)
+			r = group_table[group]->insert(key, local, local_count, append);
+		else
+		{
+			r = group_table[group]->find(key, local, local_count);
+			/* copy the results back */
+			local_count = 0;
+			for(size_t i = 0; i < count; i++)
+				if(column_group[values[i].index] == group)
+					values[i].value = local[local_count++].value;
+		}
+		if(r < 0)
+			break;
+	}
+	return r;
+}
+
+int group_ctable::find(const dtype & key, colval * values, size_t count) const
+{
+	return group_colvals(key, values, count, false, false);
+}
+
+bool group_ctable::contains(const dtype & key) const
+{
+	for(size_t i = 0; i < group_count; i++)
+		if(group_table[i]->contains(key))
+			return true;
+	return false;
+}
+
+int group_ctable::insert(const dtype & key, size_t column, const blob & value, bool append)
+{
+	assert(column < column_count);
+	return group_table[column_group[column]]->insert(key, column_index[column], value, append);
+}
+
+int group_ctable::insert(const dtype & key, const colval * values, size_t count, bool append)
+{
+	int r = tx_start_r();
+	if(r < 0)
+		return r;
+	r = group_colvals(key, (colval *) values, count, true, append);
+	tx_end_r();
+	return r;
+}
+
+int group_ctable::remove(const dtype & key, size_t column)
+{
+	assert(column < column_count);
+	return group_table[column_group[column]]->remove(key, column_index[column]);
+}
+
+int group_ctable::remove(const dtype & key, size_t * columns, size_t count)
+{
+	colval erase[count];
+	for(size_t i = 0; i < count; i++)
+	{
+		erase[i].index = columns[i];
+		erase[i].value = blob();
+	}
+	return insert(key, erase, count);
+}
+
+int group_ctable::remove(const dtype & key)
+{
+	int r = tx_start_r();
+	if(r < 0)
+		return r;
+	for(size_t i = 0; i < group_count; i++)
+	{
+		r = group_table[i]->remove(key);
+		if(r < 0)
+			break;
+	}
+	tx_end_r();
+	return r;
+}
+
+int group_ctable::set_blob_cmp(const blob_comparator * cmp)
+{
+	int r;
+	for(size_t i = 0; i < group_count; i++)
+	{
+		r = group_table[i]->set_blob_cmp(cmp);
+		if(r < 0)
+			return r;
+	}
+	r = ctable::set_blob_cmp(cmp);
+	assert(r >= 0);
+	return r;
+}
+
+int group_ctable::maintain(bool force)
+{
+	int r = 0;
+	for(size_t i = 0; i < group_count; i++)
+	{
+		int r2 = group_table[i]->maintain(force);
+		if(r2 < 0)
+			r = r2;
+	}
+	return r;
+}
+
+void group_ctable::deinit()
+{
+	if(group_count)
+	{
+		for(size_t i = 0; i < group_count; i++)
+			delete group_table[i];
+		delete[] group_table;
+		delete[] column_group;
+		delete[] column_index;
+		delete[] column_name;
+		column_map.clear();
+		column_count = 0;
+		group_count = 0;
+		ctable::deinit();
+	}
+}
+
+int group_ctable::init(int dfd, const char * file, const params & config, sys_journal * sysj)
+{
+	int gct_dfd, r;
+	const ctable_factory * base;
+	params base_config;
+	
+	off_t offset;
+	ctable_header meta;
+	rofile * meta_file;
+	
+	if(group_count)
+		deinit();
+	base = ctable_factory::lookup(config, "base");
+	if(!base)
+		return -ENOENT;
+	if(!config.get("base_config", &base_config, params()))
+		return -EINVAL;
+	gct_dfd = openat(dfd, file, O_RDONLY);
+	if(gct_dfd < 0)
+		return gct_dfd;
+	meta_file = rofile::open<4, 2>(gct_dfd, "gct_meta");
+	if(!meta_file)
+		goto fail_open;
+	r = meta_file->read_type(0, &meta);
+	if(r < 0)
+		goto fail_header;
+	if(meta.magic != GROUP_CTABLE_MAGIC || meta.version != GROUP_CTABLE_VERSION)
+		goto fail_header;
+	if(!meta.columns || !meta.groups)
+		goto fail_header;
+	column_count = meta.columns;
+	
+	column_name = new istr[column_count];
+	column_group = new size_t[column_count];
+	column_index = new size_t[column_count];
+	group_table = new ctable *[meta.groups];
+	for(size_t i = 0; i < meta.groups; i++)
+		group_table[i] = NULL;
+	
+	offset = sizeof(meta);
+	for(size_t i = 0; i < column_count; i++)
+	{
+		uint32_t group, length;
+		r = meta_file->read_type(offset, &group);
+		if(r < 0 || group >= meta.groups)
+			goto fail_names;
+		offset += sizeof(group);
+		column_group[i] = group;
+		r = meta_file->read_type(offset, &length);
+		if(r < 0)
+			goto fail_names;
+		offset += sizeof(length);
+		column_name[i] = meta_file->read_string(offset, length);
+		if(!column_name[i])
+			goto fail_names;
+		offset += length;
+		column_map[column_name[i]] = i;
+	}
+	
+	for(size_t i = 0; i < meta.groups; i++)
+	{
+		char string[32];
+		params group_config;
+		const ctable_factory * group = base;
+		sprintf(string, "group%d_base", (int) i);
+		if(config.has(string) && !(group = ctable_factory::lookup(config, string)))
+			goto fail_groups;
+		sprintf(string, "group%d_config", (int) i);
+		if(!config.get(string, &group_config, base_config))
+			goto fail_groups;
+		sprintf(string, "group%d", (int) i);
+		group_table[i] = group->open(gct_dfd, string, group_config, sysj);
+		if(!group_table[i])
+			goto fail_groups;
+	}
+	group_count = meta.groups;
+	
+	/* find where each column ended up in its group */
+	for(size_t i = 0; i < column_count; i++)
+	{
+		column_index[i] = group_table[column_group[i]]->index(column_name[i]);
+		if(column_index[i] == (size_t) -1)
+			goto fail_index;
+	}
+	
+	ktype = group_table[0]->key_type();
+	cmp_name = group_table[0]->get_cmp_name();
+	
+	delete meta_file;
+	close(gct_dfd);
+	return 0;
+	
+fail_index:
+	group_count = 0;
+fail_groups:
+	for(size_t i = 0; i < meta.groups; i++)
+		if(group_table[i])
+			delete group_table[i];
+fail_names:
+	column_map.clear();
+	delete[] group_table;
+	delete[] column_index;
+	delete[] column_group;
+	delete[] column_name;
+	column_count = 0;
+fail_header:
+	delete meta_file;
+fail_open:
+	close(gct_dfd);
+	return -1;
+}
+
+int group_ctable::create(int dfd, const char * file, const params & config, dtype::ctype key_type)
+{
+	int gct_dfd, columns, groups, r;
+	const ctable_factory * base;
+	params base_config;
+	std::set<istr, strcmp_less> names;
+	
+	ctable_header meta;
+	rwfile meta_file;
+	
+	base = ctable_factory::lookup(config, "base");
+	if(!base)
+		return -ENOENT;
+	if(!config.get("base_config", &base_config, params()))
+		return -EINVAL;
+	if(!config.get("columns", &columns, 0) || columns < 1)
+		return -EINVAL;
+	if(!config.get("groups", &groups, 1) || groups < 1)
+		return -EINVAL;
+	
+	std::vector<istr> group_names[groups];
+	int column_group[columns];
+	
+	/* check that we have all the names, and which groups they are in */
+	for(int i = 0; i < columns; i++)
+	{
+		char string[32];
+		istr column_name;
+		sprintf(string, "column%d_name", i);
+		if(!config.get(string, &column_name) || !column_name)
+			return -EINVAL;
+		if(names.count(column_name))
+			return -EEXIST;
+		names.insert(column_name);
+		sprintf(string, "column%d_group", i);
+		if(!config.get(string, &column_group[i], 0))
+			return -EINVAL;
+		if(column_group[i] < 0 || column_group[i] >= groups)
+			return -EINVAL;
+		group_names[column_group[i]].push_back(column_name);
+	}
+	names.clear();
+	for(int i = 0; i < groups; i++)
+	{
+		char string[32];
+		params group_config;
+		/* empty groups are not allowed */
+		if(group_names[i].empty())
+			return -EINVAL;
+		sprintf(string, "group%d_base", i);
+		if(config.has(string) && !ctable_factory::lookup(config, string))
+			return -EINVAL;
+		sprintf(string, "group%d_config", i);
+		if(!config.get(string, &group_config, params()))
+			return -EINVAL;
+	}
+	
+	r = mkdirat(dfd, file, 0755);
+	if(r < 0)
+		return r;
+	gct_dfd = openat(dfd, file, O_RDONLY);
+	if(gct_dfd < 0)
+		goto fail_open;
+	
+	meta.magic = GROUP_CTABLE_MAGIC;
+	meta.version = GROUP_CTABLE_VERSION;
+	meta.columns = columns;
+	meta.groups = groups;
+	r = meta_file.create(gct_dfd, "gct_meta");
+	if(r < 0)
+		goto fail_meta;
+	r = meta_file.append(&meta);
+	if(r < 0)
+		goto fail_create;
+	
+	/* record column groups and names */
+	for(int i = 0; i < columns; i++)
+	{
+		uint32_t group = column_group[i], length;
+		char string[32];
+		istr column_name;
+		sprintf(string, "column%d_name", i);
+		r = config.get(string, &column_name);
+		assert(r && column_name);
+		r = meta_file.append(&group);
+		if(r < 0)
+			goto fail_create;
+		length = column_name.length();
+		r = meta_file.append(&length);
+		if(r < 0)
+			goto fail_create;
+		r = meta_file.append(column_name);
+		if(r < 0)
+			goto fail_create;
+	}
+	r = meta_file.flush();
+	if(r < 0)
+		goto fail_create;
+	
+	/* create the groups, each with just its own columns */
+	for(int i = 0; i < groups; i++)
+	{
+		char string[32];
+		params group_config;
+		const ctable_factory * group = base;
+		sprintf(string, "group%d_base", i);
+		if(config.has(string))
+			group = ctable_factory::lookup(config, string);
+		sprintf(string, "group%d_config", i);
+		r = config.get(string, &group_config, base_config);
+		assert(r);
+		group_config.set("columns", (int) group_names[i].size());
+		for(size_t j = 0; j < group_names[i].size(); j++)
+		{
+			sprintf(string, "column%d_name", (int) j);
+			group_config.set(string, group_names[i][j]);
+		}
+		sprintf(string, "group%d", i);
+		r = group->create(gct_dfd, string, group_config, key_type);
+		if(r < 0)
+			goto fail_create;
+	}
+	
+	meta_file.close();
+	close(gct_dfd);
+	return 0;
+	
+fail_create:
+	meta_file.close();
+fail_meta:
+	close(gct_dfd);
+fail_open:
+	util::rm_r(dfd, file);
+	return (r < 0) ? r : -1;
+}
+
+DEFINE_CT_FACTORY(group_ctable);
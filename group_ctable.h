@@ -0,0 +1,187 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#ifndef __GROUP_CTABLE_H
+#define __GROUP_CTABLE_H
+
+#ifndef __cplusplus
+#error group_ctable.h is a C++ header file
+#endif
+
+#include <map>
+
+#include "ctable.h"
+#include "ctable_factory.h"
+
+#define GROUP_CTABLE_MAGIC 0x6C1F0A52
+#define GROUP_CTABLE_VERSION 0
+
+/* A group ctable is in between simple_ctable, which keeps whole rows together,
+ * and column_ctable, which keeps each column separately. Its columns are split
+ * into groups, and each group is stored as a separate ctable (usually a
+ * simple_ctable). Columns which are usually read together, like small and
+ * frequently used ones, can share a group so that reading a row needs only a
+ * single lookup, while wide or rarely used columns can be put in groups of
+ * their own so that scans which do not need them never read them at all.
+ * Projection iterators only open the groups containing the requested columns.
+ *
+ * Configuration: "columns", "column<n>_name", and "column<n>_group" (which
+ * defaults to 0) describe the columns; "groups" is the number of groups, and
+ * "base" and "base_config" (or "group<n>_base" and "group<n>_config") say how
+ * to store each group. Every group must contain at least one column. */
+
+class group_ctable : public ctable
+{
+public:
+	virtual dtable::key_iter * keys() const;
+	virtual iter * iterator() const;
+	virtual p_iter * iterator(const size_t * columns, size_t count) const;
+	virtual blob find(const dtype & key, size_t column) const;
+	virtual int find(const dtype & key, colval * values, size_t count) const;
+	virtual bool contains(const dtype & key) const;
+	
+	inline virtual bool writable() const
+	{
+		return group_table[0]->writable();
+	}
+	
+	virtual int insert(const dtype & key, size_t column, const blob & value, bool append = false);
+	virtual int insert(const dtype & key, const colval * values, size_t count, bool append = false);
+	virtual int remove(const dtype & key, size_t column);
+	virtual int remove(const dtype & key, size_t * columns, size_t count);
+	virtual int remove(const dtype & key);
+	
+	virtual int set_blob_cmp(const blob_comparator * cmp);
+	
+	virtual int maintain(bool force = false);
+	
+	inline group_ctable() : group_count(0), group_table(NULL), column_group(NULL), column_index(NULL) {}
+	int init(int dfd, const char * file, const params & config, sys_journal * sysj);
+	void deinit();
+	inline virtual ~group_ctable()
+	{
+		if(group_count)
+			deinit();
+	}
+	
+	static int create(int dfd, const char * file, const params & config, dtype::ctype key_type);
+	DECLARE_CT_FACTORY(group_ctable);
+	
+private:
+	struct ctable_header
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t columns;
+		uint32_t groups;
+	} __attribute__((packed));
+	
+	/* merges projection iterators from the groups, which may not all have the
+	 * same keys; each sub iterator is kept at the first key >= the current key */
+	class p_iter : public ctable::p_iter
+	{
+	public:
+		virtual bool valid() const;
+		virtual bool next();
+		virtual bool prev();
+		virtual bool first();
+		virtual bool last();
+		virtual dtype key() const;
+		virtual bool seek(const dtype & key);
+		virtual bool seek(const dtype_test & test);
+		virtual dtype::ctype key_type() const;
+		virtual blob value(size_t column) const;
+		p_iter(const group_ctable * base, const size_t * columns, size_t count);
+		virtual ~p_iter()
+		{
+			for(size_t i = 0; i < base->group_count; i++)
+				if(source[i])
+					delete source[i];
+			delete[] source;
+			delete[] current_group;
+		}
+	
+	private:
+		/* finds the smallest key and which groups have it */
+		bool update();
+		
+		const group_ctable * base;
+		ctable::p_iter ** source;
+		/* whether each sub iterator points at the current key */
+		bool * current_group;
+		dtype current;
+		bool is_valid;
+	};
+	
+	class iter : public ctable::iter
+	{
+	public:
+		virtual bool valid() const;
+		virtual bool next(bool row = false);
+		virtual bool prev(bool row = false);
+		virtual bool first();
+		virtual bool last();
+		virtual dtype key() const;
+		virtual bool seek(const dtype & key);
+		virtual bool seek(const dtype_test & test);
+		virtual dtype::ctype key_type() const;
+		virtual size_t column() const;
+		virtual const istr & name() const;
+		virtual blob value() const;
+		virtual blob index(size_t column) const;
+		iter(const group_ctable * base);
+		virtual ~iter()
+		{
+			delete source;
+		}
+	
+	private:
+		/* skip forward/backward past any nonexistent columns */
+		bool next_column(bool reset = false);
+		bool prev_column(bool reset = false);
+		bool advance();
+		bool retreat();
+		
+		const group_ctable * base;
+		p_iter * source;
+		size_t number;
+	};
+	
+	/* adapts a p_iter with a column from each group into a key iterator */
+	class key_iter : public dtable::key_iter
+	{
+	public:
+		virtual bool valid() const;
+		virtual bool next();
+		virtual bool prev();
+		virtual bool first();
+		virtual bool last();
+		virtual dtype key() const;
+		virtual bool seek(const dtype & key);
+		virtual bool seek(const dtype_test & test);
+		virtual dtype::ctype key_type() const;
+		virtual const blob_comparator * get_blob_cmp() const;
+		virtual const istr & get_cmp_name() const;
+		inline key_iter(const group_ctable * base, p_iter * source) : base(base), source(source) {}
+		virtual ~key_iter()
+		{
+			delete source;
+		}
+	
+	private:
+		const group_ctable * base;
+		p_iter * source;
+	};
+	
+	/* splits the values by group, and calls find() or insert() on each */
+	int group_colvals(const dtype & key, colval * values, size_t count, bool insert, bool append) const;
+	
+	size_t group_count;
+	ctable ** group_table;
+	/* the group of each column, and its index within that group */
+	size_t * column_group;
+	size_t * column_index;
+};
+
+#endif /* __GROUP_CTABLE_H */
@@ -91,7 +91,8 @@ blob index_blob::flatten() const
 				buffer.overwrite(offset, indices[i].value);
 				indices[i].modified = false;
 			}
-			offset += indices[i].value.size();
+			/* unmodified columns may still be delayed */
+			offset += indices[i].size();
 		}
 		modified = false;
 		base = buffer;
@@ -119,3 +120,90 @@ blob index_blob::flatten() const
 	}
 	return base;
 }
+
+/* Deltas have the INDEX_BLOB_DELTA marker, the column count, and then a code
+ * for each column: 0 if it is unchanged, 1 if it is removed, and otherwise 2
+ * more than the size of its new value. The new values follow, in order. */
+blob index_blob::flatten_delta() const
+{
+	size_t offset = (count + 2) * sizeof(uint32_t);
+	for(size_t i = 0; i < count; i++)
+		if(indices[i].modified)
+			offset += indices[i].value.size();
+	blob_buffer buffer(offset);
+	buffer << (uint32_t) INDEX_BLOB_DELTA;
+	buffer << (uint32_t) count;
+	for(size_t i = 0; i < count; i++)
+	{
+		uint32_t code = 0;
+		if(indices[i].modified)
+			code = indices[i].exists() ? indices[i].size() + 2 : 1;
+		buffer << code;
+	}
+	for(size_t i = 0; i < count; i++)
+		if(indices[i].modified)
+			buffer.append(indices[i].value);
+	return buffer;
+}
+
+class index_blob_merger : public blob_merger
+{
+public:
+	virtual bool partial(const blob & value) const
+	{
+		return index_blob::is_delta(value);
+	}
+	
+	virtual blob merge(const blob & delta, const blob & older) const
+	{
+		size_t count = delta.index<uint32_t>(1);
+		bool changed[count];
+		blob values[count];
+		read(delta, count, changed, values);
+		if(partial(older))
+		{
+			bool older_changed[count];
+			blob older_values[count];
+			index_blob merged(count);
+			read(older, count, older_changed, older_values);
+			for(size_t i = 0; i < count; i++)
+				if(changed[i])
+					merged.set(i, values[i]);
+				else if(older_changed[i])
+					merged.set(i, older_values[i]);
+			return merged.flatten_delta();
+		}
+		index_blob row(count, older);
+		for(size_t i = 0; i < count; i++)
+			if(changed[i])
+				row.set(i, values[i]);
+		return row.flatten();
+	}
+	
+	inline index_blob_merger() : blob_merger("index_blob") {}
+	
+private:
+	static void read(const blob & delta, size_t count, bool * changed, blob * values)
+	{
+		size_t offset = (count + 2) * sizeof(uint32_t);
+		assert(delta.index<uint32_t>(1) == count);
+		for(size_t i = 0; i < count; i++)
+		{
+			uint32_t code = delta.index<uint32_t>(i + 2);
+			changed[i] = code != 0;
+			if(code < 2)
+				continue;
+			code -= 2;
+			assert(offset + code <= delta.size());
+			values[i] = code ? blob(code, &delta[offset]) : blob::empty;
+			offset += code;
+		}
+	}
+};
+
+static const index_blob_merger merger_instance;
+
+const blob_merger * index_blob::merger()
+{
+	return &merger_instance;
+}
@@ -12,6 +12,11 @@
 #endif
 
 #include "blob.h"
+#include "blob_merger.h"
+
+/* Deltas start with this value where a row would have its first size, which
+ * would otherwise mean that the first column is 4GiB long. */
+#define INDEX_BLOB_DELTA 0xFFFFFFFF
 
 class index_blob
 {
@@ -51,6 +56,20 @@ public:
 	
 	blob flatten() const;
 	
+	/* Deltas record changes to only some of the columns, and can be stored in
+	 * dtables using merger() as their blob merger (see blob_merger.h). To make
+	 * one, call set() on an index_blob constructed with just a count, then use
+	 * this instead of flatten(). */
+	blob flatten_delta() const;
+	
+	static inline bool is_delta(const blob & x)
+	{
+		return x.exists() && x.size() >= 2 * sizeof(uint32_t) && x.index<uint32_t>(0) == INDEX_BLOB_DELTA;
+	}
+	
+	/* the blob merger for rows made by index_blob, named "index_blob" */
+	static const blob_merger * merger();
+	
 	inline ~index_blob()
 	{
 		if(indices)
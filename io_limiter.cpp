@@ -0,0 +1,122 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#include <time.h>
+#include <errno.h>
+
+#include "params.h"
+#include "io_limiter.h"
+
+__thread bool io_limiter::limited = false;
+atomic<uint32_t> io_limiter::enabled;
+atomic<uint32_t> io_limiter::adapting;
+init_mutex io_limiter::lock;
+size_t io_limiter::max_rate = 0;
+size_t io_limiter::min_rate = 0;
+size_t io_limiter::rate = 0;
+uint32_t io_limiter::target = 0;
+double io_limiter::tokens = 0;
+uint64_t io_limiter::last_refill = 0;
+atomic<uint64_t> io_limiter::period_start;
+atomic<uint64_t> io_limiter::latency_sum;
+atomic<uint32_t> io_limiter::latency_count;
+
+int io_limiter::configure(const params & config)
+{
+	int value, minimum, latency;
+	if(!config.get("rate", &value, 0) || value < 0)
+		return -EINVAL;
+	if(!config.get("min_rate", &minimum, value / 8) || minimum < 0 || minimum > value)
+		return -EINVAL;
+	if(!config.get("latency", &latency, 0) || latency < 0)
+		return -EINVAL;
+	scopelock scope(lock);
+	max_rate = value * (size_t) 1024;
+	min_rate = minimum * (size_t) 1024;
+	/* don't let it get stuck at 0 */
+	if(!min_rate)
+		min_rate = 1024;
+	rate = max_rate;
+	target = latency;
+	tokens = 0;
+	last_refill = now();
+	period_start.set(last_refill);
+	latency_sum.zero();
+	latency_count.zero();
+	enabled.set(max_rate != 0);
+	adapting.set(max_rate && target);
+	return 0;
+}
+
+size_t io_limiter::get_rate()
+{
+	scopelock scope(lock);
+	return rate;
+}
+
+void io_limiter::wait(size_t bytes)
+{
+	uint64_t delay = 0;
+	uint64_t time = now();
+	scopelock scope(lock);
+	if(!max_rate)
+		return;
+	if(time > last_refill)
+	{
+		double burst = rate * (double) IO_LIMITER_BURST / 1000000;
+		tokens += (time - last_refill) * (double) rate / 1000000;
+		if(tokens > burst)
+			tokens = burst;
+		last_refill = time;
+	}
+	/* we allow the bucket to go into debt: later callers will wait for it
+	 * to be paid off in addition to their own I/O, keeping the average rate */
+	tokens -= bytes;
+	if(tokens < 0)
+		delay = (uint64_t) (-tokens * 1000000 / rate);
+	scope.unlock();
+	if(delay)
+	{
+		struct timespec ts;
+		ts.tv_sec = delay / 1000000;
+		ts.tv_nsec = (delay % 1000000) * 1000;
+		while(nanosleep(&ts, &ts) < 0 && errno == EINTR);
+	}
+}
+
+void io_limiter::observe(uint64_t start)
+{
+	uint64_t time = now();
+	/* avoid taking the lock in the common case */
+	latency_sum.add(time - start);
+	latency_count.inc();
+	if(time - period_start.get() >= IO_LIMITER_PERIOD)
+		adapt(time);
+}
+
+void io_limiter::adapt(uint64_t time)
+{
+	uint64_t average, sum;
+	uint32_t count;
+	scopelock scope(lock);
+	/* someone else may have just done it */
+	if(time - period_start.get() < IO_LIMITER_PERIOD || !target)
+		return;
+	/* take the count first: observations that come in between just make
+	 * this period's average a little high, and are not lost */
+	count = latency_count.zero();
+	sum = latency_sum.zero();
+	period_start.set(time);
+	if(!count)
+		return;
+	average = sum / count;
+	if(average > target)
+		rate /= 2;
+	else
+		rate += (max_rate - min_rate) / IO_LIMITER_STEPS + 1;
+	if(rate < min_rate)
+		rate = min_rate;
+	else if(rate > max_rate)
+		rate = max_rate;
+}
@@ -0,0 +1,114 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#ifndef __IO_LIMITER_H
+#define __IO_LIMITER_H
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#ifndef __cplusplus
+#error io_limiter.h is a C++ header file
+#endif
+
+#include "atomic.h"
+#include "locking.h"
+
+class params;
+
+/* The I/O limiter is a process-wide token bucket which limits how fast
+ * maintenance work (digests and combines; see managed_dtable) reads and writes
+ * files, so that it does not saturate the disk. Only threads inside an
+ * io_limiter::scope are limited: rofile and rwfile call charge() as they do
+ * I/O, and it sleeps as necessary to keep the average rate within the limit.
+ *
+ * If a latency target is set, the rate also adapts to the foreground lookup
+ * latency reported through observe(): at the end of each period, the rate is
+ * halved if the average latency was above the target, and otherwise grows back
+ * by a fixed step toward the configured maximum. */
+
+/* the adaptation period, in microseconds */
+#define IO_LIMITER_PERIOD 250000
+/* the number of periods to get from the minimum rate back to the maximum */
+#define IO_LIMITER_STEPS 16
+/* the bucket holds at most this many microseconds worth of I/O */
+#define IO_LIMITER_BURST 100000
+
+class io_limiter
+{
+public:
+	/* Configuration parameters: "rate" is the maximum rate in KiB/s, or 0 for
+	 * no limit; "min_rate" is the rate below which adaptation will not go (by
+	 * default, 1/8 of the maximum); and "latency" is the target foreground
+	 * lookup latency in microseconds, or 0 to disable adaptation. The limiter
+	 * is shared by the whole process, so it is configured just once, through
+	 * anvil_configure(), rather than by each table. */
+	static int configure(const params & config);
+	
+	/* I/O done in the current thread while one of these exists is limited */
+	class scope
+	{
+	public:
+		inline scope(bool enable = true) : previous(limited)
+		{
+			limited = enable;
+		}
+		inline ~scope()
+		{
+			limited = previous;
+		}
+	private:
+		bool previous;
+	};
+	
+	/* account for some I/O, sleeping if necessary; cheap if not limited */
+	static inline void charge(size_t bytes)
+	{
+		if(limited && enabled.get())
+			wait(bytes);
+	}
+	
+	/* should foreground operations be timed and passed to observe()? */
+	static inline bool adaptive()
+	{
+		return adapting.get() != 0;
+	}
+	
+	/* report a foreground operation that started at the given time */
+	static void observe(uint64_t start);
+	
+	/* the current time in microseconds */
+	static inline uint64_t now()
+	{
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return tv.tv_sec * (uint64_t) 1000000 + tv.tv_usec;
+	}
+	
+	/* the current rate in bytes per second */
+	static size_t get_rate();
+	
+private:
+	static void wait(size_t bytes);
+	static void adapt(uint64_t now);
+	
+	static __thread bool limited;
+	/* whether there is a limit, and whether there is a latency target; these
+	 * are checked without the lock, and only change with it held */
+	static atomic<uint32_t> enabled, adapting;
+	/* the rest of the configuration and state is protected by the lock */
+	static init_mutex lock;
+	/* in bytes per second */
+	static size_t max_rate, min_rate, rate;
+	static uint32_t target;
+	static double tokens;
+	static uint64_t last_refill;
+	/* foreground latency statistics for the current period; the lock is
+	 * only needed to end the period, not to add to it */
+	static atomic<uint64_t> period_start, latency_sum;
+	static atomic<uint32_t> latency_count;
+};
+
+#endif /* __IO_LIMITER_H */
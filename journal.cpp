@@ -5,13 +5,15 @@
 #define _ATFILE_SOURCE
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/time.h>
 #include <time.h>
 
-#include "md5.h"
+#include "crc32c.h"
 #include "openat.h"
 #include "journal.h"
 
@@ -25,10 +27,22 @@
  * them. The records do not necessarily have to describe idempotent actions, but
  * if they do not, the client code must be able to figure out whether a record's
  * action has already been taken or not so as not to perform it twice in the
- * event of recovery. */
+ * event of recovery.
+ *
+ * Each journal's data file is a segment that starts with a header carrying a
+ * generation number, which every commit record repeats. Erased journals are
+ * renamed into a small pool of segments instead of being unlinked, and new
+ * journals reuse them: the data blocks are already allocated, and the commit
+ * records left over from the previous generation are simply ignored.
+ *
+ * Every record carries a CRC32C of its data, computed as it is appended, and
+ * each commit record carries a CRC32C of the record checksums it covers. So
+ * committing never has to read back the journal, and a torn record is caught
+ * by its own checksum during recovery and playback. */
 
 struct data_header {
 	size_t length;
+	uint32_t checksum;
 } __attribute__((packed));
 
 journal * journal::create(int dfd, const istr & path, journal * prev)
@@ -36,7 +50,7 @@ journal * journal::create(int dfd, const istr & path, journal * prev)
 	journal * j = new journal(path, dfd, prev);
 	if(!j)
 		return NULL;
-	if(!j->path || j->data_file.create(dfd, path) < 0)
+	if(!j->path || j->init_segment() < 0)
 	{
 		int save = errno;
 		delete j;
@@ -56,7 +70,15 @@ int journal::wait()
 		return -EINVAL;
 	return patchgroup_sync(last_commit);
 #else /* }}} */
+	return wait_all();
+#endif
+}
+
+#if !HAVE_FSTITCH
+int journal::wait_all()
+{
 	int r;
+	scopelock scope(fs_lock);
 	/* by changing the timestamp and calling fsync() on a file within
 	 * the target file system, we force the ext3 transaction to end */
 	fd_tv[0].tv_sec++;
@@ -65,8 +87,8 @@ int journal::wait()
 	r = fsync(fs_fd);
 	assert(r >= 0);
 	return 0;
-#endif
 }
+#endif
 
 int journal::appendv(const struct ovec * ovp, size_t count)
 {
@@ -77,8 +99,12 @@ int journal::appendv(const struct ovec * ovp, size_t count)
 	if(count < 1 || erasure)
 		return -EINVAL;
 	header.length = ovp[0].ov_len;
+	header.checksum = crc32c(0, ovp[0].ov_base, ovp[0].ov_len);
 	for(i = 1; i < count; i++)
+	{
 		header.length += ovp[i].ov_len;
+		header.checksum = crc32c(header.checksum, ovp[i].ov_base, ovp[i].ov_len);
+	}
 	data = (uint8_t *) malloc(header.length + sizeof(header));
 	cursor = sizeof(header);
 	util::memcpy(data, &header, sizeof(header));
@@ -113,6 +139,7 @@ int journal::appendv(const struct ovec * ovp, size_t count)
 		return -1;
 	}
 	free(data);
+	records_crc = crc32c(records_crc, &header.checksum, sizeof(header.checksum));
 	return 0;
 }
 
@@ -154,30 +181,39 @@ int journal::end_external(bool success)
 	return 0;
 }
 
-int journal::checksum(off_t start, off_t end, uint8_t * checksum)
+/* recomputes the checksum of the records in a committed range, checking each
+ * record's own checksum along the way; returns 1 if they are all intact, 0 if
+ * a record is torn, and < 0 on I/O error */
+int journal::checksum(off_t start, off_t end, uint32_t * checksum)
 {
-	/* this can be replaced with any other hash function;
-	 * I already had MD5 lying around so I used it here */
-	MD5_CTX ctx;
+	data_header header;
 	uint8_t buffer[4096];
-	ssize_t size = end - start;
-	MD5Init(&ctx);
-	if(size > (ssize_t) sizeof(buffer))
-		size = sizeof(buffer);
-	size = data_file.read(start, buffer, size);
-	while(size > 0 && end > start)
-	{
-		start += size;
-		MD5Update(&ctx, buffer, size);
-		size = end - start;
-		if(size > (ssize_t) sizeof(buffer))
-			size = sizeof(buffer);
-		size = data_file.read(start, buffer, size);
-	}
-	if(size < 0)
-		return -1;
-	MD5Final(checksum, &ctx);
-	return 0;
+	*checksum = 0;
+	while(start < end)
+	{
+		uint32_t crc = 0;
+		size_t left;
+		if(data_file.read(start, &header, sizeof(header)) != sizeof(header))
+			return -1;
+		start += sizeof(header);
+		left = header.length;
+		if((off_t) left > end - start)
+			return 0;
+		while(left)
+		{
+			ssize_t size = (left > sizeof(buffer)) ? sizeof(buffer) : left;
+			size = data_file.read(start, buffer, size);
+			if(size <= 0)
+				return -1;
+			crc = crc32c(crc, buffer, size);
+			start += size;
+			left -= size;
+		}
+		if(crc != header.checksum)
+			return 0;
+		*checksum = crc32c(*checksum, &crc, sizeof(crc));
+	}
+	return 1;
 }
 
 int journal::commit()
@@ -201,8 +237,8 @@ int journal::commit()
 
 	cr.offset = prev_cr.offset + prev_cr.length;
 	cr.length = data_file.end() - cr.offset;
-	if(checksum(cr.offset, cr.offset + cr.length, cr.checksum) < 0)
-		return -1;
+	cr.generation = generation;
+	cr.checksum = records_crc;
 #if HAVE_FSTITCH /* {{{ */
 	patchgroup_id_t commit;
 	commit = patchgroup_create(0);
@@ -262,18 +298,17 @@ int journal::commit()
 		patchgroup_abandon(last_commit);
 	last_commit = commit;
 #else /* }}} */
-	char commit_number[16];
 	istr old_commit, new_commit;
 	last_commit = commits;
-	snprintf(commit_number, sizeof(commit_number), "%d", last_commit);
-	old_commit = path + J_COMMIT_EXT + commit_number;
-	snprintf(commit_number, sizeof(commit_number), "%d", commits + 1);
-	new_commit = path + J_COMMIT_EXT + commit_number;
+	old_commit = commit_file(last_commit);
+	new_commit = commit_file(commits + 1);
 	int r = renameat(dfd, old_commit, dfd, new_commit);
 	if(r < 0)
 		return r;
+	crname = new_commit;
 #endif
 	records = 0;
+	records_crc = 0;
 	++commits;
 	prev_cr = cr;
 	return 0;
@@ -285,7 +320,6 @@ int journal::playback(record_processor processor, commit_hook commit, void * par
 	commit_record cr;
 	off_t readoff;
 	uint8_t buffer[65536];
-	uint8_t zero_checksum[J_CHECKSUM_LEN];
 	int r = -1;
 	if(erasure)
 		return -EINVAL;
@@ -322,10 +356,9 @@ int journal::playback(record_processor processor, commit_hook commit, void * par
 		return -1;
 	}
 #endif /* }}} */
-	util::memset(zero_checksum, 0, sizeof(zero_checksum));
 	while(pread(crfd, &cr, sizeof(cr), readoff) == sizeof(cr))
 	{
-		if(!cr.offset && !cr.length && !memcmp(&cr.checksum, &zero_checksum, J_CHECKSUM_LEN))
+		if(cr.generation != generation)
 			break;
 		
 		off_t curoff = cr.offset;
@@ -341,6 +374,11 @@ int journal::playback(record_processor processor, commit_hook commit, void * par
 				r = -1;
 				goto playback_error;
 			}
+			if(crc32c(0, buffer, header.length) != header.checksum)
+			{
+				r = -EIO;
+				goto playback_error;
+			}
 			curoff += sizeof(header) + header.length;
 			r = processor(buffer, header.length, param);
 			if(r < 0)
@@ -433,15 +471,11 @@ int journal::erase()
 	r = patchgroup_engage(erasure);
 	assert(r >= 0);
 #endif /* }}} */
-	unlinkat(dfd, path, 0);
+	recycle();
 #if HAVE_FSTITCH /* {{{ */
 	r = patchgroup_disengage(erasure);
 	assert(r >= 0);
-#else /* }}} */
-	char commit_number[16];
-	snprintf(commit_number, sizeof(commit_number), "%d", commits);
-	unlinkat(dfd, path + J_COMMIT_EXT + commit_number, 0);
-#endif
+#endif /* }}} */
 	r = data_file.close();
 	assert(r >= 0);
 	close(crfd);
@@ -472,26 +506,43 @@ int journal::release()
 		patchgroup_abandon(last_commit);
 	patchgroup_abandon(erasure);
 #endif /* }}} */
-	/* no need to unlink, since those were done in erase() */
+	/* no need to unlink, since those were recycled in erase() */
 	delete this;
 	return 0;
 }
 
-/* returns 1 for OK, 0 for failure, and < 0 on I/O error */
+/* returns 1 for OK, 0 if the last commit is torn, and < 0 on I/O error or if
+ * an earlier commit is damaged: only the last one can be torn by a crash, so
+ * the journal must not be thrown away as if it had never been committed */
 int journal::verify()
 {
 	commit_record cr;
-	uint8_t actual[J_CHECKSUM_LEN];
+	uint32_t actual;
+	int r;
 	if(crfd < 0)
 		return -1;
 	for(uint32_t i = 0; i < commits; i++)
 	{
 		if(pread(crfd, &cr, sizeof(cr), i * sizeof(cr)) != sizeof(cr))
 			return -1;
-		if(checksum(cr.offset, cr.offset + cr.length, actual) < 0)
+		if(cr.generation != generation)
+			r = 0;
+		else
+		{
+			r = checksum(cr.offset, cr.offset + cr.length, &actual);
+			if(r > 0 && actual != cr.checksum)
+				r = 0;
+		}
+		if(r < 0)
+			return r;
+		if(!r)
+		{
+			if(i + 1 == commits)
+				return 0;
+			fprintf(stderr, "Error: journal %s commit %u is damaged\n", path.str(), i);
+			errno = EIO;
 			return -1;
-		if(memcmp(cr.checksum, actual, J_CHECKSUM_LEN))
-			return 0;
+		}
 	}
 	return 1;
 }
@@ -501,32 +552,27 @@ int journal::init_crfd(const istr & commit_name)
 	int r;
 	off_t filesize, nextcr = 0;
 	struct timeval settime[2] = {{0, 0}, {0, 0}};
-	commit_record zero = {0, 0}, cr;
+	commit_record cr;
 	
 	/* Only append more empy records to the commit file if it is already open
 	 * otherwise create a new commit record file. */
 	if(crfd < 0)
 	{
-		istr cname = commit_name;
-		if(!cname)
-		{
-			char commit_number[16];
-			snprintf(commit_number, sizeof(commit_number), "%d", commits);
-			cname = path + J_COMMIT_EXT + commit_number;
-		}
+		istr cname = commit_name ? commit_name : commit_file(commits);
 		crfd = openat(dfd, cname, O_CREAT | O_RDWR, 0644);
 		if(crfd < 0)
 			return -1;
+		crname = cname;
 	}
 
 	filesize = lseek(crfd, 0, SEEK_END);
-	util::memset(zero.checksum, 0, sizeof(zero.checksum));
-	/* find out where the last good commit record is */
+	/* find out where the last good commit record is; records
+	 * from a previous use of the segment have an old generation */
 	while((r = pread(crfd, &cr, sizeof(cr), nextcr)))
 	{
 		if(r < (int) sizeof(cr))
 			break;
-		if(!cr.offset && !cr.length && !memcmp(&cr.checksum, &zero.checksum, J_CHECKSUM_LEN))
+		if(cr.generation != generation)
 			break;
 		nextcr += r;
 	}
@@ -546,15 +592,15 @@ int journal::init_crfd(const istr & commit_name)
 	
 	if(filesize < (nextcr + (int) sizeof(cr)))
 	{
-		/* zero out the rest of the file J_ADD_N_COMMITS records at a time */
-		uint8_t zbuffer[1000 * sizeof(zero)];
-		util::memset(zbuffer, 0, sizeof(zbuffer));
-		while((filesize - nextcr) < J_ADD_N_COMMITS * (int) sizeof(zbuffer))
+		/* allocate room for J_ADD_N_COMMITS thousand more records; the
+		 * new blocks read as zeros, which is never a valid generation */
+		off_t add = nextcr + J_ADD_N_COMMITS * 1000 * (off_t) sizeof(cr) - filesize;
+		r = posix_fallocate(crfd, filesize, add);
+		if(r)
 		{
-			r = pwrite(crfd, zbuffer, sizeof(zbuffer), filesize);
-			if(r <= 0)
-				goto error;
-			filesize += r;
+			errno = r;
+			r = -1;
+			goto error;
 		}
 		/* necessary? */
 		fsync(crfd);
@@ -587,6 +633,18 @@ int journal::reopen(int dfd, const istr & path, const istr & commit_name, journa
 		return -1;
 	if(!j->path)
 		goto error;
+	r = j->read_header();
+	if(r < 0)
+		goto error;
+	if(!r)
+	{
+		/* the header never made it to disk, so nothing was committed */
+		if(prev)
+			prev->usage--;
+		delete j;
+		*pj = NULL;
+		return 0;
+	}
 	offset = j->init_crfd(commit_name);
 	if(offset < 0)
 		goto error;
@@ -640,12 +698,208 @@ error:
 	return -1;
 }
 
+/* returns 1 for OK, 0 if the header never made it to disk, and < 0 on I/O
+ * error or if the journal is not in a format we know how to play back */
+int journal::read_header()
+{
+	segment_header header;
+	ssize_t r;
+	int fd = openat(dfd, path, O_RDONLY);
+	if(fd < 0)
+		return -1;
+	r = pread(fd, &header, sizeof(header), 0);
+	close(fd);
+	if(r < 0)
+		return -1;
+	/* the header is synced before anything else is written, so a journal
+	 * without one can only be empty (or read as zeros) if it is ours */
+	if(r != sizeof(header) || (!header.magic && !header.generation))
+		return 0;
+	if(header.magic != J_SEGMENT_MAGIC || !header.generation)
+	{
+		/* it may be committed, so it must not be thrown away */
+		fprintf(stderr, "Error: journal %s is in an unrecognized format\n", path.str());
+		errno = EPROTO;
+		return -1;
+	}
+	generation = header.generation;
+	return 1;
+}
+
+istr journal::commit_file(uint32_t number) const
+{
+	char commit_number[16];
+	snprintf(commit_number, sizeof(commit_number), "%u", number);
+	return path + J_COMMIT_EXT + commit_number;
+}
+
+void journal::segment_name(char * name, size_t size, uint32_t number, bool commit)
+{
+	snprintf(name, size, J_SEGMENT_PREFIX "%08x%s", number, commit ? J_SEGMENT_COMMIT : "");
+}
+
+/* takes a segment from the pool and moves it to our path, returning an open
+ * file descriptor for it; the new header is written (and synced) first so
+ * that a crash can never leave stale commit records with a valid generation */
+int journal::reuse_segment(segment_header * header)
+{
+	char name[32];
+	segment s = segments[--segment_count];
+	int fd;
+	header->generation = s.generation + 1;
+	if(!header->generation)
+		header->generation = 1;
+	segment_name(name, sizeof(name), s.number, false);
+	fd = openat(dfd, name, O_RDWR);
+	if(fd < 0)
+		goto fail;
+	if(pwrite(fd, header, sizeof(*header), 0) != sizeof(*header) || fdatasync(fd) < 0)
+		goto fail_close;
+	/* move the data file first: a journal without a commit file is empty */
+	if(renameat(dfd, name, dfd, path) < 0)
+		goto fail_close;
+	segment_name(name, sizeof(name), s.number, true);
+	if(!crname)
+		crname = commit_file(commits);
+	if(renameat(dfd, name, dfd, crname) < 0)
+	{
+		/* it will be created when we first commit */
+		unlinkat(dfd, name, 0);
+		crname = NULL;
+	}
+	return fd;
+	
+fail_close:
+	close(fd);
+fail:
+	unlinkat(dfd, name, 0);
+	segment_name(name, sizeof(name), s.number, true);
+	unlinkat(dfd, name, 0);
+	return -1;
+}
+
+int journal::init_segment()
+{
+	segment_header header;
+	int fd = -1;
+	header.magic = J_SEGMENT_MAGIC;
+	while(fd < 0 && segment_count)
+		fd = reuse_segment(&header);
+	if(fd < 0)
+	{
+		header.generation = 1;
+		fd = openat(dfd, path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if(fd < 0)
+			return -1;
+		if(pwrite(fd, &header, sizeof(header), 0) != sizeof(header) || fdatasync(fd) < 0)
+		{
+			close(fd);
+			unlinkat(dfd, path, 0);
+			return -1;
+		}
+	}
+	/* if this fails, the blocks will just be allocated as we append */
+	if(segment_size)
+		posix_fallocate(fd, 0, segment_size);
+	close(fd);
+	generation = header.generation;
+	return data_file.open(dfd, path, sizeof(header));
+}
+
+/* moves the files of an erased journal into the pool, or unlinks them */
+void journal::recycle()
+{
+	char name[32];
+	segment s;
+	if(!generation || segment_count >= J_SEGMENT_POOL)
+		goto unlink;
+	s.number = next_segment++;
+	s.generation = generation;
+	/* move the commit file first, for the same reason as in reuse_segment() */
+	if(crname)
+	{
+		segment_name(name, sizeof(name), s.number, true);
+		if(renameat(dfd, crname, dfd, name) < 0)
+			goto unlink;
+	}
+	segment_name(name, sizeof(name), s.number, false);
+	if(renameat(dfd, path, dfd, name) < 0)
+	{
+		unlinkat(dfd, path, 0);
+		segment_name(name, sizeof(name), s.number, true);
+		unlinkat(dfd, name, 0);
+		return;
+	}
+	segments[segment_count++] = s;
+	return;
+	
+unlink:
+	unlinkat(dfd, path, 0);
+	if(crname)
+		unlinkat(dfd, crname, 0);
+}
+
+bool journal::is_segment(const char * name)
+{
+	return !strncmp(name, J_SEGMENT_PREFIX, strlen(J_SEGMENT_PREFIX));
+}
+
+int journal::add_segment(int dfd, const char * name)
+{
+	char data_name[32];
+	segment_header header;
+	segment s;
+	const char * end;
+	ssize_t r;
+	int fd;
+	s.number = strtoul(name + strlen(J_SEGMENT_PREFIX), (char **) &end, 16);
+	segment_name(data_name, sizeof(data_name), s.number, false);
+	if(!strcmp(end, J_SEGMENT_COMMIT))
+	{
+		/* keep the commit file only if its data file is still there */
+		fd = openat(dfd, data_name, O_RDONLY);
+		if(fd >= 0)
+		{
+			close(fd);
+			return 0;
+		}
+		return unlinkat(dfd, name, 0);
+	}
+	if(*end)
+		return unlinkat(dfd, name, 0);
+	if(segment_count >= J_SEGMENT_POOL)
+		goto drop;
+	fd = openat(dfd, name, O_RDONLY);
+	if(fd < 0)
+		return fd;
+	r = pread(fd, &header, sizeof(header), 0);
+	close(fd);
+	if(r != sizeof(header) || header.magic != J_SEGMENT_MAGIC)
+		goto drop;
+	s.generation = header.generation;
+	segments[segment_count++] = s;
+	if(next_segment <= s.number)
+		next_segment = s.number + 1;
+	return 0;
+	
+drop:
+	segment_name(data_name, sizeof(data_name), s.number, true);
+	unlinkat(dfd, data_name, 0);
+	return unlinkat(dfd, name, 0);
+}
+
+journal::segment journal::segments[J_SEGMENT_POOL];
+size_t journal::segment_count = 0;
+uint32_t journal::next_segment = 0;
+size_t journal::segment_size = 0;
+
 #if !HAVE_FSTITCH
 int journal::fs_fd = -1;
 struct timeval journal::fd_tv[2];
+init_mutex journal::fs_lock;
 #endif
 
-int journal::init(int dfd)
+int journal::init(int dfd, size_t segment_size)
 {
 #if !HAVE_FSTITCH
 	if(fs_fd >= 0)
@@ -656,6 +910,7 @@ int journal::init(int dfd)
 	unlinkat(dfd, ".fsync_fs", 0);
 	memset(fd_tv, 0, sizeof(fd_tv));
 #endif
+	journal::segment_size = segment_size;
 	return 0;
 }
 
@@ -667,5 +922,8 @@ int journal::deinit()
 	close(fs_fd);
 	fs_fd = -1;
 #endif
+	/* the segment files stay on disk for next time */
+	segment_count = 0;
+	next_segment = 0;
 	return 0;
 }
@@ -7,6 +7,7 @@
 
 #include <errno.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 #ifndef __cplusplus
 #error journal.h is a C++ header file
@@ -26,11 +27,17 @@ extern "C" {
 
 #include "istr.h"
 #include "rwfile.h"
+#include "locking.h"
 
 #define J_COMMIT_EXT ".commit."
-#define J_CHECKSUM_LEN 16
 #define J_ADD_N_COMMITS 50 /* in thousands of commits */
 
+/* erased journals are kept as preallocated segments for reuse */
+#define J_SEGMENT_PREFIX "segment."
+#define J_SEGMENT_COMMIT ".cr"
+#define J_SEGMENT_MAGIC 0x4A534743
+#define J_SEGMENT_POOL 4
+
 class journal
 {
 public:
@@ -62,6 +69,12 @@ public:
 	/* blocks waiting for a committed journal to be written to disk */
 	int wait();
 	
+#if !HAVE_FSTITCH
+	/* blocks waiting for everything committed so far, in any journal, to
+	 * be written to disk; unlike wait(), this is safe from other threads */
+	static int wait_all();
+#endif
+	
 	/* plays back a journal, possibly during recovery */
 	int playback(record_processor processor, commit_hook commit, void * param);
 	
@@ -74,29 +87,57 @@ public:
 	/* creates a new journal */
 	static journal * create(int dfd, const istr & path, journal * prev);
 	
-	/* reopens an existing journal if it is committed, otherwise leaves it alone */
+	/* reopens an existing journal if it is committed, otherwise leaves it alone;
+	 * fails with errno = EPROTO if it is not in the current format */
 	static int reopen(int dfd, const istr & path, const istr & commit_name, journal ** pj, journal * prev);
 	
 	/* number of bytes currently occupied by the journal */
 	inline size_t size() const { return data_file.end() + (commits * sizeof(commit_record));}
 	
-	/* initialize the journal system */
-	static int init(int dfd);
+	/* initialize the journal system; segment_size is preallocated for new journals */
+	static int init(int dfd, size_t segment_size = 0);
 	static int deinit();
 	
+	/* segment files found in the journal directory must be given back to
+	 * the pool with add_segment() before any journals are reopened */
+	static bool is_segment(const char * name);
+	static int add_segment(int dfd, const char * name);
+	
 private:
 #if !HAVE_FSTITCH
 	static int fs_fd;
 	static struct timeval fd_tv[2];
+	static init_mutex fs_lock;
 #endif
 	
+	/* the header at the start of each data file */
+	struct segment_header {
+		uint32_t magic;
+		uint32_t generation;
+	} __attribute__((packed));
+	
 	/* a commit record */
 	struct commit_record {
 		off_t offset;
 		size_t length;
-		uint8_t checksum[J_CHECKSUM_LEN];
+		/* must match the data file header */
+		uint32_t generation;
+		/* CRC32C of the record checksums in this commit */
+		uint32_t checksum;
 	} __attribute__((packed));
 	
+	/* a free segment in the pool */
+	struct segment {
+		uint32_t number;
+		uint32_t generation;
+	};
+	
+	/* a plain array, since tx_deinit() may run after static destructors */
+	static segment segments[J_SEGMENT_POOL];
+	static size_t segment_count;
+	static uint32_t next_segment;
+	static size_t segment_size;
+	
 	inline journal(const istr & path, int dfd, journal * prev)
 		: path(path), dfd(dfd), crfd(-1), records(0), last_commit(0),
 		  finished(0), erasure(0), external(0),
@@ -104,9 +145,9 @@ private:
 		  handler(this),
 #endif
 		  prev(prev), commits(0), playbacks(0), usage(1),
-		  ext_count(0), ext_success(false)
+		  ext_count(0), ext_success(false), generation(0), records_crc(0)
 	{
-		prev_cr.offset = 0;
+		prev_cr.offset = sizeof(segment_header);
 		prev_cr.length = 0;
 		if(prev)
 			prev->usage++;
@@ -132,11 +173,19 @@ private:
 	};
 #endif
 	
-	int checksum(off_t start, off_t end, uint8_t * checksum);
+	int checksum(off_t start, off_t end, uint32_t * checksum);
 	int init_crfd(const istr & commit_name);
+	int init_segment();
+	int reuse_segment(segment_header * header);
+	int read_header();
+	void recycle();
 	int verify();
 	
-	istr path;
+	/* the name of our commit record file after a number of commits */
+	istr commit_file(uint32_t number) const;
+	static void segment_name(char * name, size_t size, uint32_t number, bool commit);
+	
+	istr path, crname;
 	int dfd, crfd;
 	rwfile data_file;
 #if HAVE_FSTITCH
@@ -167,6 +216,10 @@ private:
 	/* external dependency state */
 	int ext_count;
 	bool ext_success;
+	/* the generation number of the data file */
+	uint32_t generation;
+	/* the combined checksum of the records since the last commit */
+	uint32_t records_crc;
 };
 
 #endif /* __JOURNAL_H */
@@ -6,7 +6,9 @@
 
 #include "util.h"
 #include "exception.h"
+#include "dtable_stats.h"
 #include "hack_avl_map.h"
+#include "memory_budget.h"
 #include "journal_dtable.h"
 
 bool journal_dtable::iter::valid() const
@@ -109,6 +111,13 @@ blob journal_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
 	return blob();
 }
 
+int journal_dtable::get_stats(dtable_stats * stats) const
+{
+	*stats = key_stats;
+	stats->finish();
+	return 0;
+}
+
 #define JDT_KEY_U32 1
 struct jdt_key_u32
 {
@@ -159,6 +168,27 @@ struct jdt_blob_cmp
 	char name[0];
 } __attribute__((packed));
 
+/* logged before the first delta, so we can find the merger again on replay */
+#define JDT_BLOB_MERGER 6
+struct jdt_blob_merger
+{
+	uint8_t type;
+	/* this may be the first entry, so it must say what the key type is */
+	uint8_t key_type;
+	size_t length;
+	char name[0];
+} __attribute__((packed));
+
+#define JDT_KEY_U64 7
+struct jdt_key_u64
+{
+	uint8_t type;
+	uint8_t append;
+	uint64_t key;
+	size_t size;
+	uint8_t data[0];
+} __attribute__((packed));
+
 int journal_dtable::log_blob_cmp()
 {
 	int r;
@@ -174,22 +204,49 @@ int journal_dtable::log_blob_cmp()
 	return 0;
 }
 
-template<class T> inline int journal_dtable::log(T * entry, const blob & blob, size_t offset)
+int journal_dtable::log_blob_merger()
 {
 	int r;
-	size_t size = sizeof(*entry) + offset;
+	size_t length = strlen(blob_mrg->name);
+	jdt_blob_merger * entry = (jdt_blob_merger *) malloc(sizeof(*entry) + length);
+	if(!entry)
+		return -ENOMEM;
+	entry->type = JDT_BLOB_MERGER;
+	entry->key_type = ktype;
+	entry->length = length;
+	util::memcpy(entry->name, blob_mrg->name, length);
+	r = journal_append(entry, sizeof(*entry) + length);
+	free(entry);
+	if(r >= 0)
+		merger_logged = true;
+	return r;
+}
+
+/* the entry header, key, and value are passed to the journal as separate pieces,
+ * so that large values are written straight from the blob without any copies */
+template<class T> inline int journal_dtable::log(T * entry, const blob & blob, const void * key, size_t key_size)
+{
+	struct iovec iov[3];
+	int count = 1;
+	iov[0].iov_base = entry;
+	iov[0].iov_len = sizeof(*entry);
+	if(key_size)
+	{
+		iov[count].iov_base = (void *) key;
+		iov[count++].iov_len = key_size;
+	}
 	if(blob.exists())
 	{
 		entry->size = blob.size();
 		if(entry->size)
-			util::memcpy(&entry->data[offset], &blob[0], entry->size);
-		size += entry->size;
+		{
+			iov[count].iov_base = (void *) &blob[0];
+			iov[count++].iov_len = entry->size;
+		}
 	}
 	else
 		entry->size = -1;
-	r = journal_append(entry, size);
-	free(entry);
-	return r;
+	return journal_appendv(iov, count);
 }
 
 int journal_dtable::log(const dtype & key, const blob & blob, bool append)
@@ -202,51 +259,53 @@ int journal_dtable::log(const dtype & key, const blob & blob, bool append)
 			return value;
 		cmp_name = blob_cmp->name;
 	}
+	if(!merger_logged && partial(blob))
+	{
+		int value = log_blob_merger();
+		if(value < 0)
+			return value;
+	}
 	switch(key.type)
 	{
 		case dtype::UINT32:
 		{
-			jdt_key_u32 * entry = (jdt_key_u32 *) malloc(sizeof(*entry) + blob.size());
-			if(!entry)
-				return -ENOMEM;
-			entry->type = JDT_KEY_U32;
-			entry->append = append;
-			entry->key = key.u32;
-			return log(entry, blob);
+			jdt_key_u32 entry;
+			entry.type = JDT_KEY_U32;
+			entry.append = append;
+			entry.key = key.u32;
+			return log(&entry, blob);
+		}
+		case dtype::UINT64:
+		{
+			jdt_key_u64 entry;
+			entry.type = JDT_KEY_U64;
+			entry.append = append;
+			entry.key = key.u64;
+			return log(&entry, blob);
 		}
 		case dtype::DOUBLE:
 		{
-			jdt_key_dbl * entry = (jdt_key_dbl *) malloc(sizeof(*entry) + blob.size());
-			if(!entry)
-				return -ENOMEM;
-			entry->type = JDT_KEY_DBL;
-			entry->append = append;
-			entry->key = key.dbl;
-			return log(entry, blob);
+			jdt_key_dbl entry;
+			entry.type = JDT_KEY_DBL;
+			entry.append = append;
+			entry.key = key.dbl;
+			return log(&entry, blob);
 		}
 		case dtype::STRING:
 		{
-			jdt_key_str * entry = (jdt_key_str *) malloc(sizeof(*entry) + blob.size() + key.str.length());
-			if(!entry)
-				return -ENOMEM;
-			entry->type = JDT_KEY_STR;
-			entry->append = append;
-			entry->key_size = key.str.length();
-			if(entry->key_size)
-				util::memcpy(entry->data, key.str, entry->key_size);
-			return log(entry, blob, entry->key_size);
+			jdt_key_str entry;
+			entry.type = JDT_KEY_STR;
+			entry.append = append;
+			entry.key_size = key.str.length();
+			return log(&entry, blob, (const char *) key.str, entry.key_size);
 		}
 		case dtype::BLOB:
 		{
-			jdt_key_blob * entry = (jdt_key_blob *) malloc(sizeof(*entry) + blob.size() + key.blb.size());
-			if(!entry)
-				return -ENOMEM;
-			entry->type = JDT_KEY_BLOB;
-			entry->append = append;
-			entry->key_size = key.blb.size();
-			if(entry->key_size)
-				util::memcpy(entry->data, &key.blb[0], entry->key_size);
-			return log(entry, blob, entry->key_size);
+			jdt_key_blob entry;
+			entry.type = JDT_KEY_BLOB;
+			entry.append = append;
+			entry.key_size = key.blb.size();
+			return log(&entry, blob, entry.key_size ? &key.blb[0] : NULL, entry.key_size);
 		}
 	}
 	abort();
@@ -297,8 +356,12 @@ int journal_dtable::reinit(sys_journal::listener_id lid)
 		blob_cmp = NULL;
 	}
 	cmp_name = NULL;
+	/* keep the blob merger, but we'll need to log it again */
+	merger_logged = false;
 	jdt_hash.clear();
 	jdt_map.clear();
+	set_memory(0);
+	key_stats = dtable_stats();
 	set_id(lid);
 	return 0;
 }
@@ -307,6 +370,8 @@ void journal_dtable::deinit()
 {
 	jdt_hash.clear();
 	jdt_map.clear();
+	set_memory(0);
+	key_stats = dtable_stats();
 	initialized = false;
 	dtable::deinit();
 }
@@ -323,16 +388,35 @@ int journal_dtable::set_node(const dtype & key, const blob & value, bool append)
 			jdt_map.insert(jdt_map.end(), map_pair);
 		else
 			jdt_map.insert(map_pair);
+		set_memory(memory + node_memory(key, value));
+		stats_add(key, value);
+		return 0;
 	}
+	size_t old_size = insert.first->second.size();
+	bool existed = insert.first->second.exists();
+	if(partial(value))
+		/* merge the delta with the value we already have */
+		insert.first->second = blob_mrg->merge(value, insert.first->second);
 	else
 		/* update value in hash */
 		insert.first->second = value;
+	set_memory(memory - old_size + insert.first->second.size());
+	stats_change(existed, insert.first->second);
 	return 0;
 }
 
+void journal_dtable::set_memory(size_t bytes)
+{
+	memory_budget::charge((ssize_t) bytes - (ssize_t) memory);
+	memory = bytes;
+}
+
 int journal_dtable::real_rollover(listening_dtable * target) const
 {
 	journal_dtable_hash::const_iterator it;
+	if(blob_mrg && !target->get_blob_merger())
+		/* the target will need it to merge any deltas we send */
+		target->set_blob_merger(blob_mrg);
 	for(it = jdt_hash.begin(); it != jdt_hash.end(); ++it)
 	{
 		int r = send(target, it->first, it->second);
@@ -357,6 +441,15 @@ int journal_dtable::journal_replay(void *& entry, size_t length)
 				value = blob(u32->size, u32->data);
 			return set_node(u32->key, value, u32->append);
 		}
+		case JDT_KEY_U64:
+		{
+			jdt_key_u64 * u64 = (jdt_key_u64 *) entry;
+			if(ktype != dtype::UINT64)
+				return -EINVAL;
+			if(u64->size != (size_t) -1)
+				value = blob(u64->size, u64->data);
+			return set_node(u64->key, value, u64->append);
+		}
 		case JDT_KEY_DBL:
 		{
 			jdt_key_dbl * dbl = (jdt_key_dbl *) entry;
@@ -399,6 +492,22 @@ int journal_dtable::journal_replay(void *& entry, size_t length)
 			cmp_name = copy;
 			return 0;
 		}
+		case JDT_BLOB_MERGER:
+		{
+			jdt_blob_merger * name = (jdt_blob_merger *) entry;
+			istr copy(name->name, name->length);
+			const blob_merger * merger = blob_merger::lookup(copy);
+			if(name->key_type != ktype)
+				return -EINVAL;
+			if(!merger)
+				/* it must be registered before the journal is replayed */
+				return -ENOENT;
+			if(blob_mrg && blob_mrg != merger)
+				return -EINVAL;
+			blob_mrg = merger;
+			merger_logged = true;
+			return 0;
+		}
 		default:
 			return -EINVAL;
 	}
@@ -412,6 +521,9 @@ bool journal_dtable::entry_key_type(const void * entry, size_t length, dtype::ct
 		case JDT_KEY_U32:
 			*key_type = dtype::UINT32;
 			break;
+		case JDT_KEY_U64:
+			*key_type = dtype::UINT64;
+			break;
 		case JDT_KEY_DBL:
 			*key_type = dtype::DOUBLE;
 			break;
@@ -422,6 +534,9 @@ bool journal_dtable::entry_key_type(const void * entry, size_t length, dtype::ct
 		case JDT_BLOB_CMP:
 			*key_type = dtype::BLOB;
 			break;
+		case JDT_BLOB_MERGER:
+			*key_type = (dtype::ctype) ((jdt_blob_merger *) entry)->key_type;
+			break;
 		default:
 			return false;
 	}
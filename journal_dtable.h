@@ -19,8 +19,12 @@
 #include "avl/map.h"
 
 #include "dtable.h"
+#include "dtable_stats.h"
 #include "sys_journal.h"
 
+/* the bookkeeping overhead of each key, in both the hash and the map */
+#define JDT_NODE_OVERHEAD (sizeof(std::pair<const dtype, blob>) + sizeof(std::pair<const dtype, blob *>) + 6 * sizeof(void *))
+
 /* The journal dtable doesn't have an associated file: all its data is stored in
  * a sys_journal. The only identifying part of journal dtables is their listener
  * ID, which must be chosen to be unique for each new journal dtable. */
@@ -34,9 +38,13 @@ public:
 	
 	/* journal_dtable supports size() even though it is not otherwise indexable */
 	inline virtual size_t size() const { return jdt_hash.size(); }
+	/* also charged to the process-wide memory_budget */
+	inline virtual size_t memory_usage() const { return memory; }
 	inline virtual bool writable() const { return true; }
 	virtual int insert(const dtype & key, const blob & blob, bool append = false, ATX_OPT);
 	virtual int remove(const dtype & key, ATX_OPT);
+	/* kept up to date as keys are added, except for the histogram */
+	virtual int get_stats(dtable_stats * stats) const;
 	
 	inline virtual int set_blob_cmp(const blob_comparator * cmp)
 	{
@@ -45,6 +53,13 @@ public:
 		return listening_dtable::set_blob_cmp(cmp);
 	}
 	
+	/* deltas are merged with the existing value for the key, if there is one */
+	inline virtual int set_blob_merger(const blob_merger * merger)
+	{
+		blob_mrg = merger;
+		return 0;
+	}
+	
 	/* for rollover */
 	virtual int real_rollover(listening_dtable * target) const;
 	inline virtual int accept(const dtype & key, const blob & value, bool append = false) { return set_node(key, value, append); }
@@ -64,7 +79,7 @@ public:
 	
 protected:
 	/* journal_dtables should only be constructed by a journal_dtable_warehouse */
-	inline journal_dtable() : initialized(false), jdt_map(blob_cmp), jdt_hash(10, blob_cmp, blob_cmp) {}
+	inline journal_dtable() : initialized(false), merger_logged(false), jdt_map(blob_cmp), jdt_hash(10, blob_cmp, blob_cmp), memory(0) {}
 	int init(dtype::ctype key_type, sys_journal::listener_id lid, sys_journal * sysj);
 	void deinit();
 	inline virtual ~journal_dtable()
@@ -77,15 +92,48 @@ protected:
 	
 	int log(const dtype & key, const blob & blob, bool append);
 	
+	inline bool partial(const blob & value) const
+	{
+		return blob_mrg && value.exists() && blob_mrg->partial(value);
+	}
+	
 	typedef __gnu_cxx::__pool_alloc<std::pair<const dtype, blob *> > tree_pool_allocator;
 	typedef __gnu_cxx::__pool_alloc<std::pair<const dtype, blob> > hash_pool_allocator;
 	typedef avl::map<dtype, blob *, dtype_comparator_refobject, tree_pool_allocator> journal_dtable_map;
 	typedef __gnu_cxx::hash_map<const dtype, blob, dtype_hashing_comparator, dtype_hashing_comparator, hash_pool_allocator> journal_dtable_hash;
 	
 	bool initialized;
+	/* whether we have logged the name of the blob merger yet */
+	bool merger_logged;
 	journal_dtable_map jdt_map;
 	journal_dtable_hash jdt_hash;
 	
+	/* roughly the memory used by a key and its value in the hash and map */
+	static inline size_t node_memory(const dtype & key, const blob & value)
+	{
+		size_t size = JDT_NODE_OVERHEAD + value.size();
+		if(key.type == dtype::STRING)
+			size += key.str.length() + 1;
+		else if(key.type == dtype::BLOB)
+			size += key.blb.size();
+		return size;
+	}
+	void set_memory(size_t bytes);
+	
+	/* the statistics for get_stats(), updated by set_node() */
+	dtable_stats key_stats;
+	inline void stats_add(const dtype & key, const blob & value)
+	{
+		key_stats.add_unordered(key, value.exists(), blob_cmp);
+	}
+	inline void stats_change(bool existed, const blob & value)
+	{
+		if(existed && !value.exists())
+			key_stats.dne_count++;
+		else if(!existed && value.exists())
+			key_stats.dne_count--;
+	}
+	
 private:
 	class iter : public iter_source<journal_dtable>
 	{
@@ -108,9 +156,12 @@ private:
 	};
 	
 	int log_blob_cmp();
-	template<class T> inline int log(T * entry, const blob & blob, size_t offset = 0);
+	int log_blob_merger();
+	template<class T> inline int log(T * entry, const blob & blob, const void * key = NULL, size_t key_size = 0);
 	int set_node(const dtype & key, const blob & value, bool append);
 	
+	size_t memory;
+	
 	virtual int journal_replay(void *& entry, size_t length);
 };
 
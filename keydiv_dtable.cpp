@@ -7,10 +7,18 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
 
 #include "openat.h"
 
 #include "util.h"
+#include "blob_buffer.h"
+#include "dtable_stats.h"
 #include "keydiv_dtable.h"
 
 keydiv_dtable::iter::iter(const keydiv_dtable * source, ATX_DEF)
@@ -21,7 +29,7 @@ keydiv_dtable::iter::iter(const keydiv_dtable * source, ATX_DEF)
 	{
 		subs[i].iter = source->sub[i]->iterator(atx);
 		subs[i].at_first = true;
-		subs[i].at_end = !subs[i].iter->valid();
+		subs[i].at_end = !sub_first(i);
 	}
 	/* find the first nonempty iterator */
 	while(current_index < source->sub.size() && subs[current_index].at_end)
@@ -33,6 +41,47 @@ keydiv_dtable::iter::~iter()
 	delete[] subs;
 }
 
+/* The underlying dtables may have keys outside their ranges, since when a
+ * shard is split, the moved keys are left in the old one as nonexistent values
+ * until they are eventually combined away. So we skip over any such keys. */
+bool keydiv_dtable::iter::below(size_t index) const
+{
+	if(!index)
+		return false;
+	return subs[index].iter->key().compare(dt_source->dividers[index - 1], dt_source->blob_cmp) < 0;
+}
+
+bool keydiv_dtable::iter::above(size_t index) const
+{
+	if(index == dt_source->dividers.size())
+		return false;
+	return subs[index].iter->key().compare(dt_source->dividers[index], dt_source->blob_cmp) >= 0;
+}
+
+bool keydiv_dtable::iter::sub_first(size_t index)
+{
+	dtable::iter * iter = subs[index].iter;
+	bool valid = iter->first();
+	if(valid && below(index))
+		valid = iter->seek(dt_source->dividers[index - 1]) || iter->valid();
+	return valid && !above(index);
+}
+
+bool keydiv_dtable::iter::sub_last(size_t index)
+{
+	dtable::iter * iter = subs[index].iter;
+	bool valid = iter->last();
+	if(valid && above(index))
+	{
+		/* this finds the first key not below the divider */
+		iter->seek(dt_source->dividers[index]);
+		valid = iter->prev();
+		if(valid && above(index))
+			valid = false;
+	}
+	return valid && !below(index);
+}
+
 bool keydiv_dtable::iter::valid() const
 {
 	return current_index < dt_source->sub.size();
@@ -42,7 +91,7 @@ bool keydiv_dtable::iter::next()
 {
 	if(current_index >= dt_source->sub.size())
 		return false;
-	if(subs[current_index].iter->next())
+	if(subs[current_index].iter->next() && !above(current_index))
 	{
 		subs[current_index].at_first = false;
 		return true;
@@ -53,7 +102,7 @@ bool keydiv_dtable::iter::next()
 		if(!subs[current_index].at_first)
 		{
 			subs[current_index].at_first = true;
-			subs[current_index].at_end = !subs[current_index].iter->first();
+			subs[current_index].at_end = !sub_first(current_index);
 		}
 		if(!subs[current_index].at_end)
 			return true;
@@ -68,16 +117,17 @@ bool keydiv_dtable::iter::prev()
 	if(current_index < dt_source->sub.size())
 	{
 		if(subs[current_index].iter->prev())
-			return true;
+		{
+			if(!below(current_index))
+				return true;
+			/* move back to the first key in range */
+			subs[current_index].iter->next();
+		}
 		subs[current_index].at_first = true;
 	}
 	while(current_index)
 	{
-		bool empty;
-		if(subs[--current_index].at_end)
-			empty = !subs[current_index].iter->prev();
-		else
-			empty = !subs[current_index].iter->last();
+		bool empty = !sub_last(--current_index);
 		subs[current_index].at_first = empty;
 		subs[current_index].at_end = empty;
 		if(!empty)
@@ -96,7 +146,7 @@ bool keydiv_dtable::iter::first()
 	for(size_t i = 0; i < dt_source->sub.size(); i++)
 	{
 		subs[i].at_first = true;
-		subs[i].at_end = !subs[i].iter->first();
+		subs[i].at_end = !sub_first(i);
 	}
 	current_index = 0;
 	/* find the first nonempty iterator */
@@ -121,7 +171,7 @@ bool keydiv_dtable::iter::seek(const dtype & key)
 {
 	size_t target_index = dt_source->key_index(key);
 	bool found = subs[target_index].iter->seek(key);
-	bool valid = found || subs[target_index].iter->valid();
+	bool valid = found || (subs[target_index].iter->valid() && !above(target_index));
 	current_index = target_index;
 	subs[current_index].at_first = false;
 	subs[current_index].at_end = !valid;
@@ -136,7 +186,7 @@ bool keydiv_dtable::iter::seek(const dtype_test & test)
 {
 	size_t target_index = dt_source->key_index(test);
 	bool found = subs[target_index].iter->seek(test);
-	bool valid = found || subs[target_index].iter->valid();
+	bool valid = found || (subs[target_index].iter->valid() && !above(target_index));
 	current_index = target_index;
 	subs[current_index].at_first = false;
 	subs[current_index].at_end = !valid;
@@ -182,6 +232,7 @@ bool keydiv_dtable::present(const dtype & key, bool * found, ATX_DEF) const
 {
 	size_t index = key_index(key);
 	assert(index < sub.size());
+	scopelock scope(writers[index]->lock);
 	if(atx != NO_ABORTABLE_TX)
 		if(map_atx(&atx, index) < 0)
 		{
@@ -195,6 +246,7 @@ blob keydiv_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
 {
 	size_t index = key_index(key);
 	assert(index < sub.size());
+	scopelock scope(writers[index]->lock);
 	if(atx != NO_ABORTABLE_TX)
 		if(map_atx(&atx, index) < 0)
 		{
@@ -204,30 +256,81 @@ blob keydiv_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
 	return sub[index]->lookup(key, found, atx);
 }
 
+int keydiv_dtable::get_stats(dtable_stats * stats) const
+{
+	bool any = false;
+	*stats = dtable_stats();
+	for(size_t i = 0; i < sub.size(); i++)
+	{
+		dtable_stats part;
+		int r = sub[i]->get_stats(&part);
+		if(r == -ENOSYS)
+		{
+			stats->partial = true;
+			continue;
+		}
+		if(r < 0)
+			return r;
+		stats->merge(part, blob_cmp);
+		any = true;
+	}
+	return any ? 0 : -ENOSYS;
+}
+
+/* Without shard journals, all the shards write to the same system journal,
+ * which is not safe to do from several threads at once. So in that case, a
+ * write while another one is in progress is refused with -EBUSY. */
+int keydiv_dtable::lock_shard(size_t index)
+{
+	if(!shard_journals && !write_lock.trylock())
+		return -EBUSY;
+	writers[index]->lock.lock();
+	return 0;
+}
+
+void keydiv_dtable::unlock_shard(size_t index)
+{
+	writers[index]->lock.unlock();
+	if(!shard_journals)
+		write_lock.unlock();
+}
+
 int keydiv_dtable::insert(const dtype & key, const blob & blob, bool append, ATX_DEF)
 {
+	int r;
 	size_t index = key_index(key);
 	assert(index < sub.size());
+	r = lock_shard(index);
+	if(r < 0)
+		return r;
 	if(atx != NO_ABORTABLE_TX)
+		r = map_atx(&atx, index);
+	if(r >= 0)
 	{
-		int r = map_atx(&atx, index);
-		if(r < 0)
-			return r;
+		writes[index]++;
+		r = sub[index]->insert(key, blob, append, atx);
 	}
-	return sub[index]->insert(key, blob, append, atx);
+	unlock_shard(index);
+	return r;
 }
 
 int keydiv_dtable::remove(const dtype & key, ATX_DEF)
 {
+	int r;
 	size_t index = key_index(key);
 	assert(index < sub.size());
+	r = lock_shard(index);
+	if(r < 0)
+		return r;
 	if(atx != NO_ABORTABLE_TX)
+		r = map_atx(&atx, index);
+	if(r >= 0)
 	{
-		int r = map_atx(&atx, index);
-		if(r < 0)
-			return r;
+		writes[index]++;
+		r = sub[index]->remove(key, atx);
 	}
-	return sub[index]->remove(key, atx);
+	unlock_shard(index);
+	return r;
 }
 
 /* keydiv_dtable does not need to do anything itself to support abortable
@@ -322,7 +425,12 @@ int keydiv_dtable::atx_state::populate(const keydiv_dtable * kddt) const
 abortable_tx keydiv_dtable::atx_state::get(size_t index, const keydiv_dtable * kddt) const
 {
 	if(atx[index] == NO_ABORTABLE_TX)
+	{
+		/* creating abortable transactions allocates system journal
+		 * IDs, which is not safe to do from several threads at once */
+		scopelock scope(kddt->atx_lock);
 		atx[index] = kddt->sub[index]->create_tx();
+	}
 	return atx[index];
 }
 
@@ -381,18 +489,346 @@ int keydiv_dtable::maintain(bool force)
 	for(size_t i = 0; i < sub.size(); i++)
 	{
 		r = sub[i]->maintain(force);
+		if(r < 0)
+			return r;
+	}
+	return rebalance();
+}
+
+size_t keydiv_dtable::shard_size(size_t index) const
+{
+	bool valid;
+	size_t size = 0;
+	dtable_stats stats;
+	dtable::iter * iter;
+	if(sub[index]->get_stats(&stats) >= 0 && !stats.partial)
+		return stats.count - stats.dne_count;
+	/* no statistics, so count them ourselves */
+	iter = sub[index]->iterator();
+	if(!iter)
+		return 0;
+	for(valid = iter->valid(); valid; valid = iter->next())
+		if(iter->meta().exists())
+			size++;
+	delete iter;
+	return size;
+}
+
+/* Splits or merges at most one shard per call, to bound the work done by any
+ * one maintain() call. Since this changes the set of underlying dtables, it is
+ * not done while there are open iterators or abortable transactions. The shard
+ * sizes are remembered between calls, and only shards that have been written
+ * to since then (or that have not been sized yet) are sized again. */
+int keydiv_dtable::rebalance()
+{
+	int r = 0;
+	if(!split_size && !split_writes)
+		return 0;
+	if(in_use() || !open_atx_map.empty() || !writable())
+		return 0;
+	for(size_t i = 0; i < sub.size(); i++)
+		if(writes[i] || sizes[i] == KDDTABLE_UNKNOWN_SIZE)
+			sizes[i] = shard_size(i);
+	for(size_t i = 0; i < sub.size(); i++)
+	{
+		bool big = split_size && sizes[i] > split_size;
+		bool hot = split_writes && writes[i] > split_writes;
+		/* the header only has room for 255 dtables */
+		if((big || hot) && sizes[i] > 1 && sub.size() < 255)
+		{
+			r = split(i, sizes[i]);
+			goto done;
+		}
+	}
+	for(size_t i = 1; i < sub.size(); i++)
+	{
+		bool small = sizes[i - 1] + sizes[i] < merge_size;
+		bool cold = !split_writes || writes[i - 1] + writes[i] < split_writes / 4;
+		if(small && cold)
+		{
+			r = merge(i - 1);
+			goto done;
+		}
+	}
+done:
+	for(size_t i = 0; i < writes.size(); i++)
+		writes[i] = 0;
+	return r;
+}
+
+/* copies the keys from source (starting at start, if given) into target */
+static int copy_keys(const dtable * source, dtable * target, const dtype * start, std::vector<dtype> * copied)
+{
+	int r = 0;
+	bool valid;
+	dtable::iter * iter = source->iterator();
+	if(!iter)
+		return -ENOMEM;
+	if(start)
+		iter->seek(*start);
+	for(valid = iter->valid(); valid; valid = iter->next())
+	{
+		dtype key = iter->key();
+		/* there is no need to copy nonexistent values */
+		if(iter->meta().exists())
+		{
+			r = target->insert(key, iter->value());
+			if(r < 0)
+				break;
+		}
+		copied->push_back(key);
+	}
+	delete iter;
+	return r;
+}
+
+/* Splits sub[index] at its median key into two shards. We copy the upper half
+ * into a new dtable, write the new metadata, and only then remove the keys
+ * from the old one; all of this is done in a single transaction. Then we
+ * maintain() both of them to digest the changes into their disk dtables. */
+int keydiv_dtable::split(size_t index, size_t size)
+{
+	int r;
+	bool valid;
+	char name[32];
+	dtable * target;
+	dtable::iter * iter;
+	shard_writer * writer;
+	std::vector<dtype> copied;
+	uint32_t number = dt_next;
+	dtype divider(0u);
+	
+	/* find the median key */
+	iter = sub[index]->iterator();
+	if(!iter)
+		return -ENOMEM;
+	valid = iter->valid();
+	for(size_t i = 0; valid && i < size / 2; i++)
+		valid = iter->next();
+	if(valid)
+		divider = iter->key();
+	delete iter;
+	/* the statistics may have been wrong, so just give up for now */
+	if(!valid || (index && !divider.compare(dividers[index - 1], blob_cmp)))
+		return 0;
+	
+	r = tx_start_r();
+	if(r < 0)
+		return r;
+	sprintf(name, "kdd_data.%u", number);
+	r = base->create(kdd_dfd, name, base_config, ktype);
+	if(r < 0)
+		goto fail_create;
+	target = open_shard(number, shard_journals, &writer);
+	if(!target)
+		goto fail_open;
+	if(blob_cmp)
+	{
+		r = target->set_blob_cmp(blob_cmp);
+		if(r < 0)
+			goto fail_copy;
+	}
+	r = copy_keys(sub[index], target, &divider, &copied);
+	if(r < 0)
+		goto fail_copy;
+	
+	sub.insert(sub.begin() + index + 1, target);
+	numbers.insert(numbers.begin() + index + 1, number);
+	dividers.insert(dividers.begin() + index, divider);
+	writes.insert(writes.begin() + index + 1, 0);
+	writers.insert(writers.begin() + index + 1, writer);
+	sizes.insert(sizes.begin() + index + 1, KDDTABLE_UNKNOWN_SIZE);
+	sizes[index] = KDDTABLE_UNKNOWN_SIZE;
+	header.dt_count++;
+	dt_next++;
+	r = write_meta();
+	if(r < 0)
+		goto fail_meta;
+	
+	for(size_t i = 0; i < copied.size(); i++)
+	{
+		r = sub[index]->remove(copied[i]);
+		if(r < 0)
+			goto fail_remove;
+	}
+	r = sub[index]->maintain(true);
+	if(r >= 0)
+		r = target->maintain(true);
+fail_remove:
+	tx_end_r();
+	return r;
+	
+fail_meta:
+	sub.erase(sub.begin() + index + 1);
+	numbers.erase(numbers.begin() + index + 1);
+	dividers.erase(dividers.begin() + index);
+	writes.erase(writes.begin() + index + 1);
+	writers.erase(writers.begin() + index + 1);
+	sizes.erase(sizes.begin() + index + 1);
+	header.dt_count--;
+	dt_next--;
+fail_copy:
+	target->destroy();
+	writer->journal.deinit(true);
+	delete writer;
+fail_open:
+	tx_unlink(kdd_dfd, name, 1);
+fail_create:
+	tx_end_r();
+	return (r < 0) ? r : -1;
+}
+
+/* Merges sub[index + 1] into sub[index]. We copy its keys over and write the
+ * new metadata in a single transaction, after which the old dtable is deleted
+ * and the merged one is maintain()ed to digest the copied keys. */
+int keydiv_dtable::merge(size_t index)
+{
+	int r;
+	char name[32];
+	std::vector<dtype> copied;
+	dtable * source = sub[index + 1];
+	shard_writer * writer = writers[index + 1];
+	uint32_t number = numbers[index + 1];
+	dtype divider = dividers[index];
+	size_t count = writes[index + 1];
+	
+	r = tx_start_r();
+	if(r < 0)
+		return r;
+	r = copy_keys(source, sub[index], NULL, &copied);
+	if(r < 0)
+		goto fail_copy;
+	
+	sub.erase(sub.begin() + index + 1);
+	numbers.erase(numbers.begin() + index + 1);
+	dividers.erase(dividers.begin() + index);
+	writes.erase(writes.begin() + index + 1);
+	writers.erase(writers.begin() + index + 1);
+	sizes.erase(sizes.begin() + index + 1);
+	sizes[index] = KDDTABLE_UNKNOWN_SIZE;
+	header.dt_count--;
+	r = write_meta();
+	if(r < 0)
+		goto fail_meta;
+	
+	source->destroy();
+	writer->journal.deinit(true);
+	delete writer;
+	sprintf(name, "kdd_data.%u", number);
+	tx_unlink(kdd_dfd, name, 1);
+	r = sub[index]->maintain(true);
+	tx_end_r();
+	return r;
+	
+fail_meta:
+	sub.insert(sub.begin() + index + 1, source);
+	numbers.insert(numbers.begin() + index + 1, number);
+	dividers.insert(dividers.begin() + index, divider);
+	writes.insert(writes.begin() + index + 1, count);
+	writers.insert(writers.begin() + index + 1, writer);
+	sizes.insert(sizes.begin() + index + 1, KDDTABLE_UNKNOWN_SIZE);
+	header.dt_count++;
+fail_copy:
+	/* take back whatever we copied */
+	for(size_t i = 0; i < copied.size(); i++)
+		sub[index]->remove(copied[i]);
+	tx_end_r();
+	return r;
+}
+
+/* gets the file number from a shard's data or journal file name */
+static bool shard_file_number(const char * name, uint32_t * number)
+{
+	char * end;
+	if(!strncmp(name, "kdd_data.", 9))
+		name += 9;
+	else if(!strncmp(name, "kdd_journal.", 12))
+		name += 12;
+	else
+		return false;
+	if(*name < '0' || *name > '9')
+		return false;
+	*number = strtoul(name, &end, 10);
+	return !*end;
+}
+
+/* Removes the files of any shards which the metadata does not name. A split
+ * creates the new shard's dtable before the transaction that writes the new
+ * metadata, so if that transaction never commits, the dtable is left behind,
+ * and it would get in the way of the next split that picks the same number. */
+int keydiv_dtable::remove_stale()
+{
+	int r = 0, copy;
+	DIR * dir;
+	struct dirent * ent;
+	std::vector<istr> stale;
+	copy = dup(kdd_dfd);
+	if(copy < 0)
+		return copy;
+	dir = fdopendir(copy);
+	if(!dir)
+	{
+		close(copy);
+		return -1;
+	}
+	while((ent = readdir(dir)))
+	{
+		uint32_t number;
+		if(!shard_file_number(ent->d_name, &number))
+			continue;
+		if(std::find(numbers.begin(), numbers.end(), number) == numbers.end())
+			stale.push_back(ent->d_name);
+	}
+	closedir(dir);
+	if(stale.empty())
+		return 0;
+	r = tx_start_r();
+	if(r < 0)
+		return r;
+	for(size_t i = 0; i < stale.size(); i++)
+	{
+		r = tx_unlink(kdd_dfd, stale[i], 1);
 		if(r < 0)
 			break;
 	}
+	tx_end_r();
 	return r;
 }
 
+dtable * keydiv_dtable::open_shard(uint32_t number, bool create_journal, shard_writer ** writer)
+{
+	int r;
+	char name[32];
+	dtable * shard;
+	*writer = new shard_writer;
+	sprintf(name, "kdd_journal.%u", number);
+	r = (*writer)->journal.init(kdd_dfd, name, create_journal);
+	/* without a journal of its own, the shard uses the global one */
+	if(r < 0 && (create_journal || r != -ENOENT))
+		goto fail_init;
+	sprintf(name, "kdd_data.%u", number);
+	shard = base->open(kdd_dfd, name, base_config, (*writer)->get_journal(sysj));
+	if(!shard)
+		goto fail_open;
+	/* the shards may then be written from several threads at once, and
+	 * any digests they need are done by maintain() instead */
+	if(shard_journals)
+		shard->defer_maintenance(true);
+	return shard;
+	
+fail_open:
+	(*writer)->journal.deinit();
+fail_init:
+	delete *writer;
+	*writer = NULL;
+	return NULL;
+}
+
 int keydiv_dtable::init(int dfd, const char * name, const params & config, sys_journal * sysj)
 {
 	abortable_tx atx;
-	int r, kdd_dfd, meta;
-	const dtable_factory * base;
-	params base_config;
+	int r = 0;
+	tx_fd meta;
 	if(sub.size() >= 0)
 		deinit();
 	base = dtable_factory::lookup(config, "base");
@@ -400,57 +836,91 @@ int keydiv_dtable::init(int dfd, const char * name, const params & config, sys_j
 		return -EINVAL;
 	if(!config.get("base_config", &base_config, params()))
 		return -EINVAL;
+	if(!config.get("split_size", &r, 0) || r < 0)
+		return -EINVAL;
+	split_size = r;
+	if(!config.get("split_writes", &r, 0) || r < 0)
+		return -EINVAL;
+	split_writes = r;
+	if(!config.get("merge_size", &r, split_size / 4) || r < 0)
+		return -EINVAL;
+	merge_size = r;
+	if(!config.get("shard_journals", &shard_journals, false))
+		return -EINVAL;
+	this->sysj = sysj;
 	kdd_dfd = openat(dfd, name, O_RDONLY);
 	if(kdd_dfd < 0)
 		return kdd_dfd;
-	meta = openat(kdd_dfd, "kdd_meta", O_RDONLY);
-	if(meta < 0)
+	meta = tx_open(kdd_dfd, "kdd_meta", 0);
+	if(!meta)
 		goto fail_meta;
 	
-	if(pread(meta, &header, sizeof(header), 0) != sizeof(header))
-	{
-		close(meta);
-		goto fail_meta;
-	}
-	close(meta);
-	if(header.magic != KDDTABLE_MAGIC || header.version != KDDTABLE_VERSION)
-		goto fail_meta;
+	if(tx_read(meta, &header, sizeof(header), 0) != sizeof(header))
+		goto fail_read;
+	if(header.magic != KDDTABLE_MAGIC || !header.version || header.version > KDDTABLE_VERSION)
+		goto fail_read;
 	if(!header.dt_count)
-		goto fail_meta;
+		goto fail_read;
+	/* version 1 didn't store the dividers; they came from the parameters */
+	r = 0;
 	switch(header.key_type)
 	{
 		case 1:
 			ktype = dtype::UINT32;
-			r = load_dividers<int, uint32_t>(config, header.dt_count, &dividers);
+			if(header.version < 2)
+				r = load_dividers<int, uint32_t>(config, header.dt_count, &dividers);
 			break;
 		case 2:
 			ktype = dtype::DOUBLE;
-			r = load_dividers<float, double>(config, header.dt_count, &dividers);
+			if(header.version < 2)
+				r = load_dividers<float, double>(config, header.dt_count, &dividers);
 			break;
 		case 3:
 			ktype = dtype::STRING;
-			r = load_dividers<istr, istr>(config, header.dt_count, &dividers);
+			if(header.version < 2)
+				r = load_dividers<istr, istr>(config, header.dt_count, &dividers);
 			break;
 		case 4:
 			ktype = dtype::BLOB;
-			r = load_dividers<blob, blob>(config, header.dt_count, &dividers, true);
+			if(header.version < 2)
+				r = load_dividers<blob, blob>(config, header.dt_count, &dividers, true);
+			break;
+		case 5:
+			ktype = dtype::UINT64;
+			if(header.version < 2)
+				r = load_dividers<uint64_t, uint64_t>(config, header.dt_count, &dividers);
 			break;
 		default:
-			goto fail_meta;
+			goto fail_read;
 	}
+	if(header.version < 2)
+	{
+		for(uint32_t i = 0; i < header.dt_count; i++)
+			numbers.push_back(i);
+		dt_next = header.dt_count;
+		/* we'll write version 2 metadata if we ever change it */
+		header.version = KDDTABLE_VERSION;
+	}
+	else
+		r = read_meta(meta, header, ktype, &dt_next, &numbers, &dividers);
 	if(r < 0)
+		goto fail_read;
+	tx_close(meta);
+	
+	if(remove_stale() < 0)
 		goto fail_meta;
 	
 	for(uint32_t i = 0; i < header.dt_count; i++)
 	{
-		char name[32];
-		dtable * source;
-		sprintf(name, "kdd_data.%u", i);
-		source = base->open(kdd_dfd, name, base_config, sysj);
+		shard_writer * writer;
+		dtable * source = open_shard(numbers[i], shard_journals, &writer);
 		if(!source)
 			goto fail_sub;
 		sub.push_back(source);
+		writers.push_back(writer);
 	}
+	writes.resize(sub.size(), 0);
+	sizes.resize(sub.size(), KDDTABLE_UNKNOWN_SIZE);
 	
 	if(sub[0]->get_cmp_name())
 		cmp_name = sub[0]->get_cmp_name();
@@ -464,11 +934,20 @@ int keydiv_dtable::init(int dfd, const char * name, const params & config, sys_j
 	
 fail_sub:
 	for(size_t i = 0; i < sub.size(); i++)
+	{
 		sub[i]->destroy();
-fail_meta:
+		delete writers[i];
+	}
 	sub.clear();
+	writers.clear();
+	goto fail_meta;
+fail_read:
+	tx_close(meta);
+fail_meta:
 	dividers.clear();
+	numbers.clear();
 	close(kdd_dfd);
+	kdd_dfd = -1;
 	return -1;
 }
 
@@ -476,9 +955,20 @@ void keydiv_dtable::deinit()
 {
 	if(!sub.size())
 		return;
+	/* the shards must be closed before their journals */
 	for(size_t i = 0; i < sub.size(); i++)
+	{
 		sub[i]->destroy();
+		delete writers[i];
+	}
 	sub.clear();
+	writers.clear();
+	dividers.clear();
+	numbers.clear();
+	writes.clear();
+	sizes.clear();
+	close(kdd_dfd);
+	kdd_dfd = -1;
 	dtable::deinit();
 }
 
@@ -526,6 +1016,61 @@ int keydiv_dtable::load_dividers(const params & config, size_t dt_count, divider
 	return 0;
 }
 
+int keydiv_dtable::read_meta(tx_fd meta, const kddtable_header & header, dtype::ctype key_type, uint32_t * dt_next, number_list * numbers, divider_list * dividers)
+{
+	size_t size = tx_size(meta);
+	size_t offset = sizeof(header);
+	if(tx_read(meta, dt_next, sizeof(*dt_next), offset) != sizeof(*dt_next))
+		return -EINVAL;
+	offset += sizeof(*dt_next);
+	numbers->resize(header.dt_count);
+	if(tx_read(meta, &(*numbers)[0], header.dt_count * sizeof(uint32_t), offset) != header.dt_count * sizeof(uint32_t))
+		return -EINVAL;
+	offset += header.dt_count * sizeof(uint32_t);
+	dividers->clear();
+	for(size_t i = 1; i < header.dt_count; i++)
+	{
+		uint32_t length;
+		if(tx_read(meta, &length, sizeof(length), offset) != sizeof(length))
+			return -EINVAL;
+		offset += sizeof(length);
+		if(offset + length > size)
+			return -EINVAL;
+		blob_buffer flat(length);
+		flat.set_size(length, false);
+		if(length && tx_read(meta, &flat[0], length, offset) != length)
+			return -EINVAL;
+		offset += length;
+		dividers->push_back(dtype(flat, key_type));
+	}
+	return 0;
+}
+
+int keydiv_dtable::write_meta(int dfd, const kddtable_header & header, uint32_t dt_next, const number_list & numbers, const divider_list & dividers)
+{
+	int r;
+	tx_fd meta;
+	blob_buffer buffer;
+	buffer << header << dt_next;
+	buffer.append(&numbers[0], numbers.size() * sizeof(numbers[0]));
+	for(size_t i = 0; i < dividers.size(); i++)
+	{
+		blob flat = dividers[i].flatten();
+		uint32_t length = flat.size();
+		buffer << length;
+		buffer.append(flat);
+	}
+	meta = tx_open(dfd, "kdd_meta", 1);
+	if(!meta)
+		return -1;
+	/* the metadata can shrink when shards are merged */
+	r = tx_truncate(meta);
+	if(r >= 0)
+		r = tx_write(meta, buffer.data(), buffer.size(), 0);
+	tx_close(meta);
+	return r;
+}
+
 /* The dividers are inclusive up: that is, if we have a keydiv dtable with a
  * single divider X, then sub[0] will contain all keys up to but not including
  * X, and sub[1] will contain X and up. This is mostly an arbitrary choice. */
@@ -556,7 +1101,8 @@ size_t keydiv_dtable::key_index(const T & test) const
 
 int keydiv_dtable::create(int dfd, const char * name, const params & config, dtype::ctype key_type)
 {
-	int r, kdd_dfd, meta;
+	int r, kdd_dfd;
+	number_list numbers;
 	divider_list dividers;
 	const dtable_factory * base;
 	params base_config;
@@ -582,6 +1128,10 @@ int keydiv_dtable::create(int dfd, const char * name, const params & config, dty
 			header.key_type = 4;
 			r = load_dividers<blob, blob>(config, 0, &dividers, true);
 			break;
+		case dtype::UINT64:
+			header.key_type = 5;
+			r = load_dividers<uint64_t, uint64_t>(config, 0, &dividers);
+			break;
 		default:
 			return -EINVAL;
 	}
@@ -613,17 +1163,11 @@ int keydiv_dtable::create(int dfd, const char * name, const params & config, dty
 		r = base->create(kdd_dfd, name, base_config, key_type);
 		if(r < 0)
 			goto fail;
+		numbers.push_back(i);
 	}
 	
-	meta = openat(kdd_dfd, "kdd_meta", O_WRONLY | O_CREAT, 0644);
-	if(meta < 0)
-	{
-		r = meta;
-		goto fail;
-	}
-	r = pwrite(meta, &header, sizeof(header), 0);
-	close(meta);
-	if(r != sizeof(header))
+	r = write_meta(kdd_dfd, header, header.dt_count, numbers, dividers);
+	if(r < 0)
 		goto fail;
 	close(kdd_dfd);
 	return 0;
@@ -17,14 +17,34 @@
 #include <vector>
 #include <ext/hash_map>
 
+#include "locking.h"
+#include "transaction.h"
+#include "local_journal.h"
 #include "dtable_factory.h"
 
 /* A keydiv dtable splits the keyspace among several underlying dtables. This
  * allows them to be maintained separately, although currently the maintain()
  * method for keydiv dtable just calls maintain() on all of them together. */
+/* The initial dividers are given to create() as parameters ("uint64" ones for
+ * 64-bit keys), but after that they are stored in the metadata file. If the "split_size" or "split_writes"
+ * parameters are given to init(), maintain() will also split shards that have
+ * grown too large or received too many writes since the last maintenance, and
+ * merge adjacent shards whose total size is less than "merge_size". */
+/* When the "shard_journals" parameter is given to init(), each shard gets its
+ * own system journal (and so its own background writer) in the keydiv
+ * directory, and writes to different shards may be made concurrently from
+ * several threads, although maintain(), create_tx(), and iterator() must not
+ * be. The shards then leave their digests to maintain(), so that they never
+ * happen on the writers' threads. Without it, the shards share the system
+ * journal, and a write made while another is in progress fails with -EBUSY.
+ * Abortable transactions still commit atomically across shards, since all the
+ * journals are flushed as part of the same underlying transaction. */
 
 #define KDDTABLE_MAGIC 0x11720081
-#define KDDTABLE_VERSION 1
+#define KDDTABLE_VERSION 2
+
+/* the size of a shard which has not been sized since it was opened or changed */
+#define KDDTABLE_UNKNOWN_SIZE ((size_t) -1)
 
 class keydiv_dtable : public dtable
 {
@@ -32,6 +52,8 @@ public:
 	virtual iter * iterator(ATX_OPT) const;
 	virtual bool present(const dtype & key, bool * found, ATX_OPT) const;
 	virtual blob lookup(const dtype & key, bool * found, ATX_OPT) const;
+	/* like overlay_dtable, skips shards which don't keep statistics */
+	virtual int get_stats(dtable_stats * stats) const;
 	
 	inline virtual bool writable() const { return sub[0]->writable(); }
 	
@@ -52,7 +74,7 @@ public:
 	static int create(int dfd, const char * name, const params & config, dtype::ctype key_type);
 	DECLARE_RW_FACTORY(keydiv_dtable);
 	
-	inline keydiv_dtable() : support_atx(false) {}
+	inline keydiv_dtable() : kdd_dfd(-1), base(NULL), sysj(NULL), shard_journals(false), support_atx(false) {}
 	int init(int dfd, const char * name, const params & config, sys_journal * sysj);
 	
 protected:
@@ -70,6 +92,8 @@ private:
 		uint16_t version;
 		uint8_t key_type;
 		uint8_t dt_count;
+		/* version 2: followed by the next dtable number, the dtable
+		 * numbers, and the dividers (each a length and a flat key) */
 	} __attribute__((packed));
 	
 	class iter : public iter_source<keydiv_dtable>
@@ -90,6 +114,13 @@ private:
 		virtual ~iter();
 		
 	private:
+		/* whether the key of subs[index] is outside its range */
+		bool below(size_t index) const;
+		bool above(size_t index) const;
+		/* like first() and last(), but staying within the range */
+		bool sub_first(size_t index);
+		bool sub_last(size_t index);
+		
 		struct sub
 		{
 			dtable::iter * iter;
@@ -118,12 +149,45 @@ private:
 	};
 	int map_atx(abortable_tx * atx, size_t index) const;
 	
+	struct shard_writer
+	{
+		init_mutex lock;
+		/* not open if the shard uses the global journal */
+		local_journal journal;
+		inline sys_journal * get_journal(sys_journal * global)
+		{
+			return journal.is_open() ? journal.journal() : global;
+		}
+	};
+	/* removes the files of shards left behind by an unfinished split */
+	int remove_stale();
+	/* locks a shard for writing, or fails if that is not safe (see above) */
+	int lock_shard(size_t index);
+	void unlock_shard(size_t index);
+	/* opens a shard dtable and its writer, creating its journal if asked */
+	dtable * open_shard(uint32_t number, bool create_journal, shard_writer ** writer);
+	
 	typedef std::vector<dtable *> dtable_list;
 	typedef std::vector<dtype> divider_list;
+	typedef std::vector<uint32_t> number_list;
+	typedef std::vector<shard_writer *> writer_list;
 	typedef __gnu_cxx::hash_map<abortable_tx, atx_state> atx_map;
 	
 	template<class T, class C>
 	static int load_dividers(const params & config, size_t dt_count, divider_list * list, bool skip_check = false);
+	static int read_meta(tx_fd meta, const kddtable_header & header, dtype::ctype key_type, uint32_t * dt_next, number_list * numbers, divider_list * dividers);
+	static int write_meta(int dfd, const kddtable_header & header, uint32_t dt_next, const number_list & numbers, const divider_list & dividers);
+	inline int write_meta() const
+	{
+		return write_meta(kdd_dfd, header, dt_next, numbers, dividers);
+	}
+	
+	/* the number of keys in a shard, from its statistics if it has them */
+	size_t shard_size(size_t index) const;
+	/* split or merge shards as necessary (see above) */
+	int rebalance();
+	int split(size_t index, size_t size);
+	int merge(size_t index);
 	
 	/* return index into sub array */
 	inline size_t key_index(const dtype & key) const
@@ -135,9 +199,29 @@ private:
 	
 	kddtable_header header;
 	
+	int kdd_dfd;
+	const dtable_factory * base;
+	params base_config;
+	sys_journal * sysj;
+	
 	dtable_list sub;
 	divider_list dividers;
+	/* the file numbers of the sub dtables, and the next one to use */
+	number_list numbers;
+	uint32_t dt_next;
+	/* the number of writes to each shard since the last maintenance */
+	std::vector<size_t> writes;
+	/* the shards' sizes as of the last maintenance, if known */
+	std::vector<size_t> sizes;
+	size_t split_size, split_writes, merge_size;
+	/* parallel to sub; the shards' locks and journals */
+	writer_list writers;
+	bool shard_journals;
+	/* without shard journals, only one write may be in progress at once */
+	init_mutex write_lock;
 	atx_map open_atx_map;
+	/* protects creating the shards' abortable transactions */
+	mutable init_mutex atx_lock;
 	bool support_atx;
 };
 
@@ -0,0 +1,52 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#define _ATFILE_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "openat.h"
+#include "transaction.h"
+#include "local_journal.h"
+
+int local_journal::init(int dfd, const char * file, bool create, bool filter_on_empty)
+{
+	int r;
+	if(open)
+		deinit();
+	if(!create)
+	{
+		/* tx_open() creates missing files, so check first */
+		int fd = openat(dfd, file, O_RDONLY);
+		if(fd < 0)
+			return (errno == ENOENT) ? -ENOENT : fd;
+		close(fd);
+	}
+	r = tx_start_r();
+	if(r < 0)
+		return r;
+	r = sysj.init(dfd, file, &warehouse, &temp_warehouse, create, filter_on_empty);
+	if(r < 0)
+	{
+		tx_end_r();
+		return r;
+	}
+	open = true;
+	/* remove any entries discarded before we were last closed */
+	r = sysj.filter();
+	if(r < 0)
+		deinit();
+	tx_end_r();
+	return r;
+}
+
+void local_journal::deinit(bool erase)
+{
+	if(!open)
+		return;
+	sysj.deinit(erase);
+	open = false;
+}
@@ -0,0 +1,52 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#ifndef __LOCAL_JOURNAL_H
+#define __LOCAL_JOURNAL_H
+
+#ifndef __cplusplus
+#error local_journal.h is a C++ header file
+#endif
+
+#include "sys_journal.h"
+#include "journal_dtable.h"
+#include "temp_journal_dtable.h"
+
+/* A local journal is a sys_journal with its own warehouses, for dtables (or
+ * groups of them) that should not share the global system journal. Filtering
+ * it then only rewrites the records of the dtables that use it. Since it uses
+ * the transaction library just like the global journal, changes to several
+ * journals made in the same transaction are still committed atomically. */
+
+class local_journal
+{
+public:
+	/* like sys_journal::init(), but using our own warehouses; returns
+	 * -ENOENT if the journal does not exist and create is false */
+	int init(int dfd, const char * file, bool create = false, bool filter_on_empty = true);
+	/* erase = true will tx_unlink() the journal */
+	void deinit(bool erase = false);
+	
+	inline bool is_open() const { return open; }
+	inline sys_journal * journal() { return &sysj; }
+	
+	inline local_journal() : open(false) {}
+	inline ~local_journal()
+	{
+		if(open)
+			deinit();
+	}
+	
+private:
+	/* the warehouses must outlive the journal */
+	journal_dtable::journal_dtable_warehouse warehouse;
+	temp_journal_dtable::temp_journal_dtable_warehouse temp_warehouse;
+	sys_journal sysj;
+	bool open;
+	
+	void operator=(const local_journal &);
+	local_journal(const local_journal &);
+};
+
+#endif /* __LOCAL_JOURNAL_H */
@@ -39,6 +39,18 @@ public:
 #endif
 	}
 	
+	/* returns false if the mutex is already locked */
+	inline bool trylock()
+	{
+		if(pthread_mutex_trylock(&mutex))
+			return false;
+#if LOCK_DEBUG
+		holder = pthread_self();
+		locked = true;
+#endif
+		return true;
+	}
+	
 	inline void unlock()
 	{
 #if LOCK_DEBUG
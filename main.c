@@ -139,7 +139,7 @@ static int command_drop(int argc, const char * argv[])
 		else if(open_gtable)
 		{
 			t_row_id id;
-			if(sscanf(argv[2], ROW_FORMAT, &id) != 1)
+			if(sscanf(argv[2], ROW_SCAN_FORMAT, &id) != 1)
 				r = -EINVAL;
 			else
 			{
@@ -223,7 +223,7 @@ static int command_open(int argc, const char * argv[])
 		else
 		{
 			t_row_id id;
-			if(sscanf(argv[2], ROW_FORMAT, &id) != 1)
+			if(sscanf(argv[2], ROW_SCAN_FORMAT, &id) != 1)
 				r = -EINVAL;
 			else
 			{
@@ -281,7 +281,7 @@ static void print_value(t_type type, const t_value * value)
 	switch(type)
 	{
 		case T_INT:
-			printf("%u\n", value->v_int);
+			printf("%" PRIu64 "\n", value->v_int);
 			break;
 		case T_FLOAT:
 			printf("%lg\n", value->v_float);
@@ -386,7 +386,7 @@ static t_value * parse_value(t_type type, const char * string, t_value * value)
 	switch(type)
 	{
 		case T_INT:
-			value->v_int = strtoll(string, &end, 0);
+			value->v_int = strtoull(string, &end, 0);
 			if(end && *end)
 				return NULL;
 			return value;
@@ -627,19 +627,36 @@ struct {
 	{"bfdtable", "Test bloom filter dtable functionality.", command_bfdtable},
 	{"oracle", "Test performance impact of nonexistent values.", command_oracle},
 	{"sidtable", "Test smallint dtable functionality.", command_sidtable},
+	{"zdtable", "Test zone dtable functionality.", command_zdtable},
+	{"rofile", "Test the shared rofile page pool.", command_rofile},
+	{"rwfile", "Test rwfile direct writes.", command_rwfile},
+	{"iolimit", "Test the I/O limiter.", command_iolimit},
 	{"didtable", "Test deltaint dtable functionality.", command_didtable},
 	{"kddtable", "Test keydiv dtable functionality.", command_kddtable},
 	{"udtable", "Test unique value dtable functionality.", command_udtable},
 	{"ctable", "Test ctable functionality.", command_ctable},
+	{"delta", "Test index_blob deltas in managed dtables.", command_delta},
 	{"cctable", "Test column ctable functionality.", command_cctable},
+	{"gctable", "Test group ctable functionality.", command_gctable},
 	{"consistency", "Test Anvil consistency model.", command_consistency},
 	{"durability", "Test Anvil durability model.", command_durability},
+	{"concurrent", "Test concurrent metafile transactions.", command_concurrent},
+	{"budget", "Test the journal dtable memory budget.", command_budget},
 	{"rollover", "Test system journal rollover.", command_rollover},
 	{"abort", "Test abortable dtable transactions.", command_abort},
 	{"rwatx", "Test read-write abortable transactions.", command_rwatx},
 	{"stable", "Test stable functionality.", command_stable},
+	{"stindex", "Test simple_stable column indices.", command_stindex},
+	{"stplan", "Test simple_stable query plans and column iterators.", command_stplan},
+	{"rowbitmap", "Test row_bitmap containers.", command_rowbitmap},
+	{"toilet64", "Test 64-bit toilet row IDs.", command_toilet64},
+	{"dtstats", "Test dtable statistics.", command_dtstats},
+	{"bloom", "Test bloom filter sizing and tracking.", command_bloom},
+	{"mdjournal", "Test managed dtables with their own journals.", command_mdjournal},
+	{"journal", "Test journal record checksums.", command_journal},
 	{"iterator", "Test iterator functionality.", command_iterator},
 	{"blob_cmp", "Test blob_cmp functionality.", command_blob_cmp},
+	{"merger", "Test blob_merger functionality.", command_merger},
 	{"performance", "Test performance.", command_performance},
 	{"tpchtype", "Set TPCH-H table type: row, column.", command_tpchtype},
 	{"tpchgen", "Generate a TPC-H-like dataset.", command_tpchgen},
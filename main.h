@@ -53,18 +53,35 @@ int command_edtable(int argc, const char * argv[]);
 int command_exdtable(int argc, const char * argv[]);
 int command_ussdtable(int argc, const char * argv[]);
 int command_sidtable(int argc, const char * argv[]);
+int command_zdtable(int argc, const char * argv[]);
+int command_rofile(int argc, const char * argv[]);
+int command_rwfile(int argc, const char * argv[]);
+int command_iolimit(int argc, const char * argv[]);
 int command_didtable(int argc, const char * argv[]);
 int command_kddtable(int argc, const char * argv[]);
 int command_udtable(int argc, const char * argv[]);
 int command_ctable(int argc, const char * argv[]);
+int command_delta(int argc, const char * argv[]);
 int command_cctable(int argc, const char * argv[]);
+int command_gctable(int argc, const char * argv[]);
 int command_consistency(int argc, const char * argv[]);
 int command_durability(int argc, const char * argv[]);
+int command_concurrent(int argc, const char * argv[]);
+int command_budget(int argc, const char * argv[]);
 int command_rollover(int argc, const char * argv[]);
 int command_abort(int argc, const char * argv[]);
 int command_rwatx(int argc, const char * argv[]);
 int command_stable(int argc, const char * argv[]);
+int command_stindex(int argc, const char * argv[]);
+int command_stplan(int argc, const char * argv[]);
+int command_rowbitmap(int argc, const char * argv[]);
+int command_toilet64(int argc, const char * argv[]);
+int command_dtstats(int argc, const char * argv[]);
+int command_bloom(int argc, const char * argv[]);
+int command_mdjournal(int argc, const char * argv[]);
+int command_journal(int argc, const char * argv[]);
 int command_iterator(int argc, const char * argv[]);
+int command_merger(int argc, const char * argv[]);
 
 /* in main_util.cpp */
 int drop_cache(const char * path);
@@ -4,21 +4,40 @@
 
 #define _ATFILE_SOURCE
 
+#include <poll.h>
 #include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <vector>
+#include <algorithm>
+#include <iterator>
 
 #include "main.h"
+#include "anvil.h"
 #include "openat.h"
 #include "transaction.h"
+#include "toilet.h"
 
 #include "util.h"
+#include "rofile.h"
+#include "rwfile.h"
+#include "row_bitmap.h"
+#include "io_limiter.h"
+#include "journal.h"
 #include "sys_journal.h"
 #include "journal_dtable.h"
 #include "simple_dtable.h"
 #include "managed_dtable.h"
 #include "usstate_dtable.h"
 #include "memory_dtable.h"
+#include "zone_dtable.h"
+#include "stats_dtable.h"
+#include "bloom_dtable.h"
 #include "simple_stable.h"
 #include "reverse_blob_comparator.h"
+#include "counter_merger.h"
+#include "index_blob.h"
 
 int command_info(int argc, const char * argv[])
 {
@@ -33,7 +52,15 @@ int command_dtable(int argc, const char * argv[])
 	sys_journal * sysj = sys_journal::get_global_journal();
 	const char * path;
 	params config;
+	bool own_journal = false;
 	
+	if(argc > 1 && !strcmp(argv[1], "-j"))
+	{
+		own_journal = true;
+		config.set("own_journal", true);
+		argc--;
+		argv++;
+	}
 	if(argc > 1)
 		path = argv[1];
 	else
@@ -119,6 +146,14 @@ int command_dtable(int argc, const char * argv[])
 	run_iterator(mdt);
 	mdt->destroy();
 	
+	if(own_journal)
+	{
+		char name[256];
+		struct stat st;
+		snprintf(name, sizeof(name), "%s/md_journal", path);
+		EXPECT_NOFAIL("stat(md_journal)", stat(name, &st));
+	}
+	
 	return 0;
 }
 
@@ -430,6 +465,427 @@ int command_sidtable(int argc, const char * argv[])
 	return 0;
 }
 
+/* skips zones from the start of the table, returning the key it stops at */
+static uint32_t zone_skip(dtable::iter * iter, const zone_test & test)
+{
+	iter->first();
+	if(!iter->skip_zones(test))
+		return (uint32_t) -1;
+	return iter->key().u32;
+}
+
+int command_zdtable(int argc, const char * argv[])
+{
+	int r;
+	params config, zone_config;
+	dtable * table;
+	dtable::iter * iter;
+	managed_dtable * mdt;
+	memory_dtable source;
+	sys_journal * sysj = sys_journal::get_global_journal();
+	const dtable_factory * base = dtable_factory::lookup("zone_dtable");
+	zone_dtable::range_test<uint32_t> test(550, 560);
+	
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) simple_dtable
+		"zone_size" int 100
+		"value_type" string "uint32"
+	]), &zone_config);
+	EXPECT_NOFAIL("params::parse", r);
+	
+	/* the values increase with the keys, so only one zone has 550-560 */
+	source.init(dtype::UINT32, true);
+	for(uint32_t i = 0; i < 1000; i++)
+		source.insert(i, blob(sizeof(i), &i));
+	r = base->create(AT_FDCWD, "zdt_test", zone_config, &source);
+	EXPECT_NOFAIL("zdt::create", r);
+	table = base->open(AT_FDCWD, "zdt_test", zone_config, sysj);
+	EXPECT_NONULL("zdt::open", table);
+	iter = table->iterator();
+	EXPECT_SIZET("skip_zones", 500, zone_skip(iter, test));
+	/* the current zone might match, so it should not move */
+	iter->seek(520u);
+	iter->skip_zones(test);
+	EXPECT_SIZET("skip_zones", 520, iter->key().u32);
+	iter->seek(600u);
+	if(iter->skip_zones(test) || iter->valid())
+		EXPECT_NEVER("skip_zones did not reach the end");
+	delete iter;
+	table->destroy();
+	
+	/* wrappers pass it through */
+	config.set_class("base", zone_dtable);
+	config.set("base_config", zone_config);
+	base = dtable_factory::lookup("btree_dtable");
+	r = base->create(AT_FDCWD, "zdt_btree", config, &source);
+	EXPECT_NOFAIL("btree::create", r);
+	table = base->open(AT_FDCWD, "zdt_btree", config, sysj);
+	EXPECT_NONULL("btree::open", table);
+	iter = table->iterator();
+	EXPECT_SIZET("skip_zones", 500, zone_skip(iter, test));
+	delete iter;
+	table->destroy();
+	
+	/* and so do managed dtables, as far as their journals allow */
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = managed_dtable::create(AT_FDCWD, "zdt_managed", config, dtype::UINT32);
+	EXPECT_NOFAIL("managed_dtable::create", r);
+	mdt = new managed_dtable;
+	r = mdt->init(AT_FDCWD, "zdt_managed", config, sysj);
+	EXPECT_NOFAIL("mdt->init", r);
+	for(uint32_t i = 0; i < 1000; i++)
+	{
+		r = mdt->insert(i, blob(sizeof(i), &i));
+		if(r < 0)
+			break;
+	}
+	EXPECT_NOFAIL("mdt->insert", r);
+	r = mdt->digest();
+	EXPECT_NOFAIL("mdt->digest", r);
+	iter = mdt->iterator();
+	EXPECT_SIZET("skip_zones", 500, zone_skip(iter, test));
+	delete iter;
+	/* the journal has no summaries, so its keys can't be skipped */
+	r = mdt->insert(50u, blob(sizeof(r), &r));
+	EXPECT_NOFAIL("mdt->insert", r);
+	iter = mdt->iterator();
+	EXPECT_SIZET("skip_zones", 50, zone_skip(iter, test));
+	iter->next();
+	iter->skip_zones(test);
+	EXPECT_SIZET("skip_zones", 500, iter->key().u32);
+	delete iter;
+	mdt->destroy();
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	return 0;
+}
+
+#define ROFILE_TEST_PAGES 64
+
+/* checks the pattern written by command_rofile() */
+static bool rofile_check(const rofile * file, off_t offset, size_t count)
+{
+	uint32_t data[count];
+	if(file->read(offset * sizeof(uint32_t), data, sizeof(data)) != (ssize_t) sizeof(data))
+		return false;
+	for(size_t i = 0; i < count; i++)
+		if(data[i] != offset + i)
+			return false;
+	return true;
+}
+
+/* empties the pool, waiting for any prefetches to finish first */
+static void rofile_reset(size_t budget)
+{
+	rofile_pool::set_budget(0);
+	for(int i = 0; i < 100 && rofile_pool::get_used(); i++)
+	{
+		usleep(10000);
+		rofile_pool::set_budget(0);
+	}
+	EXPECT_SIZET("used", 0, rofile_pool::get_used());
+	rofile_pool::set_budget(budget);
+}
+
+int command_rofile(int argc, const char * argv[])
+{
+	int r;
+	rofile * file;
+	size_t hits, peak = 0;
+	uint32_t data[ROFILE_TEST_PAGES * 1024];
+	int fd = open("rofile_test", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	EXPECT_NOFAIL("open", fd);
+	for(uint32_t i = 0; i < ROFILE_TEST_PAGES * 1024; i++)
+		data[i] = i;
+	r = write(fd, data, sizeof(data));
+	EXPECT_SIZET("write", sizeof(data), r);
+	close(fd);
+	
+	/* 16 of the 4K pages, with 4 of them in the FIFO queue */
+	rofile_pool::set_budget(65536);
+	file = rofile::open<4, 2>(AT_FDCWD, "rofile_test");
+	EXPECT_NONULL("rofile::open", file);
+	/* unaligned reads which span pages */
+	for(off_t i = 0; i + 250 <= ROFILE_TEST_PAGES * 1024; i += 250)
+	{
+		if(!rofile_check(file, i, 250))
+		{
+			EXPECT_NEVER("bad data at %zu", (size_t) i);
+			break;
+		}
+		if(rofile_pool::get_used() > peak)
+			peak = rofile_pool::get_used();
+	}
+	printf("peak usage %zu\n", peak);
+	if(peak > 65536)
+		EXPECT_NEVER("budget exceeded");
+	for(int i = 0; i < 1000; i++)
+	{
+		off_t offset = rand() % (ROFILE_TEST_PAGES * 1024 - 100);
+		if(!rofile_check(file, offset, 100))
+		{
+			EXPECT_NEVER("bad data at %zu", (size_t) offset);
+			break;
+		}
+	}
+	
+	/* a page read twice in a row is a hit the second time */
+	rofile_check(file, 0, 1);
+	hits = file->pool_stats().hits;
+	rofile_check(file, 0, 1);
+	EXPECT_SIZET("hits", hits + 1, file->pool_stats().hits);
+	
+	/* a sequential run should prefetch the pages after it; reads of pages
+	 * still being loaded wait for them, and count as hits */
+	rofile_reset(65536);
+	for(off_t i = 40; i < 43; i++)
+		rofile_check(file, i * 1024, 1);
+	hits = file->pool_stats().hits;
+	for(off_t i = 43; i < 51; i++)
+		rofile_check(file, i * 1024, 1);
+	EXPECT_SIZET("prefetch hits", hits + 8, file->pool_stats().hits);
+	
+	
+	/* start over, then read page 0 again after it leaves the FIFO */
+	rofile_reset(65536);
+	rofile_check(file, 0, 1);
+	/* push it out of the pool but not out of a1out, skipping pages to avoid
+	 * readahead so that exactly 17 pages are read */
+	for(off_t i = 2; i < 36; i += 2)
+		rofile_check(file, i * 1024, 1);
+	rofile_check(file, 0, 1);
+	/* a scan of new pages should not evict it now */
+	for(off_t i = 32; i < ROFILE_TEST_PAGES; i++)
+		rofile_check(file, i * 1024, 1);
+	hits = file->pool_stats().hits;
+	rofile_check(file, 0, 1);
+	EXPECT_SIZET("hits", hits + 1, file->pool_stats().hits);
+	printf("%zu hits, %zu misses\n", file->pool_stats().hits, file->pool_stats().misses);
+	printf("%zu hits, %zu misses\n", file->pool_stats().hits, file->pool_stats().misses);
+	
+	/* closing the file should drop all its pages, once any reads finish */
+	delete file;
+	for(int i = 0; i < 100 && rofile_pool::get_used(); i++)
+		usleep(10000);
+	EXPECT_SIZET("used", 0, rofile_pool::get_used());
+	rofile_pool::set_budget(0);
+	unlink("rofile_test");
+	return 0;
+}
+
+/* the byte at the given offset in command_rwfile()'s files */
+static inline uint8_t rwfile_byte(off_t offset)
+{
+	return offset * 7 + offset / 251;
+}
+
+/* appends count bytes of the pattern in pieces of the given size */
+static bool rwfile_fill(rwfile * file, size_t count, size_t piece)
+{
+	uint8_t data[piece];
+	while(count)
+	{
+		off_t offset = file->end();
+		size_t size = (count < piece) ? count : piece;
+		for(size_t i = 0; i < size; i++)
+			data[i] = rwfile_byte(offset + i);
+		if(file->append(data, size) != (ssize_t) size)
+			return false;
+		count -= size;
+	}
+	return true;
+}
+
+/* reads the file back without the page cache's help from rwfile */
+static bool rwfile_verify(const char * name, off_t size)
+{
+	uint8_t data[4000];
+	off_t offset = 0, end;
+	bool ok = true;
+	int fd = open(name, O_RDONLY);
+	if(fd < 0)
+		return false;
+	end = lseek(fd, 0, SEEK_END);
+	if(end != size)
+	{
+		printf("size %zu, expected %zu\n", (size_t) end, (size_t) size);
+		ok = false;
+	}
+	while(ok && offset < size)
+	{
+		ssize_t r = pread(fd, data, sizeof(data), offset);
+		if(r <= 0)
+			ok = false;
+		for(ssize_t i = 0; ok && i < r; i++)
+			if(data[i] != rwfile_byte(offset + i))
+			{
+				printf("bad data at %zu\n", (size_t) (offset + i));
+				ok = false;
+			}
+		offset += r;
+	}
+	close(fd);
+	return ok;
+}
+
+int command_rwfile(int argc, const char * argv[])
+{
+	int r;
+	/* more than two direct buffers, with an unaligned tail */
+	const size_t total = 3 * RWFILE_DIRECT_BUFFER * 1024 + 1234;
+	rwfile file;
+	{
+		rwfile::direct_scope scope;
+		r = file.create(AT_FDCWD, "rwfile_test");
+		EXPECT_NOFAIL("create", r);
+	}
+	if(!file.get_direct())
+		printf("O_DIRECT is not supported here; testing normal mode instead\n");
+	/* pieces which do not divide the block size */
+	if(!rwfile_fill(&file, total / 2, 1000))
+		EXPECT_NEVER("append failed");
+	/* this writes a padded partial block, which later writes must replace */
+	r = file.flush();
+	EXPECT_NOFAIL("flush", r);
+	if(!rwfile_fill(&file, total - total / 2, 3333))
+		EXPECT_NEVER("append failed");
+	EXPECT_SIZET("end", total, file.end());
+	r = file.close();
+	EXPECT_NOFAIL("close", r);
+	if(!rwfile_verify("rwfile_test", total))
+		EXPECT_NEVER("bad direct file");
+	
+	/* a file smaller than one block, then read back through the rwfile */
+	{
+		rwfile::direct_scope scope;
+		r = file.create(AT_FDCWD, "rwfile_test");
+		EXPECT_NOFAIL("create", r);
+	}
+	if(!rwfile_fill(&file, 100, 100))
+		EXPECT_NEVER("append failed");
+	uint8_t data[50];
+	r = file.read(25, data, sizeof(data));
+	EXPECT_SIZET("read", sizeof(data), r);
+	for(size_t i = 0; i < sizeof(data); i++)
+		if(data[i] != rwfile_byte(25 + i))
+		{
+			EXPECT_NEVER("bad data at %zu", 25 + i);
+			break;
+		}
+	/* the read switched it back to normal mode */
+	EXPECT_SIZET("direct", 0, file.get_direct());
+	if(!rwfile_fill(&file, 3000, 700))
+		EXPECT_NEVER("append failed");
+	r = file.close();
+	EXPECT_NOFAIL("close", r);
+	if(!rwfile_verify("rwfile_test", 3100))
+		EXPECT_NEVER("bad mixed file");
+	unlink("rwfile_test");
+	return 0;
+}
+
+/* reports slow lookups for a little more than two adaptation periods */
+static void * iolimit_observer(void * arg)
+{
+	uint64_t end = io_limiter::now() + 2 * IO_LIMITER_PERIOD + 50000;
+	while(io_limiter::now() < end)
+	{
+		io_limiter::observe(io_limiter::now() - 1000);
+		usleep(100);
+	}
+	return NULL;
+}
+
+/* charges the given amount in 64K pieces, returning the time it took */
+static uint64_t iolimit_charge(size_t total)
+{
+	uint64_t start = io_limiter::now();
+	for(size_t i = 0; i < total; i += 65536)
+		io_limiter::charge(65536);
+	return io_limiter::now() - start;
+}
+
+int command_iolimit(int argc, const char * argv[])
+{
+	int r;
+	params config;
+	uint64_t time;
+	size_t rate;
+	
+	/* 1 MiB/s, configured the way applications do it */
+	r = params::parse(LITERAL(
+	config [
+		"io_limit" config [
+			"rate" int 1024
+			"min_rate" int 128
+		]
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	r = anvil_configure(anvil_params_union_const(&config));
+	EXPECT_NOFAIL("anvil_configure", r);
+	EXPECT_SIZET("rate", 1048576, io_limiter::get_rate());
+	EXPECT_SIZET("adaptive", 0, io_limiter::adaptive());
+	
+	/* only I/O inside a scope is limited */
+	time = iolimit_charge(524288);
+	printf("unlimited: %u ms\n", (unsigned int) (time / 1000));
+	if(time > 100000)
+		EXPECT_NEVER("unlimited I/O was delayed");
+	{
+		io_limiter::scope limit;
+		time = iolimit_charge(524288);
+	}
+	/* the bucket starts empty, so this should take half a second */
+	printf("limited: %u ms\n", (unsigned int) (time / 1000));
+	if(time < 400000 || time > 1000000)
+		EXPECT_NEVER("limited I/O took %u ms", (unsigned int) (time / 1000));
+	
+	/* with a latency target, slow lookups halve the rate */
+	r = params::parse(LITERAL(
+	config [
+		"rate" int 1024
+		"min_rate" int 128
+		"latency" int 100
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	r = io_limiter::configure(config);
+	EXPECT_NOFAIL("configure", r);
+	EXPECT_SIZET("adaptive", 1, io_limiter::adaptive());
+	io_limiter::observe(io_limiter::now() - 1000);
+	usleep(IO_LIMITER_PERIOD + 10000);
+	io_limiter::observe(io_limiter::now() - 1000);
+	EXPECT_SIZET("rate", 524288, io_limiter::get_rate());
+	/* and fast ones let it grow back, one step per period */
+	usleep(IO_LIMITER_PERIOD + 10000);
+	io_limiter::observe(io_limiter::now());
+	rate = 524288 + (1048576 - 131072) / IO_LIMITER_STEPS + 1;
+	EXPECT_SIZET("rate", rate, io_limiter::get_rate());
+	
+	/* observations from several threads at once */
+	io_limiter::configure(config);
+	{
+		const int threads = 4;
+		pthread_t thread[threads];
+		for(int i = 0; i < threads; i++)
+			pthread_create(&thread[i], NULL, iolimit_observer, NULL);
+		for(int i = 0; i < threads; i++)
+			pthread_join(thread[i], NULL);
+	}
+	rate = io_limiter::get_rate();
+	printf("rate after concurrent observations: %zu\n", rate);
+	if(rate < 131072 || rate > 1048576)
+		EXPECT_NEVER("rate out of range");
+	
+	/* turn it back off */
+	r = io_limiter::configure(params());
+	EXPECT_NOFAIL("configure", r);
+	EXPECT_SIZET("adaptive", 0, io_limiter::adaptive());
+	return 0;
+}
+
 int command_didtable(int argc, const char * argv[])
 {
 	int r;
@@ -810,98 +1266,320 @@ static void iterator_test(const istr & type, const char * name, const params & c
 	dt->destroy();
 }
 
-int command_kddtable(int argc, const char * argv[])
+/* checks that the keys (and values) are exactly those in [low, high) */
+static void kddtable_check(const dtable * dt, uint32_t low, uint32_t high)
 {
-	int r;
-	size_t count = 0;
-	bool verbose = false;
-	params config;
-	
-	if(argc > 1 && !strcmp(argv[1], "perf"))
-		return kddtable_perf();
-	
-	if(argc > 1 && !strcmp(argv[1], "-v"))
+	bool valid;
+	uint32_t expect = low;
+	dtable::iter * iter = dt->iterator();
+	for(valid = iter->valid(); valid; valid = iter->next())
 	{
-		verbose = true;
-		argc--;
-		argv++;
+		dtype key = iter->key();
+		/* removed keys may still be there as nonexistent values */
+		if(!iter->meta().exists())
+			continue;
+		if(key.u32 != expect || iter->value().index<uint32_t>(0) != expect)
+		{
+			EXPECT_NEVER("bad key %u (expected %u)", key.u32, expect);
+			break;
+		}
+		expect++;
 	}
-	if(argc > 1)
-		count = atoi(argv[1]);
-	if(!count)
-		count = 2000000;
+	delete iter;
+	EXPECT_SIZET("keys", high - low, expect - low);
+}
+
+static int kddtable_split(void)
+{
+	int r;
+	dtable * dt;
+	params config;
+	struct stat st;
+	sys_journal * sysj = sys_journal::get_global_journal();
 	
 	r = params::parse(LITERAL(
 	config [
 		"base" class(dt) managed_dtable
 		"base_config" config [
 			"base" class(dt) simple_dtable
-			"digest_interval" int 2
 		]
-		"divider_0" int 8
-		"divider_1" int 11
-		"divider_2" int 12
-		"divider_3" int 15
+		"divider_0" int 1000000
+		"split_size" int 1000
 	]), &config);
 	EXPECT_NOFAIL("params::parse", r);
-	config.print();
-	printf("\n");
 	
-	iterator_test("keydiv_dtable", "kddt_test", config, count, verbose);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = dtable_factory::setup("keydiv_dtable", AT_FDCWD, "kddt_split", config, dtype::UINT32);
+	EXPECT_NOFAIL("dtable::create", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	dt = dtable_factory::load("keydiv_dtable", AT_FDCWD, "kddt_split", config, sysj);
+	EXPECT_NONULL("dtable_factory::load", dt);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	for(uint32_t i = 0; i < 4000; i++)
+	{
+		r = dt->insert(i, blob(sizeof(i), &i));
+		EXPECT_NOFAIL_SILENT_BREAK("insert", r);
+	}
+	/* each maintain() should split the largest shard, until none are too big */
+	for(int i = 0; i < 4; i++)
+	{
+		r = dt->maintain(true);
+		EXPECT_NOFAIL("dt->maintain", r);
+		kddtable_check(dt, 0, 4000);
+	}
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	EXPECT_NOFAIL("stat(kdd_data.4)", stat("kddt_split/kdd_data.4", &st));
+	EXPECT_FAIL("stat(kdd_journal.4)", stat("kddt_split/kdd_journal.4", &st));
+	dt->destroy();
+	
+	/* the new dividers should have been saved */
+	dt = dtable_factory::load("keydiv_dtable", AT_FDCWD, "kddt_split", config, sysj);
+	EXPECT_NONULL("dtable_factory::load", dt);
+	kddtable_check(dt, 0, 4000);
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	for(uint32_t i = 0; i < 3900; i++)
+	{
+		r = dt->remove(i);
+		EXPECT_NOFAIL_SILENT_BREAK("remove", r);
+	}
+	/* now the small shards should get merged back together */
+	for(int i = 0; i < 5; i++)
+	{
+		r = dt->maintain(true);
+		EXPECT_NOFAIL("dt->maintain", r);
+		kddtable_check(dt, 3900, 4000);
+	}
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	EXPECT_FAIL("stat(kdd_data.2)", stat("kddt_split/kdd_data.2", &st));
+	dt->destroy();
+	
+	/* a split that never committed leaves the next shard behind */
+	r = mkdir("kddt_split/kdd_data.5", 0755);
+	EXPECT_NOFAIL("mkdir(kdd_data.5)", r);
+	dt = dtable_factory::load("keydiv_dtable", AT_FDCWD, "kddt_split", config, sysj);
+	EXPECT_NONULL("dtable_factory::load", dt);
+	kddtable_check(dt, 3900, 4000);
+	EXPECT_FAIL("stat(kdd_data.5)", stat("kddt_split/kdd_data.5", &st));
+	/* so the next split can use it */
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	for(uint32_t i = 0; i < 3900; i++)
+	{
+		r = dt->insert(i, blob(sizeof(i), &i));
+		EXPECT_NOFAIL_SILENT_BREAK("insert", r);
+	}
+	r = dt->maintain(true);
+	EXPECT_NOFAIL("dt->maintain", r);
+	kddtable_check(dt, 0, 4000);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	EXPECT_NOFAIL("stat(kdd_data.5)", stat("kddt_split/kdd_data.5", &st));
+	dt->destroy();
 	
+	util::rm_r(AT_FDCWD, "kddt_split");
 	return 0;
 }
 
-struct uniq_insert
-{
-	double key;
-	size_t index;
-};
-
-struct uniq_key
+struct kddtable_writer
 {
-	double key;
-	size_t size;
+	dtable * dt;
+	uint32_t low, high;
+	int result;
 };
 
-static void verify_uniq_alts(const char ** strings, const uniq_insert * alts, size_t count, const char * type, const char * path, const params & config, sys_journal * sysj)
+static void * kddtable_write(void * arg)
 {
-	dtable::iter * iter;
-	dtable * dt = dtable_factory::load(type, AT_FDCWD, path, config, sysj);
-	EXPECT_NONULL("dtable_factory::load alt", dt);
-	run_iterator(dt);
-	iter = dt->iterator();
-	for(size_t i = 0; i < count; i++)
+	kddtable_writer * writer = (kddtable_writer *) arg;
+	writer->result = 0;
+	for(uint32_t i = writer->low; i < writer->high; i++)
 	{
-		if(!iter->valid())
-			EXPECT_NEVER("iterator not valid");
-		dtype key = iter->key();
-		blob value = iter->value();
-		blob expect = blob(strings[alts[i].index]);
-		assert(key.type == dtype::DOUBLE);
-		if(key.dbl != alts[i].key)
-			EXPECT_NEVER("incorrect key[%zu]", i);
-		if(value.compare(expect))
-			EXPECT_NEVER("incorrect value[%zu]", i);
-		iter->next();
+		writer->result = writer->dt->insert(i, blob(sizeof(i), &i));
+		if(writer->result < 0)
+			break;
 	}
-	if(iter->valid())
-		EXPECT_NEVER("iterator still valid");
-	delete iter;
-	dt->destroy();
+	return NULL;
 }
 
-static void verify_uniq_keys(const uniq_key * sizes, size_t count, const char * type, const char * path, const params & config, sys_journal * sysj)
+static int kddtable_journals(void)
 {
-	dtable::iter * iter;
-	dtable * dt = dtable_factory::load(type, AT_FDCWD, path, config, sysj);
-	EXPECT_NONULL("dtable_factory::load keys", dt);
-	run_iterator(dt);
-	iter = dt->iterator();
-	for(size_t i = 0; i < count; i++)
-	{
-		if(!iter->valid())
-			EXPECT_NEVER("iterator not valid");
+	int r;
+	dtable * dt;
+	params config;
+	struct stat st;
+	pthread_t threads[4];
+	kddtable_writer writers[4];
+	sys_journal * sysj = sys_journal::get_global_journal();
+	
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) managed_dtable
+		"base_config" config [
+			"base" class(dt) simple_dtable
+			"digest_size" int 100
+		]
+		"divider_0" int 1000
+		"divider_1" int 2000
+		"divider_2" int 3000
+		"shard_journals" bool true
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = dtable_factory::setup("keydiv_dtable", AT_FDCWD, "kddt_journals", config, dtype::UINT32);
+	EXPECT_NOFAIL("dtable::create", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	dt = dtable_factory::load("keydiv_dtable", AT_FDCWD, "kddt_journals", config, sysj);
+	EXPECT_NONULL("dtable_factory::load", dt);
+	EXPECT_NOFAIL("stat(kdd_journal.3)", stat("kddt_journals/kdd_journal.3", &st));
+	
+	/* write each shard from its own thread */
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	for(int i = 0; i < 4; i++)
+	{
+		writers[i].dt = dt;
+		writers[i].low = i * 1000;
+		writers[i].high = (i + 1) * 1000;
+		r = pthread_create(&threads[i], NULL, kddtable_write, &writers[i]);
+		EXPECT_NOFAIL("pthread_create", r);
+	}
+	for(int i = 0; i < 4; i++)
+	{
+		pthread_join(threads[i], NULL);
+		EXPECT_NOFAIL("insert", writers[i].result);
+	}
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	kddtable_check(dt, 0, 4000);
+	/* the writers must not have digested, even past "digest_size" */
+	EXPECT_FAIL("stat(md_data.0)", stat("kddt_journals/kdd_data.0/md_data.0", &st));
+	dt->destroy();
+	
+	/* the keys should be played back from the shards' journals */
+	dt = dtable_factory::load("keydiv_dtable", AT_FDCWD, "kddt_journals", config, sysj);
+	EXPECT_NONULL("dtable_factory::load", dt);
+	kddtable_check(dt, 0, 4000);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = dt->maintain(true);
+	EXPECT_NOFAIL("dt->maintain", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	kddtable_check(dt, 0, 4000);
+	EXPECT_NOFAIL("stat(md_data.0)", stat("kddt_journals/kdd_data.0/md_data.0", &st));
+	dt->destroy();
+	
+	util::rm_r(AT_FDCWD, "kddt_journals");
+	return 0;
+}
+
+int command_kddtable(int argc, const char * argv[])
+{
+	int r;
+	size_t count = 0;
+	bool verbose = false;
+	params config;
+	
+	if(argc > 1 && !strcmp(argv[1], "perf"))
+		return kddtable_perf();
+	if(argc > 1 && !strcmp(argv[1], "split"))
+		return kddtable_split();
+	if(argc > 1 && !strcmp(argv[1], "journals"))
+		return kddtable_journals();
+	
+	if(argc > 1 && !strcmp(argv[1], "-v"))
+	{
+		verbose = true;
+		argc--;
+		argv++;
+	}
+	if(argc > 1)
+		count = atoi(argv[1]);
+	if(!count)
+		count = 2000000;
+	
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) managed_dtable
+		"base_config" config [
+			"base" class(dt) simple_dtable
+			"digest_interval" int 2
+		]
+		"divider_0" int 8
+		"divider_1" int 11
+		"divider_2" int 12
+		"divider_3" int 15
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	config.print();
+	printf("\n");
+	
+	iterator_test("keydiv_dtable", "kddt_test", config, count, verbose);
+	
+	return 0;
+}
+
+struct uniq_insert
+{
+	double key;
+	size_t index;
+};
+
+struct uniq_key
+{
+	double key;
+	size_t size;
+};
+
+static void verify_uniq_alts(const char ** strings, const uniq_insert * alts, size_t count, const char * type, const char * path, const params & config, sys_journal * sysj)
+{
+	dtable::iter * iter;
+	dtable * dt = dtable_factory::load(type, AT_FDCWD, path, config, sysj);
+	EXPECT_NONULL("dtable_factory::load alt", dt);
+	run_iterator(dt);
+	iter = dt->iterator();
+	for(size_t i = 0; i < count; i++)
+	{
+		if(!iter->valid())
+			EXPECT_NEVER("iterator not valid");
+		dtype key = iter->key();
+		blob value = iter->value();
+		blob expect = blob(strings[alts[i].index]);
+		assert(key.type == dtype::DOUBLE);
+		if(key.dbl != alts[i].key)
+			EXPECT_NEVER("incorrect key[%zu]", i);
+		if(value.compare(expect))
+			EXPECT_NEVER("incorrect value[%zu]", i);
+		iter->next();
+	}
+	if(iter->valid())
+		EXPECT_NEVER("iterator still valid");
+	delete iter;
+	dt->destroy();
+}
+
+static void verify_uniq_keys(const uniq_key * sizes, size_t count, const char * type, const char * path, const params & config, sys_journal * sysj)
+{
+	dtable::iter * iter;
+	dtable * dt = dtable_factory::load(type, AT_FDCWD, path, config, sysj);
+	EXPECT_NONULL("dtable_factory::load keys", dt);
+	run_iterator(dt);
+	iter = dt->iterator();
+	for(size_t i = 0; i < count; i++)
+	{
+		if(!iter->valid())
+			EXPECT_NEVER("iterator not valid");
 		dtype key = iter->key();
 		blob value = iter->value();
 		assert(key.type == dtype::DOUBLE);
@@ -1188,10 +1866,194 @@ int command_ctable(int argc, const char * argv[])
 	return 0;
 }
 
+/* checks a row made of index_blob deltas in command_delta() */
+static bool delta_check(const dtable * table, uint32_t key, const char * a, const char * b, const char * c)
+{
+	const char * expect[3] = {a, b, c};
+	blob value = table->find(key);
+	if(!value.exists() || index_blob::is_delta(value))
+	{
+		printf("row %u %s\n", key, value.exists() ? "is a delta" : "is missing");
+		return false;
+	}
+	index_blob row(3, value);
+	for(size_t i = 0; i < 3; i++)
+	{
+		blob column = row.get(i);
+		if(expect[i] ? column.compare(blob(expect[i])) : column.exists())
+		{
+			printf("row %u column %zu is wrong\n", key, i);
+			return false;
+		}
+	}
+	return true;
+}
+
+/* checks all the rows of command_delta()'s table, and that the iterator's
+ * metadata matches the merged values */
+static bool delta_check_all(const dtable * table, bool removed)
+{
+	size_t rows = 0;
+	bool ok = delta_check(table, 1, "a", "B", "C") && delta_check(table, 2, NULL, NULL, "z");
+	if(!removed)
+		ok = ok && delta_check(table, 3, "x", NULL, "y");
+	dtable::iter * iter = table->iterator();
+	for(; ok && iter->valid(); iter->next())
+	{
+		metablob meta = iter->meta();
+		blob value = iter->value();
+		if(!meta.exists())
+			continue;
+		rows++;
+		if(meta.size() != value.size() || index_blob::is_delta(value))
+		{
+			printf("bad value for row %u\n", iter->key().u32);
+			ok = false;
+		}
+	}
+	delete iter;
+	if(ok && rows != (removed ? 2 : 3))
+	{
+		printf("%zu rows\n", rows);
+		ok = false;
+	}
+	return ok;
+}
+
+/* writes a delta setting one column of a row */
+static int delta_set(dtable * table, uint32_t key, size_t column, const char * value)
+{
+	index_blob delta(3);
+	delta.set(column, blob(value));
+	return table->insert(key, delta.flatten_delta());
+}
+
+int command_delta(int argc, const char * argv[])
+{
+	int r;
+	managed_dtable * mdt;
+	sys_journal * sysj = sys_journal::get_global_journal();
+	params config;
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) simple_dtable
+		"blob_merger" string "index_blob"
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = managed_dtable::create(AT_FDCWD, "mdelta_test", config, dtype::UINT32);
+	EXPECT_NOFAIL("dtable::create", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	mdt = new managed_dtable;
+	r = mdt->init(AT_FDCWD, "mdelta_test", config, sysj);
+	EXPECT_NOFAIL("mdt->init", r);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	{
+		/* a whole row, then deltas merged with it in the journal */
+		index_blob row(3);
+		row.set(0, blob("a"));
+		row.set(1, blob("b"));
+		r = mdt->insert(1u, row.flatten());
+		EXPECT_NOFAIL("mdt->insert", r);
+	}
+	r = delta_set(mdt, 1, 1, "B");
+	EXPECT_NOFAIL("delta_set", r);
+	/* a delta with nothing under it */
+	r = delta_set(mdt, 2, 2, "z");
+	EXPECT_NOFAIL("delta_set", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	/* replay the journal */
+	mdt->destroy();
+	mdt = new managed_dtable;
+	r = mdt->init(AT_FDCWD, "mdelta_test", config, sysj);
+	EXPECT_NOFAIL("mdt->init", r);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = mdt->digest();
+	EXPECT_NOFAIL("mdt->digest", r);
+	/* now deltas over a disk dtable */
+	r = delta_set(mdt, 1, 2, "C");
+	EXPECT_NOFAIL("delta_set", r);
+	r = delta_set(mdt, 3, 0, "x");
+	EXPECT_NOFAIL("delta_set", r);
+	r = mdt->digest();
+	EXPECT_NOFAIL("mdt->digest", r);
+	r = delta_set(mdt, 3, 2, "y");
+	EXPECT_NOFAIL("delta_set", r);
+	r = mdt->digest();
+	EXPECT_NOFAIL("mdt->digest", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	EXPECT_SIZET("disk dtables", 3, mdt->disk_dtables());
+	if(!delta_check_all(mdt, false))
+		EXPECT_NEVER("bad rows after digests");
+	
+	/* combining only the newer dtables must keep the deltas for row 3 */
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = mdt->combine((size_t) 1, (size_t) 2);
+	EXPECT_NOFAIL("mdt->combine", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	EXPECT_SIZET("disk dtables", 2, mdt->disk_dtables());
+	if(!delta_check_all(mdt, false))
+		EXPECT_NEVER("bad rows after partial combine");
+	
+	/* then a delta for a removed row, and a full combine */
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = mdt->remove(3u);
+	EXPECT_NOFAIL("mdt->remove", r);
+	r = mdt->combine();
+	EXPECT_NOFAIL("mdt->combine", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	EXPECT_SIZET("disk dtables", 1, mdt->disk_dtables());
+	if(!delta_check_all(mdt, true))
+		EXPECT_NEVER("bad rows after combine");
+	
+	mdt->destroy();
+	mdt = new managed_dtable;
+	r = mdt->init(AT_FDCWD, "mdelta_test", config, sysj);
+	EXPECT_NOFAIL("mdt->init", r);
+	if(!delta_check_all(mdt, true))
+		EXPECT_NEVER("bad rows after reopening");
+	run_iterator(mdt);
+	mdt->destroy();
+	return 0;
+}
+
+/* passes rows whose value in some column starts with a given letter */
+class initial_test : public ctable::row_test
+{
+public:
+	virtual bool operator()(const ctable::p_iter * row) const
+	{
+		blob value = row->value(column);
+		return value.exists() && value.size() && value[0] == initial;
+	}
+	inline initial_test(size_t column, char initial) : column(column), initial(initial) {}
+private:
+	size_t column;
+	char initial;
+};
+
 int command_cctable(int argc, const char * argv[])
 {
 	int r;
 	ctable * ct;
+	ctable::p_iter * iter;
+	size_t first_column = 1, last_column = 0, expected = 0, count;
+	blob firsts[20];
+	bool passes[20];
+	initial_test last_p(last_column, 'P');
 	ctable::colval values[3] = {{0}, {1}, {2}};
 	sys_journal * sysj = sys_journal::get_global_journal();
 	const ctable_factory * base = ctable_factory::lookup("column_ctable");
@@ -1279,6 +2141,10 @@ int command_cctable(int argc, const char * argv[])
 		if(!(rand() % 10))
 			values[2].value = "Timbuktu";
 		r = ct->insert(i, values, 3);
+		firsts[i] = values[1].value;
+		passes[i] = values[0].value[0] == 'P';
+		if(passes[i])
+			expected++;
 	}
 	run_iterator(ct);
 	delete ct;
@@ -1293,6 +2159,33 @@ int command_cctable(int argc, const char * argv[])
 	ct = base->open(AT_FDCWD, "cctw_test", config, sysj);
 	EXPECT_NONULL("cct::open", ct);
 	run_iterator(ct);
+	/* only reads the first names of people whose last names start with P */
+	iter = ct->iterator(&first_column, 1, &last_column, 1, &last_p);
+	EXPECT_NONULL("cct::iterator", iter);
+	for(count = 0; iter->valid(); count++)
+	{
+		dtype key = iter->key();
+		blob value = iter->value(first_column);
+		print(key);
+		printf(": ");
+		print(value);
+		printf("\n");
+		if(key.u32 >= 20 || !passes[key.u32] || value.compare(firsts[key.u32]))
+			EXPECT_NEVER("cct::iterator returned a bad row");
+		iter->next();
+	}
+	EXPECT_SIZET("filtered rows", expected, count);
+	/* backward, the other columns are ahead of the row and must be sought */
+	count = 0;
+	if(iter->last())
+		do {
+			dtype key = iter->key();
+			if(key.u32 >= 20 || !passes[key.u32] || iter->value(first_column).compare(firsts[key.u32]))
+				EXPECT_NEVER("cct::iterator returned a bad row going backward");
+			count++;
+		} while(iter->prev());
+	EXPECT_SIZET("filtered rows going backward", expected, count);
+	delete iter;
 	delete ct;
 	r = tx_end(0);
 	EXPECT_NOFAIL("tx_end", r);
@@ -1300,31 +2193,135 @@ int command_cctable(int argc, const char * argv[])
 	return 0;
 }
 
-#define CONS_TEST_COLS 50
-#define CONS_TEST_ROWS 500
-#define CONS_TEST_SUM 100000000
-
-#define CONS_TEST_CELLS (CONS_TEST_COLS * CONS_TEST_ROWS)
-#define CONS_TEST_INITIAL (CONS_TEST_SUM / CONS_TEST_CELLS)
-
-#define CONS_TEST_SPREAD 100
-#define CONS_TEST_TX_SIZE 2000
-#define CONS_TEST_ITERATIONS 1000000
-
-#define CONS_TEST_BUCKET_SIZE 100
-#define CONS_TEST_BUCKET_HEIGHT 20
-#define CONS_TEST_BUCKET_ZOOM 4
-#define CONS_TEST_BUCKET_MAX (CONS_TEST_INITIAL * 2)
-#define CONS_TEST_BUCKETS ((CONS_TEST_BUCKET_MAX + CONS_TEST_BUCKET_SIZE - 1) / CONS_TEST_BUCKET_SIZE)
-#define CONS_TEST_BUCKET_SCALE (CONS_TEST_CELLS / CONS_TEST_BUCKET_HEIGHT / CONS_TEST_BUCKET_ZOOM)
-
-static bool consistency_check(const ctable * ct, size_t * buckets)
+int command_gctable(int argc, const char * argv[])
 {
-	ctable::iter * iter = ct->iterator();
-	size_t total_entries = 0;
-	uint32_t key_total = 0;
-	uint32_t value_total = 0;
-	util::memset(buckets, 0, sizeof(*buckets) * CONS_TEST_BUCKETS);
+	int r;
+	ctable * ct;
+	ctable::p_iter * iter;
+	ctable::colval values[3] = {{0}, {1}, {2}};
+	size_t column = 2, states = 0;
+	blob state[20];
+	sys_journal * sysj = sys_journal::get_global_journal();
+	const ctable_factory * base = ctable_factory::lookup("group_ctable");
+	blob first[8] = {"Amy", "Bill", "Charlie", "Diana", "Edward", "Flora", "Gail", "Henry"};
+	blob last[6] = {"Nobel", "O'Toole", "Patterson", "Quayle", "Roberts", "Smith"};
+	
+	params config;
+	r = params::parse(LITERAL(
+	config [
+		"columns" int 3
+		"groups" int 2
+		"base" class(ct) simple_ctable
+		"base_config" config [
+			"base" class(dt) managed_dtable
+			"base_config" config [
+				"base" class(dt) simple_dtable
+				"digest_interval" int 2
+			]
+		]
+		"column0_name" string "last"
+		"column1_name" string "first"
+		"column2_name" string "state"
+		"column2_group" int 1
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	config.print();
+	printf("\n");
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	
+	r = base->create(AT_FDCWD, "gct_test", config, dtype::UINT32);
+	EXPECT_NOFAIL("gct::create", r);
+	
+	ct = base->open(AT_FDCWD, "gct_test", config, sysj);
+	EXPECT_NONULL("gct::open", ct);
+	for(uint32_t i = 0; i < 20; i++)
+	{
+		values[0].value = last[rand() % 6];
+		values[1].value = first[rand() % 8];
+		values[2].value = usstate_dtable::state_codes[rand() % USSTATE_COUNT];
+		/* leave some rows out of each group */
+		if(!(i % 3))
+			r = ct->insert(i, &values[2], 1);
+		else
+			r = ct->insert(i, values, (i % 5) ? 3 : 2);
+		if(!(i % 3) || (i % 5))
+			state[i] = values[2].value;
+		EXPECT_NOFAIL("gct::insert", r);
+	}
+	run_iterator(ct);
+	delete ct;
+	
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	wait_digest(3);
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	ct = base->open(AT_FDCWD, "gct_test", config, sysj);
+	EXPECT_NONULL("gct::open", ct);
+	run_iterator(ct);
+	/* this should only need to read the second group */
+	iter = ct->iterator(&column, 1);
+	EXPECT_NONULL("gct::iterator", iter);
+	while(iter->valid())
+	{
+		dtype key = iter->key();
+		blob value = iter->value(column);
+		print(key);
+		printf(": ");
+		print(value);
+		printf("\n");
+		if(key.type != dtype::UINT32 || key.u32 >= 20)
+			EXPECT_NEVER("gct::iterator returned a bad key");
+		/* the projected column must be the one we get back */
+		if(value.exists())
+		{
+			if(value.compare(state[key.u32]))
+				EXPECT_NEVER("gct::iterator returned the wrong column");
+			states++;
+		}
+		else if(state[key.u32].exists())
+			EXPECT_NEVER("gct::iterator lost a value");
+		iter->next();
+	}
+	delete iter;
+	/* rows 5 and 10 were inserted without a state */
+	EXPECT_SIZET("states", 18, states);
+	delete ct;
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	return 0;
+}
+
+#define CONS_TEST_COLS 50
+#define CONS_TEST_ROWS 500
+#define CONS_TEST_SUM 100000000
+
+#define CONS_TEST_CELLS (CONS_TEST_COLS * CONS_TEST_ROWS)
+#define CONS_TEST_INITIAL (CONS_TEST_SUM / CONS_TEST_CELLS)
+
+#define CONS_TEST_SPREAD 100
+#define CONS_TEST_TX_SIZE 2000
+#define CONS_TEST_ITERATIONS 1000000
+
+#define CONS_TEST_BUCKET_SIZE 100
+#define CONS_TEST_BUCKET_HEIGHT 20
+#define CONS_TEST_BUCKET_ZOOM 4
+#define CONS_TEST_BUCKET_MAX (CONS_TEST_INITIAL * 2)
+#define CONS_TEST_BUCKETS ((CONS_TEST_BUCKET_MAX + CONS_TEST_BUCKET_SIZE - 1) / CONS_TEST_BUCKET_SIZE)
+#define CONS_TEST_BUCKET_SCALE (CONS_TEST_CELLS / CONS_TEST_BUCKET_HEIGHT / CONS_TEST_BUCKET_ZOOM)
+
+static bool consistency_check(const ctable * ct, size_t * buckets)
+{
+	ctable::iter * iter = ct->iterator();
+	size_t total_entries = 0;
+	uint32_t key_total = 0;
+	uint32_t value_total = 0;
+	util::memset(buckets, 0, sizeof(*buckets) * CONS_TEST_BUCKETS);
 	while(iter->valid())
 	{
 		uint32_t number;
@@ -1517,17 +2514,40 @@ static void durable_death(int signal)
 	durability_stop = true;
 }
 
+static void durable_synced(tx_id id, int result, void * data)
+{
+	assert(result >= 0);
+	(*(uint32_t *) data)++;
+}
+
+/* runs tx_sync_async() callbacks until at least target have run */
+static void durable_wait(uint32_t * synced, uint32_t target)
+{
+	struct pollfd pfd;
+	pfd.fd = tx_sync_fd();
+	pfd.events = POLLIN;
+	assert(pfd.fd >= 0);
+	while(*synced < target)
+	{
+		int r = poll(&pfd, 1, -1);
+		assert(r > 0 || errno == EINTR);
+		tx_sync_dispatch();
+	}
+}
+
 int command_durability(int argc, const char * argv[])
 {
 	params config;
 	tx_id transaction_id;
 	sys_journal * sysj = sys_journal::get_global_journal();
-	uint32_t tx_seq;
+	uint32_t tx_seq, synced = 0;
 	dtable * dt;
-	bool check;
+	bool check, async;
 	int r;
 	
 	check = argc > 1 && !strcmp(argv[1], "check");
+	/* "async" acknowledges each transaction from a tx_sync_async() callback */
+	async = argc > 1 && !strcmp(argv[1], "async");
 	
 	r = params::parse(LITERAL(
 	config [
@@ -1592,12 +2612,28 @@ int command_durability(int argc, const char * argv[])
 			}
 			
 			transaction_id = tx_end(1);
-			r = tx_sync(transaction_id);
-			assert(r >= 0);
+			if(async)
+			{
+				r = tx_sync_async(transaction_id, durable_synced, &synced);
+				assert(r >= 0);
+				tx_sync_dispatch();
+				if(stop)
+					durable_wait(&synced, tx_seq + 1);
+			}
+			else
+			{
+				r = tx_sync(transaction_id);
+				assert(r >= 0);
+			}
 			
 			if(stop && original_death != SIG_DFL && original_death != SIG_IGN)
 				original_death(SIGALRM);
 		}
+		if(async)
+		{
+			durable_wait(&synced, tx_seq);
+			printf("Asynchronously synced %u transactions\n", synced);
+		}
 	}
 	
 	dt->destroy();
@@ -1605,6 +2641,237 @@ int command_durability(int argc, const char * argv[])
 	return 0;
 }
 
+struct concurrent_writer
+{
+	tx_fd counter, own;
+	uint32_t count, retries;
+	int result;
+};
+
+/* increments the shared counter and writes our own file in each transaction */
+static void * concurrent_write(void * arg)
+{
+	concurrent_writer * writer = (concurrent_writer *) arg;
+	writer->result = 0;
+	writer->retries = 0;
+	for(uint32_t i = 1; i <= writer->count; i++)
+	{
+		tx_id r;
+		do {
+			uint32_t value = 0;
+			tx_ctx ctx = tx_ctx_start();
+			tx_ctx_read(ctx, writer->counter, &value, sizeof(value), 0);
+			value++;
+			tx_ctx_write(ctx, writer->counter, &value, sizeof(value), 0);
+			tx_ctx_write(ctx, writer->own, &i, sizeof(i), 0);
+			r = tx_ctx_end(ctx, 0);
+			if(r == -EAGAIN)
+				writer->retries++;
+		} while(r == -EAGAIN);
+		if(r < 0)
+		{
+			writer->result = r;
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* a background digest started in a global transaction uses it on behalf of the
+ * thread that owns it, which lends it to the digest thread while it waits */
+static int concurrent_digest(void)
+{
+	int r;
+	size_t count = 0;
+	params config;
+	managed_dtable * mdt;
+	sys_journal * sysj = sys_journal::get_global_journal();
+	config.set_class("base", simple_dtable);
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = managed_dtable::create(AT_FDCWD, "concurrent_mdt", config, dtype::UINT32);
+	EXPECT_NOFAIL("dtable::create", r);
+	mdt = new managed_dtable;
+	r = mdt->init(AT_FDCWD, "concurrent_mdt", config, sysj);
+	EXPECT_NOFAIL("mdt->init", r);
+	for(uint32_t i = 0; i < 1000 && r >= 0; i++)
+		r = mdt->insert(i, blob(sizeof(i), &i));
+	EXPECT_NOFAIL("mdt->insert", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	for(int i = 0; i < 2; i++)
+	{
+		r = tx_start();
+		EXPECT_NOFAIL("tx_start", r);
+		r = mdt->digest(false, true);
+		EXPECT_NOFAIL("mdt->digest", r);
+		r = mdt->background_join();
+		EXPECT_NOFAIL("mdt->background_join", r);
+		r = tx_end(0);
+		EXPECT_NOFAIL("tx_end", r);
+		r = tx_start();
+		EXPECT_NOFAIL("tx_start", r);
+		r = mdt->combine(false, true);
+		EXPECT_NOFAIL("mdt->combine", r);
+		r = mdt->background_join();
+		EXPECT_NOFAIL("mdt->background_join", r);
+		r = tx_end(0);
+		EXPECT_NOFAIL("tx_end", r);
+	}
+	for(uint32_t i = 0; i < 1000; i++)
+		if(mdt->find(i).exists())
+			count++;
+	EXPECT_SIZET("keys", 1000, count);
+	mdt->destroy();
+	util::rm_r(AT_FDCWD, "concurrent_mdt");
+	return 0;
+}
+
+int command_concurrent(int argc, const char * argv[])
+{
+	int r;
+	uint32_t value = 0, retries = 0;
+	pthread_t threads[4];
+	concurrent_writer writers[4];
+	tx_fd counter = tx_open(AT_FDCWD, "concurrent_counter", 1);
+	EXPECT_NONULL("tx_open", counter);
+	
+	for(int i = 0; i < 4; i++)
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "concurrent_%d", i);
+		writers[i].counter = counter;
+		writers[i].own = tx_open(AT_FDCWD, name, 1);
+		EXPECT_NONULL("tx_open", writers[i].own);
+		writers[i].count = 1000;
+		r = pthread_create(&threads[i], NULL, concurrent_write, &writers[i]);
+		EXPECT_NOFAIL("pthread_create", r);
+	}
+	for(int i = 0; i < 4; i++)
+	{
+		pthread_join(threads[i], NULL);
+		EXPECT_NOFAIL("tx_ctx_end", writers[i].result);
+		tx_read(writers[i].own, &value, sizeof(value), 0);
+		EXPECT_SIZET("own", 1000, value);
+		retries += writers[i].retries;
+	}
+	/* no increments can be lost, no matter how many conflicts there were */
+	tx_read(counter, &value, sizeof(value), 0);
+	EXPECT_SIZET("counter", 4000, value);
+	printf("%u conflicts retried\n", retries);
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	tx_close(counter);
+	r = tx_unlink(AT_FDCWD, "concurrent_counter", 0);
+	EXPECT_NOFAIL("tx_unlink", r);
+	for(int i = 0; i < 4; i++)
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "concurrent_%d", i);
+		tx_close(writers[i].own);
+		r = tx_unlink(AT_FDCWD, name, 0);
+		EXPECT_NOFAIL("tx_unlink", r);
+	}
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	return concurrent_digest();
+}
+
+int command_budget(int argc, const char * argv[])
+{
+	int r;
+	params config, budget, process;
+	managed_dtable * mdt[2];
+	abortable_tx atx;
+	size_t peak = 0;
+	char value[100];
+	sys_journal * sysj = sys_journal::get_global_journal();
+	memset(value, 'x', sizeof(value));
+	
+	/* a 64K budget, which can go up to 128K if we can't digest */
+	budget.set("size", 64);
+	process.set("memory_budget", budget);
+	r = anvil_configure(anvil_params_union_const(&process));
+	EXPECT_NOFAIL("anvil_configure", r);
+	config.set_class("base", simple_dtable);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	for(int i = 0; i < 2; i++)
+	{
+		const char * path = i ? "budget_b" : "budget_a";
+		r = managed_dtable::create(AT_FDCWD, path, config, dtype::UINT32);
+		EXPECT_NOFAIL_FORMAT("dtable::create(%s)", r, path);
+		mdt[i] = new managed_dtable;
+		r = mdt[i]->init(AT_FDCWD, path, config, sysj);
+		EXPECT_NOFAIL("mdt->init", r);
+	}
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	/* the journals should never get much past the budget, though a table
+	 * asked to digest only does so on its next write, up to 8 inserts away */
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	for(uint32_t i = 0; i < 4000; i++)
+	{
+		r = mdt[i % 8 ? 0 : 1]->insert(i, blob(sizeof(value), value));
+		if(r < 0)
+			break;
+		if(memory_budget::usage() > peak)
+			peak = memory_budget::usage();
+	}
+	EXPECT_NOFAIL("mdt->insert", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	printf("peak usage %zu, %zu + %zu disk dtables\n", peak, mdt[0]->disk_dtables(), mdt[1]->disk_dtables());
+	if(peak > 65536 + 2048)
+		EXPECT_NEVER("budget exceeded");
+	/* the larger one gets digested more often */
+	if(mdt[0]->disk_dtables() <= mdt[1]->disk_dtables() || !mdt[1]->disk_dtables())
+		EXPECT_NEVER("digests not largest first");
+	for(uint32_t i = 0; i < 4000; i++)
+		if(mdt[i % 8 ? 0 : 1]->find(i).size() != sizeof(value))
+		{
+			EXPECT_NEVER("missing key %u", i);
+			break;
+		}
+	
+	/* abortable transactions can't be digested, so eventually writes are refused */
+	atx = mdt[0]->create_tx();
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	for(uint32_t i = 0; i < 2000; i++)
+	{
+		r = mdt[0]->insert(i, blob(sizeof(value), value), false, atx);
+		if(r < 0)
+			break;
+	}
+	EXPECT_NOFAIL("mdt->insert(atx)", r);
+	r = mdt[1]->insert(0u, blob(sizeof(value), value));
+	EXPECT_FAIL("mdt->insert", r);
+	mdt[0]->abort_tx(atx);
+	r = mdt[1]->insert(0u, blob(sizeof(value), value));
+	EXPECT_NOFAIL("mdt->insert", r);
+	/* the journals stay in the system journal's warehouse, so empty them */
+	for(int i = 0; i < 2; i++)
+	{
+		r = mdt[i]->digest();
+		EXPECT_NOFAIL("mdt->digest", r);
+	}
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	mdt[0]->destroy();
+	mdt[1]->destroy();
+	EXPECT_SIZET("usage", 0, memory_budget::usage());
+	/* don't leave the budget set for other tests */
+	return memory_budget::configure(params());
+}
+
 /* makes a dtype of the requested type from the numeric key */
 static dtype idtype(uint32_t value, dtype::ctype key_type)
 {
@@ -1612,6 +2879,9 @@ static dtype idtype(uint32_t value, dtype::ctype key_type)
 	{
 		case dtype::UINT32:
 			return dtype(value);
+		case dtype::UINT64:
+			/* make sure the upper bits are used too */
+			return dtype(((uint64_t) value << 32) | value);
 		case dtype::DOUBLE:
 			return dtype((double) value);
 		case dtype::STRING:
@@ -1644,6 +2914,8 @@ int command_rollover(int argc, const char * argv[])
 		if(argc > 2 && !strcmp(argv[2], "-r"))
 			use_reverse = true;
 	}
+	else if(argc > 1 && !strcmp(argv[1], "-l"))
+		key_type = dtype::UINT64;
 	
 	r = tx_start();
 	EXPECT_NOFAIL("tx_start", r);
@@ -1838,6 +3110,79 @@ int command_rollover(int argc, const char * argv[])
 	printf("normal = %p, temp = %p\n", normal, temporary);
 	EXPECT_SIZET("total", 0, warehouse.size());
 	
+	/* filter incrementally, writing and discarding more entries in between */
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	normal_id = sys_journal::get_unique_id(false);
+	normal = warehouse.obtain(normal_id, key_type, sysj);
+	temp_id = sys_journal::get_unique_id(false);
+	temporary = warehouse.obtain(temp_id, key_type, sysj);
+	if(use_reverse)
+	{
+		r = normal->set_blob_cmp(reverse);
+		EXPECT_NOFAIL("normal set_cmp", r);
+		r = temporary->set_blob_cmp(reverse);
+		EXPECT_NOFAIL("temp set_cmp", r);
+	}
+	for(uint32_t i = 0; i < 100; i++)
+	{
+		r = normal->insert(idtype(i, key_type), "normal");
+		EXPECT_NOFAIL_SILENT_BREAK("normal insert", r);
+		r = temporary->insert(idtype(i, key_type), "discarded");
+		EXPECT_NOFAIL_SILENT_BREAK("temp insert", r);
+	}
+	temporary->discard();
+	temp_id = sys_journal::get_unique_id(false);
+	temporary = warehouse.obtain(temp_id, key_type, sysj);
+	if(use_reverse)
+	{
+		r = temporary->set_blob_cmp(reverse);
+		EXPECT_NOFAIL("temp set_cmp", r);
+	}
+	r = sysj->filter_step(256);
+	EXPECT_NOFAIL("filter_step", r);
+	EXPECT_TRUE("filtering", sysj->filtering());
+	for(uint32_t i = 100; i < 200; i++)
+	{
+		r = normal->insert(idtype(i, key_type), "normal");
+		EXPECT_NOFAIL_SILENT_BREAK("normal insert", r);
+		if(i < 110)
+		{
+			/* this one is discarded after the filter starts */
+			r = temporary->insert(idtype(i, key_type), "discarded");
+			EXPECT_NOFAIL_SILENT_BREAK("temp insert", r);
+		}
+		else if(i == 110)
+			temporary->discard();
+		if(sysj->filtering())
+		{
+			r = sysj->filter_step(256);
+			EXPECT_NOFAIL_SILENT_BREAK("filter_step", r);
+		}
+	}
+	EXPECT_FALSE("filtering", sysj->filtering());
+	EXPECT_SIZET("normal size", 200, normal->size());
+	delete sysj;
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	sysj = sys_journal::spawn_init("test_journal", &warehouse, NULL, true);
+	EXPECT_NONULL("sysj spawn", sysj);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	normal = warehouse.lookup(normal_id);
+	EXPECT_NONULL("normal", normal);
+	EXPECT_SIZET("total", 1, warehouse.size());
+	if(use_reverse)
+	{
+		EXPECT_SIZET("normal size", 0, normal->size());
+		r = normal->set_blob_cmp(reverse);
+		EXPECT_NOFAIL("normal set_cmp", r);
+	}
+	EXPECT_SIZET("normal size", 200, normal->size());
+	
 	r = tx_start();
 	EXPECT_NOFAIL("tx_start", r);
 	sysj->deinit(true);
@@ -2314,13 +3659,1244 @@ int command_stable(int argc, const char * argv[])
 	return 0;
 }
 
-int command_iterator(int argc, const char * argv[])
+/* returns the sorted keys of the rows with the given value in the index */
+static std::vector<uint32_t> stindex_rows(const stable * sst, const char * column, uint32_t value)
 {
-	int r;
-	size_t count = 0;
-	bool verbose = false;
-	params config;
-	
+	std::vector<uint32_t> rows;
+	ext_index * index = sst->column_index(column);
+	if(!index)
+		return rows;
+	ext_index::iter * iter = index->iterator();
+	for(iter->seek(value); iter->valid() && iter->key().u32 == value; iter->next())
+		rows.push_back(iter->pri().u32);
+	delete iter;
+	std::sort(rows.begin(), rows.end());
+	return rows;
+}
+
+static bool stindex_check(const stable * sst, uint32_t value, const uint32_t * expect, size_t count)
+{
+	std::vector<uint32_t> rows = stindex_rows(sst, "zapf", value);
+	bool ok = rows.size() == count;
+	for(size_t i = 0; ok && i < count; i++)
+		ok = rows[i] == expect[i];
+	if(!ok)
+	{
+		printf("rows with zapf = %u:", value);
+		for(size_t i = 0; i < rows.size(); i++)
+			printf(" %u", rows[i]);
+		printf("\n");
+	}
+	return ok;
+}
+
+int command_stindex(int argc, const char * argv[])
+{
+	int r;
+	params config;
+	simple_stable * sst;
+	sys_journal * sysj = sys_journal::get_global_journal();
+	const uint32_t before[] = {3, 8, 13, 18};
+	const uint32_t after[] = {3, 13, 18, 21};
+	
+	r = params::parse(LITERAL(
+	config [
+		"meta" class(dt) managed_dtable
+		"meta_config" config [
+			"base" class(dt) simple_dtable
+		]
+		"data" class(ct) simple_ctable
+		"data_config" config [
+			"base" class(dt) managed_dtable
+			"base_config" config [
+				"base" class(dt) simple_dtable
+			]
+			"columns" int 3
+			"column0_name" string "twice"
+			"column1_name" string "funky"
+			"column2_name" string "zapf"
+		]
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = simple_stable::create(AT_FDCWD, "sstindex_test", config, dtype::UINT32);
+	EXPECT_NOFAIL("stable::create", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	sst = new simple_stable;
+	r = sst->init(AT_FDCWD, "sstindex_test", config, sysj);
+	EXPECT_NOFAIL("sst->init", r);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	for(uint32_t i = 1; i <= 20; i++)
+	{
+		r = sst->insert(i, "twice", i * 2);
+		EXPECT_NOFAIL_SILENT_BREAK("sst->insert", r);
+		r = sst->insert(i, "zapf", i % 5);
+		EXPECT_NOFAIL_SILENT_BREAK("sst->insert", r);
+	}
+	/* the index is on the last column, and existing rows must be found */
+	r = sst->add_index("zapf");
+	EXPECT_NOFAIL("sst->add_index", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	if(!stindex_check(sst, 3, before, 4))
+		EXPECT_NEVER("bad index after adding it");
+	EXPECT_SIZET("rows with zapf = 5", 0, stindex_rows(sst, "zapf", 5).size());
+	
+	/* then changes must update it */
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = sst->insert(21u, "zapf", 3u);
+	EXPECT_NOFAIL("sst->insert", r);
+	r = sst->remove(8u, "zapf");
+	EXPECT_NOFAIL("sst->remove", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	if(!stindex_check(sst, 3, after, 4))
+		EXPECT_NEVER("bad index after changes");
+	delete sst;
+	
+	/* and it should be reopened along with the stable */
+	sst = new simple_stable;
+	r = sst->init(AT_FDCWD, "sstindex_test", config, sysj);
+	EXPECT_NOFAIL("sst->init", r);
+	EXPECT_NONULL("sst->column_index", sst->column_index("zapf"));
+	if(!stindex_check(sst, 3, after, 4))
+		EXPECT_NEVER("bad index after reopening");
+	delete sst;
+	return 0;
+}
+
+/* check a row_bitmap against a sorted, duplicate-free reference vector */
+static bool rowbitmap_same(const row_bitmap & bitmap, const std::vector<uint64_t> & ids)
+{
+	if(bitmap.size() != ids.size())
+	{
+		printf("size %zu, expected %zu\n", bitmap.size(), ids.size());
+		return false;
+	}
+	/* forward, which uses the cursor within and across containers */
+	for(size_t i = 0; i < ids.size(); i++)
+		if(bitmap.select(i) != ids[i] || !bitmap.contains(ids[i]))
+		{
+			printf("select(%zu) = %llu, expected %llu\n", i, (unsigned long long) bitmap.select(i), (unsigned long long) ids[i]);
+			return false;
+		}
+	/* backward, which must not trust the hints */
+	for(size_t i = ids.size(); i > 0; i--)
+		if(bitmap.select(i - 1) != ids[i - 1])
+		{
+			printf("backward select(%zu) = %llu, expected %llu\n", i - 1, (unsigned long long) bitmap.select(i - 1), (unsigned long long) ids[i - 1]);
+			return false;
+		}
+	/* and in strides that jump around within a container */
+	for(size_t stride = 7; stride < ids.size(); stride *= 5)
+		for(size_t i = 0; i < ids.size(); i += stride)
+		{
+			size_t j = (i * 31) % ids.size();
+			if(bitmap.select(j) != ids[j])
+			{
+				printf("random select(%zu) = %llu, expected %llu\n", j, (unsigned long long) bitmap.select(j), (unsigned long long) ids[j]);
+				return false;
+			}
+		}
+	return true;
+}
+
+static void rowbitmap_fill(row_bitmap * bitmap, std::vector<uint64_t> * ids, uint64_t high, uint32_t first, uint32_t count, uint32_t step)
+{
+	for(uint32_t i = 0; i < count; i++)
+	{
+		uint64_t id = (high << 16) | ((first + i * step) & 0xFFFF);
+		if(bitmap->add(id))
+			ids->push_back(id);
+	}
+	std::sort(ids->begin(), ids->end());
+	ids->erase(std::unique(ids->begin(), ids->end()), ids->end());
+}
+
+static void rowbitmap_combine(std::vector<uint64_t> * a, const std::vector<uint64_t> & b, bool unite)
+{
+	std::vector<uint64_t> result;
+	if(unite)
+		std::set_union(a->begin(), a->end(), b.begin(), b.end(), std::back_inserter(result));
+	else
+		std::set_intersection(a->begin(), a->end(), b.begin(), b.end(), std::back_inserter(result));
+	a->swap(result);
+}
+
+int command_rowbitmap(int argc, const char * argv[])
+{
+	/* containers hold 2^16 ids: arrays of up to 4096, then bitmaps */
+	const uint64_t edges[] = {0, 1, 0xFFFF, 0x10000, 0x1FFFF, 0xFFFFFFFFull, 0x100000000ull, 0xFFFFFFFFFFFF0000ull, ~0ull - 1, ~0ull};
+	row_bitmap a, b, c;
+	std::vector<uint64_t> ra, rb, rc;
+	
+	/* ids at the container edges and the ends of the id space */
+	for(size_t i = 0; i < sizeof(edges) / sizeof(edges[0]); i++)
+	{
+		if(!a.add(edges[i]))
+			EXPECT_NEVER("row_bitmap::add returned false for a new id");
+		ra.push_back(edges[i]);
+	}
+	if(a.add(0) || a.add(~0ull) || a.add(0x10000))
+		EXPECT_NEVER("row_bitmap::add returned true for an existing id");
+	if(a.contains(2) || a.contains(0xFFFE) || a.contains(~0ull - 2))
+		EXPECT_NEVER("row_bitmap::contains found a missing id");
+	if(!rowbitmap_same(a, ra))
+		EXPECT_NEVER("bad row_bitmap with edge ids");
+	
+	/* exactly ROW_BITMAP_ARRAY_MAX ids stays an array; one more is a bitmap */
+	a.clear();
+	ra.clear();
+	rowbitmap_fill(&a, &ra, 5, 0, 4096, 3);
+	if(!rowbitmap_same(a, ra))
+		EXPECT_NEVER("bad row_bitmap with a full array");
+	rowbitmap_fill(&a, &ra, 5, 1, 1, 1);
+	if(!rowbitmap_same(a, ra))
+		EXPECT_NEVER("bad row_bitmap after converting to a bitmap");
+	/* adding after a select must not leave the cursor behind */
+	a.select(100);
+	rowbitmap_fill(&a, &ra, 5, 2, 1, 1);
+	rowbitmap_fill(&a, &ra, 4, 0xFFFF, 1, 1);
+	if(!rowbitmap_same(a, ra))
+		EXPECT_NEVER("bad row_bitmap after adding behind the cursor");
+	
+	/* two arrays whose union is too big for an array */
+	b.clear();
+	rb.clear();
+	c.clear();
+	rc.clear();
+	rowbitmap_fill(&b, &rb, 9, 0, 3000, 2);
+	rowbitmap_fill(&c, &rc, 9, 1, 3000, 2);
+	b |= c;
+	rowbitmap_combine(&rb, rc, true);
+	if(!rowbitmap_same(b, rb))
+		EXPECT_NEVER("bad union of arrays into a bitmap");
+	/* two overlapping arrays whose union still fits in one */
+	b.clear();
+	rb.clear();
+	c.clear();
+	rc.clear();
+	rowbitmap_fill(&b, &rb, 9, 0, 3000, 1);
+	rowbitmap_fill(&c, &rc, 9, 1000, 3000, 1);
+	b |= c;
+	rowbitmap_combine(&rb, rc, true);
+	if(!rowbitmap_same(b, rb))
+		EXPECT_NEVER("bad union of arrays into an array");
+	/* bitmap | array, array | bitmap, and bitmap | bitmap across containers */
+	rowbitmap_fill(&c, &rc, 10, 0, 5000, 7);
+	b |= a;
+	rowbitmap_combine(&rb, ra, true);
+	if(!rowbitmap_same(b, rb))
+		EXPECT_NEVER("bad union of array and bitmap");
+	c |= b;
+	rowbitmap_combine(&rc, rb, true);
+	if(!rowbitmap_same(c, rc))
+		EXPECT_NEVER("bad union of bitmap and array");
+	
+	/* two bitmaps whose intersection fits in an array */
+	b.clear();
+	rb.clear();
+	c.clear();
+	rc.clear();
+	rowbitmap_fill(&b, &rb, 3, 0, 6000, 2);
+	rowbitmap_fill(&c, &rc, 3, 0, 6000, 3);
+	rowbitmap_fill(&c, &rc, 8, 0, 100, 1);
+	b &= c;
+	rowbitmap_combine(&rb, rc, false);
+	if(!rowbitmap_same(b, rb))
+		EXPECT_NEVER("bad intersection of bitmaps into an array");
+	/* two bitmaps whose intersection is still a bitmap */
+	b.clear();
+	rb.clear();
+	rowbitmap_fill(&b, &rb, 3, 0, 12000, 1);
+	b &= c;
+	rowbitmap_combine(&rb, rc, false);
+	if(!rowbitmap_same(b, rb))
+		EXPECT_NEVER("bad intersection of bitmaps into a bitmap");
+	/* bitmap & array and array & bitmap */
+	c.clear();
+	rc.clear();
+	rowbitmap_fill(&c, &rc, 3, 1, 1000, 5);
+	b &= c;
+	rowbitmap_combine(&rb, rc, false);
+	if(!rowbitmap_same(b, rb))
+		EXPECT_NEVER("bad intersection of bitmap and array");
+	b.clear();
+	rb.clear();
+	rowbitmap_fill(&b, &rb, 3, 0, 9000, 4);
+	c &= b;
+	rowbitmap_combine(&rc, rb, false);
+	if(!rowbitmap_same(c, rc))
+		EXPECT_NEVER("bad intersection of array and bitmap");
+	/* and disjoint containers leave nothing behind */
+	c.clear();
+	rc.clear();
+	rowbitmap_fill(&c, &rc, 4, 0, 5000, 1);
+	c &= b;
+	if(c.size() || c.contains(0x40000))
+		EXPECT_NEVER("bad intersection of disjoint containers");
+	
+	/* copies, and combining a bitmap with itself */
+	c = a;
+	c = c;
+	if(!rowbitmap_same(c, ra))
+		EXPECT_NEVER("bad row_bitmap after assignment");
+	c |= c;
+	c &= c;
+	if(!rowbitmap_same(c, ra))
+		EXPECT_NEVER("bad row_bitmap after combining with itself");
+	row_bitmap d(a);
+	if(!rowbitmap_same(d, ra))
+		EXPECT_NEVER("bad row_bitmap after copying");
+	return 0;
+}
+
+static ssize_t toilet64_query(t_gtable * gtable, const char * name, uint64_t low, uint64_t high, t_row_id * first)
+{
+	/* t_value can't be declared in C++, because of its v_string member */
+	t_value * values = (t_value *) malloc(2 * sizeof(*values));
+	t_simple_query query;
+	t_rowset * rowset;
+	ssize_t count;
+	values[0].v_int = low;
+	values[1].v_int = high;
+	query.name = name;
+	query.type = T_INT;
+	query.values[0] = &values[0];
+	query.values[1] = (high == low) ? NULL : &values[1];
+	rowset = toilet_simple_query(gtable, &query);
+	free(values);
+	if(!rowset)
+		return -1;
+	count = toilet_rowset_size(rowset);
+	if(count && first)
+		*first = toilet_rowset_row(rowset, 0);
+	toilet_put_rowset(rowset);
+	return count;
+}
+
+int command_toilet64(int argc, const char * argv[])
+{
+	int r, fd;
+	params config;
+	t_toilet * toilet;
+	t_gtable * legacy;
+	t_gtable * wide;
+	t_row * row;
+	t_row_id low_id, high_id, id;
+	t_value * value = (t_value *) malloc(sizeof(*value));
+	const t_value * found;
+	dtable * dt;
+	/* just short of 2^32, in the 32-bit format of older databases */
+	uint32_t old_next = 0xFFFFFFFF;
+	uint64_t divider;
+	size_t count;
+	
+	/* the configuration that toilet uses for its gtables, plus the column
+	 * names that simple_ctable now needs (so toilet_new_gtable() can't be
+	 * used here; toilet_get_gtable() gets them from the ctable instead) */
+	r = params::parse(LITERAL(
+	config [
+		"meta" class(dt) cache_dtable
+		"meta_config" config [
+			"cache_size" int 40000
+			"base" class(dt) managed_dtable
+			"base_config" config [
+				"base" class(dt) simple_dtable
+			]
+		]
+		"data" class(ct) simple_ctable
+		"data_config" config [
+			"base" class(dt) cache_dtable
+			"base_config" config [
+				"cache_size" int 40000
+				"base" class(dt) managed_dtable
+				"base_config" config [
+					"base" class(dt) simple_dtable
+				]
+			]
+			"columns" int 1
+			"column0_name" string "n"
+		]
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	
+	/* make an old-style database: a 32-bit row counter and gtable, along
+	 * with a new 64-bit gtable */
+	r = toilet_new("toilet64_test");
+	EXPECT_NOFAIL("toilet_new", r);
+	fd = open("toilet64_test/=next-row", O_WRONLY | O_TRUNC);
+	EXPECT_NOFAIL("open(=next-row)", fd);
+	if(write(fd, &old_next, sizeof(old_next)) != sizeof(old_next))
+		EXPECT_NEVER("write(=next-row)");
+	close(fd);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = simple_stable::create(AT_FDCWD, "toilet64_test/legacy", config, dtype::UINT32);
+	EXPECT_NOFAIL("stable::create", r);
+	r = simple_stable::create(AT_FDCWD, "toilet64_test/wide", config, dtype::UINT64);
+	EXPECT_NOFAIL("stable::create", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	toilet = toilet_open("toilet64_test", NULL);
+	EXPECT_NONULL("toilet_open", toilet);
+	legacy = toilet_get_gtable(toilet, "legacy");
+	EXPECT_NONULL("toilet_get_gtable(legacy)", legacy);
+	wide = toilet_get_gtable(toilet, "wide");
+	EXPECT_NONULL("toilet_get_gtable(wide)", wide);
+	
+	/* the old counter is read, and the next row ID needs more than 32 bits */
+	r = toilet_new_row(wide, &low_id);
+	EXPECT_NOFAIL("toilet_new_row", r);
+	r = toilet_new_row(wide, &high_id);
+	EXPECT_NOFAIL("toilet_new_row", r);
+	if(low_id > 0xFFFFFFFF || high_id <= 0xFFFFFFFF)
+		EXPECT_NEVER("unexpected row IDs " ROW_FORMAT " and " ROW_FORMAT, low_id, high_id);
+	
+	/* the legacy gtable takes 32-bit IDs, but refuses larger ones */
+	value->v_int = 7;
+	row = toilet_get_row(legacy, low_id);
+	r = toilet_row_set_value(row, "n", T_INT, value);
+	EXPECT_NOFAIL("toilet_row_set_value(legacy, low)", r);
+	toilet_put_row(row);
+	row = toilet_get_row(legacy, high_id);
+	r = toilet_row_set_value(row, "n", T_INT, value);
+	if(r != -EOVERFLOW)
+		EXPECT_NEVER("legacy gtable accepted a 64-bit row ID (%d)", r);
+	toilet_put_row(row);
+	
+	/* the new gtable takes both */
+	row = toilet_get_row(wide, low_id);
+	r = toilet_row_set_value(row, "n", T_INT, value);
+	EXPECT_NOFAIL("toilet_row_set_value(wide, low)", r);
+	toilet_put_row(row);
+	value->v_int = 8;
+	row = toilet_get_row(wide, high_id);
+	r = toilet_row_set_value(row, "n", T_INT, value);
+	EXPECT_NOFAIL("toilet_row_set_value(wide, high)", r);
+	/* but integer values are still 32 bits */
+	value->v_int = 0x100000008ull;
+	r = toilet_row_set_value(row, "n", T_INT, value);
+	if(r != -EOVERFLOW)
+		EXPECT_NEVER("accepted a 64-bit integer value (%d)", r);
+	toilet_put_row(row);
+	free(value);
+	
+	/* queries on "id" can name 64-bit row IDs */
+	id = 0;
+	EXPECT_SIZET("id query on wide", 1, toilet64_query(wide, "id", high_id, high_id, &id));
+	if(id != high_id)
+		EXPECT_NEVER("id query on wide found " ROW_FORMAT, id);
+	EXPECT_SIZET("id query on legacy", 1, toilet64_query(legacy, "id", low_id, low_id, NULL));
+	/* and must not be truncated to match a 32-bit one */
+	EXPECT_SIZET("id query on legacy", 0, toilet64_query(legacy, "id", low_id + 0x100000000ull, low_id + 0x100000000ull, NULL));
+	/* nor may value queries be */
+	EXPECT_SIZET("value query", 1, toilet64_query(wide, "n", 8, 8, NULL));
+	EXPECT_SIZET("value query", 0, toilet64_query(wide, "n", 0x100000008ull, 0x100000008ull, NULL));
+	EXPECT_SIZET("value query", 2, toilet64_query(wide, "n", 0, ~0ull, NULL));
+	EXPECT_SIZET("value query", 0, toilet64_query(wide, "n", 0x100000000ull, ~0ull, NULL));
+	
+	toilet_put_gtable(legacy);
+	toilet_put_gtable(wide);
+	toilet_close(toilet);
+	
+	/* after reopening, the counter is 64 bits and the values are still there */
+	toilet = toilet_open("toilet64_test", NULL);
+	EXPECT_NONULL("toilet_open", toilet);
+	wide = toilet_get_gtable(toilet, "wide");
+	EXPECT_NONULL("toilet_get_gtable(wide)", wide);
+	r = toilet_new_row(wide, &id);
+	EXPECT_NOFAIL("toilet_new_row", r);
+	if(id >> 32 != 1)
+		EXPECT_NEVER("unexpected row ID " ROW_FORMAT, id);
+	row = toilet_get_row(wide, high_id);
+	found = toilet_row_value(row, "n", T_INT);
+	EXPECT_NONULL("toilet_row_value", found);
+	EXPECT_SIZET("toilet_row_value", 8, found->v_int);
+	toilet_put_row(row);
+	toilet_put_gtable(wide);
+	toilet_close(toilet);
+	
+	/* 64-bit keydiv dividers must not be truncated */
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) managed_dtable
+		"base_config" config [
+			"base" class(dt) simple_dtable
+		]
+		"divider_0" uint64 0x100000000
+		"divider_1" uint64 0xFFFFFFFFFFFFFFFF
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	if(!config.get("divider_1", &divider) || divider != ~0ull)
+		EXPECT_NEVER("bad uint64 parameter");
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = dtable_factory::setup("keydiv_dtable", AT_FDCWD, "kddt64_test", config, dtype::UINT64);
+	EXPECT_NOFAIL("dtable::create", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	dt = dtable_factory::load("keydiv_dtable", AT_FDCWD, "kddt64_test", config, sys_journal::get_global_journal());
+	EXPECT_NONULL("dtable_factory::load", dt);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = dt->insert((uint64_t) 0xFFFFFFFF, blob("low"));
+	EXPECT_NOFAIL("insert", r);
+	r = dt->insert((uint64_t) 0x100000001ull, blob("high"));
+	EXPECT_NOFAIL("insert", r);
+	r = dt->insert(~(uint64_t) 0, blob("top"));
+	EXPECT_NOFAIL("insert", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	if(!dt->find((uint64_t) 0xFFFFFFFF).exists() || !dt->find((uint64_t) 0x100000001ull).exists())
+		EXPECT_NEVER("bad lookups across 64-bit dividers");
+	if(!dt->find(~(uint64_t) 0).exists() || dt->find((uint64_t) 1).exists())
+		EXPECT_NEVER("bad lookups across 64-bit dividers");
+	dtable::iter * iter = dt->iterator();
+	for(count = 0; iter->valid(); iter->next())
+		count++;
+	delete iter;
+	EXPECT_SIZET("keys in the keydiv dtable", 3, count);
+	dt->destroy();
+	return 0;
+}
+
+int command_stplan(int argc, const char * argv[])
+{
+	int r;
+	size_t count;
+	params config;
+	simple_stable * sst;
+	stable::iter * iter;
+	dtype high(0u);
+	sys_journal * sysj = sys_journal::get_global_journal();
+	
+	r = params::parse(LITERAL(
+	config [
+		"meta" class(dt) managed_dtable
+		"meta_config" config [
+			"base" class(dt) simple_dtable
+		]
+		"data" class(ct) simple_ctable
+		"data_config" config [
+			"base" class(dt) managed_dtable
+			"base_config" config [
+				"base" class(dt) simple_dtable
+			]
+			"columns" int 3
+			"column0_name" string "twice"
+			"column1_name" string "funky"
+			"column2_name" string "zapf"
+		]
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = simple_stable::create(AT_FDCWD, "stplan_test", config, dtype::UINT32);
+	EXPECT_NOFAIL("stable::create", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	sst = new simple_stable;
+	r = sst->init(AT_FDCWD, "stplan_test", config, sysj);
+	EXPECT_NOFAIL("sst->init", r);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = sst->add_index("funky");
+	EXPECT_NOFAIL("sst->add_index", r);
+	r = sst->add_index("zapf");
+	EXPECT_NOFAIL("sst->add_index", r);
+	for(uint32_t i = 0; i < 2000; i++)
+	{
+		r = sst->insert(i, "twice", i * 2);
+		EXPECT_NOFAIL_SILENT_BREAK("sst->insert", r);
+		/* only 5 values, and only in the even rows */
+		if(!(i % 2))
+		{
+			r = sst->insert(i, "funky", i % 5);
+			EXPECT_NOFAIL_SILENT_BREAK("sst->insert", r);
+		}
+		/* most rows have the same value, so the first part of the
+		 * index makes it look like there is only one */
+		r = sst->insert(i, "zapf", (i < 1500) ? 0 : i);
+		EXPECT_NOFAIL_SILENT_BREAK("sst->insert", r);
+	}
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	EXPECT_SIZET("plan(nosuch)", stable::FULL_SCAN, sst->plan("nosuch", dtype(0u)));
+	/* no index */
+	EXPECT_SIZET("plan(twice)", stable::COLUMN_SCAN, sst->plan("twice", dtype(10u)));
+	/* each value matches a fifth of the rows */
+	EXPECT_SIZET("plan(funky)", stable::COLUMN_SCAN, sst->plan("funky", dtype(3u)));
+	/* 501 distinct values, most matching one row */
+	EXPECT_SIZET("plan(zapf)", stable::INDEX_LOOKUP, sst->plan("zapf", dtype(1700u)));
+	/* ranges are decided by how many rows they cover */
+	high = dtype(1510u);
+	EXPECT_SIZET("plan(zapf, range)", stable::INDEX_LOOKUP, sst->plan("zapf", dtype(1500u), &high));
+	high = dtype(2000u);
+	EXPECT_SIZET("plan(zapf, range)", stable::COLUMN_SCAN, sst->plan("zapf", dtype(0u), &high));
+	
+	iter = sst->column_iterator("nosuch");
+	if(iter)
+		EXPECT_NEVER("column iterator for a missing column");
+	/* only the rows which have the column should be returned */
+	iter = sst->column_iterator("funky");
+	EXPECT_NONULL("sst->column_iterator", iter);
+	for(count = 0; iter->valid(); count++)
+	{
+		dtype key = iter->key();
+		dtype value = iter->value();
+		if(key.u32 % 2 || value.type != dtype::UINT32 || value.u32 != key.u32 % 5)
+			EXPECT_NEVER("bad row %u = %u from column iterator", key.u32, value.u32);
+		if(key.u32 != count * 2)
+			EXPECT_NEVER("column iterator skipped to row %u", key.u32);
+		iter->next();
+	}
+	EXPECT_SIZET("column iterator rows", 1000, count);
+	if(strcmp(iter->column(), "funky"))
+		EXPECT_NEVER("bad column iterator name");
+	/* backward too */
+	count = 0;
+	if(iter->last())
+		do {
+			if(iter->key().u32 != 1998 - count * 2)
+				EXPECT_NEVER("column iterator went back to row %u", iter->key().u32);
+			count++;
+		} while(iter->prev());
+	EXPECT_SIZET("column iterator rows going backward", 1000, count);
+	/* seeking to a row without the column finds the next one with it */
+	if(iter->seek(dtype(501u)) || !iter->valid() || iter->key().u32 != 502)
+		EXPECT_NEVER("bad column iterator seek to a missing row");
+	if(!iter->seek(dtype(700u)) || iter->value().u32 != 0)
+		EXPECT_NEVER("bad column iterator seek");
+	if(iter->seek(dtype(1999u)) || iter->valid())
+		EXPECT_NEVER("bad column iterator seek past the end");
+	delete iter;
+	delete sst;
+	return 0;
+}
+
+int command_dtstats(int argc, const char * argv[])
+{
+	int r;
+	size_t count;
+	params config, plain_config;
+	dtable * table;
+	dtable::iter * iter;
+	managed_dtable * mdt;
+	memory_dtable source, shadow;
+	dtable_stats stats, counted;
+	sys_journal * sysj = sys_journal::get_global_journal();
+	const dtable_factory * base = dtable_factory::lookup("stats_dtable");
+	
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) simple_dtable
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	
+	/* every 10th key is nonexistent, and half of those shadow something */
+	source.init(dtype::UINT32, true);
+	shadow.init(dtype::UINT32, true);
+	for(uint32_t i = 0; i < 1000; i++)
+	{
+		uint32_t key = i * 3;
+		if(i % 10)
+			source.insert(key, blob(sizeof(i), &i));
+		else
+		{
+			source.insert(key, blob());
+			if(!(i % 20))
+				shadow.insert(key, blob(sizeof(i), &i));
+		}
+	}
+	r = base->create(AT_FDCWD, "dts_test", config, &source, &shadow);
+	EXPECT_NOFAIL("stats_dtable::create", r);
+	table = base->open(AT_FDCWD, "dts_test", config, sysj);
+	EXPECT_NONULL("stats_dtable::open", table);
+	r = table->get_stats(&stats);
+	EXPECT_NOFAIL("get_stats", r);
+	EXPECT_SIZET("count", 950, stats.count);
+	EXPECT_SIZET("dne_count", 50, stats.dne_count);
+	EXPECT_SIZET("min", 0, stats.min.u32);
+	EXPECT_SIZET("max", 2997, stats.max.u32);
+	if(stats.distinct() < 900 || stats.distinct() > 1000)
+		EXPECT_NEVER("bad distinct estimate %zu", stats.distinct());
+	count = stats.estimate(0u, 1499u);
+	if(count < 425 || count > 525)
+		EXPECT_NEVER("bad range estimate %zu", count);
+	EXPECT_SIZET("estimate", 0, stats.estimate(3000u, 4000u));
+	/* the stats gathered during create() match those of the result */
+	iter = table->iterator();
+	counted.add(iter);
+	delete iter;
+	EXPECT_SIZET("count", counted.count, stats.count);
+	EXPECT_SIZET("dne_count", counted.dne_count, stats.dne_count);
+	EXPECT_SIZET("estimate", counted.estimate(0u, 1499u), count);
+	table->destroy();
+	
+	/* managed dtables merge the journal's stats with the stats dtables' */
+	plain_config = config;
+	config = params();
+	config.set_class("base", stats_dtable);
+	config.set("base_config", plain_config);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = managed_dtable::create(AT_FDCWD, "dts_managed", config, dtype::UINT32);
+	EXPECT_NOFAIL("managed_dtable::create", r);
+	mdt = new managed_dtable;
+	r = mdt->init(AT_FDCWD, "dts_managed", config, sysj);
+	EXPECT_NOFAIL("mdt->init", r);
+	for(uint32_t i = 0; i < 100; i++)
+	{
+		r = mdt->insert(i, blob(sizeof(i), &i));
+		if(r < 0)
+			break;
+	}
+	EXPECT_NOFAIL("mdt->insert", r);
+	for(uint32_t i = 0; i < 100; i += 10)
+	{
+		r = mdt->remove(i);
+		if(r < 0)
+			break;
+	}
+	EXPECT_NOFAIL("mdt->remove", r);
+	/* the journal keeps its stats as keys are added and removed */
+	r = mdt->get_stats(&stats);
+	EXPECT_NOFAIL("get_stats", r);
+	EXPECT_SIZET("journal count", 100, stats.count);
+	EXPECT_SIZET("journal dne_count", 10, stats.dne_count);
+	EXPECT_SIZET("journal max", 99, stats.max.u32);
+	r = mdt->insert(500u, blob(sizeof(r), &r));
+	EXPECT_NOFAIL("mdt->insert", r);
+	r = mdt->insert(10u, blob(sizeof(r), &r));
+	EXPECT_NOFAIL("mdt->insert", r);
+	r = mdt->get_stats(&stats);
+	EXPECT_NOFAIL("get_stats", r);
+	EXPECT_SIZET("journal count", 101, stats.count);
+	EXPECT_SIZET("journal dne_count", 9, stats.dne_count);
+	EXPECT_SIZET("journal max", 500, stats.max.u32);
+	r = mdt->digest();
+	EXPECT_NOFAIL("mdt->digest", r);
+	r = mdt->insert(1000u, blob(sizeof(r), &r));
+	EXPECT_NOFAIL("mdt->insert", r);
+	r = mdt->get_stats(&stats);
+	EXPECT_NOFAIL("get_stats", r);
+	EXPECT_SIZET("merged count", 93, stats.count);
+	EXPECT_SIZET("merged dne_count", 0, stats.dne_count);
+	EXPECT_SIZET("merged max", 1000, stats.max.u32);
+	if(stats.partial)
+		EXPECT_NEVER("complete stats were marked partial");
+	mdt->destroy();
+	
+	/* layers without stats are skipped rather than failing */
+	r = managed_dtable::create(AT_FDCWD, "dts_plain", plain_config, dtype::UINT32);
+	EXPECT_NOFAIL("managed_dtable::create", r);
+	mdt = new managed_dtable;
+	r = mdt->init(AT_FDCWD, "dts_plain", plain_config, sysj);
+	EXPECT_NOFAIL("mdt->init", r);
+	for(uint32_t i = 0; i < 100; i++)
+	{
+		r = mdt->insert(i, blob(sizeof(i), &i));
+		if(r < 0)
+			break;
+	}
+	EXPECT_NOFAIL("mdt->insert", r);
+	r = mdt->digest();
+	EXPECT_NOFAIL("mdt->digest", r);
+	r = mdt->insert(100u, blob(sizeof(r), &r));
+	EXPECT_NOFAIL("mdt->insert", r);
+	r = mdt->get_stats(&stats);
+	EXPECT_NOFAIL("get_stats", r);
+	EXPECT_SIZET("journal count", 1, stats.count);
+	if(!stats.partial)
+		EXPECT_NEVER("stats missing a layer were not marked partial");
+	mdt->destroy();
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	return 0;
+}
+
+static size_t bloom_absent_found(const dtable * table, size_t count)
+{
+	size_t found = 0;
+	/* the table has only even keys */
+	for(uint32_t i = 0; i < count; i++)
+		if(table->find(i * 2 + 1).exists())
+			found++;
+	return found;
+}
+
+int command_bloom(int argc, const char * argv[])
+{
+	int r;
+	double fpr;
+	params config, count_config, stats_config, legacy_config;
+	dtable * table;
+	memory_dtable source;
+	sys_journal * sysj = sys_journal::get_global_journal();
+	const dtable_factory * base = dtable_factory::lookup("bloom_dtable");
+	
+	source.init(dtype::UINT32, true);
+	for(uint32_t i = 0; i < 1000; i++)
+		source.insert(i * 2, blob(sizeof(i), &i));
+	
+	/* sized for a 1% false positive rate */
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) simple_dtable
+		"bloom_fpr" float 0.01
+		"bloom_track" bool true
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	r = base->create(AT_FDCWD, "bloom_test", config, &source);
+	EXPECT_NOFAIL("bloom_dtable::create", r);
+	table = base->open(AT_FDCWD, "bloom_test", config, sysj);
+	EXPECT_NONULL("bloom_dtable::open", table);
+	for(uint32_t i = 0; i < 1000; i++)
+		if(!table->find(i * 2).exists())
+		{
+			EXPECT_NEVER("key %u missing", i * 2);
+			break;
+		}
+	EXPECT_SIZET("absent keys found", 0, bloom_absent_found(table, 10000));
+	fpr = ((bloom_dtable *) table)->observed_fpr();
+	if(fpr <= 0 || fpr > 0.03)
+		EXPECT_NEVER("bad observed false positive rate %lg", fpr);
+	table->destroy();
+	
+	/* the counters are opt-in */
+	config.set("bloom_track", false);
+	table = base->open(AT_FDCWD, "bloom_test", config, sysj);
+	EXPECT_NONULL("bloom_dtable::open", table);
+	EXPECT_SIZET("absent keys found", 0, bloom_absent_found(table, 10000));
+	if(((bloom_dtable *) table)->observed_fpr() != 0)
+		EXPECT_NEVER("untracked filter reported a false positive rate");
+	table->destroy();
+	util::rm_r(AT_FDCWD, "bloom_test");
+	
+	/* the base has neither size() nor stats, or only stats */
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) exist_dtable
+		"base_config" config [
+			"base" class(dt) simple_dtable
+			"dnebase" class(dt) simple_dtable
+		]
+		"bloom_indices" int 4
+		"bloom_track" bool true
+	]), &count_config);
+	EXPECT_NOFAIL("params::parse", r);
+	r = base->create(AT_FDCWD, "bloom_count", count_config, &source);
+	EXPECT_NOFAIL("bloom_dtable::create", r);
+	table = base->open(AT_FDCWD, "bloom_count", count_config, sysj);
+	EXPECT_NONULL("bloom_dtable::open", table);
+	EXPECT_SIZET("absent keys found", 0, bloom_absent_found(table, 10000));
+	fpr = ((bloom_dtable *) table)->observed_fpr();
+	if(fpr <= 0 || fpr > 0.03)
+		EXPECT_NEVER("bad observed false positive rate %lg", fpr);
+	table->destroy();
+	util::rm_r(AT_FDCWD, "bloom_count");
+	
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) stats_dtable
+		"base_config" config [
+			"base" class(dt) exist_dtable
+			"base_config" config [
+				"base" class(dt) simple_dtable
+				"dnebase" class(dt) simple_dtable
+			]
+		]
+		"bloom_track" bool true
+	]), &stats_config);
+	EXPECT_NOFAIL("params::parse", r);
+	r = base->create(AT_FDCWD, "bloom_stats", stats_config, &source);
+	EXPECT_NOFAIL("bloom_dtable::create", r);
+	table = base->open(AT_FDCWD, "bloom_stats", stats_config, sysj);
+	EXPECT_NONULL("bloom_dtable::open", table);
+	EXPECT_SIZET("absent keys found", 0, bloom_absent_found(table, 10000));
+	fpr = ((bloom_dtable *) table)->observed_fpr();
+	if(fpr <= 0 || fpr > 0.03)
+		EXPECT_NEVER("bad observed false positive rate %lg", fpr);
+	table->destroy();
+	util::rm_r(AT_FDCWD, "bloom_stats");
+	
+	/* "bloom_k" still builds the old fixed-size filters */
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) simple_dtable
+		"bloom_k" int 8
+		"bloom_track" bool true
+	]), &legacy_config);
+	EXPECT_NOFAIL("params::parse", r);
+	r = base->create(AT_FDCWD, "bloom_legacy", legacy_config, &source);
+	EXPECT_NOFAIL("bloom_dtable::create", r);
+	rofile * file = rofile::open<4, 2>(AT_FDCWD, "bloom_legacy/bloom");
+	EXPECT_NONULL("rofile::open", file);
+	/* a 16-byte header and 2^16 bits */
+	EXPECT_SIZET("filter size", 16 + 8192, file->size());
+	delete file;
+	table = base->open(AT_FDCWD, "bloom_legacy", legacy_config, sysj);
+	EXPECT_NONULL("bloom_dtable::open", table);
+	if(!table->find(998u).exists())
+		EXPECT_NEVER("key 998 missing");
+	EXPECT_SIZET("absent keys found", 0, bloom_absent_found(table, 10000));
+	table->destroy();
+	util::rm_r(AT_FDCWD, "bloom_legacy");
+	/* and can't be mixed with the new parameters */
+	legacy_config.set("bloom_indices", 4);
+	r = base->create(AT_FDCWD, "bloom_legacy", legacy_config, &source);
+	if(r != -EINVAL)
+		EXPECT_NEVER("accepted both bloom_k and bloom_indices (%d)", r);
+	
+	return 0;
+}
+
+static int mdjournal_insert(dtable * dt, uint32_t low, uint32_t high)
+{
+	int r = 0;
+	for(uint32_t i = low; i < high; i++)
+	{
+		r = dt->insert(i, blob(sizeof(i), &i));
+		if(r < 0)
+			break;
+	}
+	return r;
+}
+
+static size_t mdjournal_count(const dtable * dt, uint32_t low, uint32_t high)
+{
+	size_t count = 0;
+	for(uint32_t i = low; i < high; i++)
+		if(dt->find(i).exists())
+			count++;
+	return count;
+}
+
+/* find the data file of mdj_own's journal, returning its sequence number */
+static int mdjournal_data(size_t * size)
+{
+	char name[32];
+	struct stat st;
+	for(int i = 0; i < 16; i++)
+	{
+		sprintf(name, "mdj_own/md_journal.%d", i);
+		if(stat(name, &st) < 0)
+			continue;
+		*size = st.st_size;
+		return i;
+	}
+	return -ENOENT;
+}
+
+/* "crash" writes a table with its own journal and one using the global journal,
+ * and dies in the middle of a transaction; "check" then verifies that each
+ * committed transaction was played back from both journals, and the uncommitted
+ * one from neither */
+static int mdjournal_crash(bool check)
+{
+	int r;
+	tx_id id;
+	params config, shared_config;
+	dtable * a;
+	dtable * b;
+	sys_journal * sysj = sys_journal::get_global_journal();
+	
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) simple_dtable
+		"own_journal" bool true
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) simple_dtable
+	]), &shared_config);
+	EXPECT_NOFAIL("params::parse", r);
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	if(!check)
+	{
+		r = dtable_factory::setup("managed_dtable", AT_FDCWD, "mdj_crash_a", config, dtype::UINT32);
+		EXPECT_NOFAIL("dtable::create", r);
+		r = dtable_factory::setup("managed_dtable", AT_FDCWD, "mdj_crash_b", shared_config, dtype::UINT32);
+		EXPECT_NOFAIL("dtable::create", r);
+	}
+	a = dtable_factory::load("managed_dtable", AT_FDCWD, "mdj_crash_a", config, sysj);
+	EXPECT_NONULL("dtable_factory::load", a);
+	b = dtable_factory::load("managed_dtable", AT_FDCWD, "mdj_crash_b", shared_config, sysj);
+	EXPECT_NONULL("dtable_factory::load", b);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	if(check)
+	{
+		EXPECT_SIZET("committed keys in a", 200, mdjournal_count(a, 0, 200));
+		EXPECT_SIZET("committed keys in b", 200, mdjournal_count(b, 0, 200));
+		EXPECT_SIZET("uncommitted keys in a", 0, mdjournal_count(a, 200, 300));
+		EXPECT_SIZET("uncommitted keys in b", 0, mdjournal_count(b, 200, 300));
+		a->destroy();
+		b->destroy();
+		return 0;
+	}
+	
+	for(uint32_t i = 0; i < 2; i++)
+	{
+		r = tx_start();
+		EXPECT_NOFAIL("tx_start", r);
+		r = mdjournal_insert(a, i * 100, i * 100 + 100);
+		EXPECT_NOFAIL("insert", r);
+		r = mdjournal_insert(b, i * 100, i * 100 + 100);
+		EXPECT_NOFAIL("insert", r);
+		id = tx_end(1);
+		EXPECT_NOFAIL("tx_end", id);
+		r = tx_sync(id);
+		EXPECT_NOFAIL("tx_sync", r);
+	}
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = mdjournal_insert(a, 200, 300);
+	EXPECT_NOFAIL("insert", r);
+	r = mdjournal_insert(b, 200, 300);
+	EXPECT_NOFAIL("insert", r);
+	printf("Dying in the middle of a transaction.\n");
+	fflush(stdout);
+	kill(getpid(), SIGKILL);
+	return 0;
+}
+
+int command_mdjournal(int argc, const char * argv[])
+{
+	int r, seq;
+	size_t global, size, filtered;
+	struct stat st;
+	params config, shared_config;
+	dtable * own;
+	dtable * shared;
+	sys_journal * sysj = sys_journal::get_global_journal();
+	
+	if(argc > 1 && !strcmp(argv[1], "crash"))
+		return mdjournal_crash(false);
+	if(argc > 1 && !strcmp(argv[1], "check"))
+		return mdjournal_crash(true);
+	
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) simple_dtable
+		"own_journal" bool true
+		"journal_filter_size" int 1
+		"journal_filter_on_empty" bool false
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) simple_dtable
+	]), &shared_config);
+	EXPECT_NOFAIL("params::parse", r);
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = dtable_factory::setup("managed_dtable", AT_FDCWD, "mdj_own", config, dtype::UINT32);
+	EXPECT_NOFAIL("dtable::create", r);
+	r = dtable_factory::setup("managed_dtable", AT_FDCWD, "mdj_shared", shared_config, dtype::UINT32);
+	EXPECT_NOFAIL("dtable::create", r);
+	own = dtable_factory::load("managed_dtable", AT_FDCWD, "mdj_own", config, sysj);
+	EXPECT_NONULL("dtable_factory::load", own);
+	shared = dtable_factory::load("managed_dtable", AT_FDCWD, "mdj_shared", shared_config, sysj);
+	EXPECT_NONULL("dtable_factory::load", shared);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	EXPECT_NOFAIL("stat(md_journal)", stat("mdj_own/md_journal", &st));
+	EXPECT_FAIL("stat(md_journal)", stat("mdj_shared/md_journal", &st));
+	
+	/* writes to the table with its own journal stay out of the global one */
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = mdjournal_insert(shared, 0, 1000);
+	EXPECT_NOFAIL("insert", r);
+	global = sysj->size();
+	r = mdjournal_insert(own, 0, 1000);
+	EXPECT_NOFAIL("insert", r);
+	EXPECT_SIZET("global journal size", global, sysj->size());
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	/* digesting and filtering it leaves the global journal alone */
+	global = sysj->size();
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = ((managed_dtable *) own)->digest();
+	EXPECT_NOFAIL("digest", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	seq = mdjournal_data(&size);
+	EXPECT_NOFAIL("mdjournal_data", seq);
+	/* the filter is done a step at a time, and then switches data files */
+	for(int i = 0; i < 100 && mdjournal_data(&filtered) == seq; i++)
+	{
+		r = tx_start();
+		EXPECT_NOFAIL("tx_start", r);
+		r = own->maintain(true);
+		EXPECT_NOFAIL_SILENT_BREAK("maintain", r);
+		r = tx_end(0);
+		EXPECT_NOFAIL_SILENT_BREAK("tx_end", r);
+	}
+	r = mdjournal_data(&filtered);
+	EXPECT_NOFAIL("mdjournal_data", r);
+	if(r == seq || filtered >= size)
+		EXPECT_NEVER("own journal was not filtered (%zu of %zu bytes)", filtered, size);
+	EXPECT_SIZET("global journal size", global, sysj->size());
+	EXPECT_SIZET("keys in own", 1000, mdjournal_count(own, 0, 1000));
+	EXPECT_SIZET("keys in shared", 1000, mdjournal_count(shared, 0, 1000));
+	
+	/* keys still only in the journal are played back from md_journal */
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = mdjournal_insert(own, 1000, 1100);
+	EXPECT_NOFAIL("insert", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	own->destroy();
+	shared->destroy();
+	own = dtable_factory::load("managed_dtable", AT_FDCWD, "mdj_own", config, sysj);
+	EXPECT_NONULL("dtable_factory::load", own);
+	EXPECT_SIZET("keys in own", 1100, mdjournal_count(own, 0, 1100));
+	/* even without the parameter, since the journal exists */
+	own->destroy();
+	own = dtable_factory::load("managed_dtable", AT_FDCWD, "mdj_own", shared_config, sysj);
+	EXPECT_NONULL("dtable_factory::load", own);
+	EXPECT_SIZET("keys in own", 1100, mdjournal_count(own, 0, 1100));
+	own->destroy();
+	shared = dtable_factory::load("managed_dtable", AT_FDCWD, "mdj_shared", shared_config, sysj);
+	EXPECT_NONULL("dtable_factory::load", shared);
+	EXPECT_SIZET("keys in shared", 1000, mdjournal_count(shared, 0, 1000));
+	shared->destroy();
+	
+	util::rm_r(AT_FDCWD, "mdj_own");
+	util::rm_r(AT_FDCWD, "mdj_shared");
+	return 0;
+}
+
+static int journal_count(void * data, size_t length, void * param)
+{
+	(*(int *) param)++;
+	return 0;
+}
+
+/* flips the bits of a byte in a journal's data file */
+static int journal_flip(int dfd, off_t offset)
+{
+	uint8_t byte;
+	int r, fd = openat(dfd, "jcorrupt", O_RDWR);
+	if(fd < 0)
+		return fd;
+	r = (pread(fd, &byte, 1, offset) == 1) ? 0 : -1;
+	byte ^= 0xFF;
+	if(r >= 0 && pwrite(fd, &byte, 1, offset) != 1)
+		r = -1;
+	close(fd);
+	return r;
+}
+
+int command_journal(int argc, const char * argv[])
+{
+	int r, count = 0;
+	journal * j;
+	journal * copy;
+	/* the records follow the 8-byte segment header, each with a 12-byte
+	 * header of its own: the data of the first is at 20, the second at 42;
+	 * the second is larger than the rwfile buffer, so that it is always
+	 * read straight from the file instead of from a cached copy */
+	const char * first = "record one";
+	char second[16384];
+	const off_t first_data = 20, second_data = 42 + sizeof(second) / 2;
+#if HAVE_FSTITCH
+	const char * commit_name = "jcorrupt" J_COMMIT_EXT "0";
+#else
+	const char * commit_name = "jcorrupt" J_COMMIT_EXT "2";
+#endif
+	/* use the transaction journal directory, so segments are recycled there */
+	int dfd = openat(AT_FDCWD, "journals", O_RDONLY);
+	EXPECT_NOFAIL("openat(journals)", dfd);
+	if(dfd < 0)
+		return dfd;
+	
+	j = journal::create(dfd, "jcorrupt", NULL);
+	EXPECT_NONULL("journal::create", j);
+	if(!j)
+	{
+		close(dfd);
+		return -1;
+	}
+	r = j->append(first, strlen(first));
+	EXPECT_NOFAIL("append", r);
+	r = j->commit();
+	EXPECT_NOFAIL("commit", r);
+	r = j->playback(journal_count, NULL, &count);
+	EXPECT_NOFAIL("playback", r);
+	EXPECT_SIZET("records", 1, count);
+	memset(second, 'x', sizeof(second));
+	r = j->append(second, sizeof(second));
+	EXPECT_NOFAIL("append", r);
+	r = j->commit();
+	EXPECT_NOFAIL("commit", r);
+	
+	/* a torn last commit is treated as never having been committed */
+	r = journal_flip(dfd, second_data);
+	EXPECT_NOFAIL("corrupt second", r);
+	r = journal::reopen(dfd, "jcorrupt", commit_name, &copy, NULL);
+	EXPECT_NOFAIL("journal::reopen", r);
+	if(copy)
+		EXPECT_NEVER("reopened a journal with a torn last commit");
+	/* and playing it back fails rather than applying it */
+	r = j->playback(journal_count, NULL, &count);
+	if(r != -EIO)
+		EXPECT_NEVER("playback of a torn record returned %d", r);
+	EXPECT_SIZET("records", 1, count);
+	r = journal_flip(dfd, second_data);
+	EXPECT_NOFAIL("restore second", r);
+	
+	/* but damage to an earlier commit is an error */
+	r = journal_flip(dfd, first_data);
+	EXPECT_NOFAIL("corrupt first", r);
+	copy = NULL;
+	r = journal::reopen(dfd, "jcorrupt", commit_name, &copy, NULL);
+	EXPECT_FAIL("journal::reopen", r);
+	if(copy)
+		EXPECT_NEVER("reopened a journal with a damaged commit");
+	r = journal_flip(dfd, first_data);
+	EXPECT_NOFAIL("restore first", r);
+	
+	r = j->playback(journal_count, NULL, &count);
+	EXPECT_NOFAIL("playback", r);
+	EXPECT_SIZET("records", 2, count);
+	r = j->erase();
+	EXPECT_NOFAIL("erase", r);
+	r = j->release();
+	EXPECT_NOFAIL("release", r);
+	close(dfd);
+	return 0;
+}
+
+int command_iterator(int argc, const char * argv[])
+{
+	int r;
+	size_t count = 0;
+	bool verbose = false;
+	params config;
+	
 	if(argc > 1 && !strcmp(argv[1], "-v"))
 	{
 		verbose = true;
@@ -2414,3 +4990,87 @@ int command_blob_cmp(int argc, const char * argv[])
 	reverse->release();
 	return 0;
 }
+
+static void check_counters(managed_dtable * mdt, int64_t scale)
+{
+	for(uint32_t i = 0; i < 10; i++)
+	{
+		blob value = mdt->find(i);
+		EXPECT_TYPE("counter", long long, "lld", scale * i, counter_merger::value(value));
+	}
+}
+
+int command_merger(int argc, const char * argv[])
+{
+	int r;
+	managed_dtable * mdt;
+	sys_journal * sysj = sys_journal::get_global_journal();
+	params config;
+	
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) simple_dtable
+		"blob_merger" string "counter"
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = managed_dtable::create(AT_FDCWD, "merger_test", config, dtype::UINT32);
+	EXPECT_NOFAIL("dtable::create", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	mdt = new managed_dtable;
+	r = mdt->init(AT_FDCWD, "merger_test", config, sysj);
+	EXPECT_NOFAIL("mdt->init", r);
+	EXPECT_FAIL("mdt->set_blob_merger", mdt->set_blob_merger(index_blob::merger()));
+	
+	/* increment each counter by its key, digesting along the way so that
+	 * operands end up in several disk dtables as well as the journal */
+	for(int round = 0; round < 3; round++)
+	{
+		r = tx_start();
+		EXPECT_NOFAIL("tx_start", r);
+		for(uint32_t i = 0; i < 10; i++)
+		{
+			r = mdt->insert(i, counter_merger::operand(i));
+			EXPECT_NOFAIL_SILENT_BREAK("mdt->insert", r);
+		}
+		r = mdt->digest();
+		EXPECT_NOFAIL("mdt->digest", r);
+		r = tx_end(0);
+		EXPECT_NOFAIL("tx_end", r);
+	}
+	check_counters(mdt, 3);
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	for(uint32_t i = 0; i < 10; i++)
+	{
+		r = mdt->insert(i, counter_merger::operand(i));
+		EXPECT_NOFAIL_SILENT_BREAK("mdt->insert", r);
+	}
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	check_counters(mdt, 4);
+	mdt->destroy();
+	
+	/* the merger should be set automatically */
+	mdt = new managed_dtable;
+	r = mdt->init(AT_FDCWD, "merger_test", config, sysj);
+	EXPECT_NOFAIL_COUNT("mdt->init", r, "disk dtables", mdt->disk_dtables());
+	check_counters(mdt, 4);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = mdt->combine();
+	EXPECT_NOFAIL("mdt->combine", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	EXPECT_SIZET("disk dtables", 1, mdt->disk_dtables());
+	check_counters(mdt, 4);
+	run_iterator(mdt);
+	mdt->destroy();
+	
+	return 0;
+}
@@ -23,6 +23,9 @@ void print(const dtype & x)
 		case dtype::UINT32:
 			printf("%u", x.u32);
 			break;
+		case dtype::UINT64:
+			printf("%" PRIu64, x.u64);
+			break;
 		case dtype::DOUBLE:
 			printf("%lg", x.dbl);
 			break;
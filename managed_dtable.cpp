@@ -12,6 +12,10 @@
 #include "transaction.h"
 
 #include "util.h"
+#include "rwfile.h"
+#include "dtable_stats.h"
+#include "io_limiter.h"
+#include "memory_budget.h"
 #include "managed_dtable.h"
 
 /* FIXME: we need to explicitly store the blob comparator name in the
@@ -23,6 +27,8 @@ int managed_dtable::init(int dfd, const char * name, const params & config, sys_
 	istr fast_config = "fastbase_config";
 	tx_fd meta;
 	off_t meta_off;
+	const blob_merger * merger = NULL;
+	bool own_journal, filter_on_empty;
 	int r = -1, size;
 	if(md_dfd >= 0)
 		deinit();
@@ -52,9 +58,28 @@ int managed_dtable::init(int dfd, const char * name, const params & config, sys_
 		return -EINVAL;
 	if(!config.get("bg_default", &bg_default, false))
 		return -EINVAL;
+	if(!config.get("direct_io", &direct_io, true))
+		return -EINVAL;
+	if(!config.get("own_journal", &own_journal, false))
+		return -EINVAL;
+	if(!config.get("journal_filter_on_empty", &filter_on_empty, true))
+		return -EINVAL;
+	if(!config.get("journal_filter_size", &size, 0) || size < 0)
+		return -EINVAL;
+	journal_filter_size = size;
 	md_dfd = openat(dfd, name, O_RDONLY);
 	if(md_dfd < 0)
 		return md_dfd;
+	/* use our own journal if we were asked to, or if we already have one */
+	r = private_journal.init(md_dfd, "md_journal", own_journal, filter_on_empty);
+	if(r >= 0)
+	{
+		sysj = private_journal.journal();
+		this->sysj = sysj;
+	}
+	else if(own_journal || r != -ENOENT)
+		goto fail_journal;
+	r = -1;
 	meta = tx_open(md_dfd, "md_meta", 0);
 	if(!meta)
 		goto fail_meta;
@@ -78,9 +103,26 @@ int managed_dtable::init(int dfd, const char * name, const params & config, sys_
 		case 4:
 			ktype = dtype::BLOB;
 			break;
+		case 5:
+			ktype = dtype::UINT64;
+			break;
 		default:
 			goto fail_header;
 	}
+	r = read_merger_name(md_dfd, &merger_name);
+	if(r < 0)
+		goto fail_header;
+	if(merger_name)
+	{
+		merger = blob_merger::lookup(merger_name);
+		if(!merger)
+		{
+			/* the merger has not been registered */
+			r = -ENOENT;
+			goto fail_header;
+		}
+	}
+	r = -1;
 	
 	for(uint32_t i = 0; i < header.ddt_count; i++)
 	{
@@ -136,8 +178,15 @@ int managed_dtable::init(int dfd, const char * name, const params & config, sys_
 		overlay = new overlay_dtable;
 		overlay->init(array, count + 1);
 	}
+	if(merger)
+	{
+		r = set_blob_merger(merger);
+		assert(r >= 0);
+	}
 	
 	digest_thread.start();
+	budget_update();
+	memory_budget::add(&budget);
 	
 	return 0;
 	
@@ -148,6 +197,9 @@ fail_disks:
 fail_header:
 	tx_close(meta);
 fail_meta:
+	private_journal.deinit();
+fail_journal:
+	merger_name = NULL;
 	close(md_dfd);
 	md_dfd = -1;
 	return (r < 0) ? r : -1;
@@ -157,6 +209,7 @@ void managed_dtable::deinit()
 {
 	if(md_dfd < 0)
 		return;
+	memory_budget::remove(&budget);
 	if(bg_digesting)
 		background_join();
 	assert(!bg_digesting);
@@ -183,6 +236,9 @@ void managed_dtable::deinit()
 	for(size_t i = 0; i < disks.size(); i++)
 		disks[i].disk->destroy();
 	disks.clear();
+	/* close the journal after all of its listeners are gone */
+	private_journal.deinit();
+	merger_name = NULL;
 	close(md_dfd);
 	md_dfd = -1;
 	dtable::deinit();
@@ -231,9 +287,22 @@ blob managed_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
 		}
 		return it->second.overlay->lookup(key, found);
 	}
+	if(io_limiter::adaptive())
+	{
+		/* let the I/O limiter know how we're doing */
+		uint64_t start = io_limiter::now();
+		blob value = overlay->lookup(key, found);
+		io_limiter::observe(start);
+		return value;
+	}
 	return overlay->lookup(key, found);
 }
 
+int managed_dtable::get_stats(dtable_stats * stats) const
+{
+	return overlay->get_stats(stats);
+}
+
 int managed_dtable::insert(const dtype & key, const blob & blob, bool append, ATX_DEF)
 {
 	int r;
@@ -247,9 +316,14 @@ int managed_dtable::insert(const dtype & key, const blob & blob, bool append, AT
 			return -EINVAL;
 		return it->second.journal->insert(key, blob, append);
 	}
+	/* may digest this managed dtable, or refuse the write */
+	r = budget_check();
+	if(r < 0)
+		return r;
 	r = journal->insert(key, blob, append);
-	if(r >= 0 && digest_size && journal->size() >= digest_size)
+	if(r >= 0 && digest_size && !defer_digests && journal->size() >= digest_size)
 		r = digest();
+	budget_update();
 	return r;
 }
 
@@ -266,9 +340,14 @@ int managed_dtable::remove(const dtype & key, ATX_DEF)
 			return -EINVAL;
 		return it->second.journal->remove(key);
 	}
+	/* may digest this managed dtable, or refuse the write */
+	r = budget_check();
+	if(r < 0)
+		return r;
 	r = journal->remove(key);
-	if(r >= 0 && digest_size && journal->size() >= digest_size)
+	if(r >= 0 && digest_size && !defer_digests && journal->size() >= digest_size)
 		r = digest();
+	budget_update();
 	return r;
 }
 
@@ -293,6 +372,8 @@ abortable_tx managed_dtable::create_tx()
 	assert(state->journal);
 	if(blob_cmp)
 		state->journal->set_blob_cmp(blob_cmp);
+	if(blob_mrg)
+		state->journal->set_blob_merger(blob_mrg);
 	
 	state->overlay = new overlay_dtable;
 	assert(state->overlay);
@@ -300,6 +381,8 @@ abortable_tx managed_dtable::create_tx()
 	assert(r >= 0);
 	if(blob_cmp)
 		state->overlay->set_blob_cmp(blob_cmp);
+	if(blob_mrg)
+		state->overlay->set_blob_merger(blob_mrg);
 	
 	return atx;
 }
@@ -331,7 +414,10 @@ int managed_dtable::commit_abort_tx(ATX_DEF, bool commit)
 		/* bad abortable transaction ID */
 		return -EINVAL;
 	if(commit)
+	{
 		it->second.journal->rollover(journal);
+		budget_update();
+	}
 	if(it->second.overlay->in_use())
 	{
 		doomed_dtable * doomed = new doomed_dtable(this, it->second.overlay);
@@ -377,6 +463,51 @@ int managed_dtable::set_blob_cmp(const blob_comparator * cmp)
 	return value;
 }
 
+/* the merger name is kept in its own file, which is empty if there is none */
+int managed_dtable::read_merger_name(int md_dfd, istr * name)
+{
+	size_t length;
+	tx_fd fd = tx_open(md_dfd, "md_merger", 0);
+	if(!fd)
+		return -1;
+	length = tx_size(fd);
+	if(length)
+	{
+		char buffer[length + 1];
+		if(tx_read(fd, buffer, length, 0) != length)
+		{
+			tx_close(fd);
+			return -1;
+		}
+		buffer[length] = 0;
+		*name = buffer;
+	}
+	else
+		*name = NULL;
+	tx_close(fd);
+	return 0;
+}
+
+int managed_dtable::set_blob_merger(const blob_merger * merger)
+{
+	atx_map::iterator it;
+	if(md_dfd < 0)
+		return -EBUSY;
+	if(merger_name && strcmp(merger_name, merger->name))
+		return -EINVAL;
+	blob_mrg = merger;
+	/* the journal merges deltas as they are inserted, and the overlay does
+	 * the rest; the disk dtables just store whatever they are given */
+	journal->set_blob_merger(merger);
+	overlay->set_blob_merger(merger);
+	for(it = open_atx_map.begin(); it != open_atx_map.end(); ++it)
+	{
+		it->second.journal->set_blob_merger(merger);
+		it->second.overlay->set_blob_merger(merger);
+	}
+	return 0;
+}
+
 /* external version */
 int managed_dtable::combine(size_t first, size_t last, bool use_fastbase, bool background)
 {
@@ -395,6 +526,7 @@ int managed_dtable::combine(size_t first, size_t last, bool use_fastbase, bool b
 		fg_token token;
 		r = combine(first, last, use_fastbase, &token);
 	}
+	budget_update();
 	return r;
 }
 
@@ -455,6 +587,8 @@ int managed_dtable::combiner::prepare(bool shift_journal)
 		mdt->journal = mdt->sysj->warehouse_obtain(mdt->header.journal_id, mdt->ktype);
 		if(mdt->blob_cmp)
 			mdt->journal->set_blob_cmp(mdt->blob_cmp);
+		if(mdt->blob_mrg)
+			mdt->journal->set_blob_merger(mdt->blob_mrg);
 		
 		/* force array scope to end */
 		{
@@ -471,6 +605,8 @@ int managed_dtable::combiner::prepare(bool shift_journal)
 			mdt->overlay->init(array, mdt->header.ddt_count + 1);
 			if(mdt->blob_cmp)
 				mdt->overlay->set_blob_cmp(mdt->blob_cmp);
+			if(mdt->blob_mrg)
+				mdt->overlay->set_blob_merger(mdt->blob_mrg);
 		}
 		
 		/* now it should look like we're not digesting the journal after all */
@@ -505,6 +641,10 @@ int managed_dtable::combiner::prepare(bool shift_journal)
 		source->init(array, count);
 		if(mdt->blob_cmp)
 			source->set_blob_cmp(mdt->blob_cmp);
+		if(mdt->blob_mrg)
+			source->set_blob_merger(mdt->blob_mrg);
+		/* if there are older dtables, deltas must stay deltas */
+		source->set_partial(shadow != NULL);
 	}
 	
 	sprintf(name, "md_data.%u", mdt->header.ddt_next);
@@ -516,6 +656,10 @@ int managed_dtable::combiner::prepare(bool shift_journal)
 int managed_dtable::combiner::run() const
 {
 	int r;
+	/* keep the new dtable out of the page cache */
+	rwfile::direct_scope direct(mdt->direct_io);
+	/* and don't let it use up all the disk bandwidth either */
+	io_limiter::scope limit;
 	
 	/* make the current transaction depend on having written the new file */
 	r = tx_start_external();
@@ -628,6 +772,8 @@ int managed_dtable::combiner::finish()
 		mdt->overlay->init(array, mdt->header.ddt_count + 1);
 		if(mdt->blob_cmp)
 			mdt->overlay->set_blob_cmp(mdt->blob_cmp);
+		if(mdt->blob_mrg)
+			mdt->overlay->set_blob_merger(mdt->blob_mrg);
 	}
 	
 	if(reset_journal)
@@ -643,6 +789,8 @@ int managed_dtable::combiner::finish()
 			mdt->journal->reinit(mdt->header.journal_id);
 		if(mdt->blob_cmp)
 			mdt->journal->set_blob_cmp(mdt->blob_cmp);
+		if(mdt->blob_mrg)
+			mdt->journal->set_blob_merger(mdt->blob_mrg);
 	}
 	
 	return 0;
@@ -706,15 +854,52 @@ void managed_dtable::combiner::fail()
 	util::rm_r(mdt->md_dfd, name);
 }
 
+void managed_dtable::budget_update()
+{
+	/* a background digest will take care of it */
+	budget.update(bg_digesting ? 0 : journal->memory_usage());
+}
+
+int managed_dtable::budget_check()
+{
+	int r = memory_budget::check(&budget);
+	if(r <= 0)
+		return r;
+	/* we were asked to digest, so do it here in our own thread */
+	if(bg_digesting)
+		background_loan();
+	if(!bg_digesting)
+		r = digest(true, bg_default);
+	/* as a last resort, wait for the background digest to finish */
+	if(r >= 0 && bg_digesting && memory_budget::over_limit())
+		r = background_join();
+	budget_update();
+	if(r >= 0 && memory_budget::over_limit())
+		r = -ENOMEM;
+	return r;
+}
+
+void managed_dtable::loan_token()
+{
+	/* the digest thread works on our behalf while it has the token, so it
+	 * gets to use our transaction (if any) until it gives the token back */
+	tx_lend(digest_thread.id());
+	digest_thread.loan_token();
+	tx_reclaim();
+}
+
 void managed_dtable::background_loan()
 {
 	if(bg_digesting)
 	{
 		reply_msg reply;
 		if(digest_thread.wants_token())
-			digest_thread.loan_token();
+			loan_token();
 		if(reply_queue.try_receive(&reply))
+		{
 			bg_digesting = false;
+			budget_update();
+		}
 	}
 }
 
@@ -726,11 +911,12 @@ int managed_dtable::background_join()
 	while(!reply_queue.try_receive(&reply))
 	{
 		if(digest_thread.wants_token())
-			digest_thread.loan_token();
+			loan_token();
 		else
 			usleep(50000); /* 1/20 sec */
 	}
 	bg_digesting = false;
+	budget_update();
 	return reply.return_value;
 }
 
@@ -820,6 +1006,12 @@ int managed_dtable::maintain(bool force, bool background)
 			return 0;
 	}
 	int r = 0;
+	/* do any digest that insert() and remove() left for us */
+	if(defer_digests && digest_size && journal->size() >= digest_size)
+		force = true;
+	/* or that the memory budget asked for while we were idle */
+	if(memory_budget::requested(&budget))
+		force = true;
 	if(background)
 	{
 		digest_msg msg;
@@ -831,7 +1023,17 @@ int managed_dtable::maintain(bool force, bool background)
 	{
 		fg_token token;
 		r = maintain(force, &token);
+		/* only our own journal, since filtering the global one is costly;
+		 * once started, we continue the filter a bit at each maintain() */
+		if(r >= 0 && journal_filter_size && private_journal.is_open())
+			if(sysj->filtering() || sysj->size() > journal_filter_size)
+			{
+				r = sysj->filter_step();
+				if(r > 0)
+					r = 0;
+			}
 	}
+	budget_update();
 	return r;
 }
 
@@ -930,6 +1132,7 @@ int managed_dtable::create(int dfd, const char * name, const params & config, dt
 {
 	int r, md_dfd;
 	tx_fd fd;
+	istr merger_name;
 	mdtable_header header;
 	header.magic = MDTABLE_MAGIC;
 	header.version = MDTABLE_VERSION;
@@ -947,6 +1150,9 @@ int managed_dtable::create(int dfd, const char * name, const params & config, dt
 		case dtype::BLOB:
 			header.key_type = 4;
 			break;
+		case dtype::UINT64:
+			header.key_type = 5;
+			break;
 		default:
 			return -EINVAL;
 	}
@@ -974,6 +1180,11 @@ int managed_dtable::create(int dfd, const char * name, const params & config, dt
 	header.autocombine_digests = r;
 	header.autocombine_digest_count = 0;
 	header.autocombine_combine_count = 0;
+	if(!config.get("blob_merger", &merger_name))
+		return -EINVAL;
+	/* make sure it will be possible to open the new dtable */
+	if(merger_name && !blob_merger::lookup(merger_name))
+		return -ENOENT;
 	
 	r = mkdirat(dfd, name, 0755);
 	if(r < 0)
@@ -994,10 +1205,28 @@ int managed_dtable::create(int dfd, const char * name, const params & config, dt
 	r = tx_write(fd, &header, sizeof(header), 0);
 	tx_close(fd);
 	if(r < 0)
-		unlinkat(md_dfd, "md_meta", 0);
-	close(md_dfd);
+		goto fail_meta;
+	
+	fd = tx_open(md_dfd, "md_merger", 1);
+	if(!fd)
+	{
+		r = -1;
+		goto fail_meta;
+	}
+	if(merger_name)
+		r = tx_write(fd, merger_name.str(), strlen(merger_name), 0);
+	tx_close(fd);
 	if(r < 0)
-		unlinkat(dfd, name, AT_REMOVEDIR);
+		goto fail_merger;
+	close(md_dfd);
+	return r;
+	
+fail_merger:
+	unlinkat(md_dfd, "md_merger", 0);
+fail_meta:
+	unlinkat(md_dfd, "md_meta", 0);
+	close(md_dfd);
+	unlinkat(dfd, name, AT_REMOVEDIR);
 	return r;
 }
 
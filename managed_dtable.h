@@ -22,6 +22,8 @@
 #include "dtable_factory.h"
 #include "overlay_dtable.h"
 #include "sys_journal.h"
+#include "local_journal.h"
+#include "memory_budget.h"
 
 #include "bg_thread.h"
 #include "msg_queue.h"
@@ -30,6 +32,19 @@
  * (e.g. simple_dtable), a journal dtable, and an overlay dtable to connect
  * everything together. It supports merging together various numbers of these
  * constituent dtables into new, combined disk dtables with the same data. */
+/* Normally the journal dtable's records go in the system journal passed to
+ * init(). With the "own_journal" parameter, the managed dtable instead keeps
+ * its own system journal, in its directory, so that filtering it does not
+ * involve (or stall) other dtables. The "journal_filter_on_empty" parameter is
+ * passed on to sys_journal::init(), and if "journal_filter_size" is given,
+ * maintain() will also filter the journal when it grows larger than that,
+ * incrementally, over as many calls as it takes. */
+/* Every managed dtable takes part in the process-wide memory_budget (see
+ * memory_budget.h) for journal dtables, which is configured through
+ * anvil_configure(). When the total is over budget, insert() and remove() first
+ * digest this managed dtable if the budget asked it to, so as with
+ * "digest_size", iterators may become stale on every insert() or remove().
+ * Managed dtables that are not being written to do so in maintain(). */
 
 #define MDTABLE_MAGIC 0x784D3DB7
 #define MDTABLE_VERSION 1
@@ -47,6 +62,7 @@ public:
 	/* send to the listening dtable (probably journal_dtable) */
 	virtual int insert(const dtype & key, const blob & blob, bool append = false, ATX_OPT);
 	virtual int remove(const dtype & key, ATX_OPT);
+	virtual int get_stats(dtable_stats * stats) const;
 	
 	/* managed_dtable supports abortable transactions */
 	virtual abortable_tx create_tx();
@@ -105,8 +121,13 @@ public:
 	/* do maintenance based on parameters */
 	inline virtual int maintain(bool force = false) { return maintain(force, bg_default); }
 	int maintain(bool force, bool background);
+	/* a journal over "digest_size" is then digested by maintain() instead */
+	inline virtual void defer_maintenance(bool defer) { defer_digests = defer; }
 	
 	virtual int set_blob_cmp(const blob_comparator * cmp);
+	/* If the "blob_merger" parameter is passed to create(), that merger will
+	 * be set automatically by init(), and no other merger can be set. */
+	virtual int set_blob_merger(const blob_merger * merger);
 	
 	/* loan the background thread the token, if it wants it, so it can proceed */
 	void background_loan();
@@ -117,7 +138,7 @@ public:
 	DECLARE_RW_FACTORY(managed_dtable);
 	
 	inline managed_dtable()
-		: digest_thread(this, &managed_dtable::digest_thread_main), bg_digesting(false), bg_default(false), md_dfd(-1), chain(this)
+		: digest_thread(this, &managed_dtable::digest_thread_main), bg_digesting(false), bg_default(false), defer_digests(false), md_dfd(-1), chain(this)
 	{
 	}
 	int init(int dfd, const char * name, const params & config, sys_journal * sysj);
@@ -272,7 +293,18 @@ private:
 	msg_queue<digest_msg> digest_queue;
 	msg_queue<reply_msg> reply_queue;
 	bool bg_digesting, bg_default;
+	/* whether insert() and remove() must leave digests to maintain() */
+	bool defer_digests;
 	void digest_thread_main(bg_token * token);
+	/* loans the digest thread the token, along with our transaction */
+	void loan_token();
+	
+	/* digests the journal dtable to stay within the memory budget */
+	memory_budget::consumer budget;
+	/* publishes how much memory a digest would free */
+	void budget_update();
+	/* digests if the memory budget asked us to, or refuses the write */
+	int budget_check();
 	
 	/* preexisting iterators may be using dtables that will be destroyed by
 	 * a combine - we delay destroying these dtables and register callbacks
@@ -325,6 +357,8 @@ private:
 	
 	int commit_abort_tx(ATX_REQ, bool commit);
 	
+	static int read_merger_name(int md_dfd, istr * name);
+	
 	int md_dfd;
 	mdtable_header header;
 	
@@ -333,11 +367,18 @@ private:
 	mutable chain_callback chain;
 	sys_journal::listening_dtable * journal;
 	sys_journal * sysj;
+	/* not open unless we have our own journal */
+	local_journal private_journal;
+	size_t journal_filter_size;
 	const dtable_factory * base;
 	const dtable_factory * fastbase;
 	params base_config, fastbase_config;
 	size_t digest_size;
 	bool digest_on_close, close_digest_fastbase, autocombine;
+	/* write new dtables with O_DIRECT, to avoid evicting cached data */
+	bool direct_io;
+	/* the name of the blob merger given to create(), if any */
+	istr merger_name;
 };
 
 #endif /* __MANAGED_DTABLE_H */
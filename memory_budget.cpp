@@ -0,0 +1,102 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#include <errno.h>
+
+#include "params.h"
+#include "memory_budget.h"
+
+atomic<size_t> memory_budget::total;
+size_t memory_budget::size = 0;
+size_t memory_budget::limit = 0;
+memory_budget::consumer * memory_budget::consumers = NULL;
+init_mutex memory_budget::lock;
+
+int memory_budget::configure(const params & config)
+{
+	int value, maximum;
+	if(!config.get("size", &value, 0) || value < 0)
+		return -EINVAL;
+	if(!config.get("limit", &maximum, value * 2) || maximum < value)
+		return -EINVAL;
+	scopelock scope(lock);
+	size = value * (size_t) 1024;
+	limit = maximum * (size_t) 1024;
+	return 0;
+}
+
+void memory_budget::add(consumer * c)
+{
+	scopelock scope(lock);
+	assert(!c->registered);
+	c->prev = NULL;
+	c->next = consumers;
+	if(consumers)
+		consumers->prev = c;
+	consumers = c;
+	c->registered = true;
+}
+
+void memory_budget::remove(consumer * c)
+{
+	scopelock scope(lock);
+	if(!c->registered)
+		return;
+	if(c->prev)
+		c->prev->next = c->next;
+	else
+		consumers = c->next;
+	if(c->next)
+		c->next->prev = c->prev;
+	c->prev = NULL;
+	c->next = NULL;
+	c->registered = false;
+}
+
+memory_budget::consumer * memory_budget::largest()
+{
+	consumer * best = NULL;
+	size_t best_size = 0;
+	for(consumer * c = consumers; c; c = c->next)
+	{
+		/* skip the ones that have already been asked */
+		if(c->relief.get())
+			continue;
+		size_t amount = c->reclaimable.get();
+		if(amount > best_size)
+		{
+			best = c;
+			best_size = amount;
+		}
+	}
+	return best;
+}
+
+int memory_budget::pressure(consumer * c)
+{
+	scopelock scope(lock);
+	size_t used = total.get();
+	if(used <= size)
+		return 0;
+	size_t excess = used - size;
+	/* the consumers already asked, but not yet relieved, will free theirs */
+	for(consumer * other = consumers; other; other = other->next)
+		if(other->relief.get())
+		{
+			size_t amount = other->reclaimable.get();
+			excess -= (amount < excess) ? amount : excess;
+		}
+	while(excess)
+	{
+		consumer * best = largest();
+		if(!best)
+			break;
+		size_t amount = best->reclaimable.get();
+		best->relief.set(1);
+		excess -= (amount < excess) ? amount : excess;
+	}
+	if(c->relief.zero())
+		return 1;
+	return (used > limit) ? -ENOMEM : 0;
+}
@@ -0,0 +1,108 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#ifndef __MEMORY_BUDGET_H
+#define __MEMORY_BUDGET_H
+
+#include <sys/types.h>
+
+#ifndef __cplusplus
+#error memory_budget.h is a C++ header file
+#endif
+
+#include "atomic.h"
+#include "locking.h"
+
+class params;
+
+/* The memory budget is a process-wide limit on the memory used by journal
+ * dtables to hold their contents. Journal dtables report their usage through
+ * charge(), and the dtables that can get rid of it by digesting their journals
+ * (see managed_dtable) register as consumers, each publishing how much memory
+ * it could free with update(). Writers call check() before each change: when
+ * the total is over the budget, the consumers holding the most reclaimable
+ * memory are asked for relief, until enough has been asked for to get back
+ * under the budget. Consumers are only ever relieved by their own threads, so
+ * check() tells the caller whether it was one of them, and the others find out
+ * the next time they call check() or requested(). If the total is over the hard
+ * limit and the caller can't help, check() fails with -ENOMEM so that the write
+ * is refused rather than exhausting memory. */
+
+class memory_budget
+{
+public:
+	/* Configuration parameters: "size" is the budget in KiB, or 0 for no
+	 * budget; "limit" is the hard limit in KiB, by default twice the size.
+	 * The budget is shared by the whole process, so it is configured just
+	 * once, through anvil_configure(), rather than by each table. */
+	static int configure(const params & config);
+	
+	class consumer
+	{
+	public:
+		/* publish the memory which relieving this consumer would free; 0 if
+		 * that is already in progress (e.g. in the background) */
+		inline void update(size_t amount)
+		{
+			reclaimable.set(amount);
+		}
+		inline consumer() : prev(NULL), next(NULL), registered(false) {}
+	private:
+		atomic<size_t> reclaimable;
+		/* set by the budget, cleared by the consumer's own thread */
+		atomic<int> relief;
+		consumer * prev;
+		consumer * next;
+		bool registered;
+		friend class memory_budget;
+	};
+	
+	static void add(consumer * c);
+	static void remove(consumer * c);
+	
+	/* account for memory allocated (or freed, if negative) by a journal */
+	static inline void charge(ssize_t bytes)
+	{
+		total.add(bytes);
+	}
+	
+	/* check for memory pressure before a write by the given consumer; returns
+	 * 1 if it should relieve itself first (and then refuse the write if it is
+	 * still over_limit()), or -ENOMEM if it can't help and should refuse it */
+	static inline int check(consumer * c)
+	{
+		if(size && total.get() > size)
+			return pressure(c);
+		return 0;
+	}
+	
+	/* whether relief was asked of the given consumer and is still needed;
+	 * for consumers that have not written anything in a while */
+	static inline bool requested(consumer * c)
+	{
+		return c->relief.zero() && size && total.get() > size;
+	}
+	
+	static inline bool over_limit()
+	{
+		return size && total.get() > limit;
+	}
+	
+	static inline size_t usage()
+	{
+		return total.get();
+	}
+	
+private:
+	static int pressure(consumer * c);
+	static consumer * largest();
+	
+	static atomic<size_t> total;
+	/* in bytes */
+	static size_t size, limit;
+	static consumer * consumers;
+	static init_mutex lock;
+};
+
+#endif /* __MEMORY_BUDGET_H */
@@ -5,6 +5,7 @@
 #include <errno.h>
 
 #include "exception.h"
+#include "dtable_stats.h"
 #include "hack_avl_map.h"
 #include "memory_dtable.h"
 
@@ -108,6 +109,17 @@ blob memory_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
 	return blob();
 }
 
+int memory_dtable::get_stats(dtable_stats * stats) const
+{
+	dtable::iter * source = iterator();
+	if(!source)
+		return -ENOMEM;
+	*stats = dtable_stats();
+	stats->add(source);
+	delete source;
+	return 0;
+}
+
 int memory_dtable::insert(const dtype & key, const blob & blob, bool append, ATX_DEF)
 {
 	if(key.type != ktype || (ktype == dtype::BLOB && !key.blb.exists()))
@@ -37,6 +37,8 @@ public:
 	inline virtual bool writable() const { return true; }
 	virtual int insert(const dtype & key, const blob & blob, bool append = false, ATX_OPT);
 	virtual int remove(const dtype & key, ATX_OPT);
+	/* computed on demand, since everything is in memory anyway */
+	virtual int get_stats(dtable_stats * stats) const;
 	
 	inline virtual int set_blob_cmp(const blob_comparator * cmp)
 	{
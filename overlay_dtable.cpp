@@ -6,10 +6,11 @@
 #include <stdarg.h>
 
 #include "util.h"
+#include "dtable_stats.h"
 #include "overlay_dtable.h"
 
 overlay_dtable::iter::iter(const overlay_dtable * source)
-	: iter_source<overlay_dtable>(source), lastdir(FORWARD), past_beginning(false)
+	: iter_source<overlay_dtable>(source), lastdir(FORWARD), past_beginning(false), merged_valid(false)
 {
 	subs = new sub[source->table_count];
 	for(size_t i = 0; i < source->table_count; i++)
@@ -44,6 +45,7 @@ bool overlay_dtable::iter::next()
 	dtype min_key(0u);
 	const blob_comparator * blob_cmp = dt_source->blob_cmp;
 	current_index = dt_source->table_count;
+	merged_valid = false;
 	
 	if(lastdir == BACKWARD)
 	{
@@ -115,6 +117,7 @@ bool overlay_dtable::iter::prev()
 	dtype max_key(0u);
 	const blob_comparator * blob_cmp = dt_source->blob_cmp;
 	size_t next_index = dt_source->table_count;
+	merged_valid = false;
 	
 	if(lastdir == FORWARD)
 	{
@@ -250,12 +253,46 @@ bool overlay_dtable::iter::seek(const dtype_test & test)
 
 metablob overlay_dtable::iter::meta() const
 {
-	return subs[current_index].iter->meta();
+	metablob meta = subs[current_index].iter->meta();
+	/* removals are never merged; anything else might be a delta, and then
+	 * the size is that of the merged value, which value() will keep */
+	if(!dt_source->blob_mrg || !meta.exists())
+		return meta;
+	return metablob(value());
 }
 
 blob overlay_dtable::iter::value() const
 {
-	return subs[current_index].iter->value();
+	if(!dt_source->blob_mrg)
+		return subs[current_index].iter->value();
+	if(!merged_valid)
+	{
+		merged = merged_value();
+		merged_valid = true;
+	}
+	return merged;
+}
+
+blob overlay_dtable::iter::merged_value() const
+{
+	blob value = subs[current_index].iter->value();
+	const blob_merger * merger = dt_source->blob_mrg;
+	if(!merger || !value.exists() || !merger->partial(value))
+		return value;
+	if(past_beginning)
+		/* prev() has already moved the older sub iterators away */
+		return dt_source->merge_older(key(), value, current_index + 1);
+	/* the shadowed entries for this key are in the older sub iterators which
+	 * have been used up (empty) but not yet advanced past it (valid) */
+	for(size_t i = current_index + 1; i < dt_source->table_count; i++)
+		if(subs[i].valid && subs[i].empty)
+		{
+			blob older = subs[i].iter->value();
+			value = merger->merge(value, older);
+			if(!older.exists() || !merger->partial(older))
+				return value;
+		}
+	return dt_source->partial ? value : merger->merge(value, blob());
 }
 
 const dtable * overlay_dtable::iter::source() const
@@ -263,6 +300,52 @@ const dtable * overlay_dtable::iter::source() const
 	return subs[current_index].iter->source();
 }
 
+/* We can only skip over a range of keys if every underlying dtable agrees that
+ * it can be skipped, since otherwise a shadowed entry could become visible. So
+ * we let each sub iterator skip as far as it can, then seek to the smallest of
+ * the resulting keys. Sub iterators that have no summaries will not move at
+ * all, which limits the skip to the next key they actually contain. */
+bool overlay_dtable::iter::skip_zones(const zone_test & test)
+{
+	bool first = true;
+	dtype min_key(0u);
+	const blob_comparator * blob_cmp = dt_source->blob_cmp;
+	if(!valid())
+		return false;
+	dtype start = key();
+	for(size_t i = 0; i < dt_source->table_count; i++)
+	{
+		subs[i].iter->seek(start);
+		if(!subs[i].iter->valid() || !subs[i].iter->skip_zones(test))
+			continue;
+		dtype sub_key = subs[i].iter->key();
+		if(first || sub_key.compare(min_key, blob_cmp) < 0)
+		{
+			first = false;
+			min_key = sub_key;
+		}
+	}
+	if(first)
+	{
+		/* everything can be skipped: leave all the subs at the end */
+		for(size_t i = 0; i < dt_source->table_count; i++)
+		{
+			subs[i].iter->last();
+			if(subs[i].iter->valid())
+				subs[i].iter->next();
+			subs[i].valid = false;
+			subs[i].empty = true;
+			subs[i].shadow = false;
+		}
+		lastdir = FORWARD;
+		past_beginning = false;
+		return next();
+	}
+	/* this resets the sub iterators, so shadowing works as usual */
+	seek(min_key);
+	return valid();
+}
+
 dtable::iter * overlay_dtable::iterator(ATX_DEF) const
 {
 	return new iter(this);
@@ -286,12 +369,53 @@ blob overlay_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
 	{
 		blob value = tables[i]->lookup(key, found);
 		if(*found)
+		{
+			if(blob_mrg && value.exists() && blob_mrg->partial(value))
+				return merge_older(key, value, i + 1);
 			return value;
+		}
 	}
 	*found = false;
 	return blob();
 }
 
+int overlay_dtable::get_stats(dtable_stats * stats) const
+{
+	bool any = false;
+	*stats = dtable_stats();
+	for(size_t i = 0; i < table_count; i++)
+	{
+		dtable_stats sub;
+		int r = tables[i]->get_stats(&sub);
+		if(r == -ENOSYS)
+		{
+			stats->partial = true;
+			continue;
+		}
+		if(r < 0)
+			return r;
+		stats->merge(sub, blob_cmp);
+		any = true;
+	}
+	return any ? 0 : -ENOSYS;
+}
+
+blob overlay_dtable::merge_older(const dtype & key, blob value, size_t index) const
+{
+	for(; index < table_count; index++)
+	{
+		bool found;
+		blob older = tables[index]->lookup(key, &found);
+		if(!found)
+			continue;
+		value = blob_mrg->merge(value, older);
+		if(!older.exists() || !blob_mrg->partial(older))
+			return value;
+	}
+	/* there is no older value, as far as we know */
+	return partial ? value : blob_mrg->merge(value, blob());
+}
+
 int overlay_dtable::set_blob_cmp(const blob_comparator * cmp)
 {
 	for(size_t i = 0; i < table_count; i++)
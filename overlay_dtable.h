@@ -17,7 +17,9 @@
 
 /* The overlay dtable just combines underlying dtables in the order specified.
  * Note that it does not propagate blob comparators to them, but it does need
- * its own blob comparator set if one is in use by the underlying dtables. */
+ * its own blob comparator set if one is in use by the underlying dtables. The
+ * same goes for blob mergers: if one is set, deltas found in newer dtables are
+ * merged with the values found in older ones. */
 
 class overlay_dtable : public dtable
 {
@@ -25,10 +27,28 @@ public:
 	virtual iter * iterator(ATX_OPT) const;
 	virtual bool present(const dtype & key, bool * found, ATX_OPT) const;
 	virtual blob lookup(const dtype & key, bool * found, ATX_OPT) const;
+	/* merges the statistics of the underlying dtables, skipping (and marking
+	 * the result partial) any which don't keep statistics; fails with -ENOSYS
+	 * only if none of them do */
+	virtual int get_stats(dtable_stats * stats) const;
 	
 	virtual int set_blob_cmp(const blob_comparator * cmp);
+	inline virtual int set_blob_merger(const blob_merger * merger)
+	{
+		blob_mrg = merger;
+		return 0;
+	}
 	
-	inline overlay_dtable() : tables(NULL), table_count(0) {}
+	/* Deltas with no older value in the overlay are normally merged with a
+	 * nonexistent value to get complete values. If the overlay only covers
+	 * the newer part of the data (e.g. when combining only some dtables),
+	 * call this so that they are left as deltas instead. */
+	inline void set_partial(bool partial)
+	{
+		this->partial = partial;
+	}
+	
+	inline overlay_dtable() : tables(NULL), table_count(0), partial(false) {}
 	int init(dtable * dt1, ...);
 	int init(dtable ** dts, size_t count);
 	/* overlay_dtable has a public destructor (and no factory) */
@@ -56,6 +76,7 @@ private:
 		virtual metablob meta() const;
 		virtual blob value() const;
 		virtual const dtable * source() const;
+		virtual bool skip_zones(const zone_test & test);
 		inline iter(const overlay_dtable * source);
 		virtual ~iter();
 		
@@ -68,14 +89,24 @@ private:
 			inline sub() : key(0u) {}
 		};
 		
+		blob merged_value() const;
+		
 		sub * subs;
 		size_t current_index;
 		enum direction {FORWARD, BACKWARD} lastdir;
 		bool past_beginning;
+		/* with a blob merger, the merged value at the current position, so
+		 * that meta() and value() together only do the merge once */
+		mutable blob merged;
+		mutable bool merged_valid;
 	};
 	
+	/* merges a delta with the values in tables[index] and older */
+	blob merge_older(const dtype & key, blob value, size_t index) const;
+	
 	dtable ** tables;
 	size_t table_count;
+	bool partial;
 };
 
 #endif /* __OVERLAY_DTABLE_H */
@@ -2,7 +2,9 @@
  * of the University of California. It is distributed under the terms of
  * version 2 of the GNU GPL. See the file LICENSE for details. */
 
+#include <errno.h>
 #include <stdlib.h>
+#include <inttypes.h>
 
 #include "dtable_factory.h"
 #include "ctable_factory.h"
@@ -72,6 +74,23 @@ bool params::get(const istr & name, int * value, int dfl) const
 	return true;
 }
 
+bool params::get(const istr & name, uint64_t * value, uint64_t dfl) const
+{
+	const param * p;
+	if(!simple_find(name, &p))
+	{
+		*value = dfl;
+		return true;
+	}
+	if(p->type == param::INT && p->i >= 0)
+		*value = p->i;
+	else if(p->type == param::U64)
+		*value = p->u;
+	else
+		return false;
+	return true;
+}
+
 bool params::get(const istr & name, float * value, float dfl) const
 {
 	const param * p;
@@ -186,9 +205,10 @@ bool params::get_seq_impl(const istr & prefix, const istr & postfix, size_t coun
 	return true;
 }
 
-/* force get_seq_impl to instantiate for the six types we need */
+/* force get_seq_impl to instantiate for the seven types we need */
 template bool params::get_seq_impl<bool>(const istr & prefix, const istr & postfix, size_t count, bool variable, std::vector<bool> * value, const bool & dfl) const;
 template bool params::get_seq_impl<int>(const istr & prefix, const istr & postfix, size_t count, bool variable, std::vector<int> * value, const int & dfl) const;
+template bool params::get_seq_impl<uint64_t>(const istr & prefix, const istr & postfix, size_t count, bool variable, std::vector<uint64_t> * value, const uint64_t & dfl) const;
 template bool params::get_seq_impl<float>(const istr & prefix, const istr & postfix, size_t count, bool variable, std::vector<float> * value, const float & dfl) const;
 template bool params::get_seq_impl<istr>(const istr & prefix, const istr & postfix, size_t count, bool variable, std::vector<istr> * value, const istr & dfl) const;
 template bool params::get_seq_impl<blob>(const istr & prefix, const istr & postfix, size_t count, bool variable, std::vector<blob> * value, const blob & dfl) const;
@@ -208,6 +228,9 @@ void params::print() const
 			case param::INT:
 				printf("int %d ", (*iter).second.i);
 				break;
+			case param::U64:
+				printf("u64 %" PRIu64 " ", (*iter).second.u);
+				break;
 			case param::FLT:
 				printf("flt %f ", (*iter).second.f);
 				break;
@@ -281,6 +304,8 @@ params::keyword params::parse_type(const char * type)
 		return BOOL;
 	if(!strcmp(type, "int"))
 		return INT;
+	if(!strcmp(type, "uint64"))
+		return UINT64;
 	if(!strcmp(type, "float"))
 		return FLOAT;
 	if(!strcmp(type, "string"))
@@ -354,6 +379,19 @@ int params::parse(token_stream * tokens, params * result)
 					result->set(name, (int) i);
 					break;
 				}
+				case UINT64:
+				{
+					char * end = NULL;
+					/* strtoull() would quietly negate a leading minus */
+					if(*token == '-')
+						return -1;
+					errno = 0;
+					unsigned long long u = strtoull(token, &end, 0);
+					if((end && *end) || errno)
+						return -1;
+					result->set(name, (uint64_t) u);
+					break;
+				}
 				case FLOAT:
 				{
 					char * end = NULL;
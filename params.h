@@ -42,6 +42,8 @@ public:
 	/* these return false on a type mismatch */
 	bool get(const istr & name, bool * value, bool dfl = false) const;
 	bool get(const istr & name, int * value, int dfl = 0) const;
+	/* also accepts non-negative ints */
+	bool get(const istr & name, uint64_t * value, uint64_t dfl = 0) const;
 	bool get(const istr & name, float * value, float dfl = 0) const;
 	bool get(const istr & name, istr * value, const istr & dfl = NULL) const;
 	bool get(const istr & name, blob * value, const blob & dfl = blob()) const;
@@ -53,6 +55,8 @@ public:
 	{ return get_seq_impl<bool>(prefix, postfix, count, variable, value, dfl); }
 	inline bool get_seq(const istr & prefix, const istr & postfix, size_t count, bool variable, std::vector<int> * value, int dfl = 0) const
 	{ return get_seq_impl<int>(prefix, postfix, count, variable, value, dfl); }
+	inline bool get_seq(const istr & prefix, const istr & postfix, size_t count, bool variable, std::vector<uint64_t> * value, uint64_t dfl = 0) const
+	{ return get_seq_impl<uint64_t>(prefix, postfix, count, variable, value, dfl); }
 	inline bool get_seq(const istr & prefix, const istr & postfix, size_t count, bool variable, std::vector<float> * value, float dfl = 0) const
 	{ return get_seq_impl<float>(prefix, postfix, count, variable, value, dfl); }
 	inline bool get_seq(const istr & prefix, const istr & postfix, size_t count, bool variable, std::vector<istr> * value, const istr & dfl = NULL) const
@@ -89,7 +93,7 @@ public:
 	static int parse(const char * input, params * result);
 	
 private:
-	enum keyword { ERROR, BOOL, INT, FLOAT, STRING, CLASS, CLASS_DT, CLASS_CT, CLASS_IDX, BLOB, CONFIG };
+	enum keyword { ERROR, BOOL, INT, UINT64, FLOAT, STRING, CLASS, CLASS_DT, CLASS_CT, CLASS_IDX, BLOB, CONFIG };
 	static inline enum keyword parse_type(const char * type);
 	static int parse(token_stream * tokens, params * result);
 	
@@ -111,11 +115,12 @@ private:
 
 struct params::param
 {
-	enum { BOOL, INT, FLT, STR, BLB, PRM } type;
+	enum { BOOL, INT, U64, FLT, STR, BLB, PRM } type;
 	union
 	{
 		bool b;
 		int i;
+		uint64_t u;
 		float f;
 	};
 	/* alas, we can't put these in the union */
@@ -125,6 +130,7 @@ struct params::param
 	inline param() : type(INT), i(0) {}
 	inline param(bool x) : type(BOOL), b(x) {}
 	inline param(int x) : type(INT), i(x) {}
+	inline param(uint64_t x) : type(U64), u(x) {}
 	inline param(float x) : type(FLT), f(x) {}
 	inline param(const istr & x) : type(STR), i(0), s(x) {}
 	/* this is necessary so const char * doesn't end up being used as bool */
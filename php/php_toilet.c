@@ -239,7 +239,7 @@ static void rowset_to_array(t_rowset * rowset, zval * array)
 {
 	size_t i, max = toilet_rowset_size(rowset);
 	for(i = 0; i < max; i++)
-		add_next_index_long(array, toilet_rowset_row(rowset, i));
+		add_next_index_long(array, (long) toilet_rowset_row(rowset, i));
 	toilet_put_rowset(rowset);
 }
 
@@ -404,7 +404,7 @@ PHP_FUNCTION(gtable_new_row)
 	ZEND_FETCH_RESOURCE(gtable, t_gtable *, &zgtable, -1, PHP_GTABLE_RES_NAME, le_gtable);
 	if(toilet_new_row(gtable, &rowid) < 0)
 		RETURN_NULL();
-	RETURN_LONG(rowid);
+	RETURN_LONG((long) rowid);
 }
 
 /* takes a gtable, returns a long */
@@ -420,19 +420,16 @@ PHP_FUNCTION(gtable_maintain)
 
 static void row_hash_populate_column(zval * hash, t_row * row, const char * name, t_type type)
 {
-	t_value id_value;
 	const t_value * value;
 	if(!strcmp(name, "id"))
 	{
-		id_value.v_int = toilet_row_id(row);
-		value = &id_value;
-	}
-	else
-	{
-		value = toilet_row_value(row, name, type);
-		if(!value)
-			return;
+		/* the row ID is not a column, so it has no t_value */
+		add_assoc_long(hash, (char *) name, (long) toilet_row_id(row));
+		return;
 	}
+	value = toilet_row_value(row, name, type);
+	if(!value)
+		return;
 	switch(type)
 	{
 		case T_INT:
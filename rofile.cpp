@@ -29,3 +29,52 @@ void rofile::close()
 		fd = -1;
 	}
 }
+
+void rofile::reset_readahead()
+{
+	for(size_t i = 0; i < ROFILE_READAHEAD_STREAMS; i++)
+	{
+		streams[i].next = -1;
+		streams[i].ahead = 0;
+		streams[i].run = 0;
+	}
+	next_stream = 0;
+}
+
+size_t rofile::readahead(off_t index, off_t page_count, off_t * start) const
+{
+	size_t i;
+	off_t end;
+	for(i = 0; i < ROFILE_READAHEAD_STREAMS; i++)
+		if(streams[i].next == index || streams[i].next == index + 1)
+			break;
+	if(i == ROFILE_READAHEAD_STREAMS)
+	{
+		/* start a new stream, replacing the oldest one */
+		i = next_stream;
+		next_stream = (next_stream + 1) % ROFILE_READAHEAD_STREAMS;
+		streams[i].next = index + 1;
+		streams[i].ahead = index + 1;
+		streams[i].run = 0;
+		return 0;
+	}
+	if(streams[i].next == index + 1)
+		/* the same page again */
+		return 0;
+	streams[i].next = index + 1;
+	if(++streams[i].run < ROFILE_READAHEAD_TRIGGER)
+		return 0;
+	if(streams[i].ahead < index + 1)
+		streams[i].ahead = index + 1;
+	/* top up the window only once half of it has been used */
+	if(streams[i].ahead > index + 1 + ROFILE_READAHEAD_PAGES / 2)
+		return 0;
+	end = index + 1 + ROFILE_READAHEAD_PAGES;
+	if(end > page_count)
+		end = page_count;
+	if(end <= streams[i].ahead)
+		return 0;
+	*start = streams[i].ahead;
+	streams[i].ahead = end;
+	return end - *start;
+}
@@ -8,6 +8,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
 
@@ -18,12 +19,28 @@
 #include "istr.h"
 #include "util.h"
 #include "locking.h"
+#include "io_limiter.h"
+#include "rofile_pool.h"
 
 /* This class provides a stdio-like wrapper around a read-only file descriptor,
  * keeping track of several buffers for file data preread from different parts
  * of the file but not yet requested by the rest of the application. We expect
  * the file system buffer cache to do most of the real caching work; this class
- * just amortizes the cost of system calls over many small read requests. */
+ * just amortizes the cost of system calls over many small read requests. If
+ * the shared rofile pool is enabled (see rofile_pool.h), rofiles opened while
+ * it is enabled use it instead of their own private buffers. */
+
+/* Each rofile also watches for sequential access to its pages, and reads ahead
+ * when it sees any: with posix_fadvise() normally, or by asking the shared pool
+ * to prefetch pages when using it. We track a few separate streams since many
+ * dtables read keys and values from different parts of the file in parallel.
+ * This way every constituent of an overlay_dtable (for instance) reads ahead
+ * by itself whenever an iterator scans through it. */
+#define ROFILE_READAHEAD_STREAMS 4
+/* the number of sequential pages to see before starting to read ahead */
+#define ROFILE_READAHEAD_TRIGGER 2
+/* the number of pages to keep read ahead of the current one */
+#define ROFILE_READAHEAD_PAGES 8
 
 class rofile
 {
@@ -77,18 +94,37 @@ public:
 	/* size of file in bytes */
 	inline off_t size() const { return f_size; }
 	
+	/* hits and misses in the shared rofile pool, if this rofile uses it */
+	inline const rofile_pool::stats & pool_stats() const { return stats; }
+	
 	/* public so callers can lock it with scopelocks */
 	mutable init_mutex lock;
 	
 protected:
 	/* reset all buffers */
 	virtual void reset() = 0;
+	void reset_readahead();
 	
 	int fd;
 	off_t f_size;
 	mutable size_t last_buffer;
-
+	mutable rofile_pool::stats stats;
+	
+	/* Call with each page index as it is used. Returns the number of pages to
+	 * read ahead, starting at *start, or 0 if none should be read ahead now.
+	 * Only a heuristic: concurrent callers may confuse it, but not break it. */
+	size_t readahead(off_t index, off_t page_count, off_t * start) const;
+	
 private:
+	struct stream
+	{
+		/* the next page we expect, and the first one not yet read ahead */
+		off_t next, ahead;
+		int run;
+	};
+	mutable stream streams[ROFILE_READAHEAD_STREAMS];
+	mutable size_t next_stream;
+	
 	struct buffer_base
 	{
 		off_t offset;
@@ -210,7 +246,10 @@ public:
 	{
 		ssize_t left = size;
 		if(size > buffer_size)
+		{
+			io_limiter::charge(size);
 			return pread(fd, data, size, offset);
+		}
 		scopelock scope(lock, do_lock);
 		lock.assert_locked();
 		/* we will need at most two buffers now */
@@ -254,6 +293,7 @@ private:
 	
 	virtual void reset()
 	{
+		reset_readahead();
 		lru_count = 0;
 		last_buffer = 0;
 		for(size_t i = 0; i < buffer_count; i++)
@@ -296,13 +336,111 @@ private:
 				max_age = age;
 			}
 		}
-		bool ok = buffers[max_idx].load(fd, offset, f_size, lru_count);
+		bool ok;
+		io_limiter::charge(buffer_size);
+		ok = buffers[max_idx].load(fd, offset, f_size, lru_count);
 		if(ok)
+		{
+			off_t start;
+			size_t count = readahead(offset / buffer_size, (f_size + buffer_size - 1) / buffer_size, &start);
+			if(count)
+				/* let the kernel do the actual work */
+				posix_fadvise(fd, start * buffer_size, count * buffer_size, POSIX_FADV_WILLNEED);
 			last_buffer = max_idx;
+		}
 		return ok;
 	}
 };
 
+/* buffer_size is in bytes */
+template<ssize_t buffer_size>
+class rofile_pooled : public rofile
+{
+public:
+	virtual ssize_t read(off_t offset, void * data, ssize_t size, bool do_lock) const
+	{
+		ssize_t left = size;
+		if(size > buffer_size)
+		{
+			io_limiter::charge(size);
+			return pread(fd, data, size, offset);
+		}
+		/* the pool does its own locking, so we ignore do_lock */
+		while(left)
+		{
+			off_t start = offset % buffer_size;
+			prefetch(offset / buffer_size);
+			rofile_pool::page * page = rofile_pool::acquire(file, fd, offset - start, buffer_size, &stats);
+			if(!page)
+				break;
+			ssize_t total = page->size - start;
+			if(total <= 0)
+			{
+				rofile_pool::release(page);
+				break;
+			}
+			if(left < total)
+				total = left;
+			util::memcpy(data, &page->data[start], total);
+			rofile_pool::release(page);
+			offset += total;
+			data = &((uint8_t *) data)[total];
+			left -= total;
+			if(start + total < buffer_size && left)
+				/* short page: end of file */
+				break;
+		}
+		return size - left;
+	}
+	
+	virtual const void * page(off_t index)
+	{
+		off_t offset = index * buffer_size;
+		lock.assert_locked();
+		/* keep the last page pinned so the pointer stays valid */
+		if(last_page && last_page->offset == offset)
+			return last_page->data;
+		if(last_page)
+			rofile_pool::release(last_page);
+		prefetch(index);
+		last_page = rofile_pool::acquire(file, fd, offset, buffer_size, &stats);
+		return last_page ? last_page->data : NULL;
+	}
+	
+	inline rofile_pooled() : last_page(NULL), file(rofile_pool::new_file()) {}
+	virtual ~rofile_pooled()
+	{
+		if(last_page)
+			rofile_pool::release(last_page);
+		rofile_pool::forget(file);
+	}
+	
+private:
+	rofile_pool::page * last_page;
+	uint32_t file;
+	
+	inline void prefetch(off_t index) const
+	{
+		off_t start;
+		size_t count = readahead(index, (f_size + buffer_size - 1) / buffer_size, &start);
+		for(size_t i = 0; i < count; i++)
+			rofile_pool::prefetch(file, fd, (start + i) * buffer_size, buffer_size);
+	}
+	
+	virtual void reset()
+	{
+		if(last_page)
+		{
+			rofile_pool::release(last_page);
+			last_page = NULL;
+		}
+		reset_readahead();
+		/* the file may have changed, so get a new identifier */
+		rofile_pool::forget(file);
+		file = rofile_pool::new_file();
+	}
+};
+
 /* the buffer sizes must all match */
 #define ROFILE_IMPL(buffer_size, buffer_count, method) \
 	rofile_impl<(buffer_size) * 1024, buffer_count, buffer<(buffer_size) * 1024, method##_buffer<(buffer_size) * 1024> > >
@@ -310,7 +448,11 @@ private:
 template<ssize_t buffer_size, int buffer_count>
 rofile * rofile::open(int dfd, const char * file)
 {
-	rofile * size = new ROFILE_IMPL(buffer_size, buffer_count, pread);
+	rofile * size;
+	if(rofile_pool::enabled())
+		size = new rofile_pooled<buffer_size * 1024>;
+	else
+		size = new ROFILE_IMPL(buffer_size, buffer_count, pread);
 	if(size)
 	{
 		int r = size->open(dfd, file);
@@ -326,7 +468,12 @@ rofile * rofile::open(int dfd, const char * file)
 template<ssize_t buffer_size, int buffer_count>
 rofile * rofile::open_mmap(int dfd, const char * file)
 {
-	rofile * size = new ROFILE_IMPL(buffer_size, buffer_count, mmap);
+	rofile * size;
+	/* the pool takes priority, since its budget is shared across all files */
+	if(rofile_pool::enabled())
+		size = new rofile_pooled<buffer_size * 1024>;
+	else
+		size = new ROFILE_IMPL(buffer_size, buffer_count, mmap);
 	if(size)
 	{
 		int r = size->open(dfd, file);
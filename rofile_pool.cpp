@@ -0,0 +1,675 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "params.h"
+#include "io_limiter.h"
+#include "rofile_pool.h"
+
+#if HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* the number of prefetch reads which may be outstanding at once */
+#define ROFILE_URING_ENTRIES 64
+#endif
+
+/* The 2Q parameters: the FIFO queue (a1in) may use up to 1/4 of the budget,
+ * and we remember evicted pages worth up to 1/2 of the budget (a1out). These
+ * are the values recommended by Johnson and Shasha in the original paper. */
+#define A1IN_SHARE 4
+#define A1OUT_SHARE 2
+
+size_t rofile_pool::budget = 0;
+size_t rofile_pool::used = 0;
+size_t rofile_pool::a1in_used = 0;
+size_t rofile_pool::ghost_used = 0;
+size_t rofile_pool::loading_used = 0;
+uint32_t rofile_pool::next_file = 0;
+init_mutex rofile_pool::lock;
+init_cond rofile_pool::loaded;
+rofile_pool::page_list rofile_pool::a1in;
+rofile_pool::page_list rofile_pool::am;
+rofile_pool::ghost_list rofile_pool::a1out;
+rofile_pool::page_map rofile_pool::pages;
+rofile_pool::ghost_map rofile_pool::ghosts;
+rofile_pool::file_map rofile_pool::files;
+rofile_pool::fd_map rofile_pool::fds;
+init_cond rofile_pool::requested;
+rofile_pool::request_list rofile_pool::requests;
+int rofile_pool::threads = 0;
+bool rofile_pool::stopping = false;
+#if HAVE_IO_URING
+rofile_pool::uring rofile_pool::ring;
+#endif
+/* this must be last, so that it will be destroyed first */
+rofile_pool::stopper rofile_pool::stop;
+
+rofile_pool::page * rofile_pool::acquire(uint32_t file, int fd, off_t offset, ssize_t page_size, stats * stats)
+{
+	page * page;
+	ssize_t size;
+	page_key key(file, offset);
+	scopelock scope(lock);
+	for(;;)
+	{
+		page_map::iterator it = pages.find(key);
+		if(it == pages.end())
+			break;
+		page = it->second;
+		if(page->queue == page::LOADING)
+		{
+			/* someone else is reading it in; wait for them */
+			scope.wait(loaded);
+			continue;
+		}
+		if(stats)
+			stats->hits++;
+		if(page->prefetched)
+		{
+			/* the first real reference */
+			page->prefetched = false;
+			promote(page);
+		}
+		else if(page->queue == page::AM)
+		{
+			/* move it to the front of the LRU queue */
+			am.erase(page->position);
+			am.push_front(page);
+			page->position = am.begin();
+		}
+		/* pages in a1in stay where they are: a second reference soon after
+		 * the first is likely to be correlated, and should not promote it */
+		page->pins++;
+		return page;
+	}
+	if(stats)
+		stats->misses++;
+	
+	page = start_load(key, page_size);
+	if(!page)
+		return NULL;
+	
+	/* read it in without holding the lock */
+	scope.unlock();
+	io_limiter::charge(page_size);
+	size = pread(fd, page->data, page_size, offset);
+	scope.lock();
+	
+	if(!finish_load(page, page_size, size))
+		return NULL;
+	return page;
+}
+
+void rofile_pool::prefetch(uint32_t file, int fd, off_t offset, ssize_t page_size)
+{
+	page * page;
+	request request;
+	page_key key(file, offset);
+	scopelock scope(lock);
+	if(!budget || pages.find(key) != pages.end())
+		return;
+	/* the rofile may be closed before the read is done */
+	request.fd = get_fd(file, fd);
+	if(!request.fd)
+		return;
+	page = start_load(key, page_size, true);
+	if(!page)
+	{
+		put_fd(request.fd);
+		return;
+	}
+	request.target = page;
+	request.size = page_size;
+#if HAVE_IO_URING
+	if(ring.init() >= 0)
+	{
+		scope.unlock();
+		if(ring.submit(request) >= 0)
+		{
+			io_limiter::charge(page_size);
+			return;
+		}
+		scope.lock();
+		/* the ring is full; fall back to the thread pool */
+	}
+#endif
+	if(!threads && !stopping)
+	{
+		for(int i = 0; i < ROFILE_PREFETCH_THREADS; i++)
+		{
+			pthread_t thread;
+			if(pthread_create(&thread, NULL, prefetch_thread, NULL))
+				break;
+			pthread_detach(thread);
+			threads++;
+		}
+		if(!threads)
+		{
+			put_fd(request.fd);
+			finish_load(page, page_size, -1);
+			return;
+		}
+	}
+	requests.push_back(request);
+	scope.signal(requested);
+	scope.unlock();
+	/* charge it to the thread that wanted it */
+	io_limiter::charge(page_size);
+}
+
+/* must be called with the lock held; returns a new reference to the file's
+ * prefetch descriptor, duplicating the rofile's descriptor the first time */
+rofile_pool::shared_fd * rofile_pool::get_fd(uint32_t file, int fd)
+{
+	shared_fd * shared;
+	fd_map::iterator it = fds.find(file);
+	if(it != fds.end())
+	{
+		it->second->refs++;
+		return it->second;
+	}
+	shared = new shared_fd;
+	if(!shared)
+		return NULL;
+	shared->fd = dup(fd);
+	if(shared->fd < 0)
+	{
+		delete shared;
+		return NULL;
+	}
+	/* one for the map, and one for the caller */
+	shared->refs = 2;
+	fds[file] = shared;
+	return shared;
+}
+
+/* must be called with the lock held */
+void rofile_pool::put_fd(shared_fd * fd)
+{
+	if(--fd->refs)
+		return;
+	::close(fd->fd);
+	delete fd;
+}
+
+/* must be called with the lock held; returns a pinned page in LOADING state */
+rofile_pool::page * rofile_pool::start_load(const page_key & key, ssize_t page_size, bool speculative)
+{
+	page * page;
+	if(!make_room(page_size, speculative))
+		return NULL;
+	page = new struct page;
+	if(!page)
+		return NULL;
+	page->data = (uint8_t *) malloc(page_size);
+	if(!page->data)
+	{
+		delete page;
+		return NULL;
+	}
+	page->offset = key.offset;
+	page->size = 0;
+	page->file = key.file;
+	page->pins = 1;
+	page->queue = page::LOADING;
+	page->doomed = false;
+	page->prefetched = speculative;
+	used += page_size;
+	loading_used += page_size;
+	pages[key] = page;
+	page_list & list = files[key.file];
+	list.push_front(page);
+	page->file_position = list.begin();
+	return page;
+}
+
+/* must be called with the lock held; returns false (and frees the page) on failure */
+bool rofile_pool::finish_load(page * page, ssize_t page_size, ssize_t size)
+{
+	loading_used -= page_size;
+	if(size <= 0 || page->doomed)
+	{
+		/* forget() already took doomed pages out of the map */
+		if(!page->doomed)
+			detach(page);
+		used -= page_size;
+		loaded.broadcast();
+		free(page->data);
+		delete page;
+		return false;
+	}
+	page->size = size;
+	/* the last page of a file may be short */
+	used -= page_size - size;
+	
+	page->queue = page::A1IN;
+	a1in.push_front(page);
+	page->position = a1in.begin();
+	a1in_used += size;
+	/* prefetching is not a reference, so wait until it is actually read */
+	if(!page->prefetched)
+		promote(page);
+	loaded.broadcast();
+	return true;
+}
+
+/* must be called with the lock held; moves a page in a1in to am if it was
+ * evicted from a1in recently, since that makes it hot */
+void rofile_pool::promote(page * page)
+{
+	ghost_map::iterator ghost = ghosts.find(page_key(page->file, page->offset));
+	assert(page->queue == page::A1IN);
+	if(ghost == ghosts.end())
+		return;
+	ghost_used -= ghost->second.second;
+	a1out.erase(ghost->second.first);
+	ghosts.erase(ghost);
+	a1in.erase(page->position);
+	a1in_used -= page->size;
+	page->queue = page::AM;
+	am.push_front(page);
+	page->position = am.begin();
+}
+
+/* called without the lock held, by whichever backend did the read */
+void rofile_pool::complete(const request & request, ssize_t size)
+{
+	scopelock scope(lock);
+	put_fd(request.fd);
+	if(finish_load(request.target, request.size, size))
+		request.target->pins--;
+}
+
+void * rofile_pool::prefetch_thread(void * arg)
+{
+	scopelock scope(lock);
+	for(;;)
+	{
+		while(requests.empty() && !stopping)
+			scope.wait(requested);
+		if(stopping)
+			break;
+		request request = requests.front();
+		requests.pop_front();
+		scope.unlock();
+		ssize_t size = pread(request.fd->fd, request.target->data, request.size, request.target->offset);
+		complete(request, size);
+		scope.lock();
+	}
+	threads--;
+	scope.broadcast(requested);
+	return NULL;
+}
+
+rofile_pool::stopper::~stopper()
+{
+#if HAVE_IO_URING
+	ring.stop();
+#endif
+	scopelock scope(lock);
+	stopping = true;
+	scope.broadcast(requested);
+	while(threads)
+		scope.wait(requested);
+}
+
+void rofile_pool::release(page * page)
+{
+	scopelock scope(lock);
+	assert(page->pins > 0);
+	if(!--page->pins && page->queue == page::ORPHAN)
+		free_page(page);
+}
+
+void rofile_pool::forget(uint32_t file)
+{
+	file_map::iterator it;
+	scopelock scope(lock);
+	/* each pass removes the first page, and the entry goes with the last */
+	while((it = files.find(file)) != files.end())
+	{
+		page * page = it->second.front();
+		if(page->queue == page::LOADING)
+		{
+			/* a prefetch is still in progress; it will free the page */
+			detach(page);
+			page->doomed = true;
+			continue;
+		}
+		unlink(page);
+		if(page->pins)
+			/* someone else still has it; free it when they're done */
+			page->queue = page::ORPHAN;
+		else
+			free_page(page);
+	}
+	/* also drop any prefetch requests which have not started yet */
+	for(request_list::iterator req = requests.begin(); req != requests.end();)
+		if(req->target->file == file)
+		{
+			put_fd(req->fd);
+			req->target->doomed = true;
+			finish_load(req->target, req->size, -1);
+			req = requests.erase(req);
+		}
+		else
+			++req;
+	fd_map::iterator fd = fds.find(file);
+	if(fd != fds.end())
+	{
+		/* requests in progress may still hold references */
+		put_fd(fd->second);
+		fds.erase(fd);
+	}
+}
+
+uint32_t rofile_pool::new_file()
+{
+	scopelock scope(lock);
+	return next_file++;
+}
+
+void rofile_pool::set_budget(size_t bytes)
+{
+	scopelock scope(lock);
+	budget = bytes;
+	make_room(0);
+}
+
+size_t rofile_pool::get_used()
+{
+	scopelock scope(lock);
+	return used;
+}
+
+int rofile_pool::configure(const params & config)
+{
+	int value;
+	if(!config.get("budget", &value, 0) || value < 0)
+		return -EINVAL;
+	set_budget(value * (size_t) 1024);
+	return 0;
+}
+
+/* must be called with the lock held */
+bool rofile_pool::make_room(size_t needed, bool speculative)
+{
+	bool room = true;
+	while(used + needed > budget)
+	{
+		page_list * first = &am;
+		page_list * second = &a1in;
+		if(speculative)
+		{
+			/* a prefetch is not worth losing a page that has been used
+			 * more than once; in-flight prefetches are not in a1in yet,
+			 * so this also keeps them from flushing am during a scan */
+			if(!evict(&a1in))
+			{
+				room = false;
+				break;
+			}
+			continue;
+		}
+		if(a1in_used + loading_used > budget / A1IN_SHARE || am.empty())
+		{
+			first = &a1in;
+			second = &am;
+		}
+		/* if everything is pinned, we just go over budget for now */
+		if(!evict(first) && !evict(second))
+			break;
+	}
+	while(ghost_used > budget / A1OUT_SHARE && !a1out.empty())
+	{
+		ghost_map::iterator ghost = ghosts.find(a1out.back());
+		ghost_used -= ghost->second.second;
+		ghosts.erase(ghost);
+		a1out.pop_back();
+	}
+	return room;
+}
+
+/* evict the oldest unpinned page in the given queue, if there is one */
+bool rofile_pool::evict(page_list * queue)
+{
+	page_list::reverse_iterator it;
+	for(it = queue->rbegin(); it != queue->rend(); ++it)
+		if(!(*it)->pins)
+			break;
+	if(it == queue->rend())
+		return false;
+	page * page = *it;
+	/* remember it in a1out, unless it was prefetched while still there */
+	if(page->queue == page::A1IN && ghosts.find(page_key(page->file, page->offset)) == ghosts.end())
+	{
+		page_key key(page->file, page->offset);
+		a1out.push_front(key);
+		ghosts[key] = std::make_pair(a1out.begin(), page->size);
+		ghost_used += page->size;
+	}
+	unlink(page);
+	free_page(page);
+	return true;
+}
+
+/* remove a page from the map and its file's list */
+void rofile_pool::detach(page * page)
+{
+	file_map::iterator file = files.find(page->file);
+	pages.erase(page_key(page->file, page->offset));
+	assert(file != files.end());
+	file->second.erase(page->file_position);
+	if(file->second.empty())
+		files.erase(file);
+}
+
+/* remove a page from the map and its queue, but don't free it */
+void rofile_pool::unlink(page * page)
+{
+	detach(page);
+	if(page->queue == page::A1IN)
+	{
+		a1in.erase(page->position);
+		a1in_used -= page->size;
+	}
+	else
+	{
+		assert(page->queue == page::AM);
+		am.erase(page->position);
+	}
+}
+
+void rofile_pool::free_page(page * page)
+{
+	used -= page->size;
+	free(page->data);
+	delete page;
+}
+
+#if HAVE_IO_URING
+int rofile_pool::uring::init()
+{
+	struct io_uring_params p;
+	size_t sq_size, cq_size;
+	uint8_t * sq_ptr;
+	uint8_t * cq_ptr;
+	scopelock scope(submit_lock);
+	if(ring_fd >= 0)
+		return 0;
+	if(failed || stopping)
+		return -ENOSYS;
+	/* only try once */
+	failed = true;
+	
+	memset(&p, 0, sizeof(p));
+	ring_fd = syscall(__NR_io_uring_setup, ROFILE_URING_ENTRIES, &p);
+	if(ring_fd < 0)
+	{
+		ring_fd = -1;
+		return -ENOSYS;
+	}
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if((p.features & IORING_FEAT_SINGLE_MMAP) && cq_size > sq_size)
+		sq_size = cq_size;
+	sq_ptr = (uint8_t *) mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if(sq_ptr == MAP_FAILED)
+		goto fail;
+	if(p.features & IORING_FEAT_SINGLE_MMAP)
+		cq_ptr = sq_ptr;
+	else
+	{
+		cq_ptr = (uint8_t *) mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+		if(cq_ptr == MAP_FAILED)
+			goto fail;
+	}
+	sqes = (struct io_uring_sqe *) mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if(sqes == MAP_FAILED)
+		goto fail;
+	
+	sq_head = (volatile unsigned int *) (sq_ptr + p.sq_off.head);
+	sq_tail = (volatile unsigned int *) (sq_ptr + p.sq_off.tail);
+	sq_mask = *(unsigned int *) (sq_ptr + p.sq_off.ring_mask);
+	sq_array = (unsigned int *) (sq_ptr + p.sq_off.array);
+	cq_head = (volatile unsigned int *) (cq_ptr + p.cq_off.head);
+	cq_tail = (volatile unsigned int *) (cq_ptr + p.cq_off.tail);
+	cq_mask = *(unsigned int *) (cq_ptr + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *) (cq_ptr + p.cq_off.cqes);
+	/* never have more outstanding than either queue can hold */
+	entries = (p.sq_entries < p.cq_entries) ? p.sq_entries : p.cq_entries;
+	
+	/* stop() joins it */
+	if(pthread_create(&thread, NULL, reap_thread, this))
+		goto fail;
+	failed = false;
+	return 0;
+	
+fail:
+	/* we don't bother unmapping anything; this should never happen */
+	::close(ring_fd);
+	ring_fd = -1;
+	return -ENOSYS;
+}
+
+/* returns a cleared submission queue entry, or NULL if the queue is full */
+struct io_uring_sqe * rofile_pool::uring::next_sqe(void * user_data)
+{
+	struct io_uring_sqe * sqe;
+	unsigned int tail = *sq_tail;
+	unsigned int index = tail & sq_mask;
+	__sync_synchronize();
+	if(tail - *sq_head >= entries)
+		return NULL;
+	sqe = &sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = (uintptr_t) user_data;
+	sq_array[index] = index;
+	return sqe;
+}
+
+/* submits the entries returned by next_sqe() */
+void rofile_pool::uring::enter(unsigned int count)
+{
+	/* the entries must be visible before the tail update */
+	__sync_synchronize();
+	*sq_tail += count;
+	__sync_synchronize();
+	/* if this fails, the entries stay in the ring and go with the next ones */
+	syscall(__NR_io_uring_enter, ring_fd, count, 0, 0, NULL, 0);
+}
+
+int rofile_pool::uring::submit(const request & req)
+{
+	struct io_uring_sqe * sqe;
+	request * copy;
+	scopelock scope(submit_lock);
+	if(stopping || inflight >= entries)
+		return -EBUSY;
+	copy = new request(req);
+	if(!copy)
+		return -ENOMEM;
+	sqe = next_sqe(copy);
+	if(!sqe)
+	{
+		delete copy;
+		return -EBUSY;
+	}
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = req.fd->fd;
+	sqe->addr = (uintptr_t) req.target->data;
+	sqe->len = req.size;
+	sqe->off = req.target->offset;
+	inflight++;
+	enter(1);
+	return 0;
+}
+
+void rofile_pool::uring::stop()
+{
+	struct io_uring_sqe * sqe;
+	scopelock scope(submit_lock);
+	if(ring_fd < 0 || stopping)
+		return;
+	stopping = true;
+	/* a no-op with no request wakes the reaper up if nothing is in flight;
+	 * otherwise it will exit after the last completion */
+	sqe = next_sqe(NULL);
+	if(sqe)
+	{
+		sqe->opcode = IORING_OP_NOP;
+		enter(1);
+	}
+	else
+		assert(inflight);
+	scope.unlock();
+	pthread_join(thread, NULL);
+	::close(ring_fd);
+	ring_fd = -1;
+}
+
+void rofile_pool::uring::reap()
+{
+	for(;;)
+	{
+		unsigned int head = *cq_head;
+		__sync_synchronize();
+		if(head == *cq_tail)
+		{
+			syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+			continue;
+		}
+		struct io_uring_cqe * cqe = &cqes[head & cq_mask];
+		request * req = (request *) (uintptr_t) cqe->user_data;
+		ssize_t size = cqe->res;
+		bool done;
+		__sync_synchronize();
+		*cq_head = head + 1;
+		if(req)
+		{
+			complete(*req, size);
+			delete req;
+		}
+		submit_lock.lock();
+		if(req)
+			inflight--;
+		done = stopping && !inflight;
+		submit_lock.unlock();
+		if(done)
+			break;
+	}
+}
+
+void * rofile_pool::uring::reap_thread(void * arg)
+{
+	((uring *) arg)->reap();
+	return NULL;
+}
+#endif
@@ -0,0 +1,226 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#ifndef __ROFILE_POOL_H
+#define __ROFILE_POOL_H
+
+#include <list>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <ext/hash_map>
+
+#ifndef __cplusplus
+#error rofile_pool.h is a C++ header file
+#endif
+
+#include "config.h"
+#include "locking.h"
+
+class params;
+
+#if HAVE_IO_URING
+struct io_uring_sqe;
+struct io_uring_cqe;
+#endif
+
+/* number of threads used to service prefetch requests without io_uring */
+#define ROFILE_PREFETCH_THREADS 2
+
+/* The rofile pool is a process-wide cache of file pages shared by all rofiles
+ * opened while it is enabled (see rofile::open()), so that the total memory
+ * used for buffering read-only files is bounded by a single byte budget rather
+ * than growing with the number of open dtables. It uses the 2Q replacement
+ * algorithm, so that a single large scan will not flush out pages which are in
+ * frequent use: pages enter a FIFO queue when first read, and are promoted to
+ * an LRU queue only if they are read again after falling out of the FIFO. */
+
+/* The pool also supports asynchronous prefetching of pages, which rofiles use
+ * to read ahead when they detect sequential access. If io_uring is available
+ * (see configure), the reads are submitted to the kernel all at once;
+ * otherwise a small pool of threads does them with pread(). A prefetched page
+ * does not count as read until it actually is, and prefetching only displaces
+ * pages in the FIFO queue, so read-ahead during a scan cannot flush hot pages
+ * either; if there is no room for a prefetch, it is simply skipped. */
+
+class rofile_pool
+{
+public:
+	struct page
+	{
+		off_t offset;
+		ssize_t size;
+		uint8_t * data;
+	private:
+		uint32_t file;
+		int pins;
+		enum { LOADING, A1IN, AM, ORPHAN } queue;
+		/* set by forget() on pages which are still being prefetched */
+		bool doomed;
+		/* prefetched, and not yet actually read */
+		bool prefetched;
+		std::list<page *>::iterator position;
+		/* in the list of the file's pages, so forget() need not search */
+		std::list<page *>::iterator file_position;
+		friend class rofile_pool;
+	};
+	
+	/* per-file statistics, updated while holding the pool lock */
+	struct stats
+	{
+		size_t hits, misses;
+		inline stats() : hits(0), misses(0) {}
+	};
+	
+	/* Returns the page of the file starting at the given offset, which should
+	 * be a multiple of the page size, reading it in if necessary. The page is
+	 * pinned in the pool until it is passed to release(). If the page could
+	 * not be read, or the offset is past the end of the file, returns NULL. */
+	static page * acquire(uint32_t file, int fd, off_t offset, ssize_t page_size, stats * stats);
+	static void release(page * page);
+	
+	/* Starts reading the page into the pool in the background, if it is not
+	 * already there. This is just a hint, and may be silently ignored. */
+	static void prefetch(uint32_t file, int fd, off_t offset, ssize_t page_size);
+	
+	/* drop all the pages of a file, which must not have any pinned pages */
+	static void forget(uint32_t file);
+	/* get a new file identifier for use with the above */
+	static uint32_t new_file();
+	
+	/* a budget of 0 disables the pool for newly opened rofiles */
+	static void set_budget(size_t bytes);
+	static inline size_t get_budget() { return budget; }
+	/* the memory used by pages, which may briefly exceed the budget */
+	static size_t get_used();
+	/* Configuration parameters: "budget" is the budget in KiB (default 0).
+	 * See also anvil_configure(), which calls this. */
+	static int configure(const params & config);
+	static inline bool enabled() { return budget > 0; }
+	
+private:
+	struct page_key
+	{
+		uint32_t file;
+		off_t offset;
+		inline page_key(uint32_t file, off_t offset) : file(file), offset(offset) {}
+		inline bool operator==(const page_key & x) const { return file == x.file && offset == x.offset; }
+	};
+	struct page_key_hash
+	{
+		inline size_t operator()(const page_key & x) const
+		{
+			return x.file * 2654435761u + (size_t) (x.offset >> 12);
+		}
+	};
+	typedef std::list<page *> page_list;
+	typedef std::list<page_key> ghost_list;
+	typedef __gnu_cxx::hash_map<page_key, page *, page_key_hash> page_map;
+	typedef __gnu_cxx::hash_map<page_key, std::pair<ghost_list::iterator, ssize_t>, page_key_hash> ghost_map;
+	typedef __gnu_cxx::hash_map<uint32_t, page_list> file_map;
+	
+	/* a dup() of a rofile's file descriptor, shared by all its prefetch
+	 * requests so that they can finish even if the rofile is closed first */
+	struct shared_fd
+	{
+		int fd;
+		/* one for each request, plus one while the file is not forgotten */
+		int refs;
+	};
+	struct request
+	{
+		shared_fd * fd;
+		page * target;
+		ssize_t size;
+	};
+	typedef std::list<request> request_list;
+	typedef __gnu_cxx::hash_map<uint32_t, shared_fd *> fd_map;
+	
+#if HAVE_IO_URING
+	/* a minimal io_uring wrapper using the raw system calls */
+	class uring
+	{
+	public:
+		inline uring() : ring_fd(-1), failed(false), stopping(false), inflight(0) {}
+		/* returns < 0 if io_uring is not supported by the kernel */
+		int init();
+		/* returns < 0 if the request could not be submitted */
+		int submit(const request & request);
+		/* waits for outstanding requests, then stops the reaper thread */
+		void stop();
+	private:
+		int ring_fd;
+		bool failed, stopping;
+		pthread_t thread;
+		unsigned int entries, inflight;
+		/* submission queue */
+		volatile unsigned int * sq_head;
+		volatile unsigned int * sq_tail;
+		unsigned int sq_mask;
+		unsigned int * sq_array;
+		struct io_uring_sqe * sqes;
+		/* completion queue */
+		volatile unsigned int * cq_head;
+		volatile unsigned int * cq_tail;
+		unsigned int cq_mask;
+		struct io_uring_cqe * cqes;
+		init_mutex submit_lock;
+		/* must be called with submit_lock held */
+		struct io_uring_sqe * next_sqe(void * user_data);
+		void enter(unsigned int count);
+		void reap();
+		static void * reap_thread(void * arg);
+	};
+	static uring ring;
+#endif
+	
+	static shared_fd * get_fd(uint32_t file, int fd);
+	static void put_fd(shared_fd * fd);
+	static page * start_load(const page_key & key, ssize_t page_size, bool speculative = false);
+	static bool finish_load(page * page, ssize_t page_size, ssize_t size);
+	static void complete(const request & request, ssize_t size);
+	static void * prefetch_thread(void * arg);
+	
+	/* stops the prefetch threads before the static members they use are
+	 * destroyed at exit, since waiting threads would block that forever */
+	struct stopper
+	{
+		~stopper();
+	};
+	
+	/* speculative loads only displace pages in a1in, and fail otherwise */
+	static bool make_room(size_t needed, bool speculative = false);
+	static void promote(page * page);
+	static bool evict(page_list * queue);
+	static void detach(page * page);
+	static void unlink(page * page);
+	static void free_page(page * page);
+	
+	static size_t budget, used, a1in_used, ghost_used;
+	/* pages being read in will (mostly) join a1in, so they count against
+	 * its share too; otherwise prefetching would push hot pages out of am */
+	static size_t loading_used;
+	static uint32_t next_file;
+	static init_mutex lock;
+	static init_cond loaded;
+	/* a1in is the FIFO queue, am is the LRU queue, and a1out remembers the
+	 * keys of pages recently evicted from a1in so we can recognize them */
+	static page_list a1in, am;
+	static ghost_list a1out;
+	static page_map pages;
+	static ghost_map ghosts;
+	/* the pages in the map, grouped by file */
+	static file_map files;
+	/* the descriptors used for prefetching each file */
+	static fd_map fds;
+	/* prefetch requests waiting for a thread */
+	static init_cond requested;
+	static request_list requests;
+	static int threads;
+	static bool stopping;
+	static stopper stop;
+};
+
+#endif /* __ROFILE_POOL_H */
@@ -0,0 +1,298 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#include <assert.h>
+
+#include <algorithm>
+#include <iterator>
+
+#include "row_bitmap.h"
+
+bool row_bitmap::container::add(uint16_t low)
+{
+	if(bitmap)
+	{
+		uint16_t bit = 1 << (low & 15);
+		if(data[low >> 4] & bit)
+			return false;
+		data[low >> 4] |= bit;
+	}
+	else
+	{
+		std::vector<uint16_t>::iterator it = std::lower_bound(data.begin(), data.end(), low);
+		if(it != data.end() && *it == low)
+			return false;
+		if(count == ROW_BITMAP_ARRAY_MAX)
+		{
+			to_bitmap();
+			return add(low);
+		}
+		data.insert(it, low);
+	}
+	count++;
+	return true;
+}
+
+bool row_bitmap::container::contains(uint16_t low) const
+{
+	if(bitmap)
+		return (data[low >> 4] >> (low & 15)) & 1;
+	return std::binary_search(data.begin(), data.end(), low);
+}
+
+uint16_t row_bitmap::container::select(size_t rank, size_t * hint_rank, uint16_t * hint_low) const
+{
+	size_t word = 0, seen = 0;
+	uint16_t bits;
+	assert(rank < count);
+	if(!bitmap)
+		return data[rank];
+	if(*hint_rank <= rank)
+	{
+		/* start counting at the beginning of the hint's word */
+		word = *hint_low >> 4;
+		seen = *hint_rank - __builtin_popcount(data[word] & ((1 << (*hint_low & 15)) - 1));
+	}
+	while(seen + __builtin_popcount(data[word]) <= rank)
+		seen += __builtin_popcount(data[word++]);
+	for(bits = data[word]; seen < rank; seen++)
+		bits &= bits - 1;
+	*hint_rank = rank;
+	*hint_low = (word << 4) + __builtin_ctz(bits);
+	return *hint_low;
+}
+
+void row_bitmap::container::to_bitmap()
+{
+	std::vector<uint16_t> bits(ROW_BITMAP_WORDS, 0);
+	assert(!bitmap);
+	for(size_t i = 0; i < data.size(); i++)
+		bits[data[i] >> 4] |= 1 << (data[i] & 15);
+	data.swap(bits);
+	bitmap = true;
+}
+
+void row_bitmap::container::to_array()
+{
+	std::vector<uint16_t> array;
+	assert(bitmap);
+	array.reserve(count);
+	for(size_t word = 0; word < ROW_BITMAP_WORDS; word++)
+		for(uint16_t bits = data[word]; bits; bits &= bits - 1)
+			array.push_back((word << 4) + __builtin_ctz(bits));
+	data.swap(array);
+	bitmap = false;
+}
+
+void row_bitmap::container::unite(const container & x)
+{
+	assert(high == x.high);
+	if(!bitmap && !x.bitmap && count + x.count <= ROW_BITMAP_ARRAY_MAX)
+	{
+		std::vector<uint16_t> merged;
+		merged.reserve(count + x.count);
+		std::set_union(data.begin(), data.end(), x.data.begin(), x.data.end(), std::back_inserter(merged));
+		data.swap(merged);
+		count = data.size();
+		return;
+	}
+	if(!bitmap)
+		to_bitmap();
+	if(x.bitmap)
+		for(size_t word = 0; word < ROW_BITMAP_WORDS; word++)
+			data[word] |= x.data[word];
+	else
+		for(size_t i = 0; i < x.data.size(); i++)
+			data[x.data[i] >> 4] |= 1 << (x.data[i] & 15);
+	count = 0;
+	for(size_t word = 0; word < ROW_BITMAP_WORDS; word++)
+		count += __builtin_popcount(data[word]);
+	/* the union of two arrays can have duplicates, and might fit after all */
+	if(count <= ROW_BITMAP_ARRAY_MAX)
+		to_array();
+}
+
+void row_bitmap::container::intersect(const container & x)
+{
+	assert(high == x.high);
+	if(!bitmap)
+	{
+		std::vector<uint16_t> result;
+		if(x.bitmap)
+		{
+			for(size_t i = 0; i < data.size(); i++)
+				if(x.contains(data[i]))
+					result.push_back(data[i]);
+		}
+		else
+			std::set_intersection(data.begin(), data.end(), x.data.begin(), x.data.end(), std::back_inserter(result));
+		data.swap(result);
+		count = data.size();
+		return;
+	}
+	if(!x.bitmap)
+	{
+		std::vector<uint16_t> result;
+		for(size_t i = 0; i < x.data.size(); i++)
+			if(contains(x.data[i]))
+				result.push_back(x.data[i]);
+		data.swap(result);
+		count = data.size();
+		bitmap = false;
+		return;
+	}
+	count = 0;
+	for(size_t word = 0; word < ROW_BITMAP_WORDS; word++)
+	{
+		data[word] &= x.data[word];
+		count += __builtin_popcount(data[word]);
+	}
+	if(count <= ROW_BITMAP_ARRAY_MAX)
+		to_array();
+}
+
+row_bitmap::row_bitmap(const row_bitmap & x)
+	: count(0), cursor_valid(false)
+{
+	*this = x;
+}
+
+row_bitmap & row_bitmap::operator=(const row_bitmap & x)
+{
+	if(&x == this)
+		return *this;
+	clear();
+	containers.reserve(x.containers.size());
+	for(size_t i = 0; i < x.containers.size(); i++)
+		containers.push_back(new container(*x.containers[i]));
+	count = x.count;
+	return *this;
+}
+
+size_t row_bitmap::find(uint64_t high) const
+{
+	size_t min = 0, max = containers.size();
+	/* IDs are often added in order, so check the end first */
+	if(max && containers[max - 1]->high < high)
+		return max;
+	while(min < max)
+	{
+		size_t mid = (min + max) / 2;
+		if(containers[mid]->high < high)
+			min = mid + 1;
+		else
+			max = mid;
+	}
+	return min;
+}
+
+bool row_bitmap::add(uint64_t id)
+{
+	uint64_t high = id >> 16;
+	size_t index = find(high);
+	if(index == containers.size() || containers[index]->high != high)
+		containers.insert(containers.begin() + index, new container(high));
+	if(!containers[index]->add(id & 0xFFFF))
+		return false;
+	count++;
+	cursor_valid = false;
+	return true;
+}
+
+bool row_bitmap::contains(uint64_t id) const
+{
+	uint64_t high = id >> 16;
+	size_t index = find(high);
+	if(index == containers.size() || containers[index]->high != high)
+		return false;
+	return containers[index]->contains(id & 0xFFFF);
+}
+
+void row_bitmap::clear()
+{
+	for(size_t i = 0; i < containers.size(); i++)
+		delete containers[i];
+	containers.clear();
+	count = 0;
+	cursor_valid = false;
+}
+
+uint64_t row_bitmap::select(size_t index) const
+{
+	assert(index < count);
+	if(!cursor_valid || index < cursor_index)
+	{
+		cursor_index = 0;
+		cursor_container = 0;
+		cursor_rank = (size_t) -1;
+		cursor_valid = true;
+	}
+	/* skip whole containers */
+	while(index - cursor_index >= containers[cursor_container]->count)
+	{
+		cursor_index += containers[cursor_container++]->count;
+		cursor_rank = (size_t) -1;
+	}
+	const container * c = containers[cursor_container];
+	return (c->high << 16) | c->select(index - cursor_index, &cursor_rank, &cursor_low);
+}
+
+row_bitmap & row_bitmap::operator|=(const row_bitmap & x)
+{
+	size_t i = 0, j = 0;
+	container_list merged;
+	if(&x == this)
+		return *this;
+	merged.reserve(containers.size() + x.containers.size());
+	count = 0;
+	while(i < containers.size() || j < x.containers.size())
+	{
+		if(j == x.containers.size() || (i < containers.size() && containers[i]->high < x.containers[j]->high))
+			merged.push_back(containers[i++]);
+		else if(i == containers.size() || x.containers[j]->high < containers[i]->high)
+			merged.push_back(new container(*x.containers[j++]));
+		else
+		{
+			containers[i]->unite(*x.containers[j++]);
+			merged.push_back(containers[i++]);
+		}
+		count += merged.back()->count;
+	}
+	containers.swap(merged);
+	cursor_valid = false;
+	return *this;
+}
+
+row_bitmap & row_bitmap::operator&=(const row_bitmap & x)
+{
+	size_t i = 0, j = 0;
+	container_list merged;
+	if(&x == this)
+		return *this;
+	count = 0;
+	while(i < containers.size() && j < x.containers.size())
+	{
+		if(containers[i]->high < x.containers[j]->high)
+			delete containers[i++];
+		else if(x.containers[j]->high < containers[i]->high)
+			j++;
+		else
+		{
+			containers[i]->intersect(*x.containers[j++]);
+			if(containers[i]->count)
+			{
+				count += containers[i]->count;
+				merged.push_back(containers[i]);
+			}
+			else
+				delete containers[i];
+			i++;
+		}
+	}
+	while(i < containers.size())
+		delete containers[i++];
+	containers.swap(merged);
+	cursor_valid = false;
+	return *this;
+}
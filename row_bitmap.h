@@ -0,0 +1,83 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#ifndef __ROW_BITMAP_H
+#define __ROW_BITMAP_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifndef __cplusplus
+#error row_bitmap.h is a C++ header file
+#endif
+
+#include <vector>
+
+/* A row bitmap is a compressed set of row IDs, in the style of Roaring bitmaps:
+ * IDs are grouped into containers by their upper 48 bits, and each container
+ * stores the lower 16 bits either as a sorted array (when there are few of
+ * them) or as a 65536-bit bitmap (when there are many). Either way, a
+ * container never needs more than 8KiB, and sparse sets stay small. */
+
+/* containers switch to bitmaps when they would have more entries than this */
+#define ROW_BITMAP_ARRAY_MAX 4096
+#define ROW_BITMAP_WORDS (65536 / 16)
+
+class row_bitmap
+{
+public:
+	/* returns true if the ID was not already present */
+	bool add(uint64_t id);
+	bool contains(uint64_t id) const;
+	inline size_t size() const { return count; }
+	void clear();
+	
+	/* Returns the index-th smallest ID. Sequential calls with increasing
+	 * indices are fast, as the position of the last one is remembered. */
+	uint64_t select(size_t index) const;
+	
+	row_bitmap & operator|=(const row_bitmap & x);
+	row_bitmap & operator&=(const row_bitmap & x);
+	
+	inline row_bitmap() : count(0), cursor_valid(false) {}
+	row_bitmap(const row_bitmap & x);
+	row_bitmap & operator=(const row_bitmap & x);
+	inline ~row_bitmap() { clear(); }
+	
+private:
+	struct container
+	{
+		uint64_t high;
+		bool bitmap;
+		uint32_t count;
+		/* either the sorted low bits, or ROW_BITMAP_WORDS words of bits */
+		std::vector<uint16_t> data;
+		
+		bool add(uint16_t low);
+		bool contains(uint16_t low) const;
+		/* the rank-th smallest value, starting from the hint if possible */
+		uint16_t select(size_t rank, size_t * hint_rank, uint16_t * hint_low) const;
+		void to_bitmap();
+		void to_array();
+		void unite(const container & x);
+		void intersect(const container & x);
+		inline container(uint64_t high) : high(high), bitmap(false), count(0) {}
+	};
+	/* pointers, so that inserting a container does not copy the others */
+	typedef std::vector<container *> container_list;
+	
+	container_list containers;
+	size_t count;
+	/* the position of the last select(): the container, the index of its
+	 * first ID, and the rank and value of the ID within it */
+	mutable size_t cursor_container, cursor_index, cursor_rank;
+	mutable uint16_t cursor_low;
+	mutable bool cursor_valid;
+	
+	/* returns the index of the container with these high bits, or the index
+	 * where it should be inserted if there is no such container */
+	size_t find(uint64_t high) const;
+};
+
+#endif /* __ROW_BITMAP_H */
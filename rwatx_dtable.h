@@ -57,6 +57,7 @@ public:
 	}
 	
 	inline virtual int maintain(bool force = false) { return base->maintain(force); }
+	inline virtual void defer_maintenance(bool defer) { base->defer_maintenance(defer); }
 	
 	DECLARE_WRAP_FACTORY(rwatx_dtable);
 	
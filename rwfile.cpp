@@ -7,13 +7,117 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "openat.h"
 
 #include "util.h"
+#include "locking.h"
+#include "io_limiter.h"
 #include "transaction.h"
 #include "rwfile.h"
 
+__thread bool rwfile::direct_default = false;
+
+/* write all the data, retrying short writes */
+static int write_all(int fd, const uint8_t * data, ssize_t size, off_t offset)
+{
+	while(size)
+	{
+		ssize_t r = pwrite(fd, data, size, offset);
+		if(r <= 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return (r < 0) ? -errno : -1;
+		}
+		data += r;
+		size -= r;
+		offset += r;
+	}
+	return 0;
+}
+
+struct rwfile::direct_writer
+{
+	int fd;
+	bool running, busy, stop;
+	const uint8_t * data;
+	ssize_t size;
+	off_t offset;
+	int result;
+	pthread_t thread;
+	init_mutex lock;
+	init_cond changed;
+	
+	inline direct_writer(int fd) : fd(fd), running(false), busy(false), stop(false), result(0) {}
+	
+	inline int start()
+	{
+		if(pthread_create(&thread, NULL, run, this))
+			return -1;
+		running = true;
+		return 0;
+	}
+	
+	/* finishes any write in progress first */
+	inline ~direct_writer()
+	{
+		if(!running)
+			return;
+		scopelock scope(lock);
+		stop = true;
+		scope.broadcast(changed);
+		scope.unlock();
+		pthread_join(thread, NULL);
+	}
+	
+	/* waits for the previous write and returns its result */
+	int wait()
+	{
+		int r;
+		scopelock scope(lock);
+		while(busy)
+			scope.wait(changed);
+		r = result;
+		result = 0;
+		return r;
+	}
+	
+	/* call wait() first */
+	void submit(const uint8_t * data, ssize_t size, off_t offset)
+	{
+		scopelock scope(lock);
+		assert(!busy);
+		this->data = data;
+		this->size = size;
+		this->offset = offset;
+		busy = true;
+		scope.broadcast(changed);
+	}
+	
+	static void * run(void * arg)
+	{
+		direct_writer * writer = (direct_writer *) arg;
+		scopelock scope(writer->lock);
+		for(;;)
+		{
+			int r;
+			while(!writer->busy && !writer->stop)
+				scope.wait(writer->changed);
+			if(!writer->busy)
+				break;
+			scope.unlock();
+			r = write_all(writer->fd, writer->data, writer->size, writer->offset);
+			scope.lock();
+			writer->result = r;
+			writer->busy = false;
+			scope.broadcast(writer->changed);
+		}
+		return NULL;
+	}
+};
+
 int rwfile::create(int dfd, const char * file, bool tx_external, mode_t mode)
 {
 	if(fd >= 0)
@@ -30,6 +134,9 @@ int rwfile::create(int dfd, const char * file, bool tx_external, mode_t mode)
 	filled = 0;
 	write_offset = 0;
 	handler = NULL;
+	if(direct_default && !tx_external)
+		/* if this fails, we just use the page cache as usual */
+		start_direct();
 	return 0;
 }
 
@@ -55,6 +162,8 @@ int rwfile::open(int dfd, const char * file, off_t end_offset, bool tx_external)
 int rwfile::flush()
 {
 	ssize_t r = 0, written = 0;
+	if(direct)
+		return flush_direct();
 	if(!write_mode || !filled)
 		return 0;
 	if(handler)
@@ -65,6 +174,7 @@ int rwfile::flush()
 	}
 	if(external)
 		tx_start_external();
+	io_limiter::charge(filled);
 	while(written < filled)
 	{
 		r = pwrite(fd, &buffer[written], filled - written, write_offset);
@@ -90,6 +200,12 @@ int rwfile::flush()
 
 int rwfile::close()
 {
+	if(direct)
+	{
+		int r = stop_direct();
+		if(r < 0)
+			return r;
+	}
 	if(write_mode && filled)
 	{
 		int r = flush();
@@ -106,6 +222,12 @@ int rwfile::truncate(off_t end_offset)
 	/* negative offsets are taken to be relative to the end of the file */
 	if(end_offset < 0)
 		end_offset += end();
+	if(direct)
+	{
+		int r = stop_direct();
+		if(r < 0)
+			return r;
+	}
 	if(write_mode && filled)
 	{
 		int r;
@@ -126,6 +248,12 @@ int rwfile::truncate(off_t end_offset)
 int rwfile::set_handler(flush_handler * handler)
 {
 	assert(!external);
+	if(direct)
+	{
+		int r = stop_direct();
+		if(r < 0)
+			return r;
+	}
 	if(write_mode && filled)
 	{
 		int r = flush();
@@ -139,6 +267,12 @@ int rwfile::set_handler(flush_handler * handler)
 int rwfile::set_external(bool tx_external)
 {
 	assert(!handler);
+	if(direct)
+	{
+		int r = stop_direct();
+		if(r < 0)
+			return r;
+	}
 	if(write_mode && filled)
 	{
 		int r = flush();
@@ -160,6 +294,9 @@ ssize_t rwfile::append(const void * data, ssize_t size)
 		filled = 0;
 	}
 	
+	if(direct)
+		return append_direct(data, size);
+	
 	/* handle large writes without the buffer */
 	if(size > buffer_size)
 	{
@@ -175,6 +312,7 @@ ssize_t rwfile::append(const void * data, ssize_t size)
 		}
 		if(external)
 			tx_start_external();
+		io_limiter::charge(size);
 		while(written < size)
 		{
 			/* can't use void * in arithmetic... */
@@ -219,6 +357,88 @@ ssize_t rwfile::append(const void * data, ssize_t size)
 	return orig;
 }
 
+ssize_t rwfile::appendv(const struct iovec * iov, int count)
+{
+	ssize_t r = 0, size = 0, written = 0, total;
+	struct iovec vec[count + 1];
+	int i, first = 0;
+	
+	for(i = 0; i < count; i++)
+		size += iov[i].iov_len;
+	
+	/* switch to write mode if necessary */
+	if(!write_mode)
+	{
+		write_mode = true;
+		filled = 0;
+	}
+	
+	if(direct || filled + size < buffer_size)
+	{
+		/* just copy to the buffer */
+		for(i = 0; i < count; i++)
+		{
+			r = append(iov[i].iov_base, iov[i].iov_len);
+			if(r != (ssize_t) iov[i].iov_len)
+			{
+				written += (r > 0) ? r : 0;
+				return written ? written : r;
+			}
+			written += r;
+		}
+		return written;
+	}
+	
+	vec[0].iov_base = buffer;
+	vec[0].iov_len = filled;
+	util::memcpy(&vec[1], iov, count * sizeof(*iov));
+	total = filled + size;
+	if(handler)
+	{
+		r = handler->pre();
+		if(r < 0)
+			return r;
+	}
+	if(external)
+		tx_start_external();
+	io_limiter::charge(total);
+	while(written < total)
+	{
+		r = pwritev(fd, &vec[first], count + 1 - first, write_offset);
+		if(r <= 0)
+		{
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+		written += r;
+		write_offset += r;
+		/* skip past whatever was written */
+		while(r > 0 && r >= (ssize_t) vec[first].iov_len)
+			r -= vec[first++].iov_len;
+		if(r > 0)
+		{
+			vec[first].iov_base = &((uint8_t *) vec[first].iov_base)[r];
+			vec[first].iov_len -= r;
+		}
+	}
+	if(handler)
+		handler->post();
+	if(external)
+		tx_end_external(true);
+	if(written < filled)
+	{
+		/* part of the buffer was written, so move the rest */
+		if(written)
+			memmove(buffer, &buffer[written], filled - written);
+		filled -= written;
+		return (r < 0) ? r : -1;
+	}
+	written -= filled;
+	filled = 0;
+	return (written || !size) ? written : (r < 0) ? r : -1;
+}
+
 int rwfile::pad(ssize_t size)
 {
 	/* this should suffice for now; it can certainly be improved */
@@ -233,6 +453,13 @@ ssize_t rwfile::read(off_t offset, void * data, ssize_t size)
 	off_t buffer_offset;
 	ssize_t orig = size;
 	
+	if(direct)
+	{
+		int r = stop_direct();
+		if(r < 0)
+			return r;
+	}
+	
 	/* make sure any dirty data is written */
 	if(write_mode && filled)
 	{
@@ -287,3 +514,139 @@ ssize_t rwfile::read(off_t offset, void * data, ssize_t size)
 	
 	return orig - size;
 }
+
+int rwfile::start_direct()
+{
+	uint8_t * larger = NULL;
+	ssize_t size = buffer_size;
+	int flags = fcntl(fd, F_GETFL);
+	assert(!filled && !(write_offset % RWFILE_DIRECT_ALIGN));
+	if(size < RWFILE_DIRECT_BUFFER * 1024)
+		size = RWFILE_DIRECT_BUFFER * 1024;
+	size += RWFILE_DIRECT_ALIGN - 1;
+	size -= size % RWFILE_DIRECT_ALIGN;
+	/* this will fail if the file system does not support O_DIRECT */
+	if(flags < 0 || fcntl(fd, F_SETFL, flags | O_DIRECT) < 0)
+		return -EINVAL;
+	if(size != buffer_size && posix_memalign((void **) &larger, RWFILE_DIRECT_ALIGN, size))
+		goto fail_larger;
+	if(posix_memalign((void **) &spare, RWFILE_DIRECT_ALIGN, size))
+		goto fail_spare;
+	writer = new direct_writer(fd);
+	if(!writer)
+		goto fail_writer;
+	if(writer->start() < 0)
+		goto fail_start;
+	if(larger)
+	{
+		free(buffer);
+		buffer = larger;
+		buffer_size = size;
+	}
+	direct = true;
+	dirty = false;
+	return 0;
+	
+fail_start:
+	delete writer;
+fail_writer:
+	writer = NULL;
+	free(spare);
+fail_spare:
+	spare = NULL;
+	if(larger)
+		free(larger);
+fail_larger:
+	fcntl(fd, F_SETFL, flags);
+	return -ENOMEM;
+}
+
+/* writes everything and switches back to normal mode */
+int rwfile::stop_direct()
+{
+	int flags, r = flush_direct();
+	if(r >= 0)
+	{
+		/* chop off the padding, if any */
+		if(ftruncate(fd, end()) < 0)
+			r = -errno;
+		else
+		{
+			write_offset += filled;
+			filled = 0;
+		}
+	}
+	delete writer;
+	writer = NULL;
+	free(spare);
+	spare = NULL;
+	flags = fcntl(fd, F_GETFL);
+	if(flags >= 0)
+		fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+	direct = false;
+	dirty = false;
+	return r;
+}
+
+ssize_t rwfile::append_direct(const void * data, ssize_t size)
+{
+	ssize_t orig = size;
+	while(size)
+	{
+		ssize_t copy = buffer_size - filled;
+		if(copy > size)
+			copy = size;
+		util::memcpy(&buffer[filled], data, copy);
+		/* can't use void * in arithmetic... */
+		data = &((uint8_t *) data)[copy];
+		size -= copy;
+		filled += copy;
+		dirty = true;
+		if(filled == buffer_size)
+		{
+			/* the buffer is full: swap it with the spare as soon as the
+			 * spare is written, and write it in the background */
+			uint8_t * full = buffer;
+			int r = writer->wait();
+			if(r < 0)
+				return r;
+			buffer = spare;
+			spare = full;
+			io_limiter::charge(filled);
+			writer->submit(full, filled, write_offset);
+			write_offset += filled;
+			filled = 0;
+			dirty = false;
+		}
+	}
+	return orig;
+}
+
+/* O_DIRECT writes must be whole blocks, so we write the last partial block
+ * padded with zeroes, and keep it in the buffer to be written again later */
+int rwfile::flush_direct()
+{
+	ssize_t aligned, padded;
+	int r = writer->wait();
+	if(r < 0 || !dirty)
+		return r;
+	aligned = filled - filled % RWFILE_DIRECT_ALIGN;
+	padded = aligned;
+	if(filled > aligned)
+	{
+		padded += RWFILE_DIRECT_ALIGN;
+		util::memset(&buffer[filled], 0, padded - filled);
+	}
+	io_limiter::charge(padded);
+	r = write_all(fd, buffer, padded, write_offset);
+	if(r < 0)
+		return r;
+	if(aligned)
+	{
+		memmove(buffer, &buffer[aligned], filled - aligned);
+		write_offset += aligned;
+		filled -= aligned;
+	}
+	dirty = false;
+	return 0;
+}
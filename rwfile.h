@@ -7,7 +7,9 @@
 
 #include <assert.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <sys/uio.h>
 #include <sys/types.h>
 
 #ifndef __cplusplus
@@ -22,15 +24,30 @@
  * optionally either calling a given handler or starting an external transaction
  * dependency before doing any writes. Both reads and writes are buffered. */
 
+/* Files created while a direct_scope exists in the creating thread are written
+ * with O_DIRECT instead, so that writing large new dtables (e.g. in digests and
+ * combines) does not push everything else out of the page cache. In this mode
+ * two large aligned buffers are used: one is filled while the other is written
+ * by a background thread. Flushing writes the last partial block padded with
+ * zeroes, and the file is truncated to its real length when it is closed. The
+ * first read, truncate, or change of handler switches back to normal mode. */
+
+/* the alignment required for O_DIRECT writes */
+#define RWFILE_DIRECT_ALIGN 4096
+/* the minimum size of each buffer in direct mode, in KiB */
+#define RWFILE_DIRECT_BUFFER 1024
+
 class rwfile
 {
 public:
 	/* buffer_size is in KiB */
 	inline rwfile(ssize_t buffer_size = 8)
-		: fd(-1), write_mode(true), external(false), filled(0), write_offset(0), handler(NULL), buffer(NULL)
+		: fd(-1), write_mode(true), external(false), direct(false), dirty(false), filled(0), write_offset(0), handler(NULL), buffer(NULL), spare(NULL), writer(NULL)
 	{
 		this->buffer_size = buffer_size * 1024;
-		buffer = new uint8_t[this->buffer_size];
+		/* aligned, in case we switch to direct mode */
+		if(posix_memalign((void **) &buffer, RWFILE_DIRECT_ALIGN, this->buffer_size))
+			buffer = NULL;
 	}
 	
 	inline ~rwfile()
@@ -41,9 +58,28 @@ public:
 			assert(r >= 0);
 		}
 		if(buffer)
-			delete[] buffer;
+			free(buffer);
+		if(spare)
+			free(spare);
 	}
 	
+	/* see above; nests, and can be used to turn direct mode off temporarily */
+	class direct_scope
+	{
+	public:
+		inline direct_scope(bool enable = true) : previous(direct_default)
+		{
+			direct_default = enable;
+		}
+		inline ~direct_scope()
+		{
+			direct_default = previous;
+		}
+	private:
+		bool previous;
+	};
+	
+	/* direct mode is never used for files with handlers or external dependencies */
 	int create(int dfd, const char * file, bool tx_external = false, mode_t mode = 0644);
 	int open(int dfd, const char * file, off_t end_offset, bool tx_external = false);
 	
@@ -77,6 +113,11 @@ public:
 		return external;
 	}
 	
+	inline bool get_direct()
+	{
+		return direct;
+	}
+	
 	/* return the current idea of the end of the file */
 	inline off_t end() const
 	{
@@ -86,6 +127,10 @@ public:
 	/* append some data to the file */
 	ssize_t append(const void * data, ssize_t size);
 	
+	/* append several pieces of data; if they will not fit in the buffer, they are
+	 * written along with it by a single pwritev() straight from the caller's memory */
+	ssize_t appendv(const struct iovec * iov, int count);
+	
 	/* appends padding zeroes to the file */
 	int pad(ssize_t size);
 	
@@ -137,12 +182,27 @@ public:
 	}
 	
 private:
+	/* the background thread used to write buffers in direct mode */
+	struct direct_writer;
+	
+	int start_direct();
+	int stop_direct();
+	ssize_t append_direct(const void * data, ssize_t size);
+	int flush_direct();
+	
 	int fd;
 	bool write_mode, external;
+	/* dirty is only used in direct mode: filled may include data already written */
+	bool direct, dirty;
 	ssize_t filled, buffer_size;
 	off_t read_offset, write_offset;
 	flush_handler * handler;
 	uint8_t * buffer;
+	/* the buffer being written in direct mode */
+	uint8_t * spare;
+	direct_writer * writer;
+	
+	static __thread bool direct_default;
 };
 
 #endif /* __RWFILE_H */
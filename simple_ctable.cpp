@@ -347,6 +347,13 @@ int simple_ctable::insert(const dtype & key, size_t column, const blob & value,
 {
 	int r = 0;
 	assert(column < column_count);
+	if(blind_writes && value.exists())
+	{
+		/* write just this column, without reading the row at all */
+		index_blob delta(column_count);
+		delta.set(column, value);
+		return base->insert(key, delta.flatten_delta(), append);
+	}
 	blob row = base->find(key);
 	if(row.exists() || value.exists())
 	{
@@ -362,13 +369,25 @@ int simple_ctable::insert(const dtype & key, const colval * values, size_t count
 {
 	int r = 0;
 	bool exist = false;
-	blob row = base->find(key);
+	blob row;
 	for(size_t i = 0; i < count; i++)
 		if(values[i].value.exists())
 		{
 			exist = true;
 			break;
 		}
+	if(blind_writes && exist)
+	{
+		/* the row will exist afterward, so we can just write a delta */
+		index_blob delta(column_count);
+		for(size_t i = 0; i < count; i++)
+		{
+			assert(values[i].index < column_count);
+			delta.set(values[i].index, values[i].value);
+		}
+		return base->insert(key, delta.flatten_delta(), append);
+	}
+	row = base->find(key);
 	if(row.exists() || exist)
 	{
 		/* TODO: improve this... it is probably killing us */
@@ -448,6 +467,8 @@ int simple_ctable::init(int dfd, const char * file, const params & config, sys_j
 		return -ENOENT;
 	if(!config.get("base_config", &base_config, params()))
 		return -EINVAL;
+	if(!config.get("blind_writes", &blind_writes, false))
+		return -EINVAL;
 	ct_dfd = openat(dfd, file, O_RDONLY);
 	if(ct_dfd < 0)
 		return ct_dfd;
@@ -486,6 +507,11 @@ int simple_ctable::init(int dfd, const char * file, const params & config, sys_j
 		goto fail_names;
 	ktype = base->key_type();
 	cmp_name = base->get_cmp_name();
+	/* Set the merger even if we won't write deltas ourselves, in case some
+	 * were written previously. If the base doesn't support deltas, then we
+	 * can't have written any, but we can't write them now either. */
+	if(base->set_blob_merger(index_blob::merger()) < 0)
+		blind_writes = false;
 	
 	delete meta_file;
 	close(ct_dfd);
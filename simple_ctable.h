@@ -58,7 +58,7 @@ public:
 		return value;
 	}
 	
-	inline simple_ctable() : base(NULL) {}
+	inline simple_ctable() : base(NULL), blind_writes(false) {}
 	int init(int dfd, const char * file, const params & config, sys_journal * sysj);
 	void deinit();
 	inline virtual ~simple_ctable()
@@ -142,6 +142,9 @@ private:
 	};
 	
 	dtable * base;
+	/* write deltas for only the changed columns, rather than whole rows;
+	 * only done if the "blind_writes" parameter is set */
+	bool blind_writes;
 };
 
 #endif /* __SIMPLE_CTABLE_H */
@@ -23,12 +23,13 @@
  * bytes 0-3: magic number
  * bytes 4-7: format version
  * bytes 8-11: key count
- * byte 12: key type (0 -> invalid, 1 -> uint32, 2 -> double, 3 -> string, 4 -> blob)
- * byte 13: key size (for uint32/string/blob; 1-4 bytes)
+ * byte 12: key type (0 -> invalid, 1 -> uint32, 2 -> double, 3 -> string, 4 -> blob, 5 -> uint64)
+ * byte 13: key size (for uint32/string/blob; 1-4 bytes, for uint64; 1-8 bytes)
  * byte 14: data length size (1-4 bytes)
  * byte 15: offset size (1-4 bytes)
  * bytes 16-19: if key type is blob, blob comparator name length
  * bytes 20-n: if key type is blob and length > 0, blob comparator name
+ * bytes 16-23: if key type is uint64, the smallest key (others are stored relative to it)
  * bytes 16-m, 20-m, or n+1-m: if key type is string/blob, a string table
  * byte 16 or m+1: main data tables
  * 
@@ -165,6 +166,8 @@ dtype simple_dtable::get_key(size_t index, size_t * data_length, off_t * data_of
 	{
 		case dtype::UINT32:
 			return dtype(util::read_bytes(bytes, 0, key_size));
+		case dtype::UINT64:
+			return dtype(key_base + util::read_bytes64(bytes, 0, key_size));
 		case dtype::DOUBLE:
 		{
 			double value;
@@ -291,6 +294,14 @@ int simple_dtable::init(int dfd, const char * file, const params & config, sys_j
 			if(key_size != sizeof(double))
 				goto fail;
 			break;
+		case 5:
+			ktype = dtype::UINT64;
+			if(key_size > 8)
+				goto fail;
+			if(fp->read_type(key_start_off, &key_base) < 0)
+				goto fail;
+			key_start_off += sizeof(key_base);
+			break;
 		case 4:
 			uint32_t length;
 			if(fp->read_type(key_start_off, &length) < 0)
@@ -347,6 +358,7 @@ int simple_dtable::create(int dfd, const char * file, const params & config, dta
 	const blob_comparator * blob_cmp = source->get_blob_cmp();
 	size_t key_count = 0, max_data_size = 0, total_data_size = 0;
 	uint32_t max_key = 0;
+	uint64_t min_key64 = (uint64_t) -1, max_key64 = 0;
 	dtable_header header;
 	int r, size;
 	rwfile out;
@@ -371,6 +383,13 @@ int simple_dtable::create(int dfd, const char * file, const params & config, dta
 				if(key.u32 > max_key)
 					max_key = key.u32;
 				break;
+			case dtype::UINT64:
+				/* the keys are in order, but this is just as easy */
+				if(key.u64 < min_key64)
+					min_key64 = key.u64;
+				if(key.u64 > max_key64)
+					max_key64 = key.u64;
+				break;
 			case dtype::DOUBLE:
 				/* nothing to do */
 				break;
@@ -396,6 +415,13 @@ int simple_dtable::create(int dfd, const char * file, const params & config, dta
 			header.key_type = 1;
 			header.key_size = util::byte_size(max_key);
 			break;
+		case dtype::UINT64:
+			if(!key_count)
+				min_key64 = 0;
+			header.key_type = 5;
+			/* only as wide as the range of keys requires */
+			header.key_size = util::byte_size64(max_key64 - min_key64);
+			break;
 		case dtype::DOUBLE:
 			header.key_type = 2;
 			header.key_size = sizeof(double);
@@ -420,7 +446,13 @@ int simple_dtable::create(int dfd, const char * file, const params & config, dta
 	r = out.append(&header);
 	if(r < 0)
 		goto fail_unlink;
-	if(key_type == dtype::BLOB)
+	if(key_type == dtype::UINT64)
+	{
+		r = out.append(&min_key64);
+		if(r < 0)
+			goto fail_unlink;
+	}
+	else if(key_type == dtype::BLOB)
 	{
 		uint32_t length = blob_cmp ? strlen(blob_cmp->name) : 0;
 		out.append(&length);
@@ -460,6 +492,9 @@ int simple_dtable::create(int dfd, const char * file, const params & config, dta
 			case dtype::UINT32:
 				util::layout_bytes(bytes, &i, key.u32, header.key_size);
 				break;
+			case dtype::UINT64:
+				util::layout_bytes64(bytes, &i, key.u64 - min_key64, header.key_size);
+				break;
 			case dtype::DOUBLE:
 				util::memcpy(bytes, &key.dbl, sizeof(double));
 				i += sizeof(double);
@@ -105,6 +105,8 @@ private:
 	size_t key_count;
 	stringtbl st;
 	uint8_t key_size, length_size, offset_size;
+	/* uint64 keys are stored as offsets from the smallest one */
+	uint64_t key_base;
 	off_t key_start_off, data_start_off;
 };
 
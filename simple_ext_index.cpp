@@ -6,66 +6,99 @@
 #include "index_factory.h"
 #include "simple_ext_index.h"
 
-/* multi value blob format:
- * 4 bytes: value length m
+/* multi value blob format: a sequence of pris, each stored as:
+ * 4 bytes: value length m (strings only)
  * m bytes: value
  */
 
-simple_ext_index::iter::iter(const simple_ext_index * src, dtable::iter * iter, dtype::ctype type)
-	: seckey(0u), source(src), store(iter), pritype(type), offset(0), is_valid(true)
+simple_ext_index::iter::iter(const simple_ext_index * src, dtable::iter * iter)
+	: seckey(0u), source(src), store(iter), offset(0), end(0), is_valid(false)
 {
+	load();
 }
 
-simple_ext_index::iter::iter(const simple_ext_index * src, const dtype & key, dtype::ctype type)
-	: seckey(key), source(src), store(NULL), pritype(type), offset(0)
+simple_ext_index::iter::iter(const simple_ext_index * src, const dtype & key)
+	: seckey(key), source(src), store(NULL), offset(0), end(0)
 {
 	multi_value = src->ro_store->find(key);
-	if(!multi_value.exists())
-		is_valid = false;
-	is_valid = true;
+	is_valid = multi_value.size() > 0;
+	if(is_valid)
+		end = source->pri_end(multi_value, 0);
+}
+
+/* reads the pris for the store's current key, skipping empty keys */
+bool simple_ext_index::iter::load()
+{
+	while(store->valid())
+	{
+		multi_value = store->value();
+		if(multi_value.size())
+		{
+			seckey = store->key();
+			offset = 0;
+			end = source->pri_end(multi_value, 0);
+			is_valid = true;
+			return true;
+		}
+		store->next();
+	}
+	is_valid = false;
+	return false;
 }
 
 bool simple_ext_index::iter::valid() const
 {
-	return store ? store->valid() : is_valid;
+	return is_valid;
 }
 
 bool simple_ext_index::iter::next()
 {
-	uint32_t next = 0;
-	if(store)
-		return store->next();
-	source->find(multi_value, seckey, &offset, &next);
-	if(next < multi_value.size())
+	if(!is_valid)
+		return false;
+	if(end < multi_value.size())
 	{
-		offset = next;
+		offset = end;
+		end = source->pri_end(multi_value, offset);
 		return true;
 	}
+	if(store)
+	{
+		store->next();
+		return load();
+	}
 	is_valid = false;
 	return false;
 }
 
+bool simple_ext_index::iter::seek(const dtype & key)
+{
+	const blob_comparator * blob_cmp = source->ro_store->get_blob_cmp();
+	if(store)
+	{
+		store->seek(key);
+		load();
+	}
+	return is_valid && !seckey.compare(key, blob_cmp);
+}
+
 dtype simple_ext_index::iter::key() const
 {
-	return store ? store->key() : seckey;
+	return seckey;
 }
 
 dtype simple_ext_index::iter::pri() const
 {
-	if(store)
-		return dtype(store->value(), pritype);
+	if(source->is_unique)
+		return dtype(multi_value, source->ref_key_type);
 	
-	switch(pritype)
+	switch(source->ref_key_type)
 	{
 		case dtype::STRING:
-		{
-			uint32_t len = multi_value.index<uint32_t>(0, offset);
-			if(offset + sizeof(uint32_t) + len > multi_value.size())
-				break;
-			return dtype(multi_value.index<const char *>(0, offset + sizeof(uint32_t)), len);
-		}
+			return dtype(multi_value.index<const char *>(0, offset + sizeof(uint32_t)), end - offset - sizeof(uint32_t));
 		case dtype::UINT32:
 			return dtype(multi_value.index<uint32_t>(0, offset));
+		case dtype::UINT64:
+			return dtype(multi_value.index<uint64_t>(0, offset));
 		case dtype::DOUBLE:
 			return dtype(multi_value.index<double>(0, offset));
 		case dtype::BLOB:
@@ -88,13 +121,13 @@ int simple_ext_index::map(const dtype & key, dtype * value) const
 ext_index::iter * simple_ext_index::iterator() const
 {
 	/* iterate over all keys */
-	return new iter(this, ro_store->iterator(), ref_key_type);
+	return new iter(this, ro_store->iterator());
 }
 
 ext_index::iter * simple_ext_index::iterator(dtype key) const
 {
 	/* iterate over only this one key */
-	return new iter(this, key, ref_key_type);
+	return new iter(this, key);
 }
 
 int simple_ext_index::set(const dtype & key, const dtype & pri)
@@ -117,38 +150,28 @@ int simple_ext_index::remove(const dtype & key)
 
 int simple_ext_index::add(const dtype & key, const dtype & pri)
 {
-	blob_buffer old;
+	blob_buffer data;
+	uint32_t start = 0, end = 0;
 	/* for !unique: add this pri to this key if it is not already there */
 	assert(!is_unique);
 	if(!rw_store || ro_store->key_type() != key.type || ref_key_type != pri.type)
 		return -1;
-	old = ro_store->find(key);
-	if(!old.exists())
-		return -1;
+	data = ro_store->find(key);
+	if(data.size() && find(data, pri, &start, &end) >= 0)
+		return 0;
 	if(ref_key_type == dtype::STRING)
-		old << strlen(pri.str);
-	return rw_store->insert(key, old << pri);
+		data << (uint32_t) strlen(pri.str);
+	data.append(pri);
+	return rw_store->insert(key, data);
 }
 
 int simple_ext_index::update(const dtype & key, const dtype & old_pri, const dtype & new_pri)
 {
-	int r;
-	blob_buffer data;
-	uint32_t start = 0, end = 0;
 	/* for !unique: change this key's mapping to old_pri to new_pri */
-	assert(!is_unique && rw_store);
-	if(!rw_store || ro_store->key_type() != key.type || ref_key_type != new_pri.type || ref_key_type != old_pri.type)
-		return -1;
-	data = ro_store->find(key);
-	if(!data.exists())
-		return -1;
-	r = find(data, old_pri, &start, &end);
-	if(r < 0)
-		return r;
-	r = data.overwrite(start, new_pri);
+	int r = remove(key, old_pri);
 	if(r < 0)
 		return r;
-	return rw_store->insert(key, data);
+	return add(key, new_pri);
 }
 
 int simple_ext_index::remove(const dtype & key, const dtype & pri)
@@ -166,6 +189,9 @@ int simple_ext_index::remove(const dtype & key, const dtype & pri)
 	r = find(data, pri, &start, &end);
 	if(r < 0)
 		return r;
+	/* don't leave empty keys around */
+	if(!start && end >= data.size())
+		return rw_store->remove(key);
 	if(end < data.size())
 	{
 		r = data.overwrite(start, &data[end], data.size() - end);
@@ -212,7 +238,7 @@ int simple_ext_index::init(dtable * store, dtype::ctype pri_key_type, const para
 /* Finds the region of blob that is equal to pri and sets idx to this byte
  * offset; sets next to the byte offset of where the next item in the blob. If
  * set is non null then instead of finding something equal to pri it makes set
- * equal to the dtype at the idx byte offset. */
+ * equal to the dtype at the idx byte offset. Returns -ENOENT if not found. */
 int simple_ext_index::find(const blob & b, const dtype & pri, uint32_t * idx, uint32_t * next, dtype * set) const
 {
 	assert(pri.type == ref_key_type);
@@ -221,7 +247,7 @@ int simple_ext_index::find(const blob & b, const dtype & pri, uint32_t * idx, ui
 		case dtype::STRING:
 		{
 			uint32_t len, i = *idx;
-			while(i + sizeof(uint32_t) < b.size())
+			while(i + sizeof(uint32_t) <= b.size())
 			{
 				len = b.index<uint32_t>(0, i);
 				if(i + sizeof(uint32_t) + len > b.size())
@@ -237,11 +263,11 @@ int simple_ext_index::find(const blob & b, const dtype & pri, uint32_t * idx, ui
 				}
 				i += sizeof(uint32_t) + len;
 			}
-			break;
+			return -ENOENT;
 		}
 		case dtype::UINT32:
 		{
-			for(uint32_t i = *idx; i < b.size(); i += sizeof(uint32_t))
+			for(uint32_t i = *idx; i + sizeof(uint32_t) <= b.size(); i += sizeof(uint32_t))
 			{
 				if(set)
 					*set = b.index<uint32_t>(0, i);
@@ -252,14 +278,29 @@ int simple_ext_index::find(const blob & b, const dtype & pri, uint32_t * idx, ui
 					return 0;
 				}
 			}
-			break;
+			return -ENOENT;
+		}
+		case dtype::UINT64:
+		{
+			for(uint32_t i = *idx; i + sizeof(uint64_t) <= b.size(); i += sizeof(uint64_t))
+			{
+				if(set)
+					*set = b.index<uint64_t>(0, i);
+				if(set || b.index<uint64_t>(0, i) == pri.u64)
+				{
+					*idx = i;
+					*next = *idx + sizeof(uint64_t);
+					return 0;
+				}
+			}
+			return -ENOENT;
 		}
 		case dtype::DOUBLE:
 		{
-			for(uint32_t i = *idx; i < b.size(); i += sizeof(double))
+			for(uint32_t i = *idx; i + sizeof(double) <= b.size(); i += sizeof(double))
 			{
 				if(set)
-					*set = b.index<uint32_t>(0, i);
+					*set = b.index<double>(0, i);
 				if(set || b.index<double>(0, i) == pri.dbl)
 				{
 					*idx = i;
@@ -267,7 +308,7 @@ int simple_ext_index::find(const blob & b, const dtype & pri, uint32_t * idx, ui
 					return 0;
 				}
 			}
-			break;
+			return -ENOENT;
 		}
 		case dtype::BLOB:
 			/* fall through */ ;
@@ -275,4 +316,31 @@ int simple_ext_index::find(const blob & b, const dtype & pri, uint32_t * idx, ui
 	abort();
 }
 
+uint32_t simple_ext_index::pri_end(const blob & b, uint32_t offset) const
+{
+	uint32_t end = b.size();
+	if(is_unique)
+		return end;
+	switch(ref_key_type)
+	{
+		case dtype::STRING:
+			if(offset + sizeof(uint32_t) <= b.size())
+				end = offset + sizeof(uint32_t) + b.index<uint32_t>(0, offset);
+			break;
+		case dtype::UINT32:
+			end = offset + sizeof(uint32_t);
+			break;
+		case dtype::UINT64:
+			end = offset + sizeof(uint64_t);
+			break;
+		case dtype::DOUBLE:
+			end = offset + sizeof(double);
+			break;
+		case dtype::BLOB:
+			abort();
+	}
+	/* truncated entries just end at the end */
+	return (end > b.size()) ? b.size() : end;
+}
+
 DEFINE_EI_FACTORY(simple_ext_index);
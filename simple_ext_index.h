@@ -56,25 +56,33 @@ private:
 	dtable * rw_store;
 	
 	int find(const blob & b, const dtype & pri, uint32_t * idx, uint32_t * next, dtype * set = NULL) const;
+	/* returns the offset just past the pri starting at offset in b */
+	uint32_t pri_end(const blob & b, uint32_t offset) const;
 	
 	class iter : public ext_index::iter
 	{
 	public:
 		virtual bool valid() const;
 		virtual bool next();
+		virtual bool seek(const dtype & key);
 		virtual dtype key() const;
 		virtual dtype pri() const;
-		inline iter(const simple_ext_index * src, dtable::iter * iter, dtype::ctype type);
-		inline iter(const simple_ext_index * src, const dtype & key, dtype::ctype type);
-		virtual ~iter() {}
+		inline iter(const simple_ext_index * src, dtable::iter * iter);
+		inline iter(const simple_ext_index * src, const dtype & key);
+		virtual ~iter()
+		{
+			if(store)
+				delete store;
+		}
 		
 	private:
+		bool load();
+		
 		dtype seckey;
 		blob multi_value;
 		const simple_ext_index * source;
 		dtable::iter * store;
-		dtype::ctype pritype;
-		uint32_t offset;
+		uint32_t offset, end;
 		bool is_valid;
 	};
 };
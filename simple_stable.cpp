@@ -4,6 +4,7 @@
 
 #define _ATFILE_SOURCE
 
+#include <math.h>
 #include <unistd.h>
 #include <fcntl.h>
 
@@ -12,6 +13,18 @@
 #include "util.h"
 #include "blob_buffer.h"
 #include "simple_stable.h"
+#include "simple_ext_index.h"
+
+/* metadata key prefix for indexed columns */
+#define INDEX_PREFIX "_index."
+
+/* the cost of finding a row with the index, relative to checking a row in a
+ * column scan: the index is not in key order, so the rows it finds are
+ * usually looked up randomly later, while scans read sequentially */
+#define INDEX_ROW_COST 8
+/* the most distinct values to count when estimating them; plan() only needs
+ * to know whether there are more than about INDEX_ROW_COST */
+#define DISTINCT_SAMPLE 1024
 
 bool simple_stable::citer::valid() const
 {
@@ -123,6 +136,95 @@ dtype simple_stable::siter::value() const
 	return dtype(data->value(), meta->column_type(data->name()));
 }
 
+bool simple_stable::piter::advance()
+{
+	bool valid = data->valid();
+	while(valid && !data->value(index).exists())
+		valid = data->next();
+	return valid;
+}
+
+bool simple_stable::piter::retreat()
+{
+	bool valid = data->valid();
+	while(valid && !data->value(index).exists())
+		valid = data->prev();
+	if(!valid)
+		advance();
+	return valid;
+}
+
+bool simple_stable::piter::valid() const
+{
+	return data->valid();
+}
+
+bool simple_stable::piter::next()
+{
+	if(!data->next())
+		return false;
+	return advance();
+}
+
+bool simple_stable::piter::prev()
+{
+	if(!data->prev())
+		return false;
+	return retreat();
+}
+
+bool simple_stable::piter::first()
+{
+	if(!data->first())
+		return false;
+	return advance();
+}
+
+bool simple_stable::piter::last()
+{
+	if(!data->last())
+		return false;
+	return retreat();
+}
+
+dtype simple_stable::piter::key() const
+{
+	return data->key();
+}
+
+bool simple_stable::piter::seek(const dtype & key)
+{
+	bool found = data->seek(key);
+	if(found && data->value(index).exists())
+		return true;
+	advance();
+	return false;
+}
+
+bool simple_stable::piter::seek(const dtype_test & test)
+{
+	bool found = data->seek(test);
+	if(found && data->value(index).exists())
+		return true;
+	advance();
+	return false;
+}
+
+dtype::ctype simple_stable::piter::key_type() const
+{
+	return data->key_type();
+}
+
+const istr & simple_stable::piter::column() const
+{
+	return name;
+}
+
+dtype simple_stable::piter::value() const
+{
+	return dtype(data->value(index), type);
+}
+
 stable::column_iter * simple_stable::columns() const
 {
 	return new citer(column_map.begin(), &column_map);
@@ -157,10 +259,46 @@ int simple_stable::set_column_index(const istr & column, ext_index * index)
 	column_map_full_iter it = column_map.find(column);
 	if(it == column_map.end())
 		return -ENOENT;
+	/* can't replace an index we are maintaining */
+	if(it->second.index_store)
+		return -EBUSY;
 	it->second.index = index;
 	return 0;
 }
 
+int simple_stable::add_index(const istr & column, bool unique)
+{
+	int r;
+	uint8_t flag = unique;
+	char name[strlen(column) + sizeof(INDEX_PREFIX)];
+	column_map_full_iter it = column_map.find(column);
+	/* refuse internal entries, and names we can't use in file names */
+	if(column[0] == '_' || strchr(column, '/'))
+		return -EINVAL;
+	if(key_type() == dtype::BLOB)
+		return -EINVAL;
+	if(indexed.count(column))
+		return (indexed[column] == unique) ? 0 : -EINVAL;
+	if(it != column_map.end() && it->second.index)
+		return -EBUSY;
+	sprintf(name, INDEX_PREFIX "%s", (const char *) column);
+	r = dt_meta->insert(istr(name), blob(sizeof(flag), &flag));
+	if(r < 0)
+		return r;
+	indexed[column] = unique;
+	if(it != column_map.end())
+	{
+		/* the column already exists, so build the index now */
+		r = open_index(column, &it->second, true);
+		if(r < 0)
+		{
+			indexed.erase(column);
+			dt_meta->remove(istr(name));
+		}
+	}
+	return r;
+}
+
 dtable::key_iter * simple_stable::keys() const
 {
 	return ct_data->keys();
@@ -190,6 +328,123 @@ stable::iter * simple_stable::iterator(const dtype & key) const
 	return wrapper;
 }
 
+stable::iter * simple_stable::column_iterator(const istr & column) const
+{
+	stable::iter * wrapper;
+	ctable::p_iter * source;
+	size_t index = ct_data->index(column);
+	const column_info * c = get_column(column);
+	if(!c || index == (size_t) -1)
+		return NULL;
+	source = ct_data->iterator(&index, 1);
+	if(!source)
+		return NULL;
+	wrapper = new piter(source, index, column, c->type);
+	if(!wrapper)
+		delete source;
+	return wrapper;
+}
+
+/* the smallest value greater than key, if there is an easy way to get it */
+static bool next_distinct(const dtype & key, dtype * next)
+{
+	switch(key.type)
+	{
+		case dtype::UINT32:
+			if(key.u32 == 0xFFFFFFFF)
+				return false;
+			*next = dtype(key.u32 + 1);
+			return true;
+		case dtype::UINT64:
+			if(key.u64 == ~(uint64_t) 0)
+				return false;
+			*next = dtype(key.u64 + 1);
+			return true;
+		case dtype::DOUBLE:
+			if(isinf(key.dbl) || isnan(key.dbl))
+				return false;
+			*next = dtype(nextafter(key.dbl, INFINITY));
+			return true;
+		case dtype::STRING:
+			/* strings can't contain NUL, so nothing sorts in between */
+			*next = dtype(istr(key.str, "\x01"));
+			return true;
+		case dtype::BLOB:
+			/* blobs may have a custom comparator */
+			return false;
+	}
+	abort();
+}
+
+size_t simple_stable::sample_distinct(const column_info * c)
+{
+	size_t distinct = 0;
+	ext_index::iter * iter;
+	if(c->index->unique())
+		return c->row_count;
+	iter = c->index->iterator();
+	if(!iter)
+		return 1;
+	/* seek past each value rather than reading all its entries, so that
+	 * the count covers the whole index instead of just its first part */
+	while(iter->valid() && distinct < DISTINCT_SAMPLE)
+	{
+		dtype key = iter->key();
+		dtype next(0u);
+		distinct++;
+		if(next_distinct(key, &next))
+			iter->seek(next);
+		else
+			while(iter->next() && !iter->key().compare(key))
+				/* skip the rest of this value */;
+	}
+	delete iter;
+	/* if there are more than that, the column is selective enough anyway */
+	return distinct ? distinct : 1;
+}
+
+size_t simple_stable::count_index(const column_info * c, const dtype & low, const dtype & high, size_t limit)
+{
+	size_t count = 0;
+	ext_index::iter * iter = c->index->iterator();
+	if(!iter)
+		return limit;
+	iter->seek(low);
+	while(iter->valid() && count < limit)
+	{
+		if(iter->key().compare(high) > 0)
+			break;
+		count++;
+		iter->next();
+	}
+	delete iter;
+	return count;
+}
+
+stable::access_path simple_stable::plan(const istr & column, const dtype & low, const dtype * high) const
+{
+	size_t limit;
+	const column_info * c = get_column(column);
+	if(!c)
+		return FULL_SCAN;
+	if(!c->index)
+		return COLUMN_SCAN;
+	/* the index must find fewer than this many rows to be worth it */
+	limit = c->row_count / INDEX_ROW_COST;
+	if(high)
+		/* range queries can match anywhere from no rows to all of them, so
+		 * just walk the index until it is clear which way to go */
+		return (count_index(c, low, *high, limit + 1) <= limit) ? INDEX_LOOKUP : COLUMN_SCAN;
+	/* resample if the column has grown or shrunk a lot */
+	if(!c->sample_rows || c->row_count > c->sample_rows * 2 || c->row_count * 2 < c->sample_rows)
+	{
+		c->distinct = sample_distinct(c);
+		c->sample_rows = c->row_count;
+	}
+	/* equality queries match row_count / distinct rows on average */
+	return (c->distinct * limit >= c->row_count) ? INDEX_LOOKUP : COLUMN_SCAN;
+}
+
 bool simple_stable::find(const dtype & key, const istr & column, dtype * value) const
 {
 	const column_info * c = get_column(column);
@@ -225,6 +480,13 @@ int simple_stable::load_columns()
 		/* skip internal entries */
 		if(key.str[0] == '_')
 		{
+			/* but remember which columns are indexed */
+			if(!strncmp(key.str, INDEX_PREFIX, sizeof(INDEX_PREFIX) - 1))
+			{
+				blob value = source->value();
+				if(value.exists())
+					indexed[(const char *) key.str + sizeof(INDEX_PREFIX) - 1] = value.size() && value[0];
+			}
 			source->next();
 			continue;
 		}
@@ -250,10 +512,16 @@ int simple_stable::load_columns()
 			case 4:
 				c->type = dtype::BLOB;
 				break;
+			case 5:
+				c->type = dtype::UINT64;
+				break;
 		}
 	}
 	if(source->valid())
+	{
 		column_map.clear();
+		indexed.clear();
+	}
 	delete source;
 	return 0;
 }
@@ -270,6 +538,7 @@ int simple_stable::adjust_column(const istr & column, ssize_t delta, dtype::ctyp
 {
 	int r;
 	ext_index * old_index = NULL;
+	dtable * old_store = NULL;
 	bool created = false, destroyed = false;
 	column_map_full_iter it = column_map.find(column);
 	column_info * c = (it == column_map.end()) ? NULL : &it->second;
@@ -288,6 +557,17 @@ int simple_stable::adjust_column(const istr & column, ssize_t delta, dtype::ctyp
 		c->row_count = delta;
 		c->type = type;
 		c->index = NULL;
+		c->index_store = NULL;
+		if(indexed.count(column))
+		{
+			/* there is no data to fill it with yet */
+			r = open_index(column, c, false);
+			if(r < 0)
+			{
+				column_map.erase(column);
+				return r;
+			}
+		}
 		created = true;
 	}
 	else
@@ -303,6 +583,7 @@ int simple_stable::adjust_column(const istr & column, ssize_t delta, dtype::ctyp
 		{
 			assert(delta < 0);
 			old_index = c->index;
+			old_store = c->index_store;
 			column_map.erase(column);
 			destroyed = true;
 		}
@@ -326,6 +607,9 @@ int simple_stable::adjust_column(const istr & column, ssize_t delta, dtype::ctyp
 			case dtype::BLOB:
 				meta << (uint8_t) 4;
 				break;
+			case dtype::UINT64:
+				meta << (uint8_t) 5;
+				break;
 		}
 		/* and write it */
 		r = dt_meta->insert(column, meta);
@@ -336,22 +620,149 @@ int simple_stable::adjust_column(const istr & column, ssize_t delta, dtype::ctyp
 	{
 		/* clean up in case of error */
 		if(created)
+		{
+			close_index(c);
 			column_map.erase(column);
+		}
 		else if(destroyed)
 		{
 			c = &column_map[column];
 			c->row_count = -delta;
 			c->type = type;
 			c->index = old_index;
+			c->index_store = old_store;
 		}
 	}
+	else if(destroyed && old_store)
+	{
+		/* the index is empty now, but we keep it for when the column returns */
+		column_info old;
+		old.index = old_index;
+		old.index_store = old_store;
+		close_index(&old);
+	}
+	return r;
+}
+
+int simple_stable::open_index(const istr & column, column_info * c, bool fill)
+{
+	int r;
+	params config;
+	simple_ext_index * index;
+	char name[strlen(column) + 10];
+	dtable * store;
+	sprintf(name, "st_index.%s", (const char *) column);
+	store = index_base->open(md_dfd, name, index_config, sysj);
+	if(store && store->key_type() != c->type)
+	{
+		/* left over from an earlier column of a different type; since the
+		 * column went away, the index must be empty and we can replace it */
+		store->destroy();
+		store = NULL;
+		r = util::rm_r(md_dfd, name);
+		if(r < 0)
+			return r;
+	}
+	if(!store)
+	{
+		r = index_base->create(md_dfd, name, index_config, c->type);
+		if(r < 0)
+			return r;
+		store = index_base->open(md_dfd, name, index_config, sysj);
+		if(!store)
+			return -1;
+	}
+	else
+		/* it's already up to date */
+		fill = false;
+	config.set("unique", indexed[column]);
+	index = new simple_ext_index;
+	r = index->init(store, key_type(), config);
+	if(r < 0)
+	{
+		delete index;
+		store->destroy();
+		return r;
+	}
+	c->index = index;
+	c->index_store = store;
+	if(fill)
+	{
+		r = fill_index(column, c);
+		if(r < 0)
+			close_index(c);
+	}
+	return r;
+}
+
+void simple_stable::close_index(column_info * c)
+{
+	if(!c->index_store)
+		return;
+	delete c->index;
+	c->index = NULL;
+	c->index_store->destroy();
+	c->index_store = NULL;
+}
+
+int simple_stable::fill_index(const istr & column, column_info * c)
+{
+	int r = 0;
+	size_t index = ct_data->index(column);
+	ctable::p_iter * source;
+	if(index == (size_t) -1)
+		return -ENOENT;
+	source = ct_data->iterator(&index, 1);
+	if(!source)
+		return -ENOMEM;
+	for(; source->valid(); source->next())
+	{
+		blob value = source->value(index);
+		if(!value.exists())
+			continue;
+		r = index_add(c, dtype(value, c->type), source->key());
+		if(r < 0)
+			break;
+	}
+	delete source;
 	return r;
 }
 
+int simple_stable::index_add(const column_info * c, const dtype & value, const dtype & pri)
+{
+	if(c->index->unique())
+	{
+		dtype other(0u);
+		if(c->index->map(value, &other) >= 0 && other.compare(pri))
+			return -EEXIST;
+		return c->index->set(value, pri);
+	}
+	return c->index->add(value, pri);
+}
+
+int simple_stable::index_remove(const column_info * c, const dtype & value, const dtype & pri)
+{
+	int r;
+	if(c->index->unique())
+	{
+		dtype other(0u);
+		/* only remove it if it's ours */
+		if(c->index->map(value, &other) < 0 || other.compare(pri))
+			return 0;
+		return c->index->remove(value);
+	}
+	r = c->index->remove(value, pri);
+	return (r == -ENOENT) ? 0 : r;
+}
+
 int simple_stable::insert(const dtype & key, const istr & column, const dtype & value, bool append)
 {
 	int r;
-	bool increment = !ct_data->find(key, column).exists();
+	const column_info * c;
+	dtype old_value(0u);
+	bool reindexed = false;
+	blob old = ct_data->find(key, column);
+	bool increment = !old.exists();
 	if(increment)
 	{
 		/* this will check that the type matches */
@@ -361,27 +772,77 @@ int simple_stable::insert(const dtype & key, const istr & column, const dtype &
 	}
 	else if(column_type(column) != value.type)
 		return -EINVAL;
+	c = get_column(column);
+	if(c->index_store)
+	{
+		if(!increment)
+			old_value = dtype(old, c->type);
+		if(increment || old_value.compare(value))
+		{
+			r = index_add(c, value, key);
+			if(r >= 0 && !increment)
+			{
+				r = index_remove(c, old_value, key);
+				if(r < 0)
+					index_remove(c, value, key);
+			}
+			if(r < 0)
+			{
+				if(increment)
+					adjust_column(column, -1, value.type);
+				return r;
+			}
+			reindexed = true;
+		}
+	}
 	r = ct_data->insert(key, column, value.flatten(), append);
-	if(r < 0 && increment)
-		adjust_column(column, -1, value.type);
+	if(r < 0)
+	{
+		if(reindexed)
+		{
+			index_remove(c, value, key);
+			if(!increment)
+				index_add(c, old_value, key);
+		}
+		if(increment)
+			adjust_column(column, -1, value.type);
+	}
 	return r;
 }
 
 int simple_stable::remove(const dtype & key, const istr & column)
 {
 	int r;
+	blob old;
 	dtype::ctype type;
 	const column_info * c = get_column(column);
 	/* does it even exist to begin with? */
-	if(!c || !ct_data->find(key, column).exists())
+	if(!c)
+		return 0;
+	old = ct_data->find(key, column);
+	if(!old.exists())
 		return 0;
 	type = c->type;
+	if(c->index_store)
+	{
+		r = index_remove(c, dtype(old, type), key);
+		if(r < 0)
+			return r;
+	}
 	r = adjust_column(column, -1, type);
+	if(r >= 0)
+	{
+		r = ct_data->remove(key, column);
+		if(r < 0)
+			adjust_column(column, 1, type);
+	}
 	if(r < 0)
-		return r;
-	r = ct_data->remove(key, column);
-	if(r < 0)
-		adjust_column(column, 1, type);
+	{
+		/* the column info may have moved */
+		c = get_column(column);
+		if(c && c->index_store)
+			index_add(c, dtype(old, type), key);
+	}
 	return r;
 }
 
@@ -394,6 +855,12 @@ int simple_stable::remove(const dtype & key)
 	while(columns->valid())
 	{
 		const column_info * c = get_column(columns->name());
+		if(c->index_store)
+		{
+			r = index_remove(c, dtype(columns->value(), c->type), key);
+			/* XXX: improve this */
+			assert(r >= 0);
+		}
 		r = adjust_column(columns->name(), -1, c->type);
 		/* XXX: improve this */
 		assert(r >= 0);
@@ -414,18 +881,27 @@ dtype::ctype simple_stable::key_type() const
 int simple_stable::init(int dfd, const char * name, const params & config, sys_journal * sysj)
 {
 	int r = -1;
+	istr index_config_name = "index_config";
 	params meta_config, data_config;
 	const dtable_factory * meta = dtable_factory::lookup(config, "meta");
 	const ctable_factory * data = ctable_factory::lookup(config, "data");
 	if(md_dfd >= 0)
 		deinit();
-	assert(column_map.empty());
+	assert(column_map.empty() && indexed.empty());
 	if(!meta || !data)
 		return -ENOENT;
 	if(!config.get("meta_config", &meta_config, params()))
 		return -EINVAL;
 	if(!config.get("data_config", &data_config, params()))
 		return -EINVAL;
+	index_base = dtable_factory::lookup(config, "index", "meta");
+	if(!index_base)
+		return -ENOENT;
+	if(!config.contains(index_config_name))
+		index_config_name = "meta_config";
+	if(!config.get(index_config_name, &index_config, params()))
+		return -EINVAL;
+	this->sysj = sysj;
 	md_dfd = openat(dfd, name, O_RDONLY);
 	if(md_dfd < 0)
 		return md_dfd;
@@ -441,8 +917,24 @@ int simple_stable::init(int dfd, const char * name, const params & config, sys_j
 	if(r < 0)
 		goto fail_check;
 	
+	for(index_map::iterator it = indexed.begin(); it != indexed.end(); ++it)
+	{
+		column_map_full_iter c = column_map.find(it->first);
+		if(c == column_map.end())
+			continue;
+		/* this will only need to fill the index if it is missing */
+		r = open_index(it->first, &c->second, true);
+		if(r < 0)
+			goto fail_index;
+	}
+	
 	return 0;
 	
+fail_index:
+	for(column_map_full_iter c = column_map.begin(); c != column_map.end(); ++c)
+		close_index(&c->second);
+	column_map.clear();
+	indexed.clear();
 fail_check:
 	delete ct_data;
 fail_data:
@@ -457,7 +949,10 @@ void simple_stable::deinit()
 {
 	if(md_dfd < 0)
 		return;
+	for(column_map_full_iter c = column_map.begin(); c != column_map.end(); ++c)
+		close_index(&c->second);
 	column_map.clear();
+	indexed.clear();
 	delete ct_data;
 	ct_data = NULL;
 	dt_meta->destroy();
@@ -24,10 +24,21 @@ public:
 	virtual dtype::ctype column_type(const istr & column) const;
 	virtual ext_index * column_index(const istr & column) const;
 	virtual int set_column_index(const istr & column, ext_index * index);
+	/* The indices are simple_ext_indexes, stored in dtables created with the
+	 * "index" factory and "index_config" (by default, the same as "meta").
+	 * Primary keys of type BLOB are not supported. */
+	virtual int add_index(const istr & column, bool unique = false);
 	
 	virtual dtable::key_iter * keys() const;
 	virtual iter * iterator() const;
 	virtual iter * iterator(const dtype & key) const;
+	virtual iter * column_iterator(const istr & column) const;
+	
+	/* Compares the cost of walking the index (when there is one) with that of
+	 * scanning the column. The number of matching rows is estimated from the
+	 * row count and a sampled count of distinct values for equality queries,
+	 * or by walking the index until it gets too expensive for range queries. */
+	virtual access_path plan(const istr & column, const dtype & low, const dtype * high = NULL) const;
 	
 	virtual bool find(const dtype & key, const istr & column, dtype * value) const;
 	virtual bool contains(const dtype & key) const;
@@ -42,7 +53,7 @@ public:
 	
 	int init(int dfd, const char * name, const params & config, sys_journal * sysj);
 	void deinit();
-	inline simple_stable() : md_dfd(-1), dt_meta(NULL), ct_data(NULL) {}
+	inline simple_stable() : md_dfd(-1), dt_meta(NULL), ct_data(NULL), sysj(NULL) {}
 	inline virtual ~simple_stable()
 	{
 		if(md_dfd >= 0)
@@ -77,6 +88,12 @@ private:
 		size_t row_count;
 		dtype::ctype type;
 		ext_index * index;
+		/* non-NULL if we manage the index ourselves (see add_index()) */
+		dtable * index_store;
+		/* the estimated number of distinct values, when there were
+		 * sample_rows rows (see plan()); zero if not yet sampled */
+		mutable size_t distinct;
+		mutable size_t sample_rows;
 	};
 	
 	typedef std::map<istr, column_info, strcmp_less> std_column_map;
@@ -84,10 +101,28 @@ private:
 	typedef std_column_map::iterator column_map_full_iter;
 	std_column_map column_map;
 	
+	/* the columns to index, and whether the index is unique; these are stored
+	 * in the metadata dtable as internal entries, since the columns might not
+	 * exist yet (and the index is created along with the column) */
+	typedef std::map<istr, bool, strcmp_less> index_map;
+	index_map indexed;
+	
 	int load_columns();
 	const column_info * get_column(const istr & column) const;
 	int adjust_column(const istr & column, ssize_t delta, dtype::ctype type);
 	
+	/* opens or creates the index store for a column, filling it from the
+	 * existing data if fill is true and it had to be created */
+	int open_index(const istr & column, column_info * c, bool fill);
+	void close_index(column_info * c);
+	int fill_index(const istr & column, column_info * c);
+	static int index_add(const column_info * c, const dtype & value, const dtype & pri);
+	static int index_remove(const column_info * c, const dtype & value, const dtype & pri);
+	
+	/* for plan() */
+	static size_t sample_distinct(const column_info * c);
+	static size_t count_index(const column_info * c, const dtype & low, const dtype & high, size_t limit);
+	
 	class citer : public column_iter
 	{
 	public:
@@ -128,9 +163,39 @@ private:
 		const stable * meta;
 	};
 	
+	/* iterates through a single column, skipping rows that don't have it */
+	class piter : public stable::iter
+	{
+	public:
+		virtual bool valid() const;
+		virtual bool next();
+		virtual bool prev();
+		virtual bool first();
+		virtual bool last();
+		virtual dtype key() const;
+		virtual bool seek(const dtype & key);
+		virtual bool seek(const dtype_test & test);
+		virtual dtype::ctype key_type() const;
+		virtual const istr & column() const;
+		virtual dtype value() const;
+		inline piter(ctable::p_iter * source, size_t index, const istr & name, dtype::ctype type) : data(source), index(index), name(name), type(type) { advance(); }
+		virtual ~piter() { delete data; }
+	private:
+		bool advance();
+		bool retreat();
+		
+		ctable::p_iter * data;
+		size_t index;
+		istr name;
+		dtype::ctype type;
+	};
+	
 	int md_dfd;
 	dtable * dt_meta;
 	ctable * ct_data;
+	sys_journal * sysj;
+	const dtable_factory * index_base;
+	params index_config;
 };
 
 #endif /* __SIMPLE_STABLE_H */
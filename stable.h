@@ -72,10 +72,34 @@ public:
 	 * can take care of creating and managing the indices themselves */
 	virtual ext_index * column_index(const istr & column) const = 0;
 	virtual int set_column_index(const istr & column, ext_index * index) = 0;
+	/* asks the stable to create and maintain an index itself; once added,
+	 * column_index() will return it for the column (when it exists) */
+	inline virtual int add_index(const istr & column, bool unique = false) { return -ENOSYS; }
 	
 	virtual dtable::key_iter * keys() const = 0;
 	virtual iter * iterator() const = 0;
 	virtual iter * iterator(const dtype & key) const = 0;
+	/* iterate through the values of just one column, in key order; returns
+	 * NULL if the stable does not support this (or the column does not exist) */
+	inline virtual iter * column_iterator(const istr & column) const { return NULL; }
+	
+	/* the ways to find the rows with values of a column in some range */
+	enum access_path
+	{
+		/* look up each key, then check its value */
+		FULL_SCAN,
+		/* read only the column, checking every value */
+		COLUMN_SCAN,
+		/* walk the column's index over the range */
+		INDEX_LOOKUP
+	};
+	/* chooses the cheapest path to find the rows with values in the range
+	 * [low, high] of the column, or equal to low if high is NULL; by default
+	 * always uses the column's index if it has one */
+	inline virtual access_path plan(const istr & column, const dtype & low, const dtype * high = NULL) const
+	{
+		return column_index(column) ? INDEX_LOOKUP : FULL_SCAN;
+	}
 	
 	/* returns true if found, otherwise does not change *value */
 	virtual bool find(const dtype & key, const istr & column, dtype * value) const = 0;
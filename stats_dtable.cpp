@@ -0,0 +1,215 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#define _ATFILE_SOURCE
+
+#include "openat.h"
+
+#include "util.h"
+#include "stats_dtable.h"
+
+bool stats_dtable::static_indexed_access(const params & config)
+{
+	const dtable_factory * factory;
+	params base_config;
+	factory = dtable_factory::lookup(config, "base");
+	if(!factory)
+		return false;
+	if(!config.get("base_config", &base_config, params()))
+		return false;
+	return factory->indexed_access(base_config);
+}
+
+stats_dtable::gather_iter::gather_iter(dtable::iter * base, const ktable * shadow)
+	: dtable_wrap_iter(base), shadow(shadow), sequential(true)
+{
+	add();
+}
+
+void stats_dtable::gather_iter::add()
+{
+	if(!base->valid())
+		return;
+	dtype key = base->key();
+	bool exists = base->meta().exists();
+	/* nonexistent values are only kept if they shadow something */
+	if(exists || (shadow && shadow->contains(key)))
+		stats.add(key, exists);
+}
+
+bool stats_dtable::gather_iter::next()
+{
+	bool valid = base->next();
+	add();
+	return valid;
+}
+
+bool stats_dtable::gather_iter::prev()
+{
+	sequential = false;
+	return base->prev();
+}
+
+bool stats_dtable::gather_iter::first()
+{
+	bool valid = base->first();
+	stats = dtable_stats();
+	sequential = true;
+	add();
+	return valid;
+}
+
+bool stats_dtable::gather_iter::last()
+{
+	sequential = false;
+	return base->last();
+}
+
+bool stats_dtable::gather_iter::seek(const dtype & key)
+{
+	sequential = false;
+	return base->seek(key);
+}
+
+bool stats_dtable::gather_iter::seek(const dtype_test & test)
+{
+	sequential = false;
+	return base->seek(test);
+}
+
+bool stats_dtable::gather_iter::seek_index(size_t index)
+{
+	sequential = false;
+	return base->seek_index(index);
+}
+
+bool stats_dtable::gather_iter::skip_zones(const zone_test & test)
+{
+	sequential = false;
+	return base->skip_zones(test);
+}
+
+bool stats_dtable::gather_iter::done(dtable_stats * result)
+{
+	if(!sequential || base->valid())
+		return false;
+	*result = stats;
+	result->finish();
+	return true;
+}
+
+int stats_dtable::init(int dfd, const char * file, const params & config, sys_journal * sysj)
+{
+	const dtable_factory * factory;
+	params base_config;
+	int r, st_dfd;
+	if(base)
+		deinit();
+	factory = dtable_factory::lookup(config, "base");
+	if(!factory)
+		return -ENOENT;
+	if(!config.get("base_config", &base_config, params()))
+		return -EINVAL;
+	st_dfd = openat(dfd, file, O_RDONLY);
+	if(st_dfd < 0)
+		return st_dfd;
+	base = factory->open(st_dfd, "base", base_config, sysj);
+	if(!base)
+		goto fail_base;
+	ktype = base->key_type();
+	cmp_name = base->get_cmp_name();
+	
+	r = stats.read(st_dfd, "stats", ktype);
+	if(r < 0)
+		goto fail_stats;
+	
+	close(st_dfd);
+	return 0;
+	
+fail_stats:
+	base->destroy();
+	base = NULL;
+fail_base:
+	close(st_dfd);
+	return -1;
+}
+
+void stats_dtable::deinit()
+{
+	if(base)
+	{
+		stats = dtable_stats();
+		base->destroy();
+		base = NULL;
+		dtable::deinit();
+	}
+}
+
+int stats_dtable::create(int dfd, const char * file, const params & config, dtable::iter * source, const ktable * shadow)
+{
+	int st_dfd, r;
+	params base_config;
+	dtable::iter * iter;
+	dtable * base_dtable;
+	dtable_stats stats;
+	bool gathered;
+	const dtable_factory * base = dtable_factory::lookup(config, "base");
+	if(!base)
+		return -ENOENT;
+	if(!config.get("base_config", &base_config, params()))
+		return -EINVAL;
+	
+	if(!source_shadow_ok(source, shadow))
+		return -EINVAL;
+	
+	r = mkdirat(dfd, file, 0755);
+	if(r < 0)
+		return r;
+	st_dfd = openat(dfd, file, O_RDONLY);
+	if(st_dfd < 0)
+		goto fail_open;
+	
+	{
+		gather_iter gather(source, shadow);
+		r = base->create(st_dfd, "base", base_config, &gather, shadow);
+		if(r < 0)
+			goto fail_create;
+		gathered = gather.done(&stats);
+	}
+	
+	if(!gathered)
+	{
+		/* the base didn't just read the source in order, so read back
+		 * what it decided to keep instead */
+		base_dtable = base->open(st_dfd, "base", base_config, NULL);
+		if(!base_dtable)
+			goto fail_reopen;
+		iter = base_dtable->iterator();
+		if(!iter)
+		{
+			base_dtable->destroy();
+			goto fail_reopen;
+		}
+		stats.add(iter);
+		delete iter;
+		base_dtable->destroy();
+	}
+	
+	r = stats.write(st_dfd, "stats");
+	if(r < 0)
+		goto fail_reopen;
+	
+	close(st_dfd);
+	return 0;
+	
+fail_reopen:
+	util::rm_r(st_dfd, "base");
+fail_create:
+	close(st_dfd);
+fail_open:
+	unlinkat(dfd, file, AT_REMOVEDIR);
+	return (r < 0) ? r : -1;
+}
+
+DEFINE_RO_FACTORY(stats_dtable);
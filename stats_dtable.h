@@ -0,0 +1,104 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#ifndef __STATS_DTABLE_H
+#define __STATS_DTABLE_H
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <sys/types.h>
+
+#ifndef __cplusplus
+#error stats_dtable.h is a C++ header file
+#endif
+
+#include "dtable_stats.h"
+#include "dtable_factory.h"
+#include "dtable_wrap_iter.h"
+
+/* The stats dtable must be created with another read-only dtable, and gathers
+ * statistics about its keys (see dtable_stats) while it is being created. They
+ * are then available cheaply via get_stats(), e.g. for query planning. */
+
+class stats_dtable : public dtable
+{
+public:
+	virtual iter * iterator(ATX_OPT) const
+	{
+		/* returns base->iterator() */
+		return iterator_chain_usage(&chain, base, atx);
+	}
+	virtual bool present(const dtype & key, bool * found, ATX_OPT) const { return base->present(key, found); }
+	virtual blob lookup(const dtype & key, bool * found, ATX_OPT) const { return base->lookup(key, found); }
+	virtual blob index(size_t index) const { return base->index(index); }
+	virtual bool contains_index(size_t index) const { return base->contains_index(index); }
+	virtual size_t size() const { return base->size(); }
+	inline virtual int get_stats(dtable_stats * stats) const
+	{
+		*stats = this->stats;
+		return 0;
+	}
+	
+	inline virtual int set_blob_cmp(const blob_comparator * cmp)
+	{
+		int value = base->set_blob_cmp(cmp);
+		if(value >= 0)
+		{
+			value = dtable::set_blob_cmp(cmp);
+			assert(value >= 0);
+		}
+		return value;
+	}
+	
+	/* stats_dtable supports indexed access if its base does */
+	static bool static_indexed_access(const params & config);
+	
+	static int create(int dfd, const char * file, const params & config, dtable::iter * source, const ktable * shadow = NULL);
+	DECLARE_RO_FACTORY(stats_dtable);
+	
+	inline stats_dtable() : base(NULL), chain(this) {}
+	int init(int dfd, const char * file, const params & config, sys_journal * sysj);
+	
+protected:
+	void deinit();
+	inline virtual ~stats_dtable()
+	{
+		if(base)
+			deinit();
+	}
+	
+private:
+	/* Passes the source through to the base's create(), gathering the
+	 * statistics as the base reads it. Bases may read the source more than
+	 * once, so each pass from first() starts over; if the base moves the
+	 * source any other way, the statistics are read back from it instead. */
+	class gather_iter : public dtable_wrap_iter
+	{
+	public:
+		virtual bool next();
+		virtual bool prev();
+		virtual bool first();
+		virtual bool last();
+		virtual bool seek(const dtype & key);
+		virtual bool seek(const dtype_test & test);
+		virtual bool seek_index(size_t index);
+		virtual bool skip_zones(const zone_test & test);
+		/* the statistics, if the last pass read the whole source */
+		bool done(dtable_stats * result);
+		gather_iter(dtable::iter * base, const ktable * shadow);
+		virtual ~gather_iter() {}
+	private:
+		void add();
+		const ktable * shadow;
+		dtable_stats stats;
+		/* whether the statistics still describe a forward pass */
+		bool sequential;
+	};
+	
+	dtable * base;
+	mutable chain_callback chain;
+	dtable_stats stats;
+};
+
+#endif /* __STATS_DTABLE_H */
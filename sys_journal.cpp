@@ -88,12 +88,17 @@ struct entry_header
 	size_t length;
 } __attribute__((packed));
 
-int sys_journal::append(listening_dtable * listener, void * entry, size_t length)
+int sys_journal::appendv(listening_dtable * listener, const struct iovec * iov, int count)
 {
-	int r;
+	ssize_t r;
+	size_t length = 0;
 	entry_header header;
-	live_entry_map::iterator count;
-	SYSJ_DEBUG("%d, %p, %zu", listener->id(), entry, length);
+	struct iovec vec[count + 1];
+	live_entry_map::iterator live;
+	
+	for(int i = 0; i < count; i++)
+		length += iov[i].iov_len;
+	SYSJ_DEBUG("%d, %d, %zu", listener->id(), count, length);
 	
 	header.id = listener->id();
 	assert(warehouse_lookup(header.id) == listener);
@@ -101,6 +106,9 @@ int sys_journal::append(listening_dtable * listener, void * entry, size_t length
 	if(length == (size_t) -1)
 		return -EINVAL;
 	header.length = length;
+	vec[0].iov_base = &header;
+	vec[0].iov_len = sizeof(header);
+	util::memcpy(&vec[1], iov, count * sizeof(*iov));
 	
 	assert_data_size();
 	if(!dirty)
@@ -109,20 +117,18 @@ int sys_journal::append(listening_dtable * listener, void * entry, size_t length
 			tx_register_pre_end(&handle);
 		dirty = true;
 	}
-	r = data.append(&header);
-	if(r < 0)
-		return r;
-	r = data.append(entry, length);
-	if(r != (int) length)
+	r = data.appendv(vec, count + 1);
+	if(r != (ssize_t) (sizeof(header) + length))
 	{
-		data.truncate(-sizeof(header));
+		if(r > 0)
+			data.truncate(-r);
 		return (r < 0) ? r : -1;
 	}
 	data_size += sizeof(header) + length;
 	
-	count = live_entry_count.find(header.id);
-	if(count != live_entry_count.end())
-		count->second++;
+	live = live_entry_count.find(header.id);
+	if(live != live_entry_count.end())
+		live->second++;
 	else
 		live_entry_count[header.id] = 1;
 	live_entries++;
@@ -225,8 +231,6 @@ int sys_journal::rollover(listener_id from, listener_id to)
 int sys_journal::filter()
 {
 	int r;
-	char seq[16];
-	meta_journal info;
 	SYSJ_DEBUG("");
 	
 	if(dirty)
@@ -237,128 +241,191 @@ int sys_journal::filter()
 		assert(!dirty);
 	}
 	
-	/* no discarded IDs? no need to filter */
-	if(!discarded.size())
-		return 0;
+	do {
+		r = filter_step((size_t) -1);
+	} while(r > 0);
+	return r;
+}
+
+/* Filtering used to copy all the live entries at once, which stalls appends for
+ * a long time when the journal is large. Now each call to filter_step() copies
+ * only a limited amount, reading the old data file while appends continue to go
+ * to it. Once the copy catches up with the end of the old file, which happens
+ * in the same call, nothing can have been appended since, so we can switch to
+ * the new file and tx_write() the meta file to commit the switch atomically.
+ * Only the IDs discarded before the filter started are omitted: the rest stay
+ * in the discarded set, and their discard records are copied, for next time. */
+int sys_journal::filter_step(size_t step)
+{
+	int r;
+	SYSJ_DEBUG("%zu", step);
 	
-	info.magic = SYSJ_META_MAGIC;
-	info.version = SYSJ_META_VERSION;
-	info.seq = sequence + 1;
-	/* size will be filled in by filter() below */
-	snprintf(seq, sizeof(seq), ".%u", info.seq);
-	assert(info_size == data_size);
-	assert_data_size();
+	/* nothing left to save? then start over, skipping everything */
+	if(filter_active && !live_entries)
+		filter_abort();
+	if(!filter_active)
+	{
+		/* no discarded IDs? no need to filter */
+		if(!discarded.size())
+			return 0;
+		r = filter_start();
+		if(r < 0)
+			return r;
+	}
 	
-	istr data_name = meta_name + seq;
-	r = tx_start_external();
+	r = filter_copy(step);
 	if(r < 0)
-		return r;
-	r = filter(meta_dfd, data_name, &info.size);
-	tx_end_external(r >= 0);
-	if(r >= 0)
 	{
-		r = tx_write(meta_fd, &info, sizeof(info), 0);
-		if(r >= 0)
-		{
-			/* switch to the new data file */
-			r = data.close();
-			assert(r >= 0);
-			data_size = info.size;
-			info_size = info.size;
-			r = data.open(meta_dfd, data_name, data_size);
-			assert(r >= 0);
-			/* delete the old sys_journal data */
-			snprintf(seq, sizeof(seq), ".%u", sequence);
-			data_name = meta_name + seq;
-			tx_unlink(meta_dfd, data_name, 0);
-			sequence = info.seq;
-			discarded.clear();
-		}
-		else
-			unlinkat(meta_dfd, data_name, 0);
+		filter_abort();
+		return r;
 	}
-	else
-		unlinkat(meta_dfd, data_name, 0);
-	assert_data_size();
-	return r;
+	if(filter_offset < data_size)
+		return 1;
+	return filter_finish();
 }
 
-int sys_journal::filter(int dfd, const char * file, size_t * new_size)
+int sys_journal::filter_start()
 {
-	rwfile out;
+	int r;
+	char seq[16];
 	data_header header;
-	SYSJ_DEBUG("%d, %s", dfd, file);
-	int r = out.create(dfd, file);
+	SYSJ_DEBUG("");
+	assert(!filter_active);
+	
+	snprintf(seq, sizeof(seq), ".%u", sequence + 1);
+	istr data_name = meta_name + seq;
+	r = filter_data.create(meta_dfd, data_name, true);
 	if(r < 0)
 		return r;
 	header.magic = SYSJ_DATA_MAGIC;
 	header.version = SYSJ_DATA_VERSION;
-	r = out.append(&header);
+	r = filter_data.append(&header);
 	if(r < 0)
-		goto fail;
+	{
+		filter_data.close();
+		unlinkat(meta_dfd, data_name, 0);
+		return r;
+	}
+	filter_ids = discarded;
 	/* if there are no live entries, don't waste time scanning */
-	if(live_entries)
+	filter_offset = live_entries ? sizeof(header) : data_size;
+	filter_active = true;
+	return 0;
+}
+
+int sys_journal::filter_copy(size_t step)
+{
+	int r;
+	size_t copied = 0;
+	entry_header entry;
+	SYSJ_DEBUG("%zu", step);
+	while(filter_offset < data_size && copied < step)
 	{
-		entry_header entry;
-		size_t offset = sizeof(header);
-		while(offset < data_size)
+		void * entry_data;
+		size_t entry_length;
+		r = data.read(filter_offset, &entry);
+		if(r < 0)
+			return r;
+		/* check for discard and rollover records */
+		if(entry.length == (size_t) -1)
+			entry_length = 0;
+		else if(entry.length == (size_t) -2)
+			entry_length = sizeof(listener_id);
+		else
+			entry_length = entry.length;
+		if(filter_ids.count(entry.id))
+		{
+			/* skip this entry, it's been discarded */
+			filter_offset += sizeof(entry) + entry_length;
+			continue;
+		}
+		r = filter_data.append(&entry);
+		if(r < 0)
+			return r;
+		if(entry_length)
 		{
-			void * entry_data;
-			size_t entry_length;
-			r = data.read(offset, &entry);
-			if(r < 0)
-				goto fail;
-			offset += sizeof(entry);
-			if(entry.length == (size_t) -1)
-				continue;
-			/* check for a rollover record */
-			if(entry.length == (size_t) -2)
-				entry_length = sizeof(listener_id);
-			else
-				entry_length = entry.length;
-			if(discarded.count(entry.id))
-			{
-				/* skip this entry, it's been discarded */
-				offset += entry_length;
-				continue;
-			}
 			entry_data = malloc(entry_length);
 			if(!entry_data)
-			{
-				r = -ENOMEM;
-				goto fail;
-			}
-			if(data.read(offset, entry_data, entry_length) != (ssize_t) entry_length)
+				return -ENOMEM;
+			if(data.read(filter_offset + sizeof(entry), entry_data, entry_length) != (ssize_t) entry_length)
 			{
 				free(entry_data);
-				r = -EIO;
-				goto fail;
-			}
-			offset += entry_length;
-			r = out.append(&entry);
-			if(r < 0)
-			{
-				free(entry_data);
-				goto fail;
+				return -EIO;
 			}
-			r = out.append(entry_data, entry_length);
+			r = filter_data.append(entry_data, entry_length);
 			free(entry_data);
 			if(r != (int) entry_length)
-				goto fail;
+				return (r < 0) ? r : -1;
 		}
-		if(offset != data_size)
-			goto fail;
+		filter_offset += sizeof(entry) + entry_length;
+		copied += sizeof(entry) + entry_length;
 	}
-	*new_size = out.end();
-	r = out.close();
-	if(r < 0)
-		goto fail;
+	if(filter_offset > data_size)
+		return -EINVAL;
 	return 0;
+}
+
+int sys_journal::filter_finish()
+{
+	int r;
+	char seq[16];
+	meta_journal info;
+	SYSJ_DEBUG("");
+	assert(filter_offset == data_size);
+	assert_data_size();
 	
-fail:
-	out.close();
-	unlinkat(dfd, file, 0);
-	return (r < 0) ? r : -1;
+	info.magic = SYSJ_META_MAGIC;
+	info.version = SYSJ_META_VERSION;
+	info.seq = sequence + 1;
+	info.size = filter_data.end();
+	r = filter_data.close();
+	if(r < 0)
+	{
+		filter_abort();
+		return r;
+	}
+	r = tx_write(meta_fd, &info, sizeof(info), 0);
+	if(r < 0)
+	{
+		filter_abort();
+		return r;
+	}
+	/* switch to the new data file */
+	snprintf(seq, sizeof(seq), ".%u", info.seq);
+	istr data_name = meta_name + seq;
+	r = data.close();
+	assert(r >= 0);
+	data_size = info.size;
+	info_size = info.size;
+	r = data.open(meta_dfd, data_name, data_size);
+	assert(r >= 0);
+	/* everything appended so far is in the new file */
+	dirty = false;
+	/* delete the old sys_journal data */
+	snprintf(seq, sizeof(seq), ".%u", sequence);
+	data_name = meta_name + seq;
+	tx_unlink(meta_dfd, data_name, 0);
+	sequence = info.seq;
+	for(listener_id_set::iterator it = filter_ids.begin(); it != filter_ids.end(); ++it)
+		discarded.erase(*it);
+	filter_ids.clear();
+	filter_active = false;
+	assert_data_size();
+	return 0;
+}
+
+void sys_journal::filter_abort()
+{
+	char seq[16];
+	SYSJ_DEBUG("");
+	if(!filter_active)
+		return;
+	filter_data.close();
+	snprintf(seq, sizeof(seq), ".%u", sequence + 1);
+	istr data_name = meta_name + seq;
+	unlinkat(meta_dfd, data_name, 0);
+	filter_ids.clear();
+	filter_active = false;
 }
 
 int sys_journal::init(int dfd, const char * file, listening_dtable_warehouse * reg_warehouse, listening_dtable_warehouse * temp_warehouse, bool create, bool filter_on_empty)
@@ -666,6 +733,7 @@ void sys_journal::deinit(bool erase)
 	if(meta_fd)
 	{
 		int r;
+		filter_abort();
 		if(dirty)
 			flush_tx();
 		assert(!dirty);
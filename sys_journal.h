@@ -25,6 +25,9 @@
 #include "rwfile.h"
 #include "dtable.h"
 
+/* the default amount of data filter_step() copies per call */
+#define SYSJ_FILTER_STEP 1048576
+
 class sys_journal
 {
 public:
@@ -83,6 +86,8 @@ public:
 		
 		/* listening dtables must implement size() */
 		virtual size_t size() const = 0;
+		/* the memory used to hold the contents, if any */
+		inline virtual size_t memory_usage() const { return 0; }
 		
 		inline listener_id id() const { return local_id; }
 		inline listening_dtable_warehouse * get_warehouse() const { return warehouse; }
@@ -133,6 +138,12 @@ public:
 			return journal->append(this, entry, length);
 		}
 		
+		/* the pieces are concatenated into a single entry */
+		inline int journal_appendv(const struct iovec * iov, int count)
+		{
+			return journal->appendv(this, iov, count);
+		}
+		
 		inline int journal_discard()
 		{
 			return journal->discard(this);
@@ -295,8 +306,16 @@ public:
 	
 	/* remove any discarded entries from this journal */
 	int filter();
+	/* like filter(), but incrementally: copies at most about step bytes of
+	 * entries per call, so that appends can continue in between calls, and
+	 * switches to the new data file once it has caught up; returns 1 if the
+	 * filter is not finished yet, or 0 if it is */
+	int filter_step(size_t step = SYSJ_FILTER_STEP);
+	inline bool filtering() const { return filter_active; }
+	/* the current size of the journal data */
+	inline size_t size() const { return data_size; }
 	
-	inline sys_journal() : meta_dfd(-1), meta_fd(NULL), dirty(false), data_size(0), info_size(0)
+	inline sys_journal() : meta_dfd(-1), meta_fd(NULL), dirty(false), data_size(0), info_size(0), filter_active(false)
 	{
 		handle.data = this;
 		handle.handle = flush_tx_static;
@@ -361,7 +380,14 @@ private:
 		return (is_temporary(listener->id()) ? temp_warehouse : reg_warehouse)->remove(listener);
 	}
 	
-	int append(listening_dtable * listener, void * entry, size_t length);
+	inline int append(listening_dtable * listener, void * entry, size_t length)
+	{
+		struct iovec iov;
+		iov.iov_base = entry;
+		iov.iov_len = length;
+		return appendv(listener, &iov, 1);
+	}
+	int appendv(listening_dtable * listener, const struct iovec * iov, int count);
 	
 	/* make a note that this listener's entries are no longer needed */
 	inline int discard(listening_dtable * listener)
@@ -417,8 +443,18 @@ private:
 	
 	/* play back the entire journal, creating listeners as necessary */
 	int playback();
-	/* copy the entries in this journal to a new one, omitting the discarded entries */
-	int filter(int dfd, const char * file, size_t * new_size);
+	/* An incremental filter copies the entries in this journal to a new one,
+	 * omitting the entries discarded before it started, then switches to it */
+	rwfile filter_data;
+	bool filter_active;
+	size_t filter_offset;
+	listener_id_set filter_ids;
+	int filter_start();
+	/* copy entries until at least step bytes have been copied, or we have
+	 * caught up with the end of the journal */
+	int filter_copy(size_t step);
+	int filter_finish();
+	void filter_abort();
 	/* flushes the data file and tx_write()s the meta file */
 	int flush_tx();
 	/* actual function used for tx_register_pre_end */
@@ -29,7 +29,7 @@ int temp_journal_dtable::insert(const dtype & key, const blob & blob, bool appen
 	r = log(key, blob, append);
 	if(r < 0)
 		return r;
-	jdt_hash[key] = blob;
+	set_hash(key, blob);
 	return 0;
 }
 
@@ -57,10 +57,40 @@ int temp_journal_dtable::accept(const dtype & key, const blob & value, bool appe
 {
 	if(!temporary)
 		return journal_dtable::accept(key, value, append);
-	jdt_hash[key] = value;
+	set_hash(key, value);
 	return 0;
 }
 
+void temp_journal_dtable::set_hash(const dtype & key, const blob & value)
+{
+	if(partial(value))
+	{
+		journal_dtable_hash::iterator it = jdt_hash.find(key);
+		if(it != jdt_hash.end())
+		{
+			size_t old_size = it->second.size();
+			bool existed = it->second.exists();
+			/* merge the delta with the value we already have */
+			it->second = blob_mrg->merge(value, it->second);
+			set_memory(memory_usage() - old_size + it->second.size());
+			stats_change(existed, it->second);
+			return;
+		}
+	}
+	std::pair<journal_dtable_hash::iterator, bool> insert = jdt_hash.insert(journal_dtable_hash::value_type(key, value));
+	if(insert.second)
+	{
+		set_memory(memory_usage() + node_memory(key, value));
+		stats_add(key, value);
+	}
+	else
+	{
+		set_memory(memory_usage() - insert.first->second.size() + value.size());
+		stats_change(insert.first->second.exists(), value);
+		insert.first->second = value;
+	}
+}
+
 int temp_journal_dtable::degrade()
 {
 	journal_dtable_hash::iterator it;
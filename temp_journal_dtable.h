@@ -53,6 +53,7 @@ protected:
 	
 private:
 	int degrade();
+	void set_hash(const dtype & key, const blob & value);
 	
 	bool temporary;
 };
@@ -94,6 +94,7 @@ t_toilet * toilet_open(const char * path, FILE * errors)
 	FILE * version_file;
 	char version_str[16];
 	int dir_fd, id_fd, copy;
+	ssize_t size;
 	t_toilet * toilet;
 	
 	dir_fd = open(path, 0);
@@ -131,7 +132,15 @@ t_toilet * toilet_open(const char * path, FILE * errors)
 	toilet->row_fd = tx_open(dir_fd, "=next-row", O_RDWR);
 	if(toilet->row_fd < 0)
 		goto fail_read_1;
-	if(tx_read(toilet->row_fd, &toilet->next_row, sizeof(toilet->next_row), 0) != sizeof(toilet->next_row))
+	size = tx_read(toilet->row_fd, &toilet->next_row, sizeof(toilet->next_row), 0);
+	if(size == sizeof(uint32_t))
+	{
+		/* older databases only stored 32 bits */
+		uint32_t next;
+		util::memcpy(&next, &toilet->next_row, sizeof(next));
+		toilet->next_row = next;
+	}
+	else if(size != sizeof(toilet->next_row))
 		goto fail_read_2;
 	
 	/* get the list of gtable names */
@@ -182,10 +191,23 @@ int toilet_close(t_toilet * toilet)
 		delete toilet;
 	}
 	else if(toilet->out_count <= toilet->recent_gtables)
+	{
+		/* take them out of the recent list first, so that the recursive
+		 * toilet_close() calls don't do this again; the last one will
+		 * delete the toilet, so we must not look at it after that */
+		t_gtable * recent[RECENT_GTABLES];
+		int count = 0;
 		for(int i = 0; i < RECENT_GTABLES; i++)
 			if(toilet->recent_gtable[i])
-				/* this will end up calling toilet_close() recursively */
-				toilet_put_gtable(toilet->recent_gtable[i]);
+			{
+				recent[count++] = toilet->recent_gtable[i];
+				toilet->recent_gtable[i] = NULL;
+			}
+		toilet->recent_gtables = 0;
+		for(int i = 0; i < count; i++)
+			/* this will end up calling toilet_close() recursively */
+			toilet_put_gtable(recent[i]);
+	}
 	return 0;
 }
 
@@ -251,7 +273,7 @@ static int toilet_new_gtable_type(t_toilet * toilet, const char * name, dtype::c
 
 int toilet_new_gtable(t_toilet * toilet, const char * name)
 {
-	return toilet_new_gtable_type(toilet, name, dtype::UINT32);
+	return toilet_new_gtable_type(toilet, name, dtype::UINT64);
 }
 
 int toilet_new_gtable_blobkey(t_toilet * toilet, const char * name)
@@ -399,6 +421,16 @@ int toilet_gtable_maintain(t_gtable * gtable)
 	return r;
 }
 
+int toilet_gtable_add_index(t_gtable * gtable, const char * name, bool unique)
+{
+	int r = tx_start_r();
+	if(r < 0)
+		return r;
+	r = gtable->table->add_index(name, unique);
+	tx_end_r();
+	return r;
+}
+
 void toilet_put_gtable(t_gtable * gtable)
 {
 	if(--gtable->out_count <= 0)
@@ -454,6 +486,9 @@ t_type toilet_columns_type(t_columns * columns)
 			return T_STRING;
 		case dtype::BLOB:
 			return T_BLOB;
+		case dtype::UINT64:
+			/* toilet never creates uint64 columns */
+			break;
 	}
 	abort();
 }
@@ -492,6 +527,9 @@ t_type toilet_gtable_column_type(t_gtable * gtable, const char * name)
 			return T_STRING;
 		case dtype::BLOB:
 			return T_BLOB;
+		case dtype::UINT64:
+			/* toilet never creates uint64 columns */
+			break;
 	}
 	abort();
 }
@@ -501,6 +539,35 @@ size_t toilet_gtable_column_row_count(t_gtable * gtable, const char * name)
 	return gtable->table->row_count(name);
 }
 
+/* Gtables created before row IDs were 64 bits have 32-bit keys; row IDs too
+ * large for them are rejected by toilet_row_key_ok() before writing. */
+static inline dtype toilet_id_key(t_gtable * gtable, t_row_id id)
+{
+	if(gtable->table->key_type() == dtype::UINT32)
+		return dtype((uint32_t) id);
+	return dtype(id);
+}
+
+static inline dtype toilet_row_key(t_row * row)
+{
+	if(row->gtable->table->key_type() == dtype::BLOB)
+		return dtype(row->blobkey);
+	return toilet_id_key(row->gtable, row->id);
+}
+
+static inline bool toilet_row_key_ok(t_row * row)
+{
+	return row->gtable->table->key_type() != dtype::UINT32 || row->id <= 0xFFFFFFFF;
+}
+
+static inline t_row_id toilet_key_row_id(const dtype & key)
+{
+	if(key.type == dtype::UINT32)
+		return key.u32;
+	assert(key.type == dtype::UINT64);
+	return key.u64;
+}
+
 static int toilet_new_row_id(t_toilet * toilet, t_row_id * row)
 {
 	int r;
@@ -510,7 +577,10 @@ static int toilet_new_row_id(t_toilet * toilet, t_row_id * row)
 	if(r < 0)
 		return r;
 	bf_setkey(&bfc, toilet->id, sizeof(toilet->id));
-	*row = bf32_encipher(&bfc, toilet->next_row);
+	/* the low 32 bits are enciphered just as they always have been, so the
+	 * first 2^32 row IDs are unchanged; after that the high bits count up,
+	 * which keeps each group of row IDs close together in the key space */
+	*row = (toilet->next_row & ~(t_row_id) 0xFFFFFFFF) | bf32_encipher(&bfc, (uint32_t) toilet->next_row);
 	toilet->next_row = next;
 	return 0;
 }
@@ -532,7 +602,7 @@ int toilet_drop_row(t_row * row)
 	int r = tx_start_r();
 	if(r < 0)
 		return r;
-	r = row->gtable->table->remove(row->id);
+	r = row->gtable->table->remove(toilet_row_key(row));
 	tx_end_r();
 	if(r >= 0)
 		toilet_put_row(row);
@@ -590,7 +660,7 @@ const t_value * toilet_row_value(t_row * row, const char * key, t_type type)
 		return row->values[key];
 	dtype value(0u);
 	t_value * converted;
-	bool found = row->gtable->table->find(row->id, key, &value);
+	bool found = row->gtable->table->find(toilet_row_key(row), key, &value);
 	if(!found)
 		return NULL;
 	switch(value.type)
@@ -623,6 +693,9 @@ const t_value * toilet_row_value(t_row * row, const char * key, t_type type)
 			converted->v_blob.data = malloc(converted->v_blob.length);
 			util::memcpy(converted->v_blob.data, &value.blb[0], converted->v_blob.length);
 			return converted;
+		case dtype::UINT64:
+			/* there is no t_type for these */
+			return NULL;
 	}
 	abort();
 }
@@ -635,16 +708,22 @@ const t_value * toilet_row_value_type(t_row * row, const char * key, t_type * ty
 
 int toilet_row_set_value_hint(t_row * row, const char * key, t_type type, const t_value * value, bool append)
 {
-	int r = tx_start_r();
+	int r;
+	if(!toilet_row_key_ok(row))
+		return -EOVERFLOW;
+	/* integer values are stored in 32 bits */
+	if(type == T_INT && value->v_int > 0xFFFFFFFF)
+		return -EOVERFLOW;
+	r = tx_start_r();
 	if(r < 0)
 		return r;
 	switch(type)
 	{
 		case T_INT:
 			if(row->gtable->table->key_type() == dtype::BLOB)
-				r = row->gtable->table->insert(row->blobkey, key, value->v_int, append);
+				r = row->gtable->table->insert(row->blobkey, key, (uint32_t) value->v_int, append);
 			else
-				r = row->gtable->table->insert(row->id, key, value->v_int, append);
+				r = row->gtable->table->insert(toilet_row_key(row), key, (uint32_t) value->v_int, append);
 			if(r >= 0 && row->values.count(key))
 				row->values[key]->v_int = value->v_int;
 			tx_end_r();
@@ -653,7 +732,7 @@ int toilet_row_set_value_hint(t_row * row, const char * key, t_type type, const
 			if(row->gtable->table->key_type() == dtype::BLOB)
 				r = row->gtable->table->insert(row->blobkey, key, value->v_float, append);
 			else
-				r = row->gtable->table->insert(row->id, key, value->v_float, append);
+				r = row->gtable->table->insert(toilet_row_key(row), key, value->v_float, append);
 			if(r >= 0 && row->values.count(key))
 				row->values[key]->v_float = value->v_float;
 			tx_end_r();
@@ -662,7 +741,7 @@ int toilet_row_set_value_hint(t_row * row, const char * key, t_type type, const
 			if(row->gtable->table->key_type() == dtype::BLOB)
 				r = row->gtable->table->insert(row->blobkey, key, value->v_string, append);
 			else
-				r = row->gtable->table->insert(row->id, key, value->v_string, append);
+				r = row->gtable->table->insert(toilet_row_key(row), key, value->v_string, append);
 			if(r >= 0 && row->values.count(key))
 			{
 				free(row->values[key]);
@@ -676,7 +755,7 @@ int toilet_row_set_value_hint(t_row * row, const char * key, t_type type, const
 			if(row->gtable->table->key_type() == dtype::BLOB)
 				r = row->gtable->table->insert(row->blobkey, key, b, append);
 			else
-				r = row->gtable->table->insert(row->id, key, b, append);
+				r = row->gtable->table->insert(toilet_row_key(row), key, b, append);
 			if(r >= 0 && row->values.count(key))
 			{
 				t_value * cache = row->values[key];
@@ -697,7 +776,7 @@ int toilet_row_remove_key(t_row * row, const char * key)
 	int r = tx_start_r();
 	if(r < 0)
 		return r;
-	r = row->gtable->table->remove(row->id, key);
+	r = row->gtable->table->remove(toilet_row_key(row), key);
 	if(r >= 0 && row->values.count(key))
 	{
 		free(row->values[key]);
@@ -731,7 +810,7 @@ int toilet_cursor_valid(t_cursor * cursor)
 
 bool toilet_cursor_seek(t_cursor * cursor, t_row_id id)
 {
-	return cursor->iter->seek(id);
+	return cursor->iter->seek(toilet_id_key(cursor->gtable, id));
 }
 
 bool toilet_cursor_seek_blobkey(t_cursor * cursor, const void * key, size_t key_size)
@@ -782,9 +861,7 @@ int toilet_cursor_last(t_cursor * cursor)
 
 t_row_id toilet_cursor_row_id(t_cursor * cursor)
 {
-	dtype key = cursor->iter->key();
-	assert(key.type == dtype::UINT32);
-	return key.u32;
+	return toilet_key_row_id(cursor->iter->key());
 }
 
 const void * toilet_cursor_row_blobkey(t_cursor * cursor, size_t * key_size)
@@ -803,14 +880,8 @@ void toilet_close_cursor(t_cursor * cursor)
 		cursor->gtable->cursor = cursor;
 }
 
-static bool toilet_row_matches(t_gtable * gtable, t_row_id id, t_simple_query * query)
+static bool toilet_value_matches(const dtype & value, t_simple_query * query)
 {
-	/* match all rows in the gtable */
-	if(!query->name)
-		return true;
-	dtype value(0u);
-	if(!gtable->table->find(dtype(id), query->name, &value))
-		return false;
 	/* match all rows with this column */
 	if(!query->values[0])
 		return true;
@@ -818,9 +889,10 @@ static bool toilet_row_matches(t_gtable * gtable, t_row_id id, t_simple_query *
 	{
 		case T_INT:
 			assert(value.type == dtype::UINT32);
+			/* compare in 64 bits, since the query values may be larger */
 			if(!query->values[1])
-				return !value.compare(query->values[0]->v_int);
-			return 0 <= value.compare(query->values[0]->v_int) && value.compare(query->values[1]->v_int) <= 0;
+				return value.u32 == query->values[0]->v_int;
+			return query->values[0]->v_int <= value.u32 && value.u32 <= query->values[1]->v_int;
 		case T_FLOAT:
 			assert(value.type == dtype::DOUBLE);
 			if(!query->values[1])
@@ -845,6 +917,160 @@ static bool toilet_row_matches(t_gtable * gtable, t_row_id id, t_simple_query *
 	abort();
 }
 
+static bool toilet_row_matches(t_gtable * gtable, t_row_id id, t_simple_query * query)
+{
+	/* match all rows in the gtable */
+	if(!query->name)
+		return true;
+	dtype value(0u);
+	if(!gtable->table->find(toilet_id_key(gtable, id), query->name, &value))
+		return false;
+	return toilet_value_matches(value, query);
+}
+
+static dtype toilet_query_value(const t_simple_query * query, int index)
+{
+	const t_value * value = query->values[index];
+	switch(query->type)
+	{
+		case T_INT:
+			/* a lower bound this large will match nothing anyway; see
+			 * toilet_query_empty() */
+			if(value->v_int > 0xFFFFFFFF)
+				return dtype(0xFFFFFFFFu);
+			return dtype((uint32_t) value->v_int);
+		case T_FLOAT:
+			return dtype(value->v_float);
+		case T_STRING:
+			return dtype(value->v_string);
+		case T_BLOB:
+			return dtype(blob(value->v_blob.length, value->v_blob.data));
+	}
+	abort();
+}
+
+/* Integer columns hold 32-bit values, so a query whose lower bound is larger
+ * than that can't match anything, and must not be clamped and looked up. */
+static inline bool toilet_query_empty(const t_simple_query * query)
+{
+	return query->name && query->type == T_INT && query->values[0] && query->values[0]->v_int > 0xFFFFFFFF;
+}
+
+/* Finds the matching rows using the column's index, adding them to the result
+ * if it is not NULL. Returns the number of matching rows, or -ENOENT if the
+ * column is not indexed (or the query is not for specific values). */
+static ssize_t toilet_index_query(t_gtable * gtable, t_simple_query * query, t_rowset * result)
+{
+	ssize_t count = 0;
+	ext_index * index;
+	ext_index::iter * iter;
+	if(!query->name || !query->values[0])
+		return -ENOENT;
+	index = gtable->table->column_index(query->name);
+	if(!index)
+		return -ENOENT;
+	dtype low = toilet_query_value(query, 0);
+	dtype high = query->values[1] ? toilet_query_value(query, 1) : low;
+	iter = index->iterator();
+	if(!iter)
+		return -ENOMEM;
+	iter->seek(low);
+	while(iter->valid())
+	{
+		if(iter->key().compare(high) > 0)
+			break;
+		if(result)
+		{
+			result->ids.add(toilet_key_row_id(iter->pri()));
+		}
+		count++;
+		iter->next();
+	}
+	delete iter;
+	return count;
+}
+
+/* Finds the matching rows by reading only the query column, adding them to
+ * the result if it is not NULL. Returns the number of matching rows, or
+ * -ENOENT if the gtable can't iterate over just that column. */
+static ssize_t toilet_column_query(t_gtable * gtable, t_simple_query * query, t_rowset * result)
+{
+	ssize_t count = 0;
+	stable::iter * iter;
+	if(!query->name)
+		return -ENOENT;
+	iter = gtable->table->column_iterator(query->name);
+	if(!iter)
+		return -ENOENT;
+	while(iter->valid())
+	{
+		if(toilet_value_matches(iter->value(), query))
+		{
+			if(result)
+				result->ids.add(toilet_key_row_id(iter->key()));
+			count++;
+		}
+		iter->next();
+	}
+	delete iter;
+	return count;
+}
+
+/* Finds the matching rows the cheapest way the gtable's planner knows of,
+ * adding them to the result if it is not NULL. Returns the number of them. */
+static ssize_t toilet_planned_query(t_gtable * gtable, t_simple_query * query, t_rowset * result)
+{
+	ssize_t count;
+	dtable::key_iter * iter;
+	if(toilet_query_empty(query))
+		return 0;
+	if(query->name)
+	{
+		stable::access_path path = stable::COLUMN_SCAN;
+		if(query->values[0])
+		{
+			dtype low = toilet_query_value(query, 0);
+			if(query->values[1])
+			{
+				dtype high = toilet_query_value(query, 1);
+				path = gtable->table->plan(query->name, low, &high);
+			}
+			else
+				path = gtable->table->plan(query->name, low);
+		}
+		if(path == stable::INDEX_LOOKUP)
+		{
+			count = toilet_index_query(gtable, query, result);
+			if(count != -ENOENT)
+				return count;
+		}
+		if(path != stable::FULL_SCAN)
+		{
+			count = toilet_column_query(gtable, query, result);
+			if(count != -ENOENT)
+				return count;
+		}
+	}
+	count = 0;
+	/* just iterate over all the rows and find the matches */
+	iter = gtable->table->keys();
+	if(!iter)
+		return -ENOMEM;
+	while(iter->valid())
+	{
+		t_row_id id = toilet_key_row_id(iter->key());
+		if(toilet_row_matches(gtable, id, query))
+		{
+			if(result)
+				result->ids.add(id);
+			count++;
+		}
+		iter->next();
+	}
+	delete iter;
+	return count;
+}
+
 t_rowset * toilet_simple_query(t_gtable * gtable, t_simple_query * query)
 {
 	if(query->name)
@@ -866,12 +1092,12 @@ t_rowset * toilet_simple_query(t_gtable * gtable, t_simple_query * query)
 					delete result;
 					return NULL;
 				}
-				if(gtable->table->contains(query->values[0]->v_int))
-				{
-					t_row_id id = query->values[0]->v_int;
-					result->rows.push_back(id);
-					result->ids.insert(id);
-				}
+				t_row_id id = query->values[0]->v_int;
+				/* 32-bit gtables can't have larger rows */
+				if(gtable->table->key_type() == dtype::UINT32 && id > 0xFFFFFFFF)
+					return result;
+				if(gtable->table->contains(toilet_id_key(gtable, id)))
+					result->ids.add(id);
 			}
 			return result;
 		}
@@ -893,26 +1119,19 @@ t_rowset * toilet_simple_query(t_gtable * gtable, t_simple_query * query)
 				if(query->type != T_BLOB)
 					return NULL;
 				break;
+			case dtype::UINT64:
+				return NULL;
 			/* no default; want the compiler to warn of new cases */
 		}
 	}
 no_name:
 	t_rowset * result = new t_rowset;
-	/* we don't have indices yet, so just iterate and find the matches */
-	dtable::key_iter * iter = gtable->table->keys();
-	while(iter->valid())
+	/* don't return a partial result if there was an error */
+	if(toilet_planned_query(gtable, query, result) < 0)
 	{
-		dtype key = iter->key();
-		t_row_id id = key.u32;
-		assert(key.type == dtype::UINT32);
-		if(toilet_row_matches(gtable, id, query))
-		{
-			result->rows.push_back(id);
-			result->ids.insert(id);
-		}
-		iter->next();
+		delete result;
+		return NULL;
 	}
-	delete iter;
 	return result;
 }
 
@@ -939,37 +1158,42 @@ ssize_t toilet_count_simple_query(t_gtable * gtable, t_simple_query * query)
 			if(query->type != T_BLOB)
 				return -EINVAL;
 			break;
+		case dtype::UINT64:
+			return -EINVAL;
 		/* no default; want the compiler to warn of new cases */
 	}
-	ssize_t result = 0;
-	/* we don't have indices yet, so just iterate and find the matches */
-	dtable::key_iter * iter = gtable->table->keys();
-	while(iter->valid())
-	{
-		dtype key = iter->key();
-		t_row_id id = key.u32;
-		assert(key.type == dtype::UINT32);
-		if(toilet_row_matches(gtable, id, query))
-			result++;
-		iter->next();
-	}
-	delete iter;
-	return result;
+	return toilet_planned_query(gtable, query, NULL);
 }
 
 size_t toilet_rowset_size(t_rowset * rowset)
 {
-	return rowset->rows.size();
+	return rowset->ids.size();
 }
 
 t_row_id toilet_rowset_row(t_rowset * rowset, size_t index)
 {
-	return rowset->rows[index];
+	return rowset->ids.select(index);
 }
 
 bool toilet_rowset_contains(t_rowset * rowset, t_row_id id)
 {
-	return rowset->ids.count(id) > 0;
+	return rowset->ids.contains(id);
+}
+
+t_rowset * toilet_rowset_union(t_rowset * a, t_rowset * b)
+{
+	t_rowset * result = new t_rowset;
+	result->ids = a->ids;
+	result->ids |= b->ids;
+	return result;
+}
+
+t_rowset * toilet_rowset_intersect(t_rowset * a, t_rowset * b)
+{
+	t_rowset * result = new t_rowset;
+	result->ids = a->ids;
+	result->ids &= b->ids;
+	return result;
 }
 
 void toilet_put_rowset(t_rowset * rowset)
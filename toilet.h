@@ -15,6 +15,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #include <sys/types.h>
 
 #ifdef __cplusplus
@@ -49,9 +50,9 @@ static inline const char * toilet_name_type(t_type type)
 	return "(unknown)";
 }
 
-/* this should be uint64_t later */
-typedef uint32_t t_row_id;
-#define ROW_FORMAT "%u"
+typedef uint64_t t_row_id;
+#define ROW_FORMAT "%" PRIu64
+#define ROW_SCAN_FORMAT "%" SCNu64
 
 struct t_gtable;
 typedef struct t_gtable t_gtable;
@@ -79,9 +80,11 @@ typedef int (*blobcmp_func)(const void * b1, size_t s1, const void * b2, size_t
 typedef void (*blobcmp_free)(void * user);
 
 /* NOTE: To use this union for strings, just cast the char * to a t_value *. */
+/* v_int is wide enough for row IDs, so queries on "id" can use it; column
+ * values are still stored in 32 bits, and larger ones are refused. */
 union t_value
 {
-	uint32_t v_int;
+	uint64_t v_int;
 	double v_float;
 	const char v_string[0];
 	struct {
@@ -144,6 +147,9 @@ void toilet_put_columns(t_columns * columns);
 
 t_type toilet_gtable_column_type(t_gtable * gtable, const char * name);
 size_t toilet_gtable_column_row_count(t_gtable * gtable, const char * name);
+/* index a column, so that simple queries on it do not need to scan the gtable;
+ * the index is kept up to date automatically and persists across opens */
+int toilet_gtable_add_index(t_gtable * gtable, const char * name, bool unique);
 
 /* rows */
 
@@ -196,6 +202,9 @@ ssize_t toilet_count_simple_query(t_gtable * gtable, t_simple_query * query);
 size_t toilet_rowset_size(t_rowset * rowset);
 t_row_id toilet_rowset_row(t_rowset * rowset, size_t index);
 bool toilet_rowset_contains(t_rowset * rowset, t_row_id id);
+/* these return new rowsets, which must also be put */
+t_rowset * toilet_rowset_union(t_rowset * a, t_rowset * b);
+t_rowset * toilet_rowset_intersect(t_rowset * a, t_rowset * b);
 void toilet_put_rowset(t_rowset * rowset);
 
 /* blob comparators */
@@ -216,6 +225,7 @@ void toilet_blobcmp_release(t_blobcmp ** blobcmp);
 #include "transaction.h"
 
 #include "istr.h"
+#include "row_bitmap.h"
 #include "stable.h"
 
 #define GTABLE_NAME_LENGTH 63
@@ -295,8 +305,8 @@ struct t_cursor
 
 struct t_rowset
 {
-	std::vector<t_row_id> rows;
-	std::set<t_row_id> ids;
+	/* kept in ID order, like a scan would find them */
+	row_bitmap ids;
 	int out_count;
 	inline t_rowset() : out_count(1) {}
 };
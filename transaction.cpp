@@ -11,6 +11,8 @@
 #include <unistd.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 
 #include <vector>
 #include <algorithm> /* for std::sort */
@@ -33,9 +35,13 @@
  * tx_write() functions, as long as each tx_fd is used by only one thread. (And
  * note that opening the same file more than once will return the same tx_fd.)
  * It is also safe to call tx_register_pre_end() and tx_unregister_pre_end().
- * All other calls must be made by a single thread; furthermore, it is not safe
- * for other threads to use tx_write() while that single thread executes any
- * other transaction library function (e.g. tx_start() or tx_end()). */
+ * The global transaction belongs to one thread at a time: tx_start() waits for
+ * any other thread's global transaction (or concurrent commit) to end first,
+ * but tx_start_r() must not be used to join another thread's transaction unless
+ * it has been lent with tx_lend(). The tx_ctx_*() calls can be used from any
+ * number of threads, each with its own transactions; see transaction.h. It is
+ * not safe for other threads to use tx_write() on files that a global
+ * transaction is using. */
 
 #define MF_TX_WRITE 1
 #define MF_TX_UNLINK 2
@@ -150,6 +156,25 @@ int metafile::unlink(int dfd, const char * name, bool recursive)
 		itr->second->flush();
 		delete itr->second;
 	}
+	if(recursive)
+	{
+		/* metafiles inside the directory must be flushed now too, or
+		 * their writes would be played back after it has been removed */
+		istr prefix = path + "/";
+		itr = mf_map.lower_bound(prefix);
+		while(itr != mf_map.end() && !strncmp(itr->first, prefix, prefix.length()))
+		{
+			metafile * mf = itr->second;
+			++itr;
+			if(mf->usage)
+			{
+				fprintf(stderr, "Warning: tried to unlink open metafile %s\n", mf->path.str());
+				return -EBUSY;
+			}
+			mf->flush();
+			delete mf;
+		}
+	}
 	uint8_t type = recursive ? MF_TX_RM_R : MF_TX_UNLINK;
 	uint16_t path_len = path.length();
 	journal::ovec ov[3] = {{&type, sizeof(type)},
@@ -171,6 +196,15 @@ tx_id metafile::last_tx_id = -1;
 tx_pre_end * metafile::pre_end_handlers = NULL;
 init_mutex metafile::pre_end_handler_lock;
 metafile::tx_map_t metafile::tx_map;
+init_mutex metafile::tx_claim_lock;
+init_cond metafile::tx_claim_free;
+pthread_t metafile::tx_owner;
+uint32_t metafile::tx_claims = 0;
+bool metafile::tx_global = false;
+bool metafile::tx_lent = false;
+pthread_t metafile::tx_borrower;
+uint32_t metafile::tx_lent_claims = 0;
+metafile::async_syncer * metafile::syncer = NULL;
 
 int metafile::record_processor(void * data, size_t length, void * param)
 {
@@ -252,7 +286,7 @@ int metafile::tx_init(int dfd, size_t log_size)
 	DIR * dir;
 	int copy, error = -1;
 	struct dirent * ent;
-	std::vector<istr> entries;
+	std::vector<istr> entries, segments;
 	
 	if(journal_dir >= 0)
 		return -EBUSY;
@@ -260,7 +294,7 @@ int metafile::tx_init(int dfd, size_t log_size)
 	journal_dir = openat(dfd, "journals", O_RDONLY);
 	if(journal_dir < 0)
 		return journal_dir;
-	copy = journal::init(dfd);
+	copy = journal::init(dfd, log_size);
 	if(copy < 0)
 	{
 		error = copy;
@@ -283,12 +317,23 @@ int metafile::tx_init(int dfd, size_t log_size)
 	{
 		if(!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
 			continue;
-		entries.push_back(ent->d_name);
+		if(journal::is_segment(ent->d_name))
+			segments.push_back(ent->d_name);
+		else
+			entries.push_back(ent->d_name);
 	}
 	closedir(dir);
 	if(ent)
 		goto fail;
 	
+	/* the pool must be complete before any journals are erased */
+	for(size_t i = 0; i < segments.size(); i++)
+	{
+		error = journal::add_segment(journal_dir, segments[i]);
+		if(error < 0)
+			goto fail;
+	}
+	
 	/* XXX: currently we assume recovery of journals in lexicographic order */
 	std::sort(entries.begin(), entries.end(), strcmp_less());
 	
@@ -310,9 +355,12 @@ int metafile::tx_init(int dfd, size_t log_size)
 			if(error < 0)
 				goto fail;
 			/* unlink the commit file as well */
-			error = unlinkat(journal_dir, commit_name, 0);
-			if(error < 0)
-				goto fail;
+			if(commit_name)
+			{
+				error = unlinkat(journal_dir, commit_name, 0);
+				if(error < 0)
+					goto fail;
+			}
 			continue;
 		}
 		error = current_journal->playback(record_processor, NULL, NULL);
@@ -351,6 +399,12 @@ void metafile::tx_deinit()
 		tx_recursion = 1;
 		tx_end(0);
 	}
+	if(syncer)
+	{
+		/* finishes any requests still pending */
+		delete syncer;
+		syncer = NULL;
+	}
 	for(tx_map_t::iterator itr = tx_map.begin(); itr != tx_map.end(); ++itr)
 	{
 		journal * j = itr->second;
@@ -372,20 +426,85 @@ void metafile::tx_deinit()
 	journal::deinit();
 	::close(journal_dir);
 	journal_dir = -1;
+	tx_claims = 0;
+	tx_global = false;
+	tx_lent = false;
+}
+
+/* must be called with tx_claim_lock held */
+bool metafile::tx_claimed(pthread_t self)
+{
+	return pthread_equal(tx_owner, self) || (tx_lent && pthread_equal(tx_borrower, self));
+}
+
+void metafile::tx_claim(bool join)
+{
+	pthread_t self = pthread_self();
+	scopelock scope(tx_claim_lock);
+	while(tx_claims && !tx_claimed(self))
+	{
+		/* joining another thread's global transaction means waiting for
+		 * it to end, and it may be waiting for us (see tx_lend()) */
+		assert(!join || !tx_global);
+		scope.wait(tx_claim_free);
+	}
+	/* a borrower's claims still belong to the owner */
+	if(!tx_claims)
+		tx_owner = self;
+	tx_claims++;
+}
+
+void metafile::tx_unclaim()
+{
+	scopelock scope(tx_claim_lock);
+	assert(tx_claims && tx_claimed(pthread_self()));
+	if(!--tx_claims)
+	{
+		assert(!tx_lent);
+		scope.broadcast(tx_claim_free);
+	}
+}
+
+void metafile::tx_lend(pthread_t thread)
+{
+	scopelock scope(tx_claim_lock);
+	if(!tx_global || !pthread_equal(tx_owner, pthread_self()))
+		return;
+	assert(!tx_lent);
+	tx_lent = true;
+	tx_borrower = thread;
+	tx_lent_claims = tx_claims;
+}
+
+void metafile::tx_reclaim()
+{
+	scopelock scope(tx_claim_lock);
+	if(!tx_lent || !pthread_equal(tx_owner, pthread_self()))
+		return;
+	/* the borrower must have ended everything it started */
+	assert(tx_claims == tx_lent_claims);
+	tx_lent = false;
 }
 
 int metafile::tx_start()
 {
 	MF_S_DEBUG("%d", tx_recursion);
+	tx_claim();
 	if(!current_journal)
 	{
 		char name[16];
 		if(journal_dir < 0)
+		{
+			tx_unclaim();
 			return -EBUSY;
+		}
 		snprintf(name, sizeof(name), "%08x.jnl", last_tx_id + 1);
 		current_journal = journal::create(journal_dir, name, last_journal);
 		if(!current_journal)
+		{
+			tx_unclaim();
 			return -1;
+		}
 		if(last_journal && tx_map.find(last_tx_id) == tx_map.end())
 		{
 			last_journal->release();
@@ -393,7 +512,11 @@ int metafile::tx_start()
 		}
 	}
 	last_tx_id++;
-	tx_recursion++;
+	if(!tx_recursion++)
+	{
+		scopelock scope(tx_claim_lock);
+		tx_global = true;
+	}
 	return 0;
 }
 
@@ -456,6 +579,11 @@ tx_id metafile::tx_end(bool assign_id)
 			goto fail;
 	}
 	tx_recursion--;
+	{
+		scopelock scope(tx_claim_lock);
+		tx_global = false;
+	}
+	tx_unclaim();
 	return assign_id ? last_tx_id : 0;
 	
 fail:
@@ -501,35 +629,226 @@ void metafile::tx_unregister_pre_end(tx_pre_end * handle)
 int metafile::tx_sync(tx_id id)
 {
 	int r;
-	tx_map_t::iterator itr = tx_map.find(id);
+	journal * j;
+	tx_map_t::iterator itr;
+	tx_claim();
+	itr = tx_map.find(id);
 	if(itr == tx_map.end())
+	{
+		tx_unclaim();
 		return -EINVAL;
-	journal * j = itr->second;
+	}
+	j = itr->second;
+	/* don't hold up other transactions while we wait */
+	tx_unclaim();
 	r = j->wait();
 	if(r < 0)
 		return r;
-	tx_map.erase(id);
-	if(j != last_journal)
-		j->release();
-	return 0;
+	return tx_forget(id);
 }
 
 int metafile::tx_forget(tx_id id)
 {
+	tx_claim();
 	tx_map_t::iterator itr = tx_map.find(id);
 	if(itr == tx_map.end())
+	{
+		tx_unclaim();
 		return -EINVAL;
+	}
 	journal * j = itr->second;
 	tx_map.erase(id);
 	if(j != last_journal)
 		j->release();
+	tx_unclaim();
+	return 0;
+}
+
+/* The syncer thread waits for requests from tx_sync_async() and forces
+ * everything committed so far to disk, so a single wait covers all the requests
+ * that were queued before it started. Finished requests go on another queue and
+ * the eventfd is signaled; the callbacks are run by tx_sync_dispatch() in the
+ * caller's own thread, since the rest of the transaction code is not thread
+ * safe. With Featherstitch, we just wait in tx_sync_async() itself. */
+struct metafile::async_syncer
+{
+	struct request
+	{
+		tx_id id;
+		tx_sync_callback callback;
+		void * data;
+		int result;
+	};
+	typedef std::vector<request> request_list;
+	
+	int event_fd;
+	bool running, stop;
+	request_list pending, completed;
+	pthread_t thread;
+	init_mutex lock;
+	init_cond changed;
+	
+	inline async_syncer() : event_fd(-1), running(false), stop(false) {}
+	
+	inline int init()
+	{
+		event_fd = eventfd(0, EFD_NONBLOCK);
+		if(event_fd < 0)
+			return -errno;
+#if !HAVE_FSTITCH
+		if(pthread_create(&thread, NULL, run, this))
+		{
+			::close(event_fd);
+			event_fd = -1;
+			return -1;
+		}
+		running = true;
+#endif
+		return 0;
+	}
+	
+	/* finishes the pending requests and runs all the callbacks first */
+	inline ~async_syncer()
+	{
+		if(running)
+		{
+			scopelock scope(lock);
+			stop = true;
+			scope.broadcast(changed);
+			scope.unlock();
+			pthread_join(thread, NULL);
+		}
+		dispatch();
+		if(event_fd >= 0)
+			::close(event_fd);
+	}
+	
+	void submit(const request & req)
+	{
+		scopelock scope(lock);
+		pending.push_back(req);
+		scope.signal(changed);
+	}
+	
+	void complete(const request_list & done)
+	{
+		uint64_t one = 1;
+		scopelock scope(lock);
+		completed.insert(completed.end(), done.begin(), done.end());
+		scope.unlock();
+		if(::write(event_fd, &one, sizeof(one)) < 0)
+			/* the counter can only overflow; it's already readable then */
+			assert(errno == EAGAIN);
+	}
+	
+	int dispatch()
+	{
+		uint64_t count;
+		request_list done;
+		scopelock scope(lock);
+		done.swap(completed);
+		/* reset the eventfd while holding the lock, so we can't miss one */
+		if(::read(event_fd, &count, sizeof(count)) < 0)
+			assert(errno == EAGAIN);
+		scope.unlock();
+		for(size_t i = 0; i < done.size(); i++)
+		{
+			/* release the journal just like tx_sync() does */
+			if(done[i].result >= 0)
+				tx_forget(done[i].id);
+			done[i].callback(done[i].id, done[i].result, done[i].data);
+		}
+		return done.size();
+	}
+	
+#if !HAVE_FSTITCH
+	static void * run(void * arg)
+	{
+		async_syncer * syncer = (async_syncer *) arg;
+		scopelock scope(syncer->lock);
+		for(;;)
+		{
+			int r;
+			request_list batch;
+			while(syncer->pending.empty() && !syncer->stop)
+				scope.wait(syncer->changed);
+			if(syncer->pending.empty())
+				break;
+			batch.swap(syncer->pending);
+			scope.unlock();
+			r = journal::wait_all();
+			for(size_t i = 0; i < batch.size(); i++)
+				batch[i].result = r;
+			syncer->complete(batch);
+			scope.lock();
+		}
+		return NULL;
+	}
+#endif
+};
+
+metafile::async_syncer * metafile::get_syncer()
+{
+	if(!syncer && journal_dir >= 0)
+	{
+		syncer = new async_syncer;
+		if(syncer && syncer->init() < 0)
+		{
+			delete syncer;
+			syncer = NULL;
+		}
+	}
+	return syncer;
+}
+
+int metafile::tx_sync_async(tx_id id, tx_sync_callback callback, void * data)
+{
+	async_syncer::request req;
+	tx_map_t::iterator itr;
+	tx_claim();
+	itr = tx_map.find(id);
+	tx_unclaim();
+	if(itr == tx_map.end())
+		return -EINVAL;
+	if(!get_syncer())
+		return -ENOMEM;
+	req.id = id;
+	req.callback = callback;
+	req.data = data;
+#if HAVE_FSTITCH
+	req.result = itr->second->wait();
+	syncer->complete(async_syncer::request_list(1, req));
+#else
+	req.result = 0;
+	syncer->submit(req);
+#endif
 	return 0;
 }
 
+int metafile::tx_sync_fd()
+{
+	if(!get_syncer())
+		return (journal_dir < 0) ? -EBUSY : -ENOMEM;
+	return syncer->event_fd;
+}
+
+int metafile::tx_sync_dispatch()
+{
+	if(!syncer)
+		return 0;
+	return syncer->dispatch();
+}
+
 int metafile::tx_start_r()
 {
+	/* another thread's commit must end before we look at tx_recursion */
+	tx_claim(true);
 	if(!tx_recursion)
-		return tx_start();
+	{
+		int r = tx_start();
+		tx_unclaim();
+		return r;
+	}
 	tx_recursion++;
 	assert(tx_recursion);
 	return 0;
@@ -542,9 +861,86 @@ int metafile::tx_end_r()
 	if(tx_recursion == 1)
 		return tx_end(0);
 	tx_recursion--;
+	tx_unclaim();
 	return 0;
 }
 
+tx_context::file_state * metafile::ctx_file(tx_context * ctx, metafile * file)
+{
+	tx_context::file_state * state;
+	tx_context::file_map::iterator itr = ctx->files.find(file);
+	if(itr != ctx->files.end())
+		return &itr->second;
+	state = &ctx->files[file];
+	/* the snapshot shares the data until one of them writes */
+	tx_claim();
+	state->data = file->data;
+	state->version = file->version;
+	state->dirty = false;
+	tx_unclaim();
+	scopelock scope(mf_map_lock);
+	file->usage++;
+	return state;
+}
+
+tx_id metafile::ctx_end(tx_context * ctx, bool assign_id)
+{
+	tx_id r;
+	tx_context::file_map::iterator itr;
+	bool dirty = false;
+	tx_claim();
+	if(tx_recursion)
+	{
+		/* we can't commit in the middle of our own global transaction */
+		tx_unclaim();
+		return -EBUSY;
+	}
+	for(itr = ctx->files.begin(); itr != ctx->files.end(); ++itr)
+	{
+		if(itr->first->version != itr->second.version)
+		{
+			tx_unclaim();
+			ctx_abort(ctx);
+			return -EAGAIN;
+		}
+		dirty |= itr->second.dirty;
+	}
+	if(!dirty)
+	{
+		/* nothing to commit, but it still had to be validated */
+		tx_unclaim();
+		ctx_abort(ctx);
+		return 0;
+	}
+	r = tx_start();
+	if(r < 0)
+	{
+		tx_unclaim();
+		ctx_abort(ctx);
+		return r;
+	}
+	for(itr = ctx->files.begin(); itr != ctx->files.end(); ++itr)
+		if(itr->second.dirty)
+		{
+			metafile * mf = itr->first;
+			mf->data = itr->second.data;
+			mf->is_dirty = true;
+			mf->version++;
+		}
+	r = tx_end(assign_id);
+	tx_unclaim();
+	ctx_abort(ctx);
+	return r;
+}
+
+void metafile::ctx_abort(tx_context * ctx)
+{
+	scopelock scope(mf_map_lock);
+	for(tx_context::file_map::iterator itr = ctx->files.begin(); itr != ctx->files.end(); ++itr)
+		itr->first->close();
+	delete ctx;
+}
+
 /* now the C interface to all this */
 
 tx_fd tx_open(int dfd, const char * name, int create)
@@ -636,6 +1032,67 @@ int tx_sync(tx_id id)
 	return metafile::tx_sync(id);
 }
 
+tx_ctx tx_ctx_start(void)
+{
+	return new tx_context;
+}
+
+size_t tx_ctx_size(tx_ctx ctx, tx_fd file)
+{
+	tx_context::file_state * state = metafile::ctx_file(ctx, file);
+	return state->data.size();
+}
+
+size_t tx_ctx_read(tx_ctx ctx, tx_fd file, void * buf, size_t length, off_t offset)
+{
+	tx_context::file_state * state = metafile::ctx_file(ctx, file);
+	if((size_t) offset >= state->data.size())
+		return 0;
+	if(offset + length > state->data.size())
+		length = state->data.size() - offset;
+	util::memcpy(buf, &state->data[offset], length);
+	return length;
+}
+
+int tx_ctx_truncate(tx_ctx ctx, tx_fd file)
+{
+	tx_context::file_state * state = metafile::ctx_file(ctx, file);
+	state->dirty = true;
+	return state->data.set_size(0);
+}
+
+int tx_ctx_write(tx_ctx ctx, tx_fd file, const void * buf, size_t length, off_t offset)
+{
+	tx_context::file_state * state = metafile::ctx_file(ctx, file);
+	state->dirty = true;
+	return state->data.overwrite(offset, buf, length);
+}
+
+tx_id tx_ctx_end(tx_ctx ctx, int assign_id)
+{
+	return metafile::ctx_end(ctx, assign_id);
+}
+
+void tx_ctx_abort(tx_ctx ctx)
+{
+	metafile::ctx_abort(ctx);
+}
+
+int tx_sync_async(tx_id id, tx_sync_callback callback, void * data)
+{
+	return metafile::tx_sync_async(id, callback, data);
+}
+
+int tx_sync_fd(void)
+{
+	return metafile::tx_sync_fd();
+}
+
+int tx_sync_dispatch(void)
+{
+	return metafile::tx_sync_dispatch();
+}
+
 int tx_forget(tx_id id)
 {
 	return metafile::tx_forget(id);
@@ -650,3 +1107,13 @@ int tx_end_r(void)
 {
 	return metafile::tx_end_r();
 }
+
+void tx_lend(pthread_t thread)
+{
+	metafile::tx_lend(thread);
+}
+
+void tx_reclaim(void)
+{
+	metafile::tx_reclaim();
+}
@@ -7,6 +7,7 @@
 
 #include <stdarg.h>
 #include <stdint.h>
+#include <pthread.h>
 #include <sys/types.h>
 
 #ifdef __cplusplus
@@ -46,6 +47,16 @@ void tx_unregister_pre_end(struct tx_pre_end * handle);
 int tx_sync(tx_id id);
 int tx_forget(tx_id id);
 
+/* tx_sync_async() is like tx_sync(), but returns right away: the callback is
+ * run by a later tx_sync_dispatch() once the transaction is on disk (with the
+ * result tx_sync() would have returned). The file descriptor returned by
+ * tx_sync_fd() becomes readable when there are callbacks waiting to be run,
+ * so event loops can poll it. tx_sync_dispatch() returns how many it ran. */
+typedef void (*tx_sync_callback)(tx_id id, int result, void * data);
+int tx_sync_async(tx_id id, tx_sync_callback callback, void * data);
+int tx_sync_fd(void);
+int tx_sync_dispatch(void);
+
 /* metafiles */
 typedef struct metafile * tx_fd;
 
@@ -62,10 +73,37 @@ int tx_close(tx_fd file);
 
 int tx_unlink(int dfd, const char * name, int recursive);
 
+/* Concurrent transactions: any thread can run transactions on open metafiles
+ * with the tx_ctx_*() calls, independently of the global transaction above.
+ * Each file is snapshotted when the transaction first uses it, and the writes
+ * stay private until tx_ctx_end() commits them through the journal. Commits
+ * (and global transactions) happen one at a time, and their order is a serial
+ * order: if another commit changed any file the transaction used since it was
+ * snapshotted, tx_ctx_end() returns -EAGAIN instead, so it can be retried.
+ * Either way, tx_ctx_end() and tx_ctx_abort() free the transaction. */
+typedef struct tx_context * tx_ctx;
+tx_ctx tx_ctx_start(void);
+size_t tx_ctx_size(tx_ctx ctx, tx_fd file);
+size_t tx_ctx_read(tx_ctx ctx, tx_fd file, void * buf, size_t length, off_t offset);
+int tx_ctx_truncate(tx_ctx ctx, tx_fd file);
+int tx_ctx_write(tx_ctx ctx, tx_fd file, const void * buf, size_t length, off_t offset);
+tx_id tx_ctx_end(tx_ctx ctx, int assign_id);
+void tx_ctx_abort(tx_ctx ctx);
+
 /* simple recursive transactions: the "real" transaction is the outermost one */
 int tx_start_r(void);
 int tx_end_r(void);
 
+/* The global transaction belongs to the thread that started it. Other threads
+ * must not touch it while it is in progress: tx_start_r() would have to wait for
+ * it to end, and it may be waiting for them, so it fails an assertion instead.
+ * A thread about to wait for a helper thread (like a background digest) can
+ * lend the transaction to it with tx_lend(), and the helper can then use it as
+ * its own until the owner calls tx_reclaim(); the helper must end everything
+ * it started before then. Neither does anything outside a transaction. */
+void tx_lend(pthread_t thread);
+void tx_reclaim(void);
+
 struct tx_handle {
 	uint32_t in_tx;
 };
@@ -94,6 +132,20 @@ struct tx_handle {
 #define MF_S_DEBUG(format, args...)
 #endif
 
+struct tx_context
+{
+	/* the transaction's view of a metafile */
+	struct file_state
+	{
+		blob_buffer data;
+		/* the metafile's version when it was snapshotted */
+		uint32_t version;
+		bool dirty;
+	};
+	typedef std::map<metafile *, file_state> file_map;
+	file_map files;
+};
+
 struct metafile
 {
 public:
@@ -123,6 +175,7 @@ public:
 	inline void truncate()
 	{
 		is_dirty = true;
+		version++;
 		data.set_size(0);
 	}
 	
@@ -130,6 +183,7 @@ public:
 	{
 		MF_DEBUG("%zu:%zu", offset, length);
 		is_dirty = true;
+		version++;
 		return data.overwrite(offset, buf, length);
 	}
 	
@@ -160,12 +214,23 @@ public:
 	static int tx_sync(tx_id id);
 	static int tx_forget(tx_id id);
 	
+	static int tx_sync_async(tx_id id, tx_sync_callback callback, void * data);
+	static int tx_sync_fd();
+	static int tx_sync_dispatch();
+	
 	static int tx_start_r();
 	static int tx_end_r();
+	static void tx_lend(pthread_t thread);
+	static void tx_reclaim();
+	
+	/* concurrent transactions */
+	static tx_context::file_state * ctx_file(tx_context * ctx, metafile * file);
+	static tx_id ctx_end(tx_context * ctx, bool assign_id);
+	static void ctx_abort(tx_context * ctx);
 	
 private:
 	inline metafile(const istr & path)
-		: path(path), usage(1), is_dirty(false)
+		: path(path), usage(1), is_dirty(false), version(0)
 	{
 		assert(path);
 		mf_map_lock.assert_locked();
@@ -188,6 +253,8 @@ private:
 	blob_buffer data;
 	size_t usage;
 	bool is_dirty;
+	/* changed by every write, to detect conflicts */
+	uint32_t version;
 	
 	/* static stuff */
 	typedef std::map<istr, metafile *, strcmp_less> mf_map_t;
@@ -206,6 +273,27 @@ private:
 	typedef std::map<tx_id, journal *> tx_map_t;
 	static tx_map_t tx_map; 
 	
+	/* only one thread at a time may run the global transaction or commit a
+	 * concurrent one; it holds the claim, and can take it recursively */
+	static init_mutex tx_claim_lock;
+	static init_cond tx_claim_free;
+	static pthread_t tx_owner;
+	static uint32_t tx_claims;
+	/* whether the owner is in a global transaction, rather than a commit */
+	static bool tx_global;
+	/* the thread the global transaction is lent to, if any */
+	static bool tx_lent;
+	static pthread_t tx_borrower;
+	static uint32_t tx_lent_claims;
+	static void tx_claim(bool join = false);
+	static void tx_unclaim();
+	static bool tx_claimed(pthread_t self);
+	
+	/* the background thread used by tx_sync_async() */
+	struct async_syncer;
+	static async_syncer * syncer;
+	static async_syncer * get_syncer();
+	
 	static int switch_journal();
 	static istr full_path(int dfd, const char * name);
 	static bool ends_with(const char * string, const char * suffix);
@@ -68,6 +68,8 @@ private:
 	public:
 		virtual metablob meta() const;
 		virtual blob value() const;
+		/* the base's zone summaries describe our encoded values */
+		virtual bool skip_zones(const zone_test & test) { return valid(); }
 		inline iter(dtable::iter * base, const usstate_dtable * source);
 		virtual ~iter() {}
 	};
@@ -27,8 +27,8 @@
  * bytes 0-3: magic number
  * bytes 4-7: format version
  * bytes 8-11: key count
- * byte 12: key type (0 -> invalid, 1 -> uint32, 2 -> double, 3 -> string, 4 -> blob)
- * byte 13: key size (for uint32/string/blob; 1-4 bytes)
+ * byte 12: key type (0 -> invalid, 1 -> uint32, 2 -> double, 3 -> string, 4 -> blob, 5 -> uint64)
+ * byte 13: key size (for uint32/string/blob; 1-4 bytes, for uint64; 1-8 bytes)
  * byte 14: data length size (1-4 bytes)
  * byte 15: offset size (1-4 bytes)
  * bytes 16-19: duplicate string table offset (relative to data start)
@@ -37,6 +37,7 @@
  * bytes 22-23: duplicate string escape sequence
  * bytes 24-27: if key type is blob, blob comparator name length
  * bytes 28-n: if key type is blob and length > 0, blob comparator name
+ * bytes 24-31: if key type is uint64, the smallest key (others are stored relative to it)
  * bytes 24-m, 28-m, or n+1-m: if key type is string/blob, a string table
  * byte 24 or m+1: main data tables
  * byte o: duplicate string table (unless offset = 0)
@@ -174,6 +175,8 @@ dtype ustr_dtable::get_key(size_t index, size_t * data_length, off_t * data_offs
 	{
 		case dtype::UINT32:
 			return dtype(util::read_bytes(bytes, 0, key_size));
+		case dtype::UINT64:
+			return dtype(key_base + util::read_bytes64(bytes, 0, key_size));
 		case dtype::DOUBLE:
 		{
 			double value;
@@ -335,6 +338,14 @@ int ustr_dtable::init(int dfd, const char * file, const params & config, sys_jou
 			if(key_size != sizeof(double))
 				goto fail;
 			break;
+		case 5:
+			ktype = dtype::UINT64;
+			if(key_size > 8)
+				goto fail;
+			if(fp->read_type(key_start_off, &key_base) < 0)
+				goto fail;
+			key_start_off += sizeof(key_base);
+			break;
 		case 4:
 			uint32_t length;
 			if(fp->read_type(key_start_off, &length) < 0)
@@ -500,6 +511,7 @@ int ustr_dtable::create(int dfd, const char * file, const params & config, dtabl
 	const blob_comparator * blob_cmp = source->get_blob_cmp();
 	size_t key_count = 0, max_data_size = 0, total_data_size = 0;
 	uint32_t max_key = 0;
+	uint64_t min_key64 = (uint64_t) -1, max_key64 = 0;
 	dtable_header header;
 	int r, size;
 	rwfile out;
@@ -527,6 +539,12 @@ int ustr_dtable::create(int dfd, const char * file, const params & config, dtabl
 				if(key.u32 > max_key)
 					max_key = key.u32;
 				break;
+			case dtype::UINT64:
+				if(key.u64 < min_key64)
+					min_key64 = key.u64;
+				if(key.u64 > max_key64)
+					max_key64 = key.u64;
+				break;
 			case dtype::DOUBLE:
 				/* nothing to do */
 				break;
@@ -648,6 +666,12 @@ int ustr_dtable::create(int dfd, const char * file, const params & config, dtabl
 			header.key_type = 1;
 			header.key_size = util::byte_size(max_key);
 			break;
+		case dtype::UINT64:
+			if(!key_count)
+				min_key64 = 0;
+			header.key_type = 5;
+			header.key_size = util::byte_size64(max_key64 - min_key64);
+			break;
 		case dtype::DOUBLE:
 			header.key_type = 2;
 			header.key_size = sizeof(double);
@@ -672,7 +696,13 @@ int ustr_dtable::create(int dfd, const char * file, const params & config, dtabl
 	r = out.append(&header);
 	if(r < 0)
 		goto fail_unlink;
-	if(key_type == dtype::BLOB)
+	if(key_type == dtype::UINT64)
+	{
+		r = out.append(&min_key64);
+		if(r < 0)
+			goto fail_unlink;
+	}
+	else if(key_type == dtype::BLOB)
 	{
 		uint32_t length = blob_cmp ? strlen(blob_cmp->name) : 0;
 		out.append(&length);
@@ -712,6 +742,9 @@ int ustr_dtable::create(int dfd, const char * file, const params & config, dtabl
 			case dtype::UINT32:
 				util::layout_bytes(bytes, &i, key.u32, header.key_size);
 				break;
+			case dtype::UINT64:
+				util::layout_bytes64(bytes, &i, key.u64 - min_key64, header.key_size);
+				break;
 			case dtype::DOUBLE:
 				util::memcpy(bytes, &key.dbl, sizeof(double));
 				i += sizeof(double);
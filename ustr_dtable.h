@@ -117,6 +117,8 @@ private:
 	size_t key_count;
 	stringtbl st, dup;
 	uint8_t key_size, length_size, offset_size;
+	/* uint64 keys are stored as offsets from the smallest one */
+	uint64_t key_base;
 	uint8_t dup_index_size, dup_escape_len, dup_escape[2];
 	off_t key_start_off, data_start_off;
 };
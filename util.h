@@ -76,6 +76,37 @@ public:
 		return value;
 	}
 	
+	/* 64-bit versions of the above, for sizes up to 8 bytes */
+	static inline uint8_t byte_size64(uint64_t value)
+	{
+		uint8_t size = 1;
+		while(size < 8 && value >= ((uint64_t) 1 << (size * 8)))
+			size++;
+		return size;
+	}
+	
+	static inline void layout_bytes64(uint8_t * array, int * index, uint64_t value, uint8_t size)
+	{
+		int i = *index;
+		*index += size;
+		/* write big endian order */
+		while(size-- > 0)
+		{
+			array[i + size] = value & 0xFF;
+			value >>= 8;
+		}
+	}
+	
+	static inline uint64_t read_bytes64(const uint8_t * array, size_t index, uint8_t size)
+	{
+		uint64_t value = 0;
+		size_t max = size + index;
+		/* read big endian order */
+		for(; index < max; ++index)
+			value = (value << 8) | array[index];
+		return value;
+	}
+	
 	/* a library call to memcpy() can be expensive, especially for small copies */
 	static inline void memcpy(void * dst, const void * src, size_t size)
 	{
@@ -0,0 +1,366 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#define _ATFILE_SOURCE
+
+#include <sys/stat.h>
+
+#include "openat.h"
+
+#include "util.h"
+#include "rofile.h"
+#include "rwfile.h"
+#include "blob_buffer.h"
+#include "zone_dtable.h"
+
+/* A zone dtable doesn't store the data itself, like btree_dtable. It divides
+ * the entries of the underlying dtable into zones of a fixed number of entries
+ * (by index), and stores the minimum and maximum value found in each zone.
+ * Scans with selective value predicates (e.g. a date range) can then skip any
+ * zones whose ranges do not overlap the predicate without reading them.
+ *
+ * The zone file has a header, zone_dtable_header, followed by one record per
+ * zone: the minimum value size and data, then the maximum value size and data.
+ * Zones containing only nonexistent values store (uint32_t) -1 for both sizes.
+ *
+ * The "value_type" parameter says how to compare values: "blob" (the default)
+ * compares them as byte strings, while "uint32", "float", and "double" compare
+ * them as native numbers and require all existing values to be that size. */
+
+zone_dtable::iter::iter(dtable::iter * base, const zone_dtable * source)
+	: iter_source<zone_dtable, dtable_wrap_iter>(base, source)
+{
+	claim_base = true;
+}
+
+bool zone_dtable::iter::skip_zones(const zone_test & test)
+{
+	size_t index, zone, start;
+	if(!base->valid())
+		return false;
+	index = base->get_index();
+	start = index / dt_source->zone_size;
+	for(zone = start; zone < dt_source->zones.size(); zone++)
+	{
+		const struct zone & z = dt_source->zones[zone];
+		if(z.min.exists() && test(z.min, z.max))
+			break;
+	}
+	if(zone == start)
+		return true;
+	if(zone == dt_source->zones.size())
+	{
+		/* nothing left can match; move past the end */
+		if(base->last())
+			base->next();
+		return false;
+	}
+	base->seek_index(zone * dt_source->zone_size);
+	return base->valid();
+}
+
+dtable::iter * zone_dtable::iterator(ATX_DEF) const
+{
+	iter * value;
+	dtable::iter * source = base->iterator();
+	if(!source)
+		return NULL;
+	value = new iter(source, this);
+	if(!value)
+	{
+		delete source;
+		return NULL;
+	}
+	return value;
+}
+
+bool zone_dtable::present(const dtype & key, bool * found, ATX_DEF) const
+{
+	return base->present(key, found);
+}
+
+blob zone_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
+{
+	return base->lookup(key, found);
+}
+
+int zone_dtable::init(int dfd, const char * file, const params & config, sys_journal * sysj)
+{
+	const dtable_factory * factory;
+	zone_dtable_header header;
+	params base_config;
+	int zn_dfd;
+	off_t offset;
+	rofile * data;
+	if(base)
+		deinit();
+	factory = dtable_factory::lookup(config, "base");
+	if(!factory)
+		return -ENOENT;
+	if(!config.get("base_config", &base_config, params()))
+		return -EINVAL;
+	if(!factory->indexed_access(base_config))
+		return -ENOSYS;
+	zn_dfd = openat(dfd, file, O_RDONLY);
+	if(zn_dfd < 0)
+		return zn_dfd;
+	base = factory->open(zn_dfd, "base", base_config, sysj);
+	if(!base)
+		goto fail_base;
+	ktype = base->key_type();
+	cmp_name = base->get_cmp_name();
+	
+	data = rofile::open<16, 1>(zn_dfd, "zones");
+	if(!data)
+		goto fail_open;
+	if(data->read_type(0, &header) < 0)
+		goto fail_format;
+	if(header.magic != ZONE_DTABLE_MAGIC || header.version != ZONE_DTABLE_VERSION)
+		goto fail_format;
+	if(!header.zone_size)
+		goto fail_format;
+	zone_size = header.zone_size;
+	zones.resize(header.zone_count);
+	offset = sizeof(header);
+	for(uint32_t i = 0; i < header.zone_count; i++)
+	{
+		blob * value = &zones[i].min;
+		for(int j = 0; j < 2; j++, value = &zones[i].max)
+		{
+			uint32_t size;
+			if(data->read_type(offset, &size) < 0)
+				goto fail_format;
+			offset += sizeof(size);
+			if(size == (uint32_t) -1)
+				continue;
+			blob_buffer buffer(size);
+			buffer.set_size(size, false);
+			if(data->read(offset, &buffer[0], size) != (ssize_t) size)
+				goto fail_format;
+			offset += size;
+			*value = buffer;
+		}
+	}
+	delete data;
+	
+	close(zn_dfd);
+	return 0;
+	
+fail_format:
+	zones.clear();
+	delete data;
+fail_open:
+	base->destroy();
+	base = NULL;
+fail_base:
+	close(zn_dfd);
+	return -1;
+}
+
+void zone_dtable::deinit()
+{
+	if(base)
+	{
+		zones.clear();
+		base->destroy();
+		base = NULL;
+		dtable::deinit();
+	}
+}
+
+int zone_dtable::compare(value_type type, const blob & a, const blob & b)
+{
+	switch(type)
+	{
+		case UINT32:
+		{
+			uint32_t x = a.index<uint32_t>(0), y = b.index<uint32_t>(0);
+			return (x < y) ? -1 : x > y;
+		}
+		case FLOAT:
+		{
+			float x = a.index<float>(0), y = b.index<float>(0);
+			return (x < y) ? -1 : x > y;
+		}
+		case DOUBLE:
+		{
+			double x = a.index<double>(0), y = b.index<double>(0);
+			return (x < y) ? -1 : x > y;
+		}
+		case BLOB:
+			return a.compare(b);
+	}
+	abort();
+}
+
+int zone_dtable::write_zones(int dfd, const char * name, const dtable * base, size_t zone_size, value_type type)
+{
+	int r = 0;
+	rwfile out;
+	size_t count = 0;
+	zone_dtable_header header;
+	dtable::iter * iter;
+	blob min, max;
+	size_t value_size = 0;
+	
+	switch(type)
+	{
+		case UINT32:
+			value_size = sizeof(uint32_t);
+			break;
+		case FLOAT:
+			value_size = sizeof(float);
+			break;
+		case DOUBLE:
+			value_size = sizeof(double);
+			break;
+		case BLOB:
+			break;
+	}
+	
+	r = out.create(dfd, name);
+	if(r < 0)
+		return r;
+	header.magic = ZONE_DTABLE_MAGIC;
+	header.version = ZONE_DTABLE_VERSION;
+	header.zone_size = zone_size;
+	/* the base supports indexed access, so we know its size already */
+	header.zone_count = (base->size() + zone_size - 1) / zone_size;
+	header.value_type = type;
+	r = out.append(&header);
+	if(r < 0)
+		goto fail;
+	
+	iter = base->iterator();
+	if(!iter)
+	{
+		r = -ENOMEM;
+		goto fail;
+	}
+	for(;;)
+	{
+		bool valid = iter->valid();
+		if(count && (!valid || !(count % zone_size)))
+		{
+			/* finish the previous zone */
+			const blob * value = &min;
+			for(int j = 0; j < 2; j++, value = &max)
+			{
+				uint32_t size = value->exists() ? value->size() : (uint32_t) -1;
+				r = out.append(&size);
+				if(r >= 0 && value->exists())
+					r = out.append(*value);
+				if(r < 0)
+					break;
+			}
+			if(r < 0)
+				break;
+			min = blob();
+			max = blob();
+		}
+		if(!valid)
+			break;
+		blob value = iter->value();
+		if(value.exists())
+		{
+			if(value_size && value.size() != value_size)
+			{
+				/* can't summarize this value */
+				r = -EINVAL;
+				break;
+			}
+			if(!min.exists() || compare(type, value, min) < 0)
+				min = value;
+			if(!max.exists() || compare(type, value, max) > 0)
+				max = value;
+		}
+		count++;
+		iter->next();
+	}
+	delete iter;
+	if(r < 0)
+		goto fail;
+	
+	assert(count == base->size());
+	r = out.close();
+	if(r < 0)
+		goto fail_unlink;
+	return 0;
+	
+fail:
+	out.close();
+fail_unlink:
+	unlinkat(dfd, name, 0);
+	return r;
+}
+
+int zone_dtable::create(int dfd, const char * file, const params & config, dtable::iter * source, const ktable * shadow)
+{
+	int zn_dfd, r;
+	istr type_name;
+	value_type type;
+	params base_config;
+	dtable * base_dtable;
+	const dtable_factory * base = dtable_factory::lookup(config, "base");
+	if(!base)
+		return -ENOENT;
+	if(!config.get("base_config", &base_config, params()))
+		return -EINVAL;
+	if(!base->indexed_access(base_config))
+		return -ENOSYS;
+	if(!config.get("zone_size", &r, 4096) || r < 1)
+		return -EINVAL;
+	if(!config.get("value_type", &type_name, "blob"))
+		return -EINVAL;
+	if(!strcmp(type_name, "blob"))
+		type = BLOB;
+	else if(!strcmp(type_name, "uint32"))
+		type = UINT32;
+	else if(!strcmp(type_name, "float"))
+		type = FLOAT;
+	else if(!strcmp(type_name, "double"))
+		type = DOUBLE;
+	else
+		return -EINVAL;
+	
+	if(!source_shadow_ok(source, shadow))
+		return -EINVAL;
+	
+	size_t zone_size = r;
+	r = mkdirat(dfd, file, 0755);
+	if(r < 0)
+		return r;
+	zn_dfd = openat(dfd, file, O_RDONLY);
+	if(zn_dfd < 0)
+		goto fail_open;
+	
+	r = base->create(zn_dfd, "base", base_config, source, shadow);
+	if(r < 0)
+		goto fail_create;
+	
+	base_dtable = base->open(zn_dfd, "base", base_config, NULL);
+	if(!base_dtable)
+		goto fail_reopen;
+	
+	r = write_zones(zn_dfd, "zones", base_dtable, zone_size, type);
+	if(r < 0)
+		goto fail_write;
+	
+	base_dtable->destroy();
+	
+	close(zn_dfd);
+	return 0;
+	
+fail_write:
+	base_dtable->destroy();
+fail_reopen:
+	util::rm_r(zn_dfd, "base");
+fail_create:
+	close(zn_dfd);
+fail_open:
+	unlinkat(dfd, file, AT_REMOVEDIR);
+	return (r < 0) ? r : -1;
+}
+
+DEFINE_RO_FACTORY(zone_dtable);
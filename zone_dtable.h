@@ -0,0 +1,119 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#ifndef __ZONE_DTABLE_H
+#define __ZONE_DTABLE_H
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <sys/types.h>
+
+#ifndef __cplusplus
+#error zone_dtable.h is a C++ header file
+#endif
+
+#include <vector>
+
+#include "dtable_factory.h"
+#include "dtable_wrap_iter.h"
+
+/* The zone dtable must be created with another read-only dtable, and stores
+ * the minimum and maximum value of each fixed-size block ("zone") of entries
+ * in it. Iterators can then skip zones which cannot satisfy a value predicate
+ * using skip_zones(). The base dtable must support indexed access. */
+
+#define ZONE_DTABLE_MAGIC 0x20E3D7A1
+#define ZONE_DTABLE_VERSION 0
+
+class zone_dtable : public dtable
+{
+public:
+	virtual iter * iterator(ATX_OPT) const;
+	virtual bool present(const dtype & key, bool * found, ATX_OPT) const;
+	virtual blob lookup(const dtype & key, bool * found, ATX_OPT) const;
+	virtual blob index(size_t index) const { return base->index(index); }
+	virtual bool contains_index(size_t index) const { return base->contains_index(index); }
+	virtual size_t size() const { return base->size(); }
+	inline virtual int get_stats(dtable_stats * stats) const { return base->get_stats(stats); }
+	
+	inline virtual int set_blob_cmp(const blob_comparator * cmp)
+	{
+		int value = base->set_blob_cmp(cmp);
+		if(value >= 0)
+		{
+			value = dtable::set_blob_cmp(cmp);
+			assert(value >= 0);
+		}
+		return value;
+	}
+	
+	static inline bool static_indexed_access(const params & config) { return true; }
+	
+	static int create(int dfd, const char * file, const params & config, dtable::iter * source, const ktable * shadow = NULL);
+	DECLARE_RO_FACTORY(zone_dtable);
+	
+	inline zone_dtable() : base(NULL) {}
+	int init(int dfd, const char * file, const params & config, sys_journal * sysj);
+	
+	/* the ways values can be compared to compute the zone summaries */
+	enum value_type { BLOB = 0, UINT32 = 1, FLOAT = 2, DOUBLE = 3 };
+	
+	/* a convenient zone_test for a range of fixed-size values, inclusive */
+	template<class T>
+	class range_test : public zone_test
+	{
+	public:
+		inline range_test(const T & low, const T & high) : low(low), high(high) {}
+		virtual bool operator()(const blob & min, const blob & max) const
+		{
+			if(min.size() != sizeof(T) || max.size() != sizeof(T))
+				/* we can't tell, so be conservative */
+				return true;
+			return low <= max.index<T>(0) && min.index<T>(0) <= high;
+		}
+	private:
+		T low, high;
+	};
+	
+protected:
+	void deinit();
+	inline virtual ~zone_dtable()
+	{
+		if(base)
+			deinit();
+	}
+	
+private:
+	struct zone_dtable_header
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t zone_size;
+		uint32_t zone_count;
+		uint8_t value_type;
+	} __attribute__((packed));
+	
+	/* zones containing only nonexistent values have nonexistent min and max */
+	struct zone
+	{
+		blob min, max;
+	};
+	
+	class iter : public iter_source<zone_dtable, dtable_wrap_iter>
+	{
+	public:
+		virtual bool skip_zones(const zone_test & test);
+		inline iter(dtable::iter * base, const zone_dtable * source);
+		virtual ~iter() {}
+	};
+	
+	static int compare(value_type type, const blob & a, const blob & b);
+	static int write_zones(int dfd, const char * name, const dtable * base, size_t zone_size, value_type type);
+	
+	dtable * base;
+	size_t zone_size;
+	std::vector<zone> zones;
+};
+
+#endif /* __ZONE_DTABLE_H */